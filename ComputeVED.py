@@ -34,6 +34,11 @@ class ComputeVED:
                  out_folder=None,
                  frangi_only=False,
                  scale_object=False,
+                 use_image_spacing=False,
+                 denoise=False,
+                 denoise_sigma=0.0,
+                 denoise_mask=None,
+                 denoise_output=None,
                  from_cmd=False):
 
         self._input = input_filename
@@ -60,6 +65,12 @@ class ComputeVED:
 
         self._frangi_only = frangi_only
         self._scale_object = scale_object
+        self._use_image_spacing = use_image_spacing
+
+        self._denoise = denoise
+        self._denoise_sigma = denoise_sigma
+        self._denoise_mask = denoise_mask
+        self._denoise_output = denoise_output
 
         if not from_cmd:
             self.valid_arg()
@@ -89,6 +100,12 @@ class ComputeVED:
 
         self._frangi_only = args.frangi_only
         self._scale_object = args.scale_object
+        self._use_image_spacing = args.use_image_spacing
+
+        self._denoise = args.denoise
+        self._denoise_sigma = args.denoise_sigma
+        self._denoise_mask = args.denoise_mask
+        self._denoise_output = args.denoise_output
 
     def valid_arg(self):
 
@@ -191,6 +208,17 @@ class ComputeVED:
             kwargs['--generateHessian'] = None
         if self._generate_iteration_files:
             kwargs['--generateIterationFiles'] = None
+        if self._use_image_spacing:
+            kwargs['--useImageSpacing'] = None
+
+        # Non-local means denoising of the input.
+        if self._denoise:
+            kwargs['--denoise'] = None
+            kwargs['--denoiseSigma'] = str(self._denoise_sigma)
+            if self._denoise_mask:
+                kwargs['--denoiseMask'] = self._denoise_mask
+            if self._denoise_output:
+                kwargs['--denoiseOutput'] = self._denoise_output
 
         cmd_string = [sys.path[0] + '/itkVEDMain']
         
@@ -301,6 +329,28 @@ if __name__ == "__main__":
                         help="Flag to generate output iteration "
                              "files and vesselness.")
 
+    parser.add_argument("-U", "--use_image_spacing", action="store_true",
+                        help="Flag to use the voxel spacing in the "
+                             "diffusion, for inputs which are not "
+                             "isotropic.")
+
+    parser.add_argument("--denoise", action="store_true",
+                        help="Flag to denoise the input with non-local "
+                             "means before the VED (replaces "
+                             "dipy_nlmeans.py).")
+
+    parser.add_argument("--denoise_sigma", type=float, default=0.0,
+                        help="Standard deviation of the noise "
+                             "(0: estimated).")
+
+    parser.add_argument("--denoise_mask", type=str,
+                        help="Only the voxels inside this mask are "
+                             "denoised.")
+
+    parser.add_argument("--denoise_output", type=str,
+                        help="Also write the denoised input to this "
+                             "file.")
+
     parser.add_argument("-D", "--out_folder", type=str,
                         help="he output folder for all the optional "
                              "generated files. This is required if "
@@ -69,6 +69,11 @@ public:
                 const DiffusionTensorNeighborhoodType& neighborhoodTensor,
                 DerivativeStructType* derivateData);
 
+  // Keep the derivative scalings of the iteration, minimum spacing / spacing
+  // when the filter uses the image spacing (see SetScaleCoefficients()), 1
+  // otherwise.
+  virtual void InitializeIteration() override;
+
   // Compute the time step for an update given a derivatie data structure.
   virtual TimeStepType ComputeGlobalTimeStep(void* derivateData) const;
 
@@ -103,6 +108,9 @@ protected:
   // Stride length along the y-dimension.
   unsigned int m_xStride[ImageDimension];
 
+  // Scaling of the differences along every axis.
+  double m_DerivativeScales[ImageDimension];
+
 private:
   // purposely not implemented
   AnisotropicDiffusionVesselEnhancementFunction(const Self&);
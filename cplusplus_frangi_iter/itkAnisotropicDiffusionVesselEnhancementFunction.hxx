@@ -5,6 +5,8 @@
 
 #include "vnl/algo/vnl_symmetric_eigensystem.h"
 
+#include <algorithm>
+
 template <class TImageType>
 AnisotropicDiffusionVesselEnhancementFunction<
     TImageType>::AnisotropicDiffusionVesselEnhancementFunction()
@@ -23,6 +25,27 @@ AnisotropicDiffusionVesselEnhancementFunction<
   for (unsigned int i = 0; i < ImageDimension; ++i)
   {
     m_xStride[i] = itNeighbor.GetStride(i);
+    m_DerivativeScales[i] = 1.0;
+  }
+}
+
+template <class TImageType>
+void AnisotropicDiffusionVesselEnhancementFunction<
+    TImageType>::InitializeIteration()
+{
+  // 1 / spacing, relative to the finest axis: the diffusion runs in voxels
+  // of the finest axis, as on the input upsampled to it, and the scales are
+  // those of GaussianDeconvolution::SetSpacing().
+  const typename Superclass::NeighborhoodScalesType scales =
+      this->ComputeNeighborhoodScales();
+  double maximumScale = scales[0];
+  for (unsigned int i = 1; i < ImageDimension; ++i)
+  {
+    maximumScale = std::max(maximumScale, scales[i]);
+  }
+  for (unsigned int i = 0; i < ImageDimension; ++i)
+  {
+    m_DerivativeScales[i] = scales[i] / maximumScale;
   }
 }
 
@@ -51,6 +74,9 @@ AnisotropicDiffusionVesselEnhancementFunction<TImageType>::ComputeUpdate(
 // m_dx -> Intensity first derivative
 // m_dxy -> Intensity second derivative
 // m_DTdxy -> Diffusion tensor first derivative
+// The differences are divided by the spacing along their axes, relative to
+// the finest one, when the filter uses the image spacing, so that anisotropic
+// grids diffuse as the grid upsampled to their finest axis.
 // =============================================================================
 template <class TImageType>
 typename AnisotropicDiffusionVesselEnhancementFunction<TImageType>::PixelType
@@ -68,12 +94,15 @@ AnisotropicDiffusionVesselEnhancementFunction<TImageType>::ComputeUpdate(
   {
     const auto positionA = m_Center + m_xStride[i];
     const auto positionB = m_Center - m_xStride[i];
+    const double scale = m_DerivativeScales[i];
 
-    dd->m_dx[i] =
-        (itNeighbor.GetPixel(positionA) - itNeighbor.GetPixel(positionB)) / 2.0;
+    dd->m_dx[i] = scale * (itNeighbor.GetPixel(positionA) -
+                           itNeighbor.GetPixel(positionB)) /
+                  2.0;
 
-    dd->m_dxy[i][i] = itNeighbor.GetPixel(positionA) +
-                      itNeighbor.GetPixel(positionB) - 2.0 * centerValue;
+    dd->m_dxy[i][i] = scale * scale *
+                      (itNeighbor.GetPixel(positionA) +
+                       itNeighbor.GetPixel(positionB) - 2.0 * centerValue);
 
     for (unsigned int j = i + 1; j < ImageDimension; ++j)
     {
@@ -83,6 +112,7 @@ AnisotropicDiffusionVesselEnhancementFunction<TImageType>::ComputeUpdate(
       const auto positionDa = positionA + m_xStride[j];
 
       dd->m_dxy[i][j] = dd->m_dxy[j][i] =
+          scale * m_DerivativeScales[j] *
           (itNeighbor.GetPixel(positionAa) - itNeighbor.GetPixel(positionBa) -
            itNeighbor.GetPixel(positionCa) + itNeighbor.GetPixel(positionDa)) /
           4.0;
@@ -96,7 +126,8 @@ AnisotropicDiffusionVesselEnhancementFunction<TImageType>::ComputeUpdate(
     for (unsigned int j = 0; j < ImageDimension; ++j)
     {
       dd->m_DTdxy[i][j] =
-          (positionATensorValue(i, j) - positionBTensorValue(i, j)) / 2.0;
+          scale * (positionATensorValue(i, j) - positionBTensorValue(i, j)) /
+          2.0;
     }
   }
 
@@ -4,8 +4,12 @@
 #include "itkAnisotropicDiffusionVesselEnhancementFunction.h"
 
 #include "itkDerivativeStruct.h"
+#include "itkFirstTouchAllocator.h"
 #include "itkMultiScaleHessian.h"
+#include "itkQuantizedImageWriter.h"
+#include "itkStageTimer.h"
 #include "itkSymmetricEigenVectorAnalysisImageFilter.h"
+#include "itkWorkStealingPool.h"
 
 #include "itkDiffusionTensor3D.h"
 #include "itkFiniteDifferenceImageFilter.h"
@@ -110,6 +114,22 @@ public:
   itkSetMacro(GenerateIterationFiles, bool);
   itkGetMacro(GenerateIterationFiles, bool);
 
+  // Write diffusion_mrtrix_tensor_*.nii.gz and diffusion_peaks.nii.gz after
+  // the first iteration. On by default.
+  itkSetMacro(GenerateTensorFiles, bool);
+  itkGetMacro(GenerateTensorFiles, bool);
+
+  // Precision of the tensor and peak files (float32 or scaled int16 in place
+  // of double). Full by default.
+  itkSetMacro(TensorFilesPrecision, QuantizedImageWriter::PrecisionType);
+  itkGetMacro(TensorFilesPrecision, QuantizedImageWriter::PrecisionType);
+
+  // Keep a copy of the diffused image of the last iteration, before the
+  // final Frangi measure replaces the output (GetDiffusedImage()). Off by
+  // default.
+  itkSetMacro(KeepDiffusedImage, bool);
+  itkGetMacro(KeepDiffusedImage, bool);
+
 #ifdef ITK_USE_CONCEPT_CHECKING
   itkConceptMacro(OutputTimesDoubleCheck,
                   (itk::Concept::MultiplyOperator<PixelType, double>));
@@ -123,32 +143,68 @@ public:
   void SetSigmaMin(double);
   void SetSigmaMax(double);
   void SetNumberOfSigmaSteps(int);
+
+  // Adaptive scale search over this number of coarse scales (0: off).
+  void SetNumberOfCoarseScales(int);
   void SetBrightBlood(bool);
   void SetFrangiOnly(bool);
 
   void SetAlpha(double);
   void SetBeta(double);
   void SetC(double);
+  void SetFrangiKernel(FrangiKernel::KernelType);
   void SetScaleObject(bool);
   void SetGenerateScale(bool);
   void SetGenerateHessian(bool);
+  void SetGenerateScaleFiles(bool);
+
+  // Write the scale files as sparse stacks (Scale_*_stack.vss).
+  void SetSparseScaleFiles(bool);
+
+  // Hessians of the scales by a Gaussian cascade (GaussianCascadeHessian).
+  void SetGaussianCascade(bool);
+
+  // Gaussian deconvolution of the vesselness of every scale, and its
+  // regularization.
+  void SetDeconvolution(bool);
+  void SetDeconvolutionRegularization(double);
+
+  // Release the eigenvector image after the tensor is built and the
+  // per-scale images of the multi-scale analysis. Off by default.
+  void SetReleaseInternalBuffers(bool);
 
   double GetSigmaMin();
   double GetSigmaMax();
   int GetNumberOfSigmaSteps();
+  int GetNumberOfCoarseScales();
   bool GetBrightBlood();
   bool GetFrangiOnly();
 
   double GetAlpha();
   double GetBeta();
   double GetC();
+  FrangiKernel::KernelType GetFrangiKernel();
   bool GetScaleObject();
   bool GetGenerateScale();
   bool GetGenerateHessian();
+  bool GetGenerateScaleFiles();
+  bool GetSparseScaleFiles();
+  bool GetGaussianCascade();
+  bool GetDeconvolution();
+  double GetDeconvolutionRegularization();
+  bool GetReleaseInternalBuffers();
+
+  // Add the buffers allocated by the filter for an image of numberOfPixels.
+  // lastPhase is the last phase the filter itself is kept alive.
+  void AddBuffersToPlan(VEDMemoryPlan* plan, double numberOfPixels,
+                        VEDMemoryPlan::PhaseType lastPhase) const;
 
   const HessianImageType* GetHessianOutput() const;
   const ScalesImageType* GetScalesOutput() const;
 
+  // The diffused image of the last update, if KeepDiffusedImage is on.
+  const OutputImageType* GetDiffusedImage() const { return m_DiffusedImage; }
+
 protected:
   AnisotropicDiffusionVesselEnhancementImageFilter();
   AnisotropicDiffusionVesselEnhancementImageFilter(
@@ -194,7 +250,6 @@ protected:
   //  Does the actual work of updating the output from the UpdateContainer
   //   over an output region supplied by the multithreading mechanism.
   //  \sa ApplyUpdate
-  // \sa ApplyUpdateThreaderCallback
   virtual void ThreadedApplyUpdate(
       TimeStepType dt, const ThreadRegionType& regionToProcess,
       const ThreadDiffusionImageRegionType& diffusionRegionToProcess,
@@ -203,7 +258,6 @@ protected:
   // Does the actual work of calculating change over a region supplied by
   // the multithreading mechanism.
   // \sa CalculateChange
-  // \sa CalculateChangeThreaderCallback
   virtual TimeStepType ThreadedCalculateChange(
       const ThreadRegionType& regionToProcess,
       const ThreadDiffusionImageRegionType& diffusionRegionToProcess,
@@ -216,24 +270,6 @@ private:
   AnisotropicDiffusionVesselEnhancementImageFilter(const Self&);
   void operator=(const Self&); // purposely not implemented
 
-  // Structure for passing information into static callback methods.  Used in
-  // the subclasses' threading mechanisms.
-  struct DenseFDThreadStruct
-  {
-    AnisotropicDiffusionVesselEnhancementImageFilter* Filter;
-    TimeStepType TimeStep;
-    std::vector<TimeStepType> TimeStepList;
-    std::vector<bool> ValidTimeStepList;
-  };
-
-  // This callback method uses ImageSource::SplitRequestedRegion to acquire an
-  // output region that it passes to ThreadedApplyUpdate for processing.
-  static ITK_THREAD_RETURN_TYPE ApplyUpdateThreaderCallback(void* arg);
-
-  // This callback method uses SplitUpdateContainer to acquire a region
-  // which it then passes to ThreadedCalculateChange for processing.
-  static ITK_THREAD_RETURN_TYPE CalculateChangeThreaderCallback(void* arg);
-
   // The buffer that holds the updates for an iteration of the algorithm.
   typename UpdateBufferType::Pointer m_UpdateBuffer;
 
@@ -255,6 +291,12 @@ private:
   unsigned int m_NumberOfIterations;
 
   bool m_GenerateIterationFiles;
+  bool m_GenerateTensorFiles;
+  QuantizedImageWriter::PrecisionType m_TensorFilesPrecision;
+  bool m_ReleaseInternalBuffers;
+  bool m_KeepDiffusedImage;
+
+  typename OutputImageType::Pointer m_DiffusedImage;
 };
 
 #if ITK_TEMPLATE_TXX
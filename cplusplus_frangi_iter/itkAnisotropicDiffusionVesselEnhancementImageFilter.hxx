@@ -16,6 +16,7 @@
 #include "math.h"
 
 
+#include <algorithm>
 #include <list>
 
 template <class TInputImage, class TOutputImage>
@@ -41,7 +42,10 @@ AnisotropicDiffusionVesselEnhancementImageFilter<TInputImage, TOutputImage>::
         double const& epsilon, const bool generateIterationFiles)
     : m_TimeStep{timeStep}, m_NumberOfIterations{nbIteration},
       m_WStrength{wStrength}, m_Sensitivity{sensitivity}, m_Epsilon{epsilon},
-      m_GenerateIterationFiles{generateIterationFiles}
+      m_GenerateIterationFiles{generateIterationFiles},
+      m_GenerateTensorFiles{true},
+      m_TensorFilesPrecision{QuantizedImageWriter::FullPrecision},
+      m_ReleaseInternalBuffers{false}, m_KeepDiffusedImage{false}
 {
   m_UpdateBuffer = UpdateBufferType::New();
   m_DiffusionTensorImage = DiffusionTensorImageType::New();
@@ -84,16 +88,11 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
 
   f->SetTimeStep(m_TimeStep);
 
-  // Check the timestep for stability.
-  double minSpacing = 1.0;
-  if (this->GetUseImageSpacing())
-  {
-    minSpacing = *(std::min_element(this->GetInput()->GetSpacing().Begin(),
-                                    this->GetInput()->GetSpacing().End()));
-  }
-
+  // Check the timestep for stability. With the image spacing, the
+  // differences are in voxels of the finest axis (the function scales are
+  // relative to it), so the bound is the same as without.
   const double ratio =
-      minSpacing / vcl_pow(2.0, static_cast<double>(ImageDimension) + 1);
+      1.0 / vcl_pow(2.0, static_cast<double>(ImageDimension) + 1);
 
   if (m_TimeStep > ratio)
   {
@@ -143,6 +142,14 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
   this->Modified();
 }
 
+template <class TInputImage, class TOutputImage>
+void AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::SetNumberOfCoarseScales(int value)
+{
+  m_MultiScaleVesselnessFilter->SetNumberOfCoarseScales(value);
+  this->Modified();
+}
+
 template <class TInputImage, class TOutputImage>
 void AnisotropicDiffusionVesselEnhancementImageFilter<
     TInputImage, TOutputImage>::SetBrightBlood(bool value)
@@ -183,6 +190,14 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
   this->Modified();
 }
 
+template <class TInputImage, class TOutputImage>
+void AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::SetFrangiKernel(FrangiKernel::KernelType value)
+{
+  m_MultiScaleVesselnessFilter->SetFrangiKernel(value);
+  this->Modified();
+}
+
 template <class TInputImage, class TOutputImage>
 void AnisotropicDiffusionVesselEnhancementImageFilter<
     TInputImage, TOutputImage>::SetScaleObject(bool value)
@@ -207,6 +222,55 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
   this->Modified();
 }
 
+template <class TInputImage, class TOutputImage>
+void AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::SetGenerateScaleFiles(bool value)
+{
+  m_MultiScaleVesselnessFilter->SetGenerateScaleFiles(value);
+  this->Modified();
+}
+
+template <class TInputImage, class TOutputImage>
+void AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::SetSparseScaleFiles(bool value)
+{
+  m_MultiScaleVesselnessFilter->SetSparseScaleFiles(value);
+  this->Modified();
+}
+
+template <class TInputImage, class TOutputImage>
+void AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::SetGaussianCascade(bool value)
+{
+  m_MultiScaleVesselnessFilter->SetGaussianCascade(value);
+  this->Modified();
+}
+
+template <class TInputImage, class TOutputImage>
+void AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::SetDeconvolution(bool value)
+{
+  m_MultiScaleVesselnessFilter->SetDeconvolution(value);
+  this->Modified();
+}
+
+template <class TInputImage, class TOutputImage>
+void AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::SetDeconvolutionRegularization(double value)
+{
+  m_MultiScaleVesselnessFilter->SetDeconvolutionRegularization(value);
+  this->Modified();
+}
+
+template <class TInputImage, class TOutputImage>
+void AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::SetReleaseInternalBuffers(bool value)
+{
+  m_ReleaseInternalBuffers = value;
+  m_MultiScaleVesselnessFilter->SetReleaseInternalBuffers(value);
+  this->Modified();
+}
+
 template <class TInputImage, class TOutputImage>
 double
 AnisotropicDiffusionVesselEnhancementImageFilter<TInputImage,
@@ -230,6 +294,13 @@ int AnisotropicDiffusionVesselEnhancementImageFilter<
   return m_MultiScaleVesselnessFilter->GetNumberOfSigmaSteps();
 }
 
+template <class TInputImage, class TOutputImage>
+int AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::GetNumberOfCoarseScales()
+{
+  return m_MultiScaleVesselnessFilter->GetNumberOfCoarseScales();
+}
+
 template <class TInputImage, class TOutputImage>
 bool AnisotropicDiffusionVesselEnhancementImageFilter<
     TInputImage, TOutputImage>::GetBrightBlood()
@@ -266,6 +337,13 @@ double AnisotropicDiffusionVesselEnhancementImageFilter<TInputImage,
   return m_MultiScaleVesselnessFilter->GetC();
 }
 
+template <class TInputImage, class TOutputImage>
+FrangiKernel::KernelType AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::GetFrangiKernel()
+{
+  return m_MultiScaleVesselnessFilter->GetFrangiKernel();
+}
+
 template <class TInputImage, class TOutputImage>
 bool AnisotropicDiffusionVesselEnhancementImageFilter<
     TInputImage, TOutputImage>::GetScaleObject()
@@ -287,6 +365,99 @@ bool AnisotropicDiffusionVesselEnhancementImageFilter<
   return m_MultiScaleVesselnessFilter->GetGenerateHessianOutput();
 }
 
+template <class TInputImage, class TOutputImage>
+bool AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::GetGenerateScaleFiles()
+{
+  return m_MultiScaleVesselnessFilter->GetGenerateScaleFiles();
+}
+
+template <class TInputImage, class TOutputImage>
+bool AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::GetSparseScaleFiles()
+{
+  return m_MultiScaleVesselnessFilter->GetSparseScaleFiles();
+}
+
+template <class TInputImage, class TOutputImage>
+bool AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::GetGaussianCascade()
+{
+  return m_MultiScaleVesselnessFilter->GetGaussianCascade();
+}
+
+template <class TInputImage, class TOutputImage>
+bool AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::GetDeconvolution()
+{
+  return m_MultiScaleVesselnessFilter->GetDeconvolution();
+}
+
+template <class TInputImage, class TOutputImage>
+double AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::GetDeconvolutionRegularization()
+{
+  return m_MultiScaleVesselnessFilter->GetDeconvolutionRegularization();
+}
+
+template <class TInputImage, class TOutputImage>
+bool AnisotropicDiffusionVesselEnhancementImageFilter<
+    TInputImage, TOutputImage>::GetReleaseInternalBuffers()
+{
+  return m_ReleaseInternalBuffers;
+}
+
+// =============================================================================
+// Buffers of the diffusion and of the multi-scale analysis, for the memory
+// plan.
+// =============================================================================
+template <class TInputImage, class TOutputImage>
+void AnisotropicDiffusionVesselEnhancementImageFilter<TInputImage,
+                                                      TOutputImage>::
+    AddBuffersToPlan(VEDMemoryPlan* plan, double numberOfPixels,
+                     VEDMemoryPlan::PhaseType lastPhase) const
+{
+  // The output is the result of the pipeline: kept after the filter.
+  plan->AddBuffer("diffusion output",
+                  numberOfPixels * sizeof(typename OutputImageType::PixelType),
+                  VEDMemoryPlan::HessianPhase, VEDMemoryPlan::PostPhase);
+  plan->AddBuffer("diffusion update buffer",
+                  numberOfPixels *
+                      sizeof(typename UpdateBufferType::PixelType),
+                  VEDMemoryPlan::HessianPhase, lastPhase);
+  plan->AddBuffer(
+      "diffusion tensor",
+      numberOfPixels * sizeof(typename DiffusionTensorImageType::PixelType),
+      VEDMemoryPlan::HessianPhase, lastPhase);
+  if (m_GenerateTensorFiles)
+  {
+    plan->AddBuffer(
+        "MRtrix tensor",
+        numberOfPixels * sizeof(typename MrtrixTensorImageType::PixelType),
+        VEDMemoryPlan::HessianPhase, lastPhase);
+    plan->AddBuffer("peaks",
+                    numberOfPixels * sizeof(typename PeakImageType::PixelType),
+                    VEDMemoryPlan::HessianPhase, lastPhase);
+  }
+  plan->AddBuffer(
+      "Hessian eigenvectors",
+      numberOfPixels * sizeof(typename OutputMatrixImageType::PixelType),
+      m_ReleaseInternalBuffers ? VEDMemoryPlan::TensorPhase
+                               : VEDMemoryPlan::HessianPhase,
+      m_ReleaseInternalBuffers ? VEDMemoryPlan::TensorPhase : lastPhase);
+
+  if (m_KeepDiffusedImage)
+  {
+    plan->AddBuffer(
+        "diffused image",
+        numberOfPixels * sizeof(typename OutputImageType::PixelType),
+        VEDMemoryPlan::DiffusionPhase, VEDMemoryPlan::PostPhase);
+  }
+
+  m_MultiScaleVesselnessFilter->AddBuffersToPlan(plan, numberOfPixels,
+                                                 lastPhase);
+}
+
 // Get the image containing the Hessian at which each pixel gave the best
 // response
 template <class TInputImage, class TOutputImage>
@@ -334,17 +505,24 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
     }
   }
 
-  itk::ImageRegionConstIterator<TInputImage> itInput(
-      input, output->GetRequestedRegion());
-  itk::ImageRegionIterator<TOutputImage> itOuput(output,
-                                                 output->GetRequestedRegion());
-
-  while (!itOuput.IsAtEnd())
-  {
-    itOuput.Value() = static_cast<PixelType>(itInput.Get());
-    ++itInput;
-    ++itOuput;
-  }
+  // The output buffer is not touched yet: copying it with the chunks of
+  // the later loops puts its pages on the NUMA nodes which process them.
+  WorkStealingPool& pool = WorkStealingPool::GetInstance();
+  const ThreadRegionType region = output->GetRequestedRegion();
+  pool.ParallelForStatic(
+      "Diffusion::CopyInputToOutput", pool.GetNumberOfChunks(region),
+      this->GetNumberOfThreads(), [&](unsigned int, size_t chunk) {
+        const ThreadRegionType chunkRegion = pool.GetChunkRegion(region, chunk);
+        itk::ImageRegionConstIterator<TInputImage> itInput(input, chunkRegion);
+        itk::ImageRegionIterator<TOutputImage> itOuput(output, chunkRegion);
+
+        while (!itOuput.IsAtEnd())
+        {
+          itOuput.Value() = static_cast<PixelType>(itInput.Get());
+          ++itInput;
+          ++itOuput;
+        }
+      });
 }
 
 template <class TInputImage, class TOutputImage>
@@ -360,7 +538,9 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
   m_UpdateBuffer->SetLargestPossibleRegion(output->GetLargestPossibleRegion());
   m_UpdateBuffer->SetRequestedRegion(output->GetRequestedRegion());
   m_UpdateBuffer->SetBufferedRegion(output->GetBufferedRegion());
-  m_UpdateBuffer->Allocate();
+  FirstTouchAllocator::Allocate(m_UpdateBuffer.GetPointer(),
+                                itk::NumericTraits<PixelType>::Zero,
+                                this->GetNumberOfThreads());
 }
 
 template <class TInputImage, class TOutputImage>
@@ -379,7 +559,15 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
       output->GetLargestPossibleRegion());
   m_DiffusionTensorImage->SetRequestedRegion(output->GetRequestedRegion());
   m_DiffusionTensorImage->SetBufferedRegion(output->GetBufferedRegion());
-  m_DiffusionTensorImage->Allocate();
+  typename DiffusionTensorImageType::PixelType zeroTensor;
+  zeroTensor.Fill(0.0);
+  FirstTouchAllocator::Allocate(m_DiffusionTensorImage.GetPointer(),
+                                zeroTensor, this->GetNumberOfThreads());
+
+  if (!m_GenerateTensorFiles)
+  {
+    return;
+  }
 
   m_MrtrixTensorImage->SetSpacing(output->GetSpacing());
   m_MrtrixTensorImage->SetOrigin(output->GetOrigin());
@@ -427,6 +615,19 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
 
     //this->SetOutput(0, m_MultiScaleVesselnessFilter->GetOutput());
 
+    if (m_KeepDiffusedImage)
+    {
+      const OutputImageType* output = this->GetOutput();
+      m_DiffusedImage = OutputImageType::New();
+      m_DiffusedImage->CopyInformation(output);
+      m_DiffusedImage->SetRegions(output->GetBufferedRegion());
+      m_DiffusedImage->Allocate();
+      std::copy(output->GetBufferPointer(),
+                output->GetBufferPointer() +
+                    output->GetBufferedRegion().GetNumberOfPixels(),
+                m_DiffusedImage->GetBufferPointer());
+    }
+
     itk::ImageRegionIterator<InputImageType> 
         itUpdate(m_MultiScaleVesselnessFilter->GetOutput(),
         m_MultiScaleVesselnessFilter->GetOutput()->GetRequestedRegion());
@@ -448,10 +649,16 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
     return;
   }
 
+  const double numberOfPixels =
+      this->GetOutput()->GetBufferedRegion().GetNumberOfPixels();
+
   m_EigenVectorMatrixAnalysisFilter->SetInput(
       m_MultiScaleVesselnessFilter->GetHessianOutput());
 
-  m_EigenVectorMatrixAnalysisFilter->Update();
+  {
+    StageTimerScope timer("Diffusion::EigenAnalysis", numberOfPixels);
+    m_EigenVectorMatrixAnalysisFilter->Update();
+  }
 
   typename OutputMatrixImageType::Pointer eigenVectorMatrixOutputImage =
       m_EigenVectorMatrixAnalysisFilter->GetOutput();
@@ -489,21 +696,26 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
 
   typedef itk::ImageRegionIterator<PeakImageType>
       PeakIteratorType;
-  PeakIteratorType itPeak(
-      m_PeakImage,
-      m_PeakImage->GetLargestPossibleRegion());
-  itPeak.GoToBegin();
-
+  PeakIteratorType itPeak;
 
   typedef itk::ImageRegionIterator<MrtrixTensorImageType>
       MrtrixTensorIteratorType;
-  MrtrixTensorIteratorType itMrtrix(
-      m_MrtrixTensorImage,
-      m_MrtrixTensorImage->GetLargestPossibleRegion());
-  itMrtrix.GoToBegin();
+  MrtrixTensorIteratorType itMrtrix;
+
+  if (m_GenerateTensorFiles)
+  {
+    itPeak = PeakIteratorType(m_PeakImage,
+                              m_PeakImage->GetLargestPossibleRegion());
+    itPeak.GoToBegin();
+
+    itMrtrix = MrtrixTensorIteratorType(
+        m_MrtrixTensorImage, m_MrtrixTensorImage->GetLargestPossibleRegion());
+    itMrtrix.GoToBegin();
+  }
 
 
   std::cout << "(In UpdateDiffusionTensorImage) Compute D tensor. \n";
+  StageTimerScope timer("Diffusion::TensorBuild", numberOfPixels);
     
     
   while (!itDiff.IsAtEnd())
@@ -574,16 +786,24 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
     mrtrixtensor[4] = productMatrix(0, 2); mrtrixtensor[5] = productMatrix(1, 2); 
     
 
-    itMrtrix.Set(mrtrixtensor);
-    itPeak.Set(peakvector);
+    if (m_GenerateTensorFiles)
+    {
+      itMrtrix.Set(mrtrixtensor);
+      itPeak.Set(peakvector);
+      ++itMrtrix;
+      ++itPeak;
+    }
     itDiff.Set(tensor);
       
-    ++itMrtrix;
-    ++itPeak;
     ++itDiff;
     ++itEigen;
     ++itHessian;
   }
+
+  if (m_ReleaseInternalBuffers)
+  {
+    m_EigenVectorMatrixAnalysisFilter->GetOutput()->ReleaseData();
+  }
 }
 
 template <class TInputImage, class TOutputImage>
@@ -593,44 +813,25 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
 
   itkDebugMacro(<< "ApplyUpdate Invoked with time step size: " << dt);
 
-  DenseFDThreadStruct str;
-  str.Filter = this;
-  str.TimeStep = dt;
-  this->GetMultiThreader()->SetNumberOfThreads(this->GetNumberOfThreads());
-  this->GetMultiThreader()->SetSingleMethod(this->ApplyUpdateThreaderCallback,
-                                            &str);
-
-  this->GetMultiThreader()->SingleMethodExecute();
-}
-
-template <class TInputImage, class TOutputImage>
-ITK_THREAD_RETURN_TYPE AnisotropicDiffusionVesselEnhancementImageFilter<
-    TInputImage, TOutputImage>::ApplyUpdateThreaderCallback(void* arg)
-{
-
-  const auto threadInfo =
-      static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
-  const int threadId = threadInfo->ThreadID;
-  const int threadCount = threadInfo->NumberOfThreads;
-  const auto str = static_cast<DenseFDThreadStruct*>(threadInfo->UserData);
-
-  // Execute the actual method with appropriate output region
-  // to find out in how many pieces extent can be split into.
-  // Using the SplitRequestedRegion method from itk::ImageSource.
-  ThreadRegionType splitRegion;
-  str->Filter->SplitRequestedRegion(threadId, threadCount, splitRegion);
-
-  ThreadDiffusionImageRegionType splitRegionDiffusionImage;
-  const int total = str->Filter->SplitRequestedRegion(
-      threadId, threadCount, splitRegionDiffusionImage);
-
-  if (threadId < total)
-  {
-    str->Filter->ThreadedApplyUpdate(str->TimeStep, splitRegion,
-                                     splitRegionDiffusionImage, threadId);
-  }
-
-  return ITK_THREAD_RETURN_VALUE;
+  StageTimerScope timer(
+      "Diffusion::ApplyUpdate",
+      this->GetOutput()->GetRequestedRegion().GetNumberOfPixels());
+
+  // Small chunks of rows, shared by the threads of the pool. Every voxel
+  // reads the update and the output, and writes the output.
+  WorkStealingPool& pool = WorkStealingPool::GetInstance();
+  const ThreadRegionType region = this->GetOutput()->GetRequestedRegion();
+  const itk::SizeValueType numberOfChunks = pool.GetNumberOfChunks(region);
+  pool.ParallelFor("Diffusion::ApplyUpdate", numberOfChunks,
+                   this->GetNumberOfThreads(),
+                   [&](unsigned int threadId, size_t chunk) {
+                     const ThreadRegionType chunkRegion =
+                         pool.GetChunkRegion(region, chunk);
+                     this->ThreadedApplyUpdate(dt, chunkRegion, chunkRegion,
+                                               threadId);
+                   },
+                   3.0 * sizeof(PixelType) * region.GetNumberOfPixels() /
+                       std::max<itk::SizeValueType>(1, numberOfChunks));
 }
 
 template <class TInputImage, class TOutputImage>
@@ -642,54 +843,40 @@ AnisotropicDiffusionVesselEnhancementImageFilter<
 
   itkDebugMacro(<< "CalculateChange called");
 
-  DenseFDThreadStruct str;
-  str.Filter = this;
-  str.TimeStep = itk::NumericTraits<TimeStepType>::Zero;
-  this->GetMultiThreader()->SetNumberOfThreads(this->GetNumberOfThreads());
-  this->GetMultiThreader()->SetSingleMethod(
-      this->CalculateChangeThreaderCallback, &str);
-
-  // Initialize the list of time step values that will be generated by the
-  // various threads. There is one distinct slot for each possible thread,
-  // so this data structure is thread-safe.
-  const int threadCount = this->GetMultiThreader()->GetNumberOfThreads();
-  str.TimeStepList.resize(threadCount);
-  str.ValidTimeStepList.assign(threadCount, false);
-
-  this->GetMultiThreader()->SingleMethodExecute();
-
-  return this->ResolveTimeStep(str.TimeStepList, str.ValidTimeStepList);
-}
-
-template <class TInputImage, class TOutputImage>
-ITK_THREAD_RETURN_TYPE AnisotropicDiffusionVesselEnhancementImageFilter<
-    TInputImage, TOutputImage>::CalculateChangeThreaderCallback(void* arg)
-{
-
-  const auto threadInfo =
-      static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
-  const int threadId = threadInfo->ThreadID;
-  const int threadCount = threadInfo->NumberOfThreads;
-  const auto str = static_cast<DenseFDThreadStruct*>(threadInfo->UserData);
-
-  // Execute the actual method with appropriate output region
-  // first find out how many pieces extent can be split into.
-  // Using the SplitRequestedRegion method from itk::ImageSource.
-  ThreadRegionType splitRegion;
-  str->Filter->SplitRequestedRegion(threadId, threadCount, splitRegion);
-
-  ThreadDiffusionImageRegionType splitDiffusionimageRegion;
-  const int total = str->Filter->SplitRequestedRegion(
-      threadId, threadCount, splitDiffusionimageRegion);
-
-  if (threadId < total)
-  {
-    str->TimeStepList[threadId] = str->Filter->ThreadedCalculateChange(
-        splitRegion, splitDiffusionimageRegion, threadId);
-    str->ValidTimeStepList[threadId] = true;
-  }
-
-  return ITK_THREAD_RETURN_VALUE;
+  StageTimerScope timer(
+      "Diffusion::ThreadedCalculateChange",
+      this->GetOutput()->GetRequestedRegion().GetNumberOfPixels());
+
+  // One time step per thread, the smallest of its chunks. Every voxel
+  // reads the output and the diffusion tensor (the neighbours are mostly in
+  // the cache) and writes the update.
+  WorkStealingPool& pool = WorkStealingPool::GetInstance();
+  const ThreadRegionType region = this->GetOutput()->GetRequestedRegion();
+  const itk::SizeValueType numberOfChunks = pool.GetNumberOfChunks(region);
+  std::vector<TimeStepType> timeStepList(pool.GetNumberOfThreads());
+  std::vector<char> validTimeSteps(timeStepList.size(), false);
+
+  pool.ParallelFor(
+      "Diffusion::ThreadedCalculateChange", numberOfChunks,
+      this->GetNumberOfThreads(), [&](unsigned int threadId, size_t chunk) {
+        const ThreadRegionType chunkRegion = pool.GetChunkRegion(region, chunk);
+        const TimeStepType timeStep =
+            this->ThreadedCalculateChange(chunkRegion, chunkRegion, threadId);
+        if (!validTimeSteps[threadId] || timeStep < timeStepList[threadId])
+        {
+          timeStepList[threadId] = timeStep;
+        }
+        validTimeSteps[threadId] = true;
+      },
+      (2.0 * sizeof(PixelType) +
+       sizeof(typename DiffusionTensorImageType::PixelType)) *
+          region.GetNumberOfPixels() /
+          std::max<itk::SizeValueType>(1, numberOfChunks));
+
+  // std::vector<bool> is not safe for concurrent writes.
+  const std::vector<bool> validTimeStepList(validTimeSteps.begin(),
+                                            validTimeSteps.end());
+  return this->ResolveTimeStep(timeStepList, validTimeStepList);
 }
 
 template <class TInputImage, class TOutputImage>
@@ -823,10 +1010,27 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
 
   if (!Superclass::GetIsInitialized())
   {
+    StageTimerScope allocateTimer("Diffusion::Allocate");
     this->AllocateOutputs();
     this->CopyInputToOutput();
     this->AllocateUpdateBuffer();
     this->AllocateDiffusionTensorImage();
+    allocateTimer.AddBytesAllocated(
+        StageTimer::ImageBytes(this->GetOutput()) +
+        StageTimer::ImageBytes(m_UpdateBuffer.GetPointer()) +
+        StageTimer::ImageBytes(m_DiffusionTensorImage.GetPointer()));
+    if (m_GenerateTensorFiles)
+    {
+      allocateTimer.AddBytesAllocated(
+          StageTimer::ImageBytes(m_MrtrixTensorImage.GetPointer()) +
+          StageTimer::ImageBytes(m_PeakImage.GetPointer()));
+    }
+    allocateTimer.Stop();
+
+    // 1 / spacing if UseImageSpacing (relative to the finest axis in the
+    // function), read by the function every iteration.
+    this->InitializeFunctionCoefficients();
+
     this->SetStateToInitialized();
     this->SetElapsedIterations(0);
 
@@ -850,28 +1054,46 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
                 << std::endl;
     }
 
+    StageTimerScope iterationTimer(
+        "Diffusion::Iteration",
+        this->GetOutput()->GetBufferedRegion().GetNumberOfPixels());
+    iterationTimer.SetArgument("iteration", iter + 1);
+
     this->InitializeIteration();
 
     //if ((m_GenerateIterationFiles && iter == 0) || this->GetFrangiOnly())
     if ((iter == 0) || this->GetFrangiOnly())
     {
+      if (m_GenerateTensorFiles)
+      {
+        StageTimerScope timer(
+            "Diffusion::WriteTensorFiles",
+            this->GetOutput()->GetBufferedRegion().GetNumberOfPixels());
     
         //WRITE OUTPUT TO FILE
-        typedef itk::ImageFileWriter<MrtrixTensorImageType> ImageMRTRIXWriterType;
-        typename ImageMRTRIXWriterType::Pointer writer_mrtrix = ImageMRTRIXWriterType::New();
+        const std::string precision =
+            QuantizedImageWriter::GetPrecisionName(m_TensorFilesPrecision);
         const std::string filename2 = "diffusion_mrtrix_tensor_D11_D22_D33_D12_D13_D23.nii.gz";
-        writer_mrtrix->SetFileName(filename2);
-        writer_mrtrix->SetInput(m_MrtrixTensorImage);
-        writer_mrtrix->Update();
+        const QuantizedImageWriter::QuantizationError tensorError =
+            QuantizedImageWriter::Write(m_MrtrixTensorImage.GetPointer(),
+                                        filename2, m_TensorFilesPrecision);
+        timer.AddFileWritten(filename2);
 
         //WRITE OUTPUT TO FILE
-        typedef itk::ImageFileWriter<PeakImageType> ImagePEAKWriterType;
-        typename ImagePEAKWriterType::Pointer writer_peaks = ImagePEAKWriterType::New();
         const std::string filename3 = "diffusion_peaks.nii.gz";
-        writer_peaks->SetFileName(filename3);
-        writer_peaks->SetInput(m_PeakImage);
-        writer_peaks->Update();
+        const QuantizedImageWriter::QuantizationError peakError =
+            QuantizedImageWriter::Write(m_PeakImage.GetPointer(), filename3,
+                                        m_TensorFilesPrecision);
+        timer.AddFileWritten(filename3);
 
+        if (m_TensorFilesPrecision != QuantizedImageWriter::FullPrecision)
+        {
+          QuantizedImageWriter::PrintError(std::cout, filename2, precision,
+                                           tensorError);
+          QuantizedImageWriter::PrintError(std::cout, filename3, precision,
+                                           peakError);
+        }
+      }
 
         if (this->GetFrangiOnly())
         {
@@ -893,6 +1115,10 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
             sstm << "ved_iteration_" << (iter + 1) << ".nii.gz";
             const std::string vedIterationFile = sstm.str();
 
+            StageTimerScope timer(
+                "Diffusion::WriteIterationFile",
+                this->GetOutput()->GetBufferedRegion().GetNumberOfPixels());
+
             //WRITE OUTPUT TO FILE
             typedef itk::Image<float, ImageDimension> floatImageType;
             typedef itk::ImageFileWriter<floatImageType> ImageWriterType;
@@ -905,6 +1131,7 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
             writer->SetFileName(vedIterationFile);
             writer->SetInput(castFilter->GetOutput());
             writer->Update();
+            timer.AddFileWritten(vedIterationFile);
         }
     }   
 
@@ -918,6 +1145,13 @@ void AnisotropicDiffusionVesselEnhancementImageFilter<
       throw itk::ProcessAborted(__FILE__, __LINE__);
     }
   }
+
+  // As FiniteDifferenceImageFilter: the next Update() (e.g. another frame
+  // of a time series) starts again from its input.
+  if (!this->GetManualReinitialization())
+  {
+    this->SetStateToUninitialized();
+  }
 }
 
 #endif
@@ -0,0 +1,506 @@
+#if defined(_MSC_VER)
+#pragma warning(disable : 4786)
+#endif
+
+#include "itkMappedImageIO.h"
+#include "itkRunLengthMask.h"
+
+#include "boost/program_options.hpp"
+#include "itkMultiThreader.h"
+
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
+
+// Regional vascular measures of registered subjects (the region-based
+// template): for every label of every atlas, the mean of the VED output,
+// the density (fraction of the voxels above the threshold) and the mean
+// diameter of these vessel voxels. The atlases are read once and turned
+// into dense label indices; every subject is then read once and all the
+// atlases are accumulated in the same sweep, each thread into its own
+// accumulators, merged at the end of the subject. An atlas adds one lookup
+// per voxel, not a pass over the cohort.
+
+const int Dimension = 3;
+typedef itk::Image<float, Dimension> ImageType;
+typedef itk::Image<int, Dimension> LabelImageType;
+
+// Sums over the voxels of one label.
+struct LabelStatistics
+{
+  double Voxels;
+  double VEDSum;
+  double Vessels;
+  double DiameterSum;
+};
+
+struct AtlasInfo
+{
+  std::string Name;
+  std::string FileName;
+
+  LabelImageType::Pointer Image;
+  std::vector<int> Labels;            // the non-zero labels, increasing
+  std::vector<unsigned short> Index;  // per voxel, 1 + position in Labels
+  unsigned int FirstSlot;             // of the atlas in the accumulators
+
+  std::ofstream SubjectTable;
+
+  // Sums over the subjects of the regional measures.
+  std::vector<double> VEDMean;
+  std::vector<double> Density;
+  std::vector<double> DiameterMean;
+  std::vector<unsigned int> DiameterSubjects;
+  std::vector<double> Voxels;
+};
+
+struct SubjectInfo
+{
+  std::string Id;
+  std::string VED;
+  std::string Diameter;
+};
+
+bool process_command_line(int argc, char** argv,
+                          boost::program_options::variables_map& vm)
+{
+  try
+  {
+    boost::program_options::options_description program(
+        "Program allowed options\n");
+    program.add_options()("help,h", "produce help message.");
+
+    boost::program_options::options_description requiredVariable("Required\n");
+    requiredVariable.add_options()(
+        "atlas,a",
+        boost::program_options::value<std::vector<std::string>>()->required(),
+        "'name,label_file', an atlas of integer labels (0: background) on "
+        "the grid of the subjects. Can be repeated; all the atlases are "
+        "processed in one pass.")(
+        "subjects,s", boost::program_options::value<std::string>()->required(),
+        "a text file with one subject per line: 'id ved_file "
+        "[diameter_file]' (lines starting with # are skipped).")(
+        "threshold,t", boost::program_options::value<double>()->required(),
+        "VED values above are vessel voxels (density and diameter).")(
+        "output,o", boost::program_options::value<std::string>()->required(),
+        "the prefix of the outputs: <prefix><atlas>_CAT_template_data_VED"
+        ".csv (one row per subject and label), <prefix><atlas>"
+        "_mean_template_data_VED.csv and the same image (mean VED of every "
+        "label).");
+
+    boost::program_options::options_description outputVariable("Outputs\n");
+    outputVariable.add_options()(
+        "imageExtension",
+        boost::program_options::value<std::string>()->default_value(
+            ".nii.gz"),
+        "Extension of the mean template images.")(
+        "threads,n", boost::program_options::value<int>()->default_value(0),
+        "The number of threads (0: ITK default).");
+
+    boost::program_options::options_description global;
+
+    global.add(program).add(requiredVariable).add(outputVariable);
+
+    boost::program_options::store(
+        boost::program_options::parse_command_line(argc, argv, global), vm);
+
+    if (vm.count("help"))
+    {
+      std::cout << global << std::endl;
+      return false;
+    }
+
+    boost::program_options::notify(vm);
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Error: " << e.what() << "\n";
+    return false;
+  }
+  catch (...)
+  {
+    std::cerr << "Unknown error!\n";
+    return false;
+  }
+  return true;
+}
+
+std::vector<SubjectInfo> read_subjects(const std::string& fileName)
+{
+  std::ifstream file(fileName.c_str());
+  if (!file)
+  {
+    throw std::runtime_error("cannot open the subjects file " + fileName);
+  }
+
+  std::vector<SubjectInfo> subjects;
+  std::string line;
+  while (std::getline(file, line))
+  {
+    std::istringstream fields(line);
+    SubjectInfo subject;
+    if (!(fields >> subject.Id) || subject.Id[0] == '#')
+    {
+      continue;
+    }
+    if (!(fields >> subject.VED))
+    {
+      throw std::runtime_error("missing VED file on line '" + line + "'");
+    }
+    fields >> subject.Diameter;
+    if (!subjects.empty() &&
+        subject.Diameter.empty() != subjects[0].Diameter.empty())
+    {
+      throw std::runtime_error("either every subject has a diameter file, "
+                               "or none has.");
+    }
+    subjects.push_back(subject);
+  }
+  if (subjects.empty())
+  {
+    throw std::runtime_error("no subject in " + fileName);
+  }
+  return subjects;
+}
+
+// The same size, and the same spacing, origin (in voxels) and direction
+// cosines within 1e-4.
+bool same_grid(const itk::ImageBase<Dimension>* image,
+               const itk::ImageBase<Dimension>* reference)
+{
+  if (image->GetBufferedRegion() != reference->GetBufferedRegion())
+  {
+    return false;
+  }
+  for (unsigned int d = 0; d < Dimension; ++d)
+  {
+    const double tolerance = 1e-4 * reference->GetSpacing()[d];
+    if (std::abs(image->GetSpacing()[d] - reference->GetSpacing()[d]) >
+            tolerance ||
+        std::abs(image->GetOrigin()[d] - reference->GetOrigin()[d]) >
+            tolerance)
+    {
+      return false;
+    }
+    for (unsigned int e = 0; e < Dimension; ++e)
+    {
+      if (std::abs(image->GetDirection()[d][e] -
+                   reference->GetDirection()[d][e]) > 1e-4)
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// The labels of the atlas and the index of every voxel.
+void index_atlas(AtlasInfo& atlas)
+{
+  const size_t numberOfVoxels =
+      atlas.Image->GetBufferedRegion().GetNumberOfPixels();
+  const int* labels = atlas.Image->GetBufferPointer();
+
+  // Labels come in long runs: look the map up only when they change.
+  std::map<int, unsigned int> positions;
+  for (size_t i = 0; i < numberOfVoxels; ++i)
+  {
+    if (labels[i] != 0 && (i == 0 || labels[i] != labels[i - 1]))
+    {
+      positions[labels[i]] = 0;
+    }
+  }
+  if (positions.size() > std::numeric_limits<unsigned short>::max() - 1u)
+  {
+    throw std::runtime_error("too many labels in " + atlas.FileName);
+  }
+
+  atlas.Labels.clear();
+  for (std::map<int, unsigned int>::iterator it = positions.begin();
+       it != positions.end(); ++it)
+  {
+    it->second = atlas.Labels.size() + 1;
+    atlas.Labels.push_back(it->first);
+  }
+
+  atlas.Index.resize(numberOfVoxels);
+  unsigned short index = 0;
+  for (size_t i = 0; i < numberOfVoxels; ++i)
+  {
+    if (i == 0 || labels[i] != labels[i - 1])
+    {
+      index = labels[i] != 0 ? positions[labels[i]] : 0;
+    }
+    atlas.Index[i] = index;
+  }
+
+  const size_t numberOfLabels = atlas.Labels.size();
+  atlas.VEDMean.assign(numberOfLabels, 0.0);
+  atlas.Density.assign(numberOfLabels, 0.0);
+  atlas.DiameterMean.assign(numberOfLabels, 0.0);
+  atlas.DiameterSubjects.assign(numberOfLabels, 0);
+  atlas.Voxels.assign(numberOfLabels, 0.0);
+}
+
+void parse_atlas(const std::string& description, AtlasInfo& atlas)
+{
+  const size_t comma = description.find(',');
+  if (comma == std::string::npos || comma == 0 ||
+      comma + 1 == description.size())
+  {
+    throw std::runtime_error("Invalid atlas '" + description +
+                             "', expected name,label_file.");
+  }
+
+  atlas.Name = description.substr(0, comma);
+  atlas.FileName = description.substr(comma + 1);
+}
+
+// =============================================================================
+// One sweep over the subject: every thread accumulates its slices into its
+// own statistics of all the labels of all the atlases, which are then
+// merged.
+// =============================================================================
+std::vector<LabelStatistics>
+accumulate_subject(const ImageType* ved, const ImageType* diameter,
+                   double threshold,
+                   const std::vector<std::unique_ptr<AtlasInfo>>& atlases,
+                   unsigned int numberOfSlots, int numberOfThreads)
+{
+  const ImageType::SizeType size = ved->GetBufferedRegion().GetSize();
+  const size_t sliceSize = static_cast<size_t>(size[0]) * size[1];
+  const int nz = size[2];
+
+  const float* vedBuffer = ved->GetBufferPointer();
+  const float* diameterBuffer = diameter ? diameter->GetBufferPointer()
+                                         : nullptr;
+
+  const LabelStatistics zero = {0.0, 0.0, 0.0, 0.0};
+  std::vector<std::vector<LabelStatistics>> threadStatistics(
+      std::max(1, numberOfThreads),
+      std::vector<LabelStatistics>(numberOfSlots, zero));
+
+  ParallelForSlices(nz, numberOfThreads, [&](int threadId, int first,
+                                             int end) {
+    LabelStatistics* statistics = threadStatistics[threadId].data();
+    for (size_t i = sliceSize * first; i < sliceSize * end; ++i)
+    {
+      const double value = vedBuffer[i];
+      const bool vessel = value > threshold;
+      const double width = vessel && diameterBuffer ? diameterBuffer[i] : 0.0;
+      for (unsigned int a = 0; a < atlases.size(); ++a)
+      {
+        const unsigned short index = atlases[a]->Index[i];
+        if (index == 0)
+        {
+          continue;
+        }
+        LabelStatistics& s = statistics[atlases[a]->FirstSlot + index - 1];
+        s.Voxels += 1.0;
+        s.VEDSum += value;
+        if (vessel)
+        {
+          s.Vessels += 1.0;
+          s.DiameterSum += width;
+        }
+      }
+    }
+  });
+
+  std::vector<LabelStatistics> total(numberOfSlots, zero);
+  for (unsigned int t = 0; t < threadStatistics.size(); ++t)
+  {
+    for (unsigned int slot = 0; slot < numberOfSlots; ++slot)
+    {
+      const LabelStatistics& s = threadStatistics[t][slot];
+      total[slot].Voxels += s.Voxels;
+      total[slot].VEDSum += s.VEDSum;
+      total[slot].Vessels += s.Vessels;
+      total[slot].DiameterSum += s.DiameterSum;
+    }
+  }
+  return total;
+}
+
+// The mean VED of every label painted on the atlas.
+void write_mean_template(const AtlasInfo& atlas, const std::string& fileName)
+{
+  ImageType::Pointer image = ImageType::New();
+  image->CopyInformation(atlas.Image);
+  image->SetRegions(atlas.Image->GetBufferedRegion());
+  image->Allocate();
+
+  float* buffer = image->GetBufferPointer();
+  for (size_t i = 0; i < atlas.Index.size(); ++i)
+  {
+    const unsigned short index = atlas.Index[i];
+    buffer[i] = index != 0 ? atlas.VEDMean[index - 1] : 0.0f;
+  }
+
+  MappedImageIO::Write(image.GetPointer(), fileName);
+}
+
+int main(int argc, char* argv[])
+{
+  boost::program_options::variables_map vm;
+  if (!process_command_line(argc, argv, vm))
+  {
+    return EXIT_FAILURE;
+  }
+
+  int numberOfThreads = vm["threads"].as<int>();
+  if (numberOfThreads <= 0)
+  {
+    numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  }
+  const double threshold = vm["threshold"].as<double>();
+  const std::string prefix = vm["output"].as<std::string>();
+
+  try
+  {
+    const std::vector<SubjectInfo> subjects =
+        read_subjects(vm["subjects"].as<std::string>());
+    const bool hasDiameter = !subjects[0].Diameter.empty();
+
+    const std::vector<std::string> descriptions =
+        vm["atlas"].as<std::vector<std::string>>();
+    std::vector<std::unique_ptr<AtlasInfo>> atlases;
+    unsigned int numberOfSlots = 0;
+    for (unsigned int a = 0; a < descriptions.size(); ++a)
+    {
+      atlases.emplace_back(new AtlasInfo);
+      AtlasInfo& atlas = *atlases.back();
+      parse_atlas(descriptions[a], atlas);
+
+      std::cout << "Reading atlas : " << atlas.FileName << std::endl;
+      atlas.Image = MappedImageIO::Read<LabelImageType>(atlas.FileName);
+      if (a > 0 && !same_grid(atlas.Image, atlases[0]->Image))
+      {
+        throw std::runtime_error(atlas.FileName +
+                                 " is not on the grid of the first atlas.");
+      }
+      index_atlas(atlas);
+      atlas.FirstSlot = numberOfSlots;
+      numberOfSlots += atlas.Labels.size();
+      std::cout << atlas.Name << " : " << atlas.Labels.size() << " labels"
+                << std::endl;
+
+      const std::string tableName =
+          prefix + atlas.Name + "_CAT_template_data_VED.csv";
+      atlas.SubjectTable.open(tableName.c_str());
+      if (!atlas.SubjectTable)
+      {
+        throw std::runtime_error("cannot write " + tableName);
+      }
+      atlas.SubjectTable << "subject,label,voxels,ved_mean,density,"
+                            "diameter_mean\n";
+    }
+
+    for (unsigned int s = 0; s < subjects.size(); ++s)
+    {
+      const SubjectInfo& subject = subjects[s];
+      std::cout << "Subject " << subject.Id << " (" << s + 1 << "/"
+                << subjects.size() << ")" << std::endl;
+
+      ImageType::Pointer ved = MappedImageIO::Read<ImageType>(subject.VED);
+      ImageType::Pointer diameter;
+      if (hasDiameter)
+      {
+        diameter = MappedImageIO::Read<ImageType>(subject.Diameter);
+      }
+      if (!same_grid(ved, atlases[0]->Image) ||
+          (diameter.IsNotNull() && !same_grid(diameter, atlases[0]->Image)))
+      {
+        throw std::runtime_error("subject " + subject.Id +
+                                 " is not on the grid of the atlases.");
+      }
+
+      const std::vector<LabelStatistics> statistics =
+          accumulate_subject(ved, diameter, threshold, atlases,
+                             numberOfSlots, numberOfThreads);
+
+      for (unsigned int a = 0; a < atlases.size(); ++a)
+      {
+        AtlasInfo& atlas = *atlases[a];
+        for (unsigned int l = 0; l < atlas.Labels.size(); ++l)
+        {
+          // Every label of the atlas has voxels.
+          const LabelStatistics& label = statistics[atlas.FirstSlot + l];
+          const double vedMean = label.VEDSum / label.Voxels;
+          const double density = label.Vessels / label.Voxels;
+          const double diameterMean =
+              hasDiameter && label.Vessels > 0
+                  ? label.DiameterSum / label.Vessels
+                  : std::numeric_limits<double>::quiet_NaN();
+
+          atlas.SubjectTable << subject.Id << "," << atlas.Labels[l] << ","
+                             << label.Voxels << "," << vedMean << ","
+                             << density << "," << diameterMean << "\n";
+
+          atlas.Voxels[l] = label.Voxels;
+          atlas.VEDMean[l] += vedMean;
+          atlas.Density[l] += density;
+          if (hasDiameter && label.Vessels > 0)
+          {
+            atlas.DiameterMean[l] += diameterMean;
+            ++atlas.DiameterSubjects[l];
+          }
+        }
+        atlas.SubjectTable.flush();
+      }
+    }
+
+    // Means over the subjects.
+    for (unsigned int a = 0; a < atlases.size(); ++a)
+    {
+      AtlasInfo& atlas = *atlases[a];
+      atlas.SubjectTable.close();
+
+      const std::string tableName =
+          prefix + atlas.Name + "_mean_template_data_VED.csv";
+      std::ofstream table(tableName.c_str());
+      if (!table)
+      {
+        throw std::runtime_error("cannot write " + tableName);
+      }
+      table << "label,voxels,ved_mean,density,diameter_mean,"
+               "diameter_subjects\n";
+      for (unsigned int l = 0; l < atlas.Labels.size(); ++l)
+      {
+        atlas.VEDMean[l] /= subjects.size();
+        atlas.Density[l] /= subjects.size();
+        if (atlas.DiameterSubjects[l] > 0)
+        {
+          atlas.DiameterMean[l] /= atlas.DiameterSubjects[l];
+        }
+        else
+        {
+          atlas.DiameterMean[l] = std::numeric_limits<double>::quiet_NaN();
+        }
+        table << atlas.Labels[l] << "," << atlas.Voxels[l] << ","
+              << atlas.VEDMean[l] << "," << atlas.Density[l] << ","
+              << atlas.DiameterMean[l] << "," << atlas.DiameterSubjects[l]
+              << "\n";
+      }
+
+      write_mean_template(atlas, prefix + atlas.Name +
+                                     "_mean_template_data_VED" +
+                                     vm["imageExtension"].as<std::string>());
+    }
+  }
+  catch (itk::ExceptionObject& err)
+  {
+    std::cerr << "Exception caught: " << err << std::endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::exception& err)
+  {
+    std::cerr << "Error: " << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
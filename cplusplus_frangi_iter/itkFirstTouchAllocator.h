@@ -0,0 +1,135 @@
+#ifndef __itkFirstTouchAllocator_h
+#define __itkFirstTouchAllocator_h
+
+#include "itkImageBufferPool.h"
+#include "itkMappedImageIO.h"
+#include "itkNumaTopology.h"
+#include "itkStageTimer.h"
+#include "itkWorkStealingPool.h"
+
+#include <sys/mman.h>
+
+#include <new>
+#include <string>
+
+// \class FirstTouchAllocator
+// \brief Allocation of the large image buffers with a parallel first touch.
+//
+// Linux puts a page on the NUMA node of the thread which first writes it.
+// Image::Allocate() followed by FillBuffer() on one thread puts a whole
+// volume on one node, and on a multi-socket machine every other node then
+// reads it through the interconnect. Allocate() maps the buffer without
+// touching it and fills it with a ParallelForStatic() over the same chunks
+// as the WorkStealingPool loops of the filters, so that the pages of every
+// slab are on the node of the thread which starts on it (see
+// NumaTopology::GetThreadCpu()).
+//
+// With the ImageBufferPool enabled, the buffer is leased from the pool
+// instead: a new mapping is untouched as well, and a reused one was first
+// touched by the same chunks the first time.
+//
+// Disabled (the default), Allocate() is Image::Allocate() and FillBuffer().
+// On a single node machine the buffers are the same either way, only
+// filled by several threads. When the StageTimer is on, the number of pages
+// of every buffer on each node is added to the trace as "FirstTouch" events.
+class FirstTouchAllocator
+{
+public:
+  static void SetEnabled(bool enabled) { Enabled() = enabled; }
+  static bool IsEnabled() { return Enabled(); }
+
+  // Allocate the buffered region of image and set every pixel to value.
+  template <typename TImage>
+  static void Allocate(TImage* image, const typename TImage::PixelType& value,
+                       unsigned int maximumNumberOfThreads = 0)
+  {
+    typedef typename TImage::PixelType PixelType;
+    typedef typename TImage::RegionType RegionType;
+    typedef MappedImageIO::MappedImageContainer<PixelType> ContainerType;
+
+    const RegionType region = image->GetBufferedRegion();
+    const itk::SizeValueType numberOfPixels = region.GetNumberOfPixels();
+    if (!IsEnabled() || numberOfPixels == 0)
+    {
+      image->Allocate();
+      image->FillBuffer(value);
+      return;
+    }
+
+    const size_t length = numberOfPixels * sizeof(PixelType);
+    if (ImageBufferPool::GetInstance().IsEnabled())
+    {
+      image->Allocate();
+    }
+    else
+    {
+      void* mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mapping == MAP_FAILED)
+      {
+        image->Allocate();
+        image->FillBuffer(value);
+        return;
+      }
+      typename ContainerType::Pointer container = ContainerType::New();
+      container->SetMapping(mapping, length, 0, numberOfPixels);
+      image->SetPixelContainer(container);
+    }
+
+    PixelType* buffer = image->GetBufferPointer();
+    const itk::SizeValueType rowLength = region.GetSize(0);
+    WorkStealingPool& pool = WorkStealingPool::GetInstance();
+    pool.ParallelForStatic(
+        "FirstTouchAllocator::Allocate", pool.GetNumberOfChunks(region),
+        maximumNumberOfThreads,
+        [&](unsigned int, size_t chunk) {
+          const RegionType chunkRegion = pool.GetChunkRegion(region, chunk);
+          const itk::SizeValueType numberOfRows =
+              chunkRegion.GetNumberOfPixels() / rowLength;
+          typename RegionType::IndexType index = chunkRegion.GetIndex();
+          for (itk::SizeValueType row = 0; row < numberOfRows; ++row)
+          {
+            PixelType* first = buffer + image->ComputeOffset(index);
+            for (itk::SizeValueType i = 0; i < rowLength; ++i)
+            {
+              new (first + i) PixelType(value);
+            }
+
+            // Next row of the chunk.
+            for (unsigned int d = 1; d < TImage::ImageDimension; ++d)
+            {
+              if (++index[d] <
+                  chunkRegion.GetIndex(d) +
+                      static_cast<itk::IndexValueType>(chunkRegion.GetSize(d)))
+              {
+                break;
+              }
+              index[d] = chunkRegion.GetIndex(d);
+            }
+          }
+        },
+        static_cast<double>(pool.GetChunkSize()) * pool.GetChunkSize() *
+            rowLength * sizeof(PixelType));
+
+    if (StageTimer::IsEnabled())
+    {
+      const std::vector<double> pages =
+          NumaTopology::GetInstance().GetPagesPerNode(buffer, length);
+      StageTimerScope timer("FirstTouch");
+      for (unsigned int n = 0; n < pages.size(); ++n)
+      {
+        timer.SetArgument(("node" + std::to_string(n) + "_pages").c_str(),
+                          pages[n]);
+      }
+    }
+  }
+
+private:
+  static bool& Enabled()
+  {
+    static bool enabled = false;
+    return enabled;
+  }
+};
+
+#endif
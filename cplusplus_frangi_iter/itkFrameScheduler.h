@@ -0,0 +1,122 @@
+#ifndef __itkFrameScheduler_h
+#define __itkFrameScheduler_h
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// \class FrameScheduler
+// \brief Runs the frames of a time series on a few lanes at once.
+//
+// Each lane is one thread (the calling thread is lane 0) with its own
+// state, e.g. one diffusion filter kept from a frame to the next. Without
+// warm start, the lanes take the next frame left until there is none, so a
+// slow frame does not hold the others back. With warm start, every lane
+// gets one contiguous range of frames, [N * l / L, N * (l + 1) / L) of N
+// frames on L lanes, run in order: every frame but the first of a range is
+// told that its lane just ran the previous frame, whose state it can start
+// from.
+//
+// The first exception thrown by a frame stops the lanes after their
+// current frame and is rethrown by Run().
+class FrameScheduler
+{
+public:
+  // body(lane, frame, warm): warm when the lane has just run frame - 1.
+  typedef std::function<void(unsigned int, unsigned int, bool)>
+      FrameFunctionType;
+
+  FrameScheduler() : m_NumberOfLanes{1}, m_WarmStart{false} {}
+
+  // Frames run at the same time, 1 by default.
+  void SetNumberOfLanes(unsigned int numberOfLanes)
+  {
+    m_NumberOfLanes = std::max(1u, numberOfLanes);
+  }
+  unsigned int GetNumberOfLanes() const { return m_NumberOfLanes; }
+
+  // Lanes used for numberOfFrames frames.
+  unsigned int GetNumberOfLanes(unsigned int numberOfFrames) const
+  {
+    return std::max(1u, std::min(m_NumberOfLanes, numberOfFrames));
+  }
+
+  // Contiguous ranges of frames in order. Off by default.
+  void SetWarmStart(bool warmStart) { m_WarmStart = warmStart; }
+  bool GetWarmStart() const { return m_WarmStart; }
+
+  void Run(unsigned int numberOfFrames, const FrameFunctionType& body)
+  {
+    const unsigned int numberOfLanes = this->GetNumberOfLanes(numberOfFrames);
+    std::atomic<unsigned int> nextFrame(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr exception;
+    std::mutex exceptionMutex;
+
+    auto lane = [&](unsigned int l) {
+      try
+      {
+        if (m_WarmStart)
+        {
+          const unsigned int first = static_cast<unsigned int>(
+              static_cast<unsigned long long>(numberOfFrames) * l /
+              numberOfLanes);
+          const unsigned int last = static_cast<unsigned int>(
+              static_cast<unsigned long long>(numberOfFrames) * (l + 1) /
+              numberOfLanes);
+          for (unsigned int frame = first; frame < last && !failed; ++frame)
+          {
+            body(l, frame, frame > first);
+          }
+        }
+        else
+        {
+          for (unsigned int frame = nextFrame++;
+               frame < numberOfFrames && !failed; frame = nextFrame++)
+          {
+            body(l, frame, false);
+          }
+        }
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(exceptionMutex);
+        if (!exception)
+        {
+          exception = std::current_exception();
+        }
+        failed = true;
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int l = 1; l < numberOfLanes; ++l)
+    {
+      threads.push_back(std::thread(lane, l));
+    }
+    lane(0);
+    for (unsigned int t = 0; t < threads.size(); ++t)
+    {
+      threads[t].join();
+    }
+
+    if (exception)
+    {
+      std::rethrow_exception(exception);
+    }
+  }
+
+private:
+  // purposely not implemented
+  FrameScheduler(const FrameScheduler&);
+  void operator=(const FrameScheduler&);
+
+  unsigned int m_NumberOfLanes;
+  bool m_WarmStart;
+};
+
+#endif
@@ -0,0 +1,392 @@
+#ifndef __itkFrangiKernel_h
+#define __itkFrangiKernel_h
+
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+#if (defined(__GNUC__) || defined(__clang__)) &&                               \
+    (defined(__x86_64__) || defined(__i386__))
+#define VED_FRANGI_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+// \class FrangiKernel
+// \brief The Frangi response of a batch of voxels.
+//
+// The eigenvalues are given as three arrays (structure of arrays), sorted by
+// magnitude |lambda1| <= |lambda2| <= |lambda3|. The voxels that are not
+// tubes of the wanted polarity (bright or dark) get 0, as in
+// VesselnessMeasurement; the others get the product of the four Frangi
+// factors, times |lambda3| if the measure is scaled.
+//
+// The AVX2 and AVX-512 kernels reject the voxels with masks, and evaluate
+// the exponentials with a polynomial on 4 or 8 doubles at once (relative
+// error below 1e-15). The two factors that are plain exponentials share one
+// exponential. The scalar kernel is the original per voxel code. The
+// automatic kernel is the widest one supported by the processor, detected
+// at run time.
+
+class FrangiKernel
+{
+public:
+  typedef enum
+  {
+    AutomaticKernel = 0,
+    ScalarKernel = 1,
+    AVX2Kernel = 2,
+    AVX512Kernel = 3
+  } KernelType;
+
+  struct Parameters
+  {
+    double Alpha;
+    double Beta;
+    double Gamma;
+    double C;
+    bool BrightObject;
+    bool ScaleObjectnessMeasure;
+  };
+
+  // Below this magnitude, lambda2 and lambda3 are not those of a tube.
+  static double GetEpsilon() { return 1e-03; }
+
+  static const char* GetKernelName(KernelType kernel)
+  {
+    static const char* names[] = {"auto", "scalar", "avx2", "avx512"};
+    return names[kernel];
+  }
+
+  static KernelType GetKernelFromName(const std::string& name)
+  {
+    for (int k = AutomaticKernel; k <= AVX512Kernel; ++k)
+    {
+      if (name == GetKernelName(static_cast<KernelType>(k)))
+      {
+        return static_cast<KernelType>(k);
+      }
+    }
+    throw std::invalid_argument("Unknown Frangi kernel '" + name +
+                                "' (auto, scalar, avx2 or avx512).");
+  }
+
+  // The widest kernel supported by the processor.
+  static KernelType GetBestKernel()
+  {
+    static const KernelType best = DetectBestKernel();
+    return best;
+  }
+
+  // The kernel used for a request: automatic is the best one, a kernel the
+  // processor does not support falls back to the best one.
+  static KernelType Resolve(KernelType kernel)
+  {
+    if (kernel == AutomaticKernel || kernel > GetBestKernel())
+    {
+      return GetBestKernel();
+    }
+    return kernel;
+  }
+
+  static void Evaluate(KernelType kernel, const Parameters& parameters,
+                       const double* lambda1, const double* lambda2,
+                       const double* lambda3, double* measure, size_t n)
+  {
+    switch (Resolve(kernel))
+    {
+#ifdef VED_FRANGI_KERNEL_X86
+    case AVX512Kernel:
+      EvaluateAVX512(parameters, lambda1, lambda2, lambda3, measure, n);
+      break;
+    case AVX2Kernel:
+      EvaluateAVX2(parameters, lambda1, lambda2, lambda3, measure, n);
+      break;
+#endif
+    default:
+      EvaluateScalar(parameters, lambda1, lambda2, lambda3, measure, n);
+      break;
+    }
+  }
+
+  static void EvaluateScalar(const Parameters& parameters,
+                             const double* lambda1, const double* lambda2,
+                             const double* lambda3, double* measure, size_t n)
+  {
+    const double alphaSqr = parameters.Alpha * parameters.Alpha;
+    const double betaSqr = parameters.Beta * parameters.Beta;
+    const double gammaSqr = parameters.Gamma * parameters.Gamma;
+    const double cSqr = parameters.C * parameters.C;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      const double l1 = lambda1[i];
+      const double l2 = lambda2[i];
+      const double l3 = lambda3[i];
+
+      // Doing bright extraction then, if blood is dark, skip (and the
+      // opposite for dark extraction).
+      const bool wrongPolarity = parameters.BrightObject
+                                     ? (l2 >= 0.0 || l3 >= 0.0)
+                                     : (l2 <= 0.0 || l3 <= 0.0);
+      if (wrongPolarity || std::abs(l2) < GetEpsilon() ||
+          std::abs(l3) < GetEpsilon())
+      {
+        measure[i] = 0.0;
+        continue;
+      }
+
+      const double lambda1Abs = std::abs(l1);
+      const double lambda2Abs = std::abs(l2);
+      const double lambda3Abs = std::abs(l3);
+
+      const double A = lambda2Abs / lambda3Abs;
+      const double B = lambda1Abs / std::sqrt(std::abs(l2 * l3));
+      const double S = l1 * l1 + l2 * l2 + l3 * l3;
+
+      const double vesMeasure1 = 1 - std::exp(-1.0 * (A * A / (2.0 * alphaSqr)));
+      const double vesMeasure2 = std::exp(-1.0 * (B * B / (2.0 * betaSqr)));
+      const double vesMeasure3 = 1 - std::exp(-1.0 * (S / (2.0 * gammaSqr)));
+      const double vesMeasure4 =
+          std::exp(-1.0 * (2.0 * cSqr) / (lambda2Abs * l3 * l3));
+
+      const double vesselnessMeasure =
+          vesMeasure1 * vesMeasure2 * vesMeasure3 * vesMeasure4;
+      measure[i] = parameters.ScaleObjectnessMeasure
+                       ? lambda3Abs * vesselnessMeasure
+                       : vesselnessMeasure;
+    }
+  }
+
+#ifdef VED_FRANGI_KERNEL_X86
+  __attribute__((target("avx2,fma"))) static void
+  EvaluateAVX2(const Parameters& parameters, const double* lambda1,
+               const double* lambda2, const double* lambda3, double* measure,
+               size_t n)
+  {
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d signMask = _mm256_set1_pd(-0.0);
+    const __m256d epsilon = _mm256_set1_pd(GetEpsilon());
+    const __m256d polarity =
+        _mm256_set1_pd(parameters.BrightObject ? -1.0 : 1.0);
+    const __m256d alphaFactor = _mm256_set1_pd(
+        -1.0 / (2.0 * parameters.Alpha * parameters.Alpha));
+    const __m256d betaFactor =
+        _mm256_set1_pd(-1.0 / (2.0 * parameters.Beta * parameters.Beta));
+    const __m256d gammaFactor = _mm256_set1_pd(
+        -1.0 / (2.0 * parameters.Gamma * parameters.Gamma));
+    const __m256d cFactor =
+        _mm256_set1_pd(-2.0 * parameters.C * parameters.C);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+      const __m256d l1 = _mm256_loadu_pd(lambda1 + i);
+      const __m256d l2 = _mm256_loadu_pd(lambda2 + i);
+      const __m256d l3 = _mm256_loadu_pd(lambda3 + i);
+      const __m256d l2Abs = _mm256_andnot_pd(signMask, l2);
+      const __m256d l3Abs = _mm256_andnot_pd(signMask, l3);
+
+      // Tubes of the wanted polarity, lambda2 and lambda3 not too small.
+      __m256d valid = _mm256_and_pd(
+          _mm256_cmp_pd(_mm256_mul_pd(polarity, l2), zero, _CMP_GT_OQ),
+          _mm256_cmp_pd(_mm256_mul_pd(polarity, l3), zero, _CMP_GT_OQ));
+      valid = _mm256_and_pd(valid,
+                            _mm256_cmp_pd(l2Abs, epsilon, _CMP_GE_OQ));
+      valid = _mm256_and_pd(valid,
+                            _mm256_cmp_pd(l3Abs, epsilon, _CMP_GE_OQ));
+
+      // The rejected voxels divide by one, their result is masked out.
+      const __m256d a2 = _mm256_blendv_pd(one, l2Abs, valid);
+      const __m256d a3 = _mm256_blendv_pd(one, l3Abs, valid);
+
+      const __m256d l1Sqr = _mm256_mul_pd(l1, l1);
+      const __m256d A = _mm256_div_pd(a2, a3);
+      const __m256d a23 = _mm256_mul_pd(a2, a3);
+      const __m256d S = _mm256_fmadd_pd(
+          l3, l3, _mm256_fmadd_pd(l2, l2, l1Sqr));
+
+      const __m256d vesMeasure1 = _mm256_sub_pd(
+          one, Exp4(_mm256_mul_pd(_mm256_mul_pd(A, A), alphaFactor)));
+      const __m256d vesMeasure3 =
+          _mm256_sub_pd(one, Exp4(_mm256_mul_pd(S, gammaFactor)));
+      // exp(-B^2 / 2 beta^2) exp(-2 c^2 / |lambda2| lambda3^2)
+      const __m256d vesMeasure24 = Exp4(_mm256_add_pd(
+          _mm256_mul_pd(_mm256_div_pd(l1Sqr, a23), betaFactor),
+          _mm256_div_pd(cFactor, _mm256_mul_pd(a23, a3))));
+
+      __m256d vesselnessMeasure = _mm256_mul_pd(
+          _mm256_mul_pd(vesMeasure1, vesMeasure3), vesMeasure24);
+      if (parameters.ScaleObjectnessMeasure)
+      {
+        vesselnessMeasure = _mm256_mul_pd(vesselnessMeasure, a3);
+      }
+      _mm256_storeu_pd(measure + i, _mm256_and_pd(valid, vesselnessMeasure));
+    }
+
+    EvaluateScalar(parameters, lambda1 + i, lambda2 + i, lambda3 + i,
+                   measure + i, n - i);
+  }
+
+  __attribute__((target("avx512f"))) static void
+  EvaluateAVX512(const Parameters& parameters, const double* lambda1,
+                 const double* lambda2, const double* lambda3,
+                 double* measure, size_t n)
+  {
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d epsilon = _mm512_set1_pd(GetEpsilon());
+    const __m512d polarity =
+        _mm512_set1_pd(parameters.BrightObject ? -1.0 : 1.0);
+    const __m512d alphaFactor = _mm512_set1_pd(
+        -1.0 / (2.0 * parameters.Alpha * parameters.Alpha));
+    const __m512d betaFactor =
+        _mm512_set1_pd(-1.0 / (2.0 * parameters.Beta * parameters.Beta));
+    const __m512d gammaFactor = _mm512_set1_pd(
+        -1.0 / (2.0 * parameters.Gamma * parameters.Gamma));
+    const __m512d cFactor =
+        _mm512_set1_pd(-2.0 * parameters.C * parameters.C);
+
+    for (size_t i = 0; i < n; i += 8)
+    {
+      // The last batch loads and stores only the voxels left.
+      const __mmask8 lanes =
+          n - i >= 8 ? 0xFF : static_cast<__mmask8>((1u << (n - i)) - 1);
+      const __m512d l1 = _mm512_maskz_loadu_pd(lanes, lambda1 + i);
+      const __m512d l2 = _mm512_maskz_loadu_pd(lanes, lambda2 + i);
+      const __m512d l3 = _mm512_maskz_loadu_pd(lanes, lambda3 + i);
+      const __m512d l2Abs = _mm512_abs_pd(l2);
+      const __m512d l3Abs = _mm512_abs_pd(l3);
+
+      // Tubes of the wanted polarity, lambda2 and lambda3 not too small.
+      __mmask8 valid = _mm512_cmp_pd_mask(_mm512_mul_pd(polarity, l2), zero,
+                                          _CMP_GT_OQ) &
+                       _mm512_cmp_pd_mask(_mm512_mul_pd(polarity, l3), zero,
+                                          _CMP_GT_OQ);
+      valid &= _mm512_cmp_pd_mask(l2Abs, epsilon, _CMP_GE_OQ) &
+               _mm512_cmp_pd_mask(l3Abs, epsilon, _CMP_GE_OQ);
+
+      // The rejected voxels divide by one, their result is masked out.
+      const __m512d a2 = _mm512_mask_blend_pd(valid, one, l2Abs);
+      const __m512d a3 = _mm512_mask_blend_pd(valid, one, l3Abs);
+
+      const __m512d l1Sqr = _mm512_mul_pd(l1, l1);
+      const __m512d A = _mm512_div_pd(a2, a3);
+      const __m512d a23 = _mm512_mul_pd(a2, a3);
+      const __m512d S = _mm512_fmadd_pd(
+          l3, l3, _mm512_fmadd_pd(l2, l2, l1Sqr));
+
+      const __m512d vesMeasure1 = _mm512_sub_pd(
+          one, Exp8(_mm512_mul_pd(_mm512_mul_pd(A, A), alphaFactor)));
+      const __m512d vesMeasure3 =
+          _mm512_sub_pd(one, Exp8(_mm512_mul_pd(S, gammaFactor)));
+      // exp(-B^2 / 2 beta^2) exp(-2 c^2 / |lambda2| lambda3^2)
+      const __m512d vesMeasure24 = Exp8(_mm512_add_pd(
+          _mm512_mul_pd(_mm512_div_pd(l1Sqr, a23), betaFactor),
+          _mm512_div_pd(cFactor, _mm512_mul_pd(a23, a3))));
+
+      __m512d vesselnessMeasure = _mm512_mul_pd(
+          _mm512_mul_pd(vesMeasure1, vesMeasure3), vesMeasure24);
+      if (parameters.ScaleObjectnessMeasure)
+      {
+        vesselnessMeasure = _mm512_mul_pd(vesselnessMeasure, a3);
+      }
+      _mm512_mask_storeu_pd(measure + i, lanes,
+                            _mm512_maskz_mov_pd(valid, vesselnessMeasure));
+    }
+  }
+#endif
+
+private:
+  static KernelType DetectBestKernel()
+  {
+#ifdef VED_FRANGI_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+      return AVX512Kernel;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+      return AVX2Kernel;
+    }
+#endif
+    return ScalarKernel;
+  }
+
+#ifdef VED_FRANGI_KERNEL_X86
+  // exp(x) for x <= 0: x = n ln2 + r with |r| <= ln2 / 2, exp(r) by its
+  // Taylor series to degree 12, times 2^n. Below -708 the result is 0.
+  __attribute__((target("avx2,fma"))) static __m256d Exp4(__m256d x)
+  {
+    const __m256d minimum = _mm256_set1_pd(-708.0);
+    const __m256d underflow = _mm256_cmp_pd(x, minimum, _CMP_LT_OQ);
+    x = _mm256_max_pd(x, minimum);
+
+    const __m256d n = _mm256_round_pd(
+        _mm256_mul_pd(x, _mm256_set1_pd(1.4426950408889634)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(6.93145751953125e-1), x);
+    r = _mm256_fnmadd_pd(n, _mm256_set1_pd(1.42860682030941723212e-6), r);
+
+    __m256d p = _mm256_set1_pd(TaylorCoefficient(12));
+    for (int k = 11; k >= 0; --k)
+    {
+      p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(TaylorCoefficient(k)));
+    }
+
+    // 2^n from the bits of n + 1023 in the exponent field.
+    const __m256d magic = _mm256_set1_pd(6755399441055744.0);
+    __m256i e = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(n, magic)),
+                                 _mm256_castpd_si256(magic));
+    e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52);
+    return _mm256_andnot_pd(underflow,
+                            _mm256_mul_pd(p, _mm256_castsi256_pd(e)));
+  }
+
+  __attribute__((target("avx512f"))) static __m512d Exp8(__m512d x)
+  {
+    const __m512d minimum = _mm512_set1_pd(-708.0);
+    const __mmask8 underflow = _mm512_cmp_pd_mask(x, minimum, _CMP_LT_OQ);
+    x = _mm512_max_pd(x, minimum);
+
+    const __m512d n = _mm512_roundscale_pd(
+        _mm512_mul_pd(x, _mm512_set1_pd(1.4426950408889634)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512d r = _mm512_fnmadd_pd(n, _mm512_set1_pd(6.93145751953125e-1), x);
+    r = _mm512_fnmadd_pd(n, _mm512_set1_pd(1.42860682030941723212e-6), r);
+
+    __m512d p = _mm512_set1_pd(TaylorCoefficient(12));
+    for (int k = 11; k >= 0; --k)
+    {
+      p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(TaylorCoefficient(k)));
+    }
+
+    return _mm512_maskz_mov_pd(static_cast<__mmask8>(~underflow),
+                               _mm512_scalef_pd(p, n));
+  }
+
+  // 1 / k!
+  static double TaylorCoefficient(int k)
+  {
+    static const double coefficients[13] = {
+        1.0,
+        1.0,
+        1.0 / 2.0,
+        1.0 / 6.0,
+        1.0 / 24.0,
+        1.0 / 120.0,
+        1.0 / 720.0,
+        1.0 / 5040.0,
+        1.0 / 40320.0,
+        1.0 / 362880.0,
+        1.0 / 3628800.0,
+        1.0 / 39916800.0,
+        1.0 / 479001600.0};
+    return coefficients[k];
+  }
+#endif
+};
+
+#endif
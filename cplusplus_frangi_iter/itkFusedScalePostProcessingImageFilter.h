@@ -0,0 +1,139 @@
+#ifndef __itkFusedScalePostProcessingImageFilter_h
+#define __itkFusedScalePostProcessingImageFilter_h
+
+#include "itkImageToImageFilter.h"
+#include "itkWorkStealingPool.h"
+
+//*\class FusedScalePostProcessingImageFilter
+//  \brief The post-processing of the vesselness of one scale, in one filter.
+//
+// Same results as the chain written to the scale files,
+//
+//   ThresholdImageFilter (below LowerThreshold to 0)
+//   -> LaplacianSharpeningImageFilter             output 0, "processed"
+//   -> SqrtImageFilter
+//   -> ThresholdImageFilter (above UpperThreshold to UpperThreshold)
+//   -> RescaleIntensityImageFilter (OutputMinimum, OutputMaximum)
+//                                                 output 1, "rescaled"
+//
+// without the five full volume outputs and the separate minimum and maximum
+// scans. The sharpening subtracts from the thresholded image its Laplacian
+// (7 point stencil scaled by the spacing, zero flux boundary) mapped to the
+// range of the image, then restores the mean: all of it is linear in the
+// Laplacian once its range and mean are known. The first sweep computes the
+// Laplacian and the ranges and sums; the second one computes it again and
+// writes the processed output and the clamped square root, with its range;
+// the rescale is then applied in place to output 1.
+//
+// A flat Laplacian (e.g. a scale without any response) leaves the
+// thresholded image unchanged, where LaplacianSharpeningImageFilter divides
+// by its zero range and gives NaN.
+template <typename TInputImage, typename TOutputImage>
+class FusedScalePostProcessingImageFilter
+    : public itk::ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  typedef FusedScalePostProcessingImageFilter Self;
+  typedef itk::ImageToImageFilter<TInputImage, TOutputImage> Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  typedef typename Superclass::InputImageType InputImageType;
+  typedef typename Superclass::OutputImageType OutputImageType;
+  typedef typename InputImageType::PixelType InputPixelType;
+  typedef typename OutputImageType::PixelType OutputPixelType;
+  typedef typename OutputImageType::RegionType OutputImageRegionType;
+
+  static const unsigned int ImageDimension = InputImageType::ImageDimension;
+
+  itkNewMacro(Self);
+
+  itkTypeMacro(FusedScalePostProcessingImageFilter, ImageToImageFilter);
+
+  // Values below are set to 0, 0.0001 by default.
+  itkSetMacro(LowerThreshold, double);
+  itkGetConstMacro(LowerThreshold, double);
+
+  // Laplacian sharpening of the thresholded image, on by default.
+  itkSetMacro(Sharpening, bool);
+  itkGetConstMacro(Sharpening, bool);
+  itkBooleanMacro(Sharpening);
+
+  // Square root of the sharpened image before the clamp, on by default.
+  itkSetMacro(SquareRoot, bool);
+  itkGetConstMacro(SquareRoot, bool);
+  itkBooleanMacro(SquareRoot);
+
+  // Values above (and NaN) are set to it, 20 by default.
+  itkSetMacro(UpperThreshold, double);
+  itkGetConstMacro(UpperThreshold, double);
+
+  // Range of the rescaled output, 0 to 1000 by default.
+  itkSetMacro(OutputMinimum, double);
+  itkGetConstMacro(OutputMinimum, double);
+  itkSetMacro(OutputMaximum, double);
+  itkGetConstMacro(OutputMaximum, double);
+
+  // The thresholded and sharpened image.
+  OutputImageType* GetProcessedOutput() { return this->GetOutput(0); }
+
+  // The square root, clamped and rescaled.
+  OutputImageType* GetRescaledOutput()
+  {
+    return dynamic_cast<OutputImageType*>(
+        this->itk::ProcessObject::GetOutput(1));
+  }
+
+protected:
+  FusedScalePostProcessingImageFilter();
+  ~FusedScalePostProcessingImageFilter() {}
+  void PrintSelf(std::ostream& os, itk::Indent indent) const;
+
+  // The whole image: the range and mean are global.
+  void GenerateInputRequestedRegion();
+  void EnlargeOutputRequestedRegion(itk::DataObject* output);
+
+  void GenerateData();
+
+private:
+  FusedScalePostProcessingImageFilter(const Self&); // purposely not implemented
+  void operator=(const Self&);                      // purposely not implemented
+
+  // Ranges and Laplacian sum of one thread.
+  struct Statistics
+  {
+    double InputMinimum;
+    double InputMaximum;
+    double LaplacianMinimum;
+    double LaplacianMaximum;
+    double LaplacianSum;
+  };
+
+  // Call f(offset, thresholded, laplacian) for every voxel of region, x
+  // fastest.
+  template <typename TFunction>
+  void ForEachVoxel(const OutputImageRegionType& region,
+                    const double* weights, TFunction f) const;
+
+  double Threshold(double value) const
+  {
+    // As ThresholdImageFilter: NaN is outside [lower, max].
+    return value >= m_LowerThreshold &&
+                   value <= itk::NumericTraits<double>::max()
+               ? value
+               : 0.0;
+  }
+
+  double m_LowerThreshold;
+  bool m_Sharpening;
+  bool m_SquareRoot;
+  double m_UpperThreshold;
+  double m_OutputMinimum;
+  double m_OutputMaximum;
+};
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkFusedScalePostProcessingImageFilter.hxx"
+#endif
+
+#endif
@@ -0,0 +1,288 @@
+#ifndef __itkFusedScalePostProcessingImageFilter_hxx
+#define __itkFusedScalePostProcessingImageFilter_hxx
+
+#include "itkFusedScalePostProcessingImageFilter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+template <typename TInputImage, typename TOutputImage>
+FusedScalePostProcessingImageFilter<TInputImage, TOutputImage>::
+    FusedScalePostProcessingImageFilter()
+    : m_LowerThreshold{0.0001}, m_Sharpening{true}, m_SquareRoot{true},
+      m_UpperThreshold{20.0}, m_OutputMinimum{0.0}, m_OutputMaximum{1000.0}
+{
+  this->SetNumberOfRequiredOutputs(2);
+  this->SetNthOutput(1, this->MakeOutput(1));
+}
+
+template <typename TInputImage, typename TOutputImage>
+void FusedScalePostProcessingImageFilter<
+    TInputImage, TOutputImage>::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  InputImageType* input = const_cast<InputImageType*>(this->GetInput());
+  if (input)
+  {
+    input->SetRequestedRegionToLargestPossibleRegion();
+  }
+}
+
+template <typename TInputImage, typename TOutputImage>
+void FusedScalePostProcessingImageFilter<TInputImage, TOutputImage>::
+    EnlargeOutputRequestedRegion(itk::DataObject* output)
+{
+  Superclass::EnlargeOutputRequestedRegion(output);
+  output->SetRequestedRegionToLargestPossibleRegion();
+}
+
+// =============================================================================
+// The thresholded value and its Laplacian (zero flux boundary) of every
+// voxel of region. No Laplacian if weights is null.
+// =============================================================================
+template <typename TInputImage, typename TOutputImage>
+template <typename TFunction>
+void FusedScalePostProcessingImageFilter<TInputImage, TOutputImage>::
+    ForEachVoxel(const OutputImageRegionType& region, const double* weights,
+                 TFunction f) const
+{
+  const InputImageType* input = this->GetInput();
+  const InputPixelType* buffer = input->GetBufferPointer();
+  const typename InputImageType::RegionType bufferedRegion =
+      input->GetBufferedRegion();
+  const typename InputImageType::IndexType upperIndex =
+      bufferedRegion.GetUpperIndex();
+  const itk::OffsetValueType* strides = input->GetOffsetTable();
+
+  const itk::SizeValueType rowLength = region.GetSize(0);
+  const itk::SizeValueType numberOfRows =
+      region.GetNumberOfPixels() / rowLength;
+  typename OutputImageRegionType::IndexType index = region.GetIndex();
+  for (itk::SizeValueType row = 0; row < numberOfRows; ++row)
+  {
+    const itk::OffsetValueType rowOffset = input->ComputeOffset(index);
+
+    // Neighbour rows, the row itself on the border of the buffer.
+    itk::OffsetValueType previous[ImageDimension];
+    itk::OffsetValueType next[ImageDimension];
+    for (unsigned int d = 1; d < ImageDimension; ++d)
+    {
+      previous[d] = index[d] > bufferedRegion.GetIndex(d) ? -strides[d] : 0;
+      next[d] = index[d] < upperIndex[d] ? strides[d] : 0;
+    }
+
+    for (itk::SizeValueType i = 0; i < rowLength; ++i)
+    {
+      const itk::IndexValueType x = index[0] + i;
+      const itk::OffsetValueType offset = rowOffset + i;
+      const double value = this->Threshold(buffer[offset]);
+
+      double laplacian = 0.0;
+      if (weights)
+      {
+        const itk::OffsetValueType left =
+            x > bufferedRegion.GetIndex(0) ? -1 : 0;
+        const itk::OffsetValueType right = x < upperIndex[0] ? 1 : 0;
+        laplacian = weights[0] * (this->Threshold(buffer[offset + left]) +
+                                  this->Threshold(buffer[offset + right]) -
+                                  2.0 * value);
+        for (unsigned int d = 1; d < ImageDimension; ++d)
+        {
+          laplacian +=
+              weights[d] * (this->Threshold(buffer[offset + previous[d]]) +
+                            this->Threshold(buffer[offset + next[d]]) -
+                            2.0 * value);
+        }
+      }
+      f(offset, value, laplacian);
+    }
+
+    // Next row of the region.
+    for (unsigned int d = 1; d < ImageDimension; ++d)
+    {
+      if (++index[d] < region.GetIndex(d) + static_cast<itk::IndexValueType>(
+                                                region.GetSize(d)))
+      {
+        break;
+      }
+      index[d] = region.GetIndex(d);
+    }
+  }
+}
+
+template <typename TInputImage, typename TOutputImage>
+void FusedScalePostProcessingImageFilter<TInputImage,
+                                         TOutputImage>::GenerateData()
+{
+  this->AllocateOutputs();
+
+  const InputImageType* input = this->GetInput();
+  OutputImageType* processed = this->GetProcessedOutput();
+  OutputImageType* rescaled = this->GetRescaledOutput();
+  const OutputImageRegionType region = processed->GetBufferedRegion();
+  if (input->GetBufferedRegion() != region ||
+      rescaled->GetBufferedRegion() != region)
+  {
+    itkExceptionMacro(<< "The input and outputs must have the same buffer.");
+  }
+  const itk::SizeValueType numberOfPixels = region.GetNumberOfPixels();
+  if (numberOfPixels == 0)
+  {
+    return;
+  }
+
+  // The 7 point Laplacian of itk::LaplacianOperator, with derivative
+  // scalings 1 / spacing.
+  double weights[ImageDimension];
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    if (input->GetSpacing()[d] == 0.0)
+    {
+      itkExceptionMacro(<< "Image spacing cannot be zero");
+    }
+    weights[d] = 1.0 / (input->GetSpacing()[d] * input->GetSpacing()[d]);
+  }
+
+  WorkStealingPool& pool = WorkStealingPool::GetInstance();
+  const itk::SizeValueType numberOfChunks = pool.GetNumberOfChunks(region);
+  const double voxelsPerChunk =
+      static_cast<double>(numberOfPixels) / numberOfChunks;
+
+  // First sweep: range of the thresholded image, range and sum of its
+  // Laplacian.
+  double sharpeningFactor = 0.0;
+  double meanLaplacian = 0.0;
+  if (m_Sharpening)
+  {
+    const double infinity = std::numeric_limits<double>::infinity();
+    const Statistics initial = {infinity, -infinity, infinity, -infinity,
+                                0.0};
+    std::vector<Statistics> statistics(pool.GetNumberOfThreads(), initial);
+    pool.ParallelFor(
+        "FusedScalePostProcessing::Statistics", numberOfChunks,
+        this->GetNumberOfThreads(),
+        [&](unsigned int threadId, size_t chunk) {
+          Statistics& s = statistics[threadId];
+          this->ForEachVoxel(
+              pool.GetChunkRegion(region, chunk), weights,
+              [&](itk::OffsetValueType, double value, double laplacian) {
+                s.InputMinimum = std::min(s.InputMinimum, value);
+                s.InputMaximum = std::max(s.InputMaximum, value);
+                s.LaplacianMinimum = std::min(s.LaplacianMinimum, laplacian);
+                s.LaplacianMaximum = std::max(s.LaplacianMaximum, laplacian);
+                s.LaplacianSum += laplacian;
+              });
+        },
+        voxelsPerChunk * sizeof(InputPixelType));
+
+    Statistics total = initial;
+    for (unsigned int t = 0; t < statistics.size(); ++t)
+    {
+      total.InputMinimum = std::min(total.InputMinimum,
+                                    statistics[t].InputMinimum);
+      total.InputMaximum = std::max(total.InputMaximum,
+                                    statistics[t].InputMaximum);
+      total.LaplacianMinimum = std::min(total.LaplacianMinimum,
+                                        statistics[t].LaplacianMinimum);
+      total.LaplacianMaximum = std::max(total.LaplacianMaximum,
+                                        statistics[t].LaplacianMaximum);
+      total.LaplacianSum += statistics[t].LaplacianSum;
+    }
+
+    // LaplacianSharpeningImageFilter maps the Laplacian to the range of the
+    // image, subtracts it and restores the mean of the image: in all,
+    // value - factor * (laplacian - mean laplacian).
+    if (total.LaplacianMaximum > total.LaplacianMinimum)
+    {
+      sharpeningFactor = (total.InputMaximum - total.InputMinimum) /
+                         (total.LaplacianMaximum - total.LaplacianMinimum);
+      meanLaplacian = total.LaplacianSum / numberOfPixels;
+    }
+  }
+
+  // Second sweep: the processed output, and the clamped square root in the
+  // rescaled output with its range.
+  OutputPixelType* processedBuffer = processed->GetBufferPointer();
+  OutputPixelType* rescaledBuffer = rescaled->GetBufferPointer();
+  std::vector<double> minimum(pool.GetNumberOfThreads(),
+                              std::numeric_limits<double>::infinity());
+  std::vector<double> maximum(pool.GetNumberOfThreads(),
+                              -std::numeric_limits<double>::infinity());
+  pool.ParallelFor(
+      "FusedScalePostProcessing::Sharpen", numberOfChunks,
+      this->GetNumberOfThreads(),
+      [&](unsigned int threadId, size_t chunk) {
+        double& threadMinimum = minimum[threadId];
+        double& threadMaximum = maximum[threadId];
+        this->ForEachVoxel(
+            pool.GetChunkRegion(region, chunk),
+            sharpeningFactor != 0.0 ? weights : nullptr,
+            [&](itk::OffsetValueType offset, double value, double laplacian) {
+              const double sharpened =
+                  value - sharpeningFactor * (laplacian - meanLaplacian);
+              processedBuffer[offset] =
+                  static_cast<OutputPixelType>(sharpened);
+
+              double clamped = m_SquareRoot ? std::sqrt(sharpened) : sharpened;
+              // As ThresholdImageFilter: NaN is outside [min, upper].
+              if (!(clamped >= itk::NumericTraits<double>::NonpositiveMin() &&
+                    clamped <= m_UpperThreshold))
+              {
+                clamped = m_UpperThreshold;
+              }
+              rescaledBuffer[offset] = static_cast<OutputPixelType>(clamped);
+              threadMinimum = std::min(threadMinimum, clamped);
+              threadMaximum = std::max(threadMaximum, clamped);
+            });
+      },
+      voxelsPerChunk * (sizeof(InputPixelType) + 2 * sizeof(OutputPixelType)));
+
+  // The factors of RescaleIntensityImageFilter.
+  const double inputMinimum = *std::min_element(minimum.begin(), minimum.end());
+  const double inputMaximum = *std::max_element(maximum.begin(), maximum.end());
+  double scale = 0.0;
+  if (inputMinimum != inputMaximum)
+  {
+    scale = (m_OutputMaximum - m_OutputMinimum) / (inputMaximum - inputMinimum);
+  }
+  else if (inputMaximum != 0.0)
+  {
+    scale = (m_OutputMaximum - m_OutputMinimum) / inputMaximum;
+  }
+  const double shift = m_OutputMinimum - inputMinimum * scale;
+
+  pool.ParallelFor(
+      "FusedScalePostProcessing::Rescale", numberOfChunks,
+      this->GetNumberOfThreads(),
+      [&](unsigned int, size_t chunk) {
+        const itk::SizeValueType first =
+            numberOfPixels * chunk / numberOfChunks;
+        const itk::SizeValueType last =
+            numberOfPixels * (chunk + 1) / numberOfChunks;
+        for (itk::SizeValueType i = first; i < last; ++i)
+        {
+          rescaledBuffer[i] =
+              static_cast<OutputPixelType>(rescaledBuffer[i] * scale + shift);
+        }
+      },
+      voxelsPerChunk * 2 * sizeof(OutputPixelType));
+}
+
+template <typename TInputImage, typename TOutputImage>
+void FusedScalePostProcessingImageFilter<TInputImage, TOutputImage>::PrintSelf(
+    std::ostream& os, itk::Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "LowerThreshold: " << m_LowerThreshold << std::endl;
+  os << indent << "Sharpening: " << m_Sharpening << std::endl;
+  os << indent << "SquareRoot: " << m_SquareRoot << std::endl;
+  os << indent << "UpperThreshold: " << m_UpperThreshold << std::endl;
+  os << indent << "OutputMinimum: " << m_OutputMinimum << std::endl;
+  os << indent << "OutputMaximum: " << m_OutputMaximum << std::endl;
+}
+
+#endif
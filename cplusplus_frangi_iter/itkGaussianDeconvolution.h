@@ -0,0 +1,354 @@
+#ifndef __itkGaussianDeconvolution_h
+#define __itkGaussianDeconvolution_h
+
+#include "itkFirstTouchAllocator.h"
+#include "itkStageTimer.h"
+#include "itkWorkStealingPool.h"
+
+#include "itkHalfHermitianToRealInverseFFTImageFilter.h"
+#include "itkImage.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkRealToHalfHermitianForwardFFTImageFilter.h"
+#include "vnl/vnl_math.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+// \class GaussianDeconvolution
+// \brief Tikhonov deconvolution of an image by a Gaussian, in the Fourier
+// domain.
+//
+// The deconvolved image is
+//
+//   F^-1[ F[input] * H / (H^2 + Regularization) ]
+//
+// with H the transfer function of a Gaussian of variance VarianceFactor *
+// sigma (2 sigma by default), set to 0 where negative if SetNonNegative().
+// The variance is in voxels of the finest axis: along an axis of coarser
+// spacing it is divided by the square of the ratio of the spacings, as on
+// the same image resampled to an isotropic grid at its smallest spacing.
+// H is computed analytically: it is the product of one
+// factor per axis, kept for every sigma, so that the kernel costs nothing
+// after the first diffusion iteration.
+//
+// Initialize() sets the padded FFT size once for the image and the largest
+// sigma: a zero margin of three standard deviations on each side against
+// the wrap-around, rounded up to a product of 2, 3 and 5 (the sizes of the
+// VNL FFT). The padded image and the FFT filters are kept between the calls,
+// so the FFT plans (FFTW wisdom when ITK uses FFTW) are made once.
+template <typename TImage>
+class GaussianDeconvolution
+{
+public:
+  typedef TImage ImageType;
+  typedef typename TImage::PixelType PixelType;
+  typedef typename TImage::RegionType RegionType;
+  typedef typename TImage::SizeType SizeType;
+
+  static const unsigned int ImageDimension = TImage::ImageDimension;
+
+  typedef itk::Image<double, ImageDimension> RealImageType;
+  typedef itk::RealToHalfHermitianForwardFFTImageFilter<RealImageType>
+      ForwardFFTType;
+  typedef typename ForwardFFTType::OutputImageType ComplexImageType;
+  typedef itk::HalfHermitianToRealInverseFFTImageFilter<ComplexImageType,
+                                                        RealImageType>
+      InverseFFTType;
+
+  GaussianDeconvolution()
+      : m_Regularization{0.01}, m_VarianceFactor{2.0}, m_NonNegative{true},
+        m_NumberOfThreads{0}
+  {
+    m_PaddedSize.Fill(0);
+    m_Margin.Fill(0);
+    m_AxisScales.Fill(1.0);
+  }
+
+  // Added to H^2 in the denominator, 0.01 by default. The largest gain of
+  // the inverse filter is 1 / (2 sqrt(Regularization)).
+  void SetRegularization(double regularization)
+  {
+    m_Regularization = regularization;
+  }
+  double GetRegularization() const { return m_Regularization; }
+
+  // Variance of the Gaussian in voxels of the finest axis, per unit of
+  // sigma. 2 by default. Clears the cached spectra.
+  void SetVarianceFactor(double varianceFactor)
+  {
+    m_VarianceFactor = varianceFactor;
+    m_Spectra.clear();
+  }
+  double GetVarianceFactor() const { return m_VarianceFactor; }
+
+  // Spacing of the images; only the ratios of the spacings matter. Clears
+  // the cached spectra if they change.
+  void SetSpacing(const typename TImage::SpacingType& spacing)
+  {
+    const double minimumSpacing =
+        *std::min_element(spacing.Begin(), spacing.End());
+    SpacingScalesType axisScales;
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      const double ratio = minimumSpacing / spacing[d];
+      axisScales[d] = ratio * ratio;
+    }
+    if (axisScales != m_AxisScales)
+    {
+      m_AxisScales = axisScales;
+      m_Spectra.clear();
+    }
+  }
+
+  void SetNonNegative(bool nonNegative) { m_NonNegative = nonNegative; }
+  bool GetNonNegative() const { return m_NonNegative; }
+
+  void SetNumberOfThreads(unsigned int numberOfThreads)
+  {
+    m_NumberOfThreads = numberOfThreads;
+  }
+
+  // Padded size of the images of region deconvolved up to maximumSigma.
+  SizeType GetPaddedSize(const RegionType& region, double maximumSigma) const
+  {
+    SizeType size;
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      size[d] = GetSmoothSize(region.GetSize(d) +
+                              2 * this->GetMargin(maximumSigma, d));
+    }
+    return size;
+  }
+
+  // Prepare the padded image for the images of region, deconvolved at
+  // sigma up to maximumSigma. Nothing is done if the size is unchanged.
+  void Initialize(const RegionType& region, double maximumSigma)
+  {
+    const SizeType paddedSize = this->GetPaddedSize(region, maximumSigma);
+    if (m_Padded.IsNotNull() && m_Region == region &&
+        m_PaddedSize == paddedSize)
+    {
+      return;
+    }
+    if (m_PaddedSize != paddedSize)
+    {
+      m_Spectra.clear();
+    }
+
+    m_Region = region;
+    m_PaddedSize = paddedSize;
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      m_Margin[d] = this->GetMargin(maximumSigma, d);
+    }
+
+    typename RealImageType::RegionType paddedRegion;
+    paddedRegion.SetSize(paddedSize);
+    m_Padded = RealImageType::New();
+    m_Padded->SetRegions(paddedRegion);
+    FirstTouchAllocator::Allocate(m_Padded.GetPointer(), 0.0,
+                                  m_NumberOfThreads);
+
+    m_ForwardFFT = ForwardFFTType::New();
+    m_ForwardFFT->SetInput(m_Padded);
+    m_InverseFFT = InverseFFTType::New();
+    m_InverseFFT->SetActualXDimensionIsOdd(paddedSize[0] % 2 != 0);
+    if (m_NumberOfThreads > 0)
+    {
+      m_ForwardFFT->SetNumberOfThreads(m_NumberOfThreads);
+      m_InverseFFT->SetNumberOfThreads(m_NumberOfThreads);
+    }
+  }
+
+  // Deconvolve the Initialize() region of input at sigma into output, which
+  // must buffer that region.
+  void Deconvolve(const TImage* input, double sigma, TImage* output)
+  {
+    if (m_Padded.IsNull())
+    {
+      throw std::logic_error("GaussianDeconvolution is not initialized.");
+    }
+    typename RealImageType::RegionType interior;
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      interior.SetIndex(d, m_Margin[d]);
+      interior.SetSize(d, m_Region.GetSize(d));
+    }
+
+    {
+      StageTimerScope timer("GaussianDeconvolution::ForwardFFT",
+                            m_Padded->GetBufferedRegion().GetNumberOfPixels());
+      itk::ImageRegionConstIterator<TImage> itInput(input, m_Region);
+      itk::ImageRegionIterator<RealImageType> itPadded(m_Padded, interior);
+      for (; !itInput.IsAtEnd(); ++itInput, ++itPadded)
+      {
+        itPadded.Set(itInput.Get());
+      }
+      m_Padded->Modified();
+      m_ForwardFFT->Update();
+    }
+
+    // The spectrum is filtered in place, then given to the inverse FFT.
+    typename ComplexImageType::Pointer spectrum = m_ForwardFFT->GetOutput();
+    spectrum->DisconnectPipeline();
+    this->Filter(spectrum, sigma);
+
+    {
+      StageTimerScope timer("GaussianDeconvolution::InverseFFT",
+                            m_Padded->GetBufferedRegion().GetNumberOfPixels());
+      m_InverseFFT->SetInput(spectrum);
+      m_InverseFFT->Update();
+
+      itk::ImageRegionConstIterator<RealImageType> itDeconvolved(
+          m_InverseFFT->GetOutput(), interior);
+      itk::ImageRegionIterator<TImage> itOutput(output, m_Region);
+      for (; !itOutput.IsAtEnd(); ++itOutput, ++itDeconvolved)
+      {
+        const double value = itDeconvolved.Get();
+        itOutput.Set(static_cast<PixelType>(
+            m_NonNegative ? std::max(0.0, value) : value));
+      }
+    }
+  }
+
+  // Release the padded image and the FFT buffers, keeping the spectra.
+  void ReleaseBuffers()
+  {
+    m_Padded = nullptr;
+    m_ForwardFFT = nullptr;
+    m_InverseFFT = nullptr;
+  }
+
+private:
+  // Zero margin of the largest Gaussian along axis, three standard
+  // deviations.
+  itk::SizeValueType GetMargin(double maximumSigma, unsigned int axis) const
+  {
+    return static_cast<itk::SizeValueType>(std::ceil(
+        3.0 * std::sqrt(m_VarianceFactor * maximumSigma * m_AxisScales[axis])));
+  }
+
+  // Smallest size at least size whose prime factors are 2, 3 and 5.
+  static itk::SizeValueType GetSmoothSize(itk::SizeValueType size)
+  {
+    for (size = std::max<itk::SizeValueType>(size, 1);; ++size)
+    {
+      itk::SizeValueType rest = size;
+      const itk::SizeValueType factors[] = {2, 3, 5};
+      for (unsigned int f = 0; f < 3; ++f)
+      {
+        while (rest % factors[f] == 0)
+        {
+          rest /= factors[f];
+        }
+      }
+      if (rest == 1)
+      {
+        return size;
+      }
+    }
+  }
+
+  // The factors of H along every axis of the half spectrum:
+  // exp(-2 pi^2 variance f^2), variance and f in voxels of the axis.
+  const std::vector<std::vector<double>>& GetSpectrum(double sigma)
+  {
+    typename SpectraMapType::iterator it = m_Spectra.find(sigma);
+    if (it != m_Spectra.end())
+    {
+      return it->second;
+    }
+
+    const double pi2 = vnl_math::pi * vnl_math::pi;
+    std::vector<std::vector<double>> factors(ImageDimension);
+    for (unsigned int d = 0; d < ImageDimension; ++d)
+    {
+      const double variance = m_VarianceFactor * sigma * m_AxisScales[d];
+      const itk::SizeValueType n = m_PaddedSize[d];
+      factors[d].resize(d == 0 ? n / 2 + 1 : n);
+      for (itk::SizeValueType k = 0; k < factors[d].size(); ++k)
+      {
+        const double f =
+            (k <= n / 2 ? static_cast<double>(k) : static_cast<double>(k) - n) /
+            n;
+        factors[d][k] = std::exp(-2.0 * pi2 * variance * f * f);
+      }
+    }
+    return m_Spectra.insert(std::make_pair(sigma, factors)).first->second;
+  }
+
+  // Multiply the half spectrum by H / (H^2 + Regularization).
+  void Filter(ComplexImageType* spectrum, double sigma)
+  {
+    const std::vector<std::vector<double>>& factors = this->GetSpectrum(sigma);
+    const SizeType size = spectrum->GetBufferedRegion().GetSize();
+    typename ComplexImageType::PixelType* buffer =
+        spectrum->GetBufferPointer();
+    const itk::SizeValueType rowLength = size[0];
+    const itk::SizeValueType numberOfRows =
+        spectrum->GetBufferedRegion().GetNumberOfPixels() / rowLength;
+
+    StageTimerScope timer("GaussianDeconvolution::Filter",
+                          numberOfRows * rowLength);
+    timer.SetArgument("sigma", sigma);
+
+    WorkStealingPool& pool = WorkStealingPool::GetInstance();
+    const itk::SizeValueType rowsPerChunk = pool.GetChunkSize();
+    const size_t numberOfChunks =
+        (numberOfRows + rowsPerChunk - 1) / rowsPerChunk;
+    pool.ParallelFor(
+        "GaussianDeconvolution::Filter", numberOfChunks, m_NumberOfThreads,
+        [&](unsigned int, size_t chunk) {
+          const itk::SizeValueType last =
+              std::min(numberOfRows, (chunk + 1) * rowsPerChunk);
+          for (itk::SizeValueType row = chunk * rowsPerChunk; row < last;
+               ++row)
+          {
+            double rowFactor = 1.0;
+            itk::SizeValueType rest = row;
+            for (unsigned int d = 1; d < ImageDimension; ++d)
+            {
+              rowFactor *= factors[d][rest % size[d]];
+              rest /= size[d];
+            }
+            typename ComplexImageType::PixelType* values =
+                buffer + row * rowLength;
+            for (itk::SizeValueType x = 0; x < rowLength; ++x)
+            {
+              const double h = rowFactor * factors[0][x];
+              const double denominator = h * h + m_Regularization;
+              values[x] *= denominator > 0.0 ? h / denominator : 0.0;
+            }
+          }
+        },
+        static_cast<double>(rowsPerChunk) * rowLength * 2 *
+            sizeof(typename ComplexImageType::PixelType));
+  }
+
+  // purposely not implemented
+  GaussianDeconvolution(const GaussianDeconvolution&);
+  void operator=(const GaussianDeconvolution&);
+
+  typedef std::map<double, std::vector<std::vector<double>>> SpectraMapType;
+  typedef itk::FixedArray<double, ImageDimension> SpacingScalesType;
+
+  double m_Regularization;
+  double m_VarianceFactor;
+  bool m_NonNegative;
+  unsigned int m_NumberOfThreads;
+
+  RegionType m_Region;
+  SizeType m_PaddedSize;
+  SizeType m_Margin;
+  SpacingScalesType m_AxisScales; // (minimum spacing / spacing)^2 per axis
+  typename RealImageType::Pointer m_Padded;
+  typename ForwardFFTType::Pointer m_ForwardFFT;
+  typename InverseFFTType::Pointer m_InverseFFT;
+  SpectraMapType m_Spectra; // factors of H per sigma
+};
+
+#endif
@@ -0,0 +1,611 @@
+#if defined(_MSC_VER)
+#pragma warning(disable : 4786)
+#endif
+
+#include "itkGeodesicDistanceMap.h"
+
+#include "boost/program_options.hpp"
+#include "itkConnectedComponentImageFilter.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkImageRegionIterator.h"
+#include "itkMultiThreader.h"
+#include "itkSignedMaurerDistanceMapImageFilter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+// Vessel constrained distance between pairs of ROIs. This is the native
+// version of utilities/DistanceBetweenROI.py: the seed of each ROI is the
+// center of mass of its intersection with the binary mask (or the nearest mask
+// voxel when they do not intersect), and the distance is the shortest
+// 26-connected path inside the mask. One distance field is computed per start
+// ROI and shared by all the pairs starting from it; start ROIs are processed
+// concurrently.
+
+const int Dimension = 3;
+typedef itk::Image<float, Dimension> ImageType;
+typedef itk::Image<unsigned char, Dimension> BinaryImageType;
+typedef ImageType::IndexType IndexType;
+typedef GeodesicDistanceMap<ImageType> GeodesicDistanceMapType;
+
+struct ROIInfo
+{
+  std::string FileName;
+  IndexType Seed;
+  std::vector<IndexType> Voxels;
+};
+
+struct PairInfo
+{
+  std::string Start;
+  std::string End;
+  std::string Output;
+
+  std::string Status;
+  double Distance = -1.0;
+  double MaximumInsideEnd = -1.0;
+};
+
+struct SourceThreadStruct
+{
+  GeodesicDistanceMapType* DistanceMap;
+  std::map<std::string, ROIInfo>* ROIs;
+  std::vector<std::string> Sources;
+  std::vector<PairInfo>* Pairs;
+  std::atomic<unsigned int> NextSource;
+  std::mutex WriterMutex;
+};
+
+bool process_command_line(int argc, char** argv,
+                          boost::program_options::variables_map& vm)
+{
+  try
+  {
+    boost::program_options::options_description program(
+        "Program allowed options\n");
+    program.add_options()("help,h", "produce help message.");
+
+    boost::program_options::options_description requiredVariable("Required\n");
+    requiredVariable.add_options()(
+        "input,i", boost::program_options::value<std::string>()->required(),
+        "the binary vessel mask file name.");
+
+    boost::program_options::options_description roiVariable("ROI pairs\n");
+    roiVariable.add_options()(
+        "start,s", boost::program_options::value<std::string>(),
+        "the start ROI file name (single pair).")(
+        "end,e", boost::program_options::value<std::string>(),
+        "the end ROI file name (single pair).")(
+        "output,o", boost::program_options::value<std::string>(),
+        "the distance map file name (single pair, optional).")(
+        "pairs,p", boost::program_options::value<std::string>(),
+        "a text file with one 'start_roi end_roi [distance_map]' per line.")(
+        "table,T", boost::program_options::value<std::string>(),
+        "the CSV file receiving one row per pair (default: stdout).");
+
+    boost::program_options::options_description distanceVariable(
+        "Distance\n");
+    distanceVariable.add_options()(
+        "maxDistance,m",
+        boost::program_options::value<double>()->default_value(15.0),
+        "Maximum search distance in mm between a ROI and the mask.")(
+        "distanceType,d",
+        boost::program_options::value<std::string>()->default_value(
+            "euclidean"),
+        "Type of distance (addition | euclidean).")(
+        "fullField,F", "Flag to compute the distance to every connected mask "
+                       "voxel instead of stopping at the end seeds.")(
+        "threads,n", boost::program_options::value<int>()->default_value(0),
+        "The number of start ROIs processed concurrently (0: ITK default).");
+
+    boost::program_options::options_description global;
+
+    global.add(program)
+        .add(requiredVariable)
+        .add(roiVariable)
+        .add(distanceVariable);
+
+    boost::program_options::store(
+        boost::program_options::parse_command_line(argc, argv, global), vm);
+
+    if (vm.count("help"))
+    {
+      std::cout << global << std::endl;
+      return false;
+    }
+
+    boost::program_options::notify(vm);
+
+    if (!vm.count("pairs") && !(vm.count("start") && vm.count("end")))
+    {
+      throw std::logic_error(
+          "provide either --pairs or both --start and --end.");
+    }
+
+    const std::string distanceType = vm["distanceType"].as<std::string>();
+    if (distanceType != "euclidean" && distanceType != "addition")
+    {
+      throw std::logic_error("distanceType must be addition or euclidean.");
+    }
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Error: " << e.what() << "\n";
+    return false;
+  }
+  catch (...)
+  {
+    std::cerr << "Unknown error!\n";
+    return false;
+  }
+  return true;
+}
+
+ImageType::Pointer read_image(const std::string& fileName)
+{
+  typedef itk::ImageFileReader<ImageType> ImageReaderType;
+  ImageReaderType::Pointer reader = ImageReaderType::New();
+  reader->SetFileName(fileName);
+  reader->Update();
+
+  ImageType::Pointer image = reader->GetOutput();
+  image->DisconnectPipeline();
+  return image;
+}
+
+// The same size, and the same spacing, origin (in voxels) and direction
+// cosines within 1e-4.
+bool same_grid(const itk::ImageBase<Dimension>* image,
+               const itk::ImageBase<Dimension>* reference)
+{
+  if (image->GetBufferedRegion() != reference->GetBufferedRegion())
+  {
+    return false;
+  }
+  for (unsigned int d = 0; d < Dimension; ++d)
+  {
+    const double tolerance = 1e-4 * reference->GetSpacing()[d];
+    if (std::abs(image->GetSpacing()[d] - reference->GetSpacing()[d]) >
+            tolerance ||
+        std::abs(image->GetOrigin()[d] - reference->GetOrigin()[d]) >
+            tolerance)
+    {
+      return false;
+    }
+    for (unsigned int e = 0; e < Dimension; ++e)
+    {
+      if (std::abs(image->GetDirection()[d][e] -
+                   reference->GetDirection()[d][e]) > 1e-4)
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// =============================================================================
+// Seed of a ROI, as in DistanceBetweenROI.get_seed: the rounded center of mass
+// of the (single) intersection with the mask, or the nearest mask voxel from
+// the ROI when they do not intersect.
+// =============================================================================
+void compute_roi_seed(const ImageType* mask, const ImageType* roi,
+                      double maxDistance, ROIInfo& info)
+{
+  if (!same_grid(roi, mask))
+  {
+    throw std::runtime_error("ROI " + info.FileName +
+                             " is not on the grid of the binary mask.");
+  }
+
+  BinaryImageType::Pointer roiImage = BinaryImageType::New();
+  roiImage->CopyInformation(roi);
+  roiImage->SetRegions(roi->GetBufferedRegion());
+  roiImage->Allocate();
+
+  BinaryImageType::Pointer intersect = BinaryImageType::New();
+  intersect->CopyInformation(roi);
+  intersect->SetRegions(roi->GetBufferedRegion());
+  intersect->Allocate();
+
+  itk::ImageRegionConstIteratorWithIndex<ImageType> itRoi(
+      roi, roi->GetBufferedRegion());
+  itk::ImageRegionConstIterator<ImageType> itMask(mask,
+                                                  mask->GetBufferedRegion());
+  itk::ImageRegionIterator<BinaryImageType> itRoiImage(
+      roiImage, roiImage->GetBufferedRegion());
+  itk::ImageRegionIterator<BinaryImageType> itIntersect(
+      intersect, intersect->GetBufferedRegion());
+
+  double centerOfMass[Dimension] = {0.0, 0.0, 0.0};
+  itk::SizeValueType intersectCount = 0;
+
+  info.Voxels.clear();
+  for (; !itRoi.IsAtEnd(); ++itRoi, ++itMask, ++itRoiImage, ++itIntersect)
+  {
+    const bool inRoi = itRoi.Get() != 0.0f;
+    const bool inBoth = inRoi && itMask.Get() != 0.0f;
+
+    itRoiImage.Set(inRoi ? 1 : 0);
+    itIntersect.Set(inBoth ? 1 : 0);
+
+    if (inRoi)
+    {
+      info.Voxels.push_back(itRoi.GetIndex());
+    }
+    if (inBoth)
+    {
+      for (unsigned int i = 0; i < Dimension; ++i)
+      {
+        centerOfMass[i] += itRoi.GetIndex()[i];
+      }
+      ++intersectCount;
+    }
+  }
+
+  if (intersectCount > 0)
+  {
+    typedef itk::Image<unsigned int, Dimension> LabelImageType;
+    typedef itk::ConnectedComponentImageFilter<BinaryImageType,
+                                               LabelImageType>
+        ConnectedComponentFilterType;
+    ConnectedComponentFilterType::Pointer connected =
+        ConnectedComponentFilterType::New();
+    connected->SetInput(intersect);
+    connected->FullyConnectedOn();
+    connected->Update();
+
+    if (connected->GetObjectCount() > 1)
+    {
+      throw std::runtime_error(
+          "There are multiples intersection regions between binary mask and "
+          "ROI " +
+          info.FileName + ". Please redefine your ROIs.");
+    }
+
+    for (unsigned int i = 0; i < Dimension; ++i)
+    {
+      info.Seed[i] = static_cast<IndexType::IndexValueType>(
+          std::floor(centerOfMass[i] / intersectCount + 0.5));
+    }
+  }
+  else
+  {
+    // Exact Euclidean distance from the ROI, instead of the pairwise cdist
+    // between every mask and ROI voxel.
+    typedef itk::SignedMaurerDistanceMapImageFilter<BinaryImageType,
+                                                    ImageType>
+        DistanceMapFilterType;
+    DistanceMapFilterType::Pointer distanceMap = DistanceMapFilterType::New();
+    distanceMap->SetInput(roiImage);
+    distanceMap->SetBackgroundValue(0);
+    distanceMap->SetInsideIsPositive(false);
+    distanceMap->SetSquaredDistance(false);
+    distanceMap->SetUseImageSpacing(true);
+    distanceMap->Update();
+
+    itk::ImageRegionConstIteratorWithIndex<ImageType> itDistance(
+        distanceMap->GetOutput(), mask->GetBufferedRegion());
+    itMask.GoToBegin();
+
+    double nearest = itk::NumericTraits<double>::max();
+    for (; !itDistance.IsAtEnd(); ++itDistance, ++itMask)
+    {
+      if (itMask.Get() != 0.0f && itDistance.Get() < nearest)
+      {
+        nearest = itDistance.Get();
+        info.Seed = itDistance.GetIndex();
+      }
+    }
+
+    if (nearest > maxDistance)
+    {
+      std::ostringstream message;
+      message << "Your ROI " << info.FileName
+              << " is too far from the binary mask. Please redefines it or "
+                 "increase the maximum distance parameter (max_distance: "
+              << maxDistance << ", current distance from ROI: " << nearest
+              << ").";
+      throw std::runtime_error(message.str());
+    }
+
+    std::cout << "Your ROI " << info.FileName
+              << " does not intersect the binary mask, but nearest mask point "
+                 "from ROI is "
+              << info.Seed << ".\n";
+  }
+
+  const ImageType::PixelType seedValue = mask->GetPixel(info.Seed);
+  if (seedValue == 0.0f)
+  {
+    throw std::runtime_error("The value of the seed of " + info.FileName +
+                             " is not included in the binary mask.");
+  }
+}
+
+void evaluate_pair(const GeodesicDistanceMapType* distanceMap,
+                   const GeodesicDistanceMapType::DistanceFieldType& field,
+                   const ROIInfo& end, PairInfo& pair)
+{
+  pair.Distance = distanceMap->GetDistance(field, end.Seed);
+  pair.MaximumInsideEnd = -1.0;
+
+  for (unsigned int v = 0; v < end.Voxels.size(); ++v)
+  {
+    pair.MaximumInsideEnd = std::max(
+        pair.MaximumInsideEnd, distanceMap->GetDistance(field, end.Voxels[v]));
+  }
+
+  if (pair.Distance >= 0.0)
+  {
+    pair.Status = "reached";
+  }
+  else if (pair.MaximumInsideEnd >= 0.0)
+  {
+    // Same fallback as the flood fill: the end ROI is reached, but not its
+    // seed.
+    pair.Status = "roi_only";
+  }
+  else
+  {
+    pair.Status = "unreached";
+  }
+}
+
+// =============================================================================
+// Each thread takes the next start ROI, computes its distance field once and
+// evaluates every pair starting from it.
+// =============================================================================
+ITK_THREAD_RETURN_TYPE SourceThreaderCallback(void* arg)
+{
+  const auto threadInfo =
+      static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+  const auto str = static_cast<SourceThreadStruct*>(threadInfo->UserData);
+
+  GeodesicDistanceMapType::DistanceFieldType field;
+
+  for (unsigned int s = str->NextSource++; s < str->Sources.size();
+       s = str->NextSource++)
+  {
+    std::vector<unsigned int> pairIds;
+    for (unsigned int p = 0; p < str->Pairs->size(); ++p)
+    {
+      if ((*str->Pairs)[p].Start == str->Sources[s])
+      {
+        pairIds.push_back(p);
+      }
+    }
+
+    // Exceptions must not leave the thread; they are reported per pair.
+    try
+    {
+      const ROIInfo& start = str->ROIs->at(str->Sources[s]);
+      std::vector<IndexType> targets;
+      for (unsigned int p = 0; p < pairIds.size(); ++p)
+      {
+        targets.push_back(
+            str->ROIs->at((*str->Pairs)[pairIds[p]].End).Seed);
+      }
+
+      str->DistanceMap->Compute(start.Seed, targets, field);
+
+      for (unsigned int p = 0; p < pairIds.size(); ++p)
+      {
+        PairInfo& pair = (*str->Pairs)[pairIds[p]];
+        evaluate_pair(str->DistanceMap, field, str->ROIs->at(pair.End), pair);
+
+        if (!pair.Output.empty())
+        {
+          typedef itk::ImageFileWriter<
+              GeodesicDistanceMapType::DistanceImageType>
+              ImageWriterType;
+          ImageWriterType::Pointer writer = ImageWriterType::New();
+          writer->SetFileName(pair.Output);
+          writer->SetInput(str->DistanceMap->MakeDistanceImage(field));
+
+          std::lock_guard<std::mutex> lock(str->WriterMutex);
+          writer->Update();
+        }
+      }
+    }
+    catch (itk::ExceptionObject& err)
+    {
+      std::cerr << "Exception caught: " << err << std::endl;
+      for (unsigned int p = 0; p < pairIds.size(); ++p)
+      {
+        (*str->Pairs)[pairIds[p]].Status = "error";
+      }
+    }
+    catch (std::exception& err)
+    {
+      std::cerr << "Error: " << err.what() << std::endl;
+      for (unsigned int p = 0; p < pairIds.size(); ++p)
+      {
+        (*str->Pairs)[pairIds[p]].Status = "error";
+      }
+    }
+  }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+bool read_pairs(const std::string& fileName, std::vector<PairInfo>& pairs)
+{
+  std::ifstream file(fileName.c_str());
+  if (!file)
+  {
+    std::cerr << "Error: cannot open the pairs file " << fileName << "\n";
+    return false;
+  }
+
+  std::string line;
+  while (std::getline(file, line))
+  {
+    std::istringstream fields(line);
+    PairInfo pair;
+    if (!(fields >> pair.Start) || pair.Start[0] == '#')
+    {
+      continue;
+    }
+    if (!(fields >> pair.End))
+    {
+      std::cerr << "Error: missing end ROI on line '" << line << "'\n";
+      return false;
+    }
+    fields >> pair.Output;
+    pairs.push_back(pair);
+  }
+  return true;
+}
+
+int main(int argc, char* argv[])
+{
+  boost::program_options::variables_map vm;
+  if (!process_command_line(argc, argv, vm))
+  {
+    return 1;
+  }
+
+  std::vector<PairInfo> pairs;
+  if (vm.count("pairs") && !read_pairs(vm["pairs"].as<std::string>(), pairs))
+  {
+    return EXIT_FAILURE;
+  }
+  if (vm.count("start") && vm.count("end"))
+  {
+    PairInfo pair;
+    pair.Start = vm["start"].as<std::string>();
+    pair.End = vm["end"].as<std::string>();
+    if (vm.count("output"))
+    {
+      pair.Output = vm["output"].as<std::string>();
+    }
+    pairs.push_back(pair);
+  }
+
+  GeodesicDistanceMapType::Pointer distanceMap =
+      GeodesicDistanceMapType::New();
+  std::map<std::string, ROIInfo> rois;
+  std::vector<std::string> sources;
+
+  try
+  {
+    std::cout << "Reading binary mask : " << vm["input"].as<std::string>()
+              << std::endl;
+    ImageType::Pointer mask = read_image(vm["input"].as<std::string>());
+
+    // Every ROI is read once, whatever the number of pairs using it.
+    for (unsigned int p = 0; p < pairs.size(); ++p)
+    {
+      const std::string names[2] = {pairs[p].Start, pairs[p].End};
+      for (unsigned int n = 0; n < 2; ++n)
+      {
+        if (rois.count(names[n]))
+        {
+          continue;
+        }
+        ROIInfo& info = rois[names[n]];
+        info.FileName = names[n];
+        compute_roi_seed(mask, read_image(names[n]),
+                         vm["maxDistance"].as<double>(), info);
+      }
+
+      if (std::find(sources.begin(), sources.end(), pairs[p].Start) ==
+          sources.end())
+      {
+        sources.push_back(pairs[p].Start);
+      }
+    }
+
+    distanceMap->SetMaskImage(mask);
+    if (vm["distanceType"].as<std::string>() == "addition")
+    {
+      distanceMap->SetDistanceType(GeodesicDistanceMapType::AdditionDistance);
+    }
+    distanceMap->SetFullField(vm.count("fullField") > 0);
+    distanceMap->Initialize();
+
+    std::cout << "Computing " << pairs.size() << " distances from "
+              << sources.size() << " start ROIs on "
+              << distanceMap->GetNumberOfNodes() << " mask voxels.\n";
+  }
+  catch (itk::ExceptionObject& err)
+  {
+    std::cerr << "Exception caught: " << err << std::endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::exception& err)
+  {
+    std::cerr << "Error: " << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  SourceThreadStruct str;
+  str.DistanceMap = distanceMap;
+  str.ROIs = &rois;
+  str.Sources = sources;
+  str.Pairs = &pairs;
+  str.NextSource = 0;
+
+  int numberOfThreads = vm["threads"].as<int>();
+  if (numberOfThreads <= 0)
+  {
+    numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  }
+  numberOfThreads =
+      std::max(1, std::min(numberOfThreads, static_cast<int>(sources.size())));
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads(numberOfThreads);
+  threader->SetSingleMethod(SourceThreaderCallback, &str);
+
+  try
+  {
+    threader->SingleMethodExecute();
+  }
+  catch (itk::ExceptionObject& err)
+  {
+    std::cerr << "Exception caught: " << err << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::ofstream tableFile;
+  if (vm.count("table"))
+  {
+    tableFile.open(vm["table"].as<std::string>().c_str());
+  }
+  std::ostream& table = vm.count("table") ? tableFile : std::cout;
+
+  table << "start_roi,end_roi,start_seed,end_seed,distance_mm,"
+           "max_inside_end_mm,status\n";
+
+  int unreached = 0;
+  for (unsigned int p = 0; p < pairs.size(); ++p)
+  {
+    const PairInfo& pair = pairs[p];
+    const IndexType& startSeed = rois[pair.Start].Seed;
+    const IndexType& endSeed = rois[pair.End].Seed;
+
+    table << pair.Start << "," << pair.End << "," << startSeed[0] << " "
+          << startSeed[1] << " " << startSeed[2] << "," << endSeed[0] << " "
+          << endSeed[1] << " " << endSeed[2] << "," << pair.Distance << ","
+          << pair.MaximumInsideEnd << "," << pair.Status << "\n";
+
+    if (pair.Status == "unreached" || pair.Status == "error")
+    {
+      std::cerr << "Distance did not reach the end ROI " << pair.End
+                << ". The ROI might be disconnected from the start ROI "
+                << pair.Start << ".\n";
+      ++unreached;
+    }
+  }
+
+  return unreached ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+#ifndef __itkGeodesicDistanceMap_h
+#define __itkGeodesicDistanceMap_h
+
+#include "itkImage.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+
+#include <vector>
+
+// \class GeodesicDistanceMap
+// \brief Vessel constrained distance from a seed, computed on a binary mask.
+//
+// The mask voxels are converted once into a compact 26-connected graph
+// (compressed neighbour lists with quantized edge lengths). Each call to
+// Compute() then runs a bucket-queue (Dial) Dijkstra from one seed over this
+// graph, so the same graph is reused for every source ROI of a run and each
+// source only costs one distance field of the size of the mask.
+//
+// Two distance types are available, matching DistanceBetweenROI.py:
+//  - Euclidean : each step costs its physical length (1, sqrt(2) or sqrt(3)
+//                voxels on isotropic data).
+//  - Addition  : each step costs one voxel, times the (isotropic) spacing.
+//
+// Edge lengths are quantized to 1/1000 of the smallest spacing, so the
+// reported distances are exact shortest paths in that metric.
+
+template <typename TMaskImage>
+class GeodesicDistanceMap : public itk::Object
+{
+public:
+  typedef GeodesicDistanceMap Self;
+  typedef itk::Object Superclass;
+
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  itkNewMacro(Self);
+
+  itkTypeMacro(GeodesicDistanceMap, Object);
+
+  typedef TMaskImage MaskImageType;
+  typedef typename MaskImageType::IndexType IndexType;
+  typedef typename MaskImageType::PixelType MaskPixelType;
+
+  static const unsigned int ImageDimension = MaskImageType::ImageDimension;
+
+  typedef itk::Image<double, ImageDimension> DistanceImageType;
+
+  typedef unsigned long long DistanceKeyType;
+  typedef std::vector<DistanceKeyType> DistanceFieldType;
+
+  typedef enum
+  {
+    EuclideanDistance = 0,
+    AdditionDistance = 1
+  } DistanceTypeType;
+
+  itkSetMacro(DistanceType, DistanceTypeType);
+  itkGetConstMacro(DistanceType, DistanceTypeType);
+
+  // When on, Compute() settles every voxel connected to the seed instead of
+  // stopping once all the targets are reached.
+  itkSetMacro(FullField, bool);
+  itkGetConstMacro(FullField, bool);
+  itkBooleanMacro(FullField);
+
+  void SetMaskImage(const MaskImageType* mask);
+
+  // Build the compact graph. Must be called after the mask and the distance
+  // type are set, and before any Compute().
+  void Initialize();
+
+  bool IsInsideMask(const IndexType& index) const;
+
+  itk::SizeValueType GetNumberOfNodes() const { return m_NodeIndex.size(); }
+
+  // Run the search from seed. The search stops as soon as every target is
+  // settled (unless FullField is on). Unreached nodes, and the nodes not
+  // settled when the search stops, keep UnreachedKey.
+  void Compute(const IndexType& seed, const std::vector<IndexType>& targets,
+               DistanceFieldType& field) const;
+
+  // Distance in mm at index, or a negative value if not reached.
+  double GetDistance(const DistanceFieldType& field,
+                     const IndexType& index) const;
+
+  // Distance image in mm, zero outside the reached part of the mask (same
+  // convention as DistanceBetweenROI.py).
+  typename DistanceImageType::Pointer
+  MakeDistanceImage(const DistanceFieldType& field) const;
+
+  static const DistanceKeyType UnreachedKey;
+
+protected:
+  GeodesicDistanceMap();
+  ~GeodesicDistanceMap() {}
+
+  void PrintSelf(std::ostream& os, itk::Indent indent) const;
+
+private:
+  GeodesicDistanceMap(const Self&); // purposely not implemented
+  void operator=(const Self&);      // purposely not implemented
+
+  long GetNode(const IndexType& index) const;
+
+  typename MaskImageType::ConstPointer m_MaskImage;
+
+  DistanceTypeType m_DistanceType;
+  bool m_FullField;
+
+  // Size of one distance unit in mm.
+  double m_Quantum;
+  unsigned int m_MaximumWeight;
+
+  // Linear image offset to node id (-1 outside the mask).
+  std::vector<int> m_NodeOfOffset;
+
+  // Node id to linear image offset.
+  std::vector<itk::OffsetValueType> m_NodeIndex;
+
+  // Compressed neighbour lists.
+  std::vector<itk::SizeValueType> m_NeighborStart;
+  std::vector<int> m_Neighbors;
+  std::vector<unsigned int> m_NeighborWeights;
+};
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkGeodesicDistanceMap.hxx"
+#endif
+
+#endif
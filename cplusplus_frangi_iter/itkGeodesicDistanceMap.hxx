@@ -0,0 +1,326 @@
+#ifndef __itkGeodesicDistanceMap_hxx
+#define __itkGeodesicDistanceMap_hxx
+
+#include "itkGeodesicDistanceMap.h"
+
+#include "itkImageRegionConstIterator.h"
+#include "vnl/vnl_math.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+template <typename TMaskImage>
+const typename GeodesicDistanceMap<TMaskImage>::DistanceKeyType
+    GeodesicDistanceMap<TMaskImage>::UnreachedKey =
+        std::numeric_limits<DistanceKeyType>::max();
+
+template <typename TMaskImage>
+GeodesicDistanceMap<TMaskImage>::GeodesicDistanceMap()
+    : m_DistanceType{EuclideanDistance}, m_FullField{false}, m_Quantum{1.0},
+      m_MaximumWeight{1}
+{
+}
+
+template <typename TMaskImage>
+void GeodesicDistanceMap<TMaskImage>::SetMaskImage(const MaskImageType* mask)
+{
+  m_MaskImage = mask;
+  this->Modified();
+}
+
+// =============================================================================
+// Convert the mask into a compact graph. Every mask voxel becomes a node and
+// keeps the list of its 26-connected mask neighbours with the quantized length
+// of the step.
+// =============================================================================
+template <typename TMaskImage>
+void GeodesicDistanceMap<TMaskImage>::Initialize()
+{
+  if (m_MaskImage.IsNull())
+  {
+    itkExceptionMacro(<< "Mask image is not set. Use SetMaskImage().");
+  }
+
+  const typename MaskImageType::RegionType region =
+      m_MaskImage->GetBufferedRegion();
+  const typename MaskImageType::SizeType size = region.GetSize();
+  const typename MaskImageType::SpacingType spacing =
+      m_MaskImage->GetSpacing();
+
+  const double minSpacing =
+      *(std::min_element(spacing.Begin(), spacing.End()));
+
+  if (m_DistanceType == AdditionDistance)
+  {
+    for (unsigned int i = 1; i < ImageDimension; ++i)
+    {
+      if (std::abs(spacing[i] - spacing[0]) > 1e-6 * spacing[0])
+      {
+        itkExceptionMacro(<< "Your data must be isotropic to extract an "
+                             "addition distance.");
+      }
+    }
+    m_Quantum = spacing[0];
+  }
+  else
+  {
+    m_Quantum = minSpacing / 1000.0;
+  }
+
+  // Number the mask voxels in buffer order.
+  m_NodeOfOffset.assign(region.GetNumberOfPixels(), -1);
+  m_NodeIndex.clear();
+
+  itk::ImageRegionConstIterator<MaskImageType> itMask(m_MaskImage, region);
+  itk::OffsetValueType offset = 0;
+  for (itMask.GoToBegin(); !itMask.IsAtEnd(); ++itMask, ++offset)
+  {
+    if (itMask.Get() != itk::NumericTraits<MaskPixelType>::Zero)
+    {
+      m_NodeOfOffset[offset] = static_cast<int>(m_NodeIndex.size());
+      m_NodeIndex.push_back(offset);
+    }
+  }
+
+  // Neighbourhood offsets and their weights.
+  std::vector<itk::Offset<ImageDimension>> neighborhood;
+  std::vector<unsigned int> neighborhoodWeights;
+  m_MaximumWeight = 1;
+
+  const unsigned int neighborhoodSize =
+      static_cast<unsigned int>(std::pow(3.0, double(ImageDimension)));
+  for (unsigned int n = 0; n < neighborhoodSize; ++n)
+  {
+    itk::Offset<ImageDimension> o;
+    unsigned int code = n;
+    bool center = true;
+    double length = 0.0;
+    for (unsigned int i = 0; i < ImageDimension; ++i)
+    {
+      o[i] = static_cast<int>(code % 3) - 1;
+      code /= 3;
+      center = center && o[i] == 0;
+      length += vnl_math_sqr(o[i] * spacing[i]);
+    }
+    if (center)
+    {
+      continue;
+    }
+
+    unsigned int weight = 1;
+    if (m_DistanceType == EuclideanDistance)
+    {
+      weight = static_cast<unsigned int>(
+          std::max(1.0, std::floor(std::sqrt(length) / m_Quantum + 0.5)));
+    }
+    m_MaximumWeight = std::max(m_MaximumWeight, weight);
+
+    neighborhood.push_back(o);
+    neighborhoodWeights.push_back(weight);
+  }
+
+  // Build the compressed neighbour lists.
+  const itk::SizeValueType numberOfNodes = m_NodeIndex.size();
+  m_NeighborStart.assign(numberOfNodes + 1, 0);
+  m_Neighbors.clear();
+  m_NeighborWeights.clear();
+
+  itk::OffsetValueType strides[ImageDimension];
+  strides[0] = 1;
+  for (unsigned int i = 1; i < ImageDimension; ++i)
+  {
+    strides[i] = strides[i - 1] * size[i - 1];
+  }
+
+  for (itk::SizeValueType node = 0; node < numberOfNodes; ++node)
+  {
+    itk::OffsetValueType linear = m_NodeIndex[node];
+    itk::OffsetValueType position[ImageDimension];
+    for (unsigned int i = 0; i < ImageDimension; ++i)
+    {
+      position[i] = linear % size[i];
+      linear /= size[i];
+    }
+
+    for (unsigned int n = 0; n < neighborhood.size(); ++n)
+    {
+      itk::OffsetValueType neighborOffset = 0;
+      bool inside = true;
+      for (unsigned int i = 0; i < ImageDimension && inside; ++i)
+      {
+        const itk::OffsetValueType p = position[i] + neighborhood[n][i];
+        inside = p >= 0 && p < static_cast<itk::OffsetValueType>(size[i]);
+        neighborOffset += p * strides[i];
+      }
+
+      if (inside && m_NodeOfOffset[neighborOffset] >= 0)
+      {
+        m_Neighbors.push_back(m_NodeOfOffset[neighborOffset]);
+        m_NeighborWeights.push_back(neighborhoodWeights[n]);
+      }
+    }
+    m_NeighborStart[node + 1] = m_Neighbors.size();
+  }
+
+  itkDebugMacro(<< "Geodesic graph: " << numberOfNodes << " nodes, "
+                << m_Neighbors.size() << " edges.");
+}
+
+template <typename TMaskImage>
+long GeodesicDistanceMap<TMaskImage>::GetNode(const IndexType& index) const
+{
+  const typename MaskImageType::RegionType region =
+      m_MaskImage->GetBufferedRegion();
+  if (!region.IsInside(index))
+  {
+    return -1;
+  }
+  return m_NodeOfOffset[m_MaskImage->ComputeOffset(index)];
+}
+
+template <typename TMaskImage>
+bool GeodesicDistanceMap<TMaskImage>::IsInsideMask(
+    const IndexType& index) const
+{
+  return this->GetNode(index) >= 0;
+}
+
+// =============================================================================
+// Bucket-queue (Dial) Dijkstra. Edge weights are small integers, so a circular
+// array of MaximumWeight + 1 buckets replaces the priority queue; stale entries
+// are skipped when their key no longer matches the node distance.
+// =============================================================================
+template <typename TMaskImage>
+void GeodesicDistanceMap<TMaskImage>::Compute(
+    const IndexType& seed, const std::vector<IndexType>& targets,
+    DistanceFieldType& field) const
+{
+  const long seedNode = this->GetNode(seed);
+  if (seedNode < 0)
+  {
+    itkExceptionMacro(<< "The seed " << seed
+                      << " is not included in the binary mask.");
+  }
+
+  field.assign(m_NodeIndex.size(), UnreachedKey);
+
+  std::vector<char> isTarget(m_NodeIndex.size(), 0);
+  itk::SizeValueType remainingTargets = 0;
+  for (unsigned int t = 0; t < targets.size(); ++t)
+  {
+    const long node = this->GetNode(targets[t]);
+    if (node >= 0 && !isTarget[node])
+    {
+      isTarget[node] = 1;
+      ++remainingTargets;
+    }
+  }
+  const bool stopAtTargets = !m_FullField && remainingTargets > 0;
+
+  const unsigned int numberOfBuckets = m_MaximumWeight + 1;
+  std::vector<std::vector<int>> buckets(numberOfBuckets);
+
+  field[seedNode] = 0;
+  buckets[0].push_back(static_cast<int>(seedNode));
+  itk::SizeValueType pending = 1;
+
+  for (DistanceKeyType key = 0; pending > 0; ++key)
+  {
+    std::vector<int>& bucket = buckets[key % numberOfBuckets];
+
+    while (!bucket.empty())
+    {
+      const int node = bucket.back();
+      bucket.pop_back();
+      --pending;
+
+      if (field[node] != key)
+      {
+        continue;
+      }
+
+      if (isTarget[node])
+      {
+        isTarget[node] = 0;
+        if (--remainingTargets == 0 && stopAtTargets)
+        {
+          // Keys above the current one are tentative: only the nodes at
+          // key or below are settled (no shorter path is left).
+          for (itk::SizeValueType n = 0; n < field.size(); ++n)
+          {
+            if (field[n] > key)
+            {
+              field[n] = UnreachedKey;
+            }
+          }
+          return;
+        }
+      }
+
+      for (itk::SizeValueType e = m_NeighborStart[node];
+           e < m_NeighborStart[node + 1]; ++e)
+      {
+        const int neighbor = m_Neighbors[e];
+        const DistanceKeyType candidate = key + m_NeighborWeights[e];
+        if (candidate < field[neighbor])
+        {
+          field[neighbor] = candidate;
+          buckets[candidate % numberOfBuckets].push_back(neighbor);
+          ++pending;
+        }
+      }
+    }
+  }
+}
+
+template <typename TMaskImage>
+double
+GeodesicDistanceMap<TMaskImage>::GetDistance(const DistanceFieldType& field,
+                                             const IndexType& index) const
+{
+  const long node = this->GetNode(index);
+  if (node < 0 || field[node] == UnreachedKey)
+  {
+    return -1.0;
+  }
+  return field[node] * m_Quantum;
+}
+
+template <typename TMaskImage>
+typename GeodesicDistanceMap<TMaskImage>::DistanceImageType::Pointer
+GeodesicDistanceMap<TMaskImage>::MakeDistanceImage(
+    const DistanceFieldType& field) const
+{
+  typename DistanceImageType::Pointer distanceImage = DistanceImageType::New();
+  distanceImage->CopyInformation(m_MaskImage);
+  distanceImage->SetRegions(m_MaskImage->GetBufferedRegion());
+  distanceImage->Allocate();
+  distanceImage->FillBuffer(0.0);
+
+  double* buffer = distanceImage->GetBufferPointer();
+  for (itk::SizeValueType node = 0; node < m_NodeIndex.size(); ++node)
+  {
+    if (field[node] != UnreachedKey)
+    {
+      buffer[m_NodeIndex[node]] = field[node] * m_Quantum;
+    }
+  }
+
+  return distanceImage;
+}
+
+template <typename TMaskImage>
+void GeodesicDistanceMap<TMaskImage>::PrintSelf(std::ostream& os,
+                                                itk::Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "DistanceType: " << m_DistanceType << std::endl;
+  os << indent << "FullField: " << m_FullField << std::endl;
+  os << indent << "Quantum: " << m_Quantum << std::endl;
+  os << indent << "NumberOfNodes: " << m_NodeIndex.size() << std::endl;
+  os << indent << "NumberOfEdges: " << m_Neighbors.size() << std::endl;
+}
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef __itkImageBufferPool_h
+#define __itkImageBufferPool_h
+
+#include "itkStageTimer.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <mutex>
+
+// \class ImageBufferPool
+// \brief Process wide pool of large buffers, keyed by size.
+//
+// Every scale of the multi-scale analysis and every diffusion iteration
+// creates new filters (Hessian, vesselness, eigen analysis, deconvolution,
+// Gaussian, threshold, sharpening, sqrt, rescale, cast) whose outputs are
+// allocated again at each update: ITK gives an image a new pixel container
+// whenever its filter runs. With the pool enabled, the image buffers of at
+// least GetMinimumSize() bytes are anonymous mappings kept when they are
+// freed and handed out again to the next allocation of the same size. From
+// the second iteration on the pipeline then maps no new buffer and takes no
+// page fault on them.
+//
+// Only the pixel containers go through the pool: PooledImageContainer, given
+// to the images by ImageBufferPoolFactory::RegisterOneFactory()
+// (itkPooledImageContainer.h). Disabled (the default), the buffers are
+// malloc() and free() with a 16 byte header. With SetHugePages(), the
+// buffers are 2 MiB huge pages (hugetlbfs if pages are reserved,
+// transparent huge pages otherwise), fewer TLB misses on the large volumes.
+//
+// Idle buffers above SetMaximumIdleBytes() are unmapped, the oldest first.
+// Every new mapping is a "ImageBufferPool::Map" stage of the StageTimer.
+class ImageBufferPool
+{
+public:
+  struct Statistics
+  {
+    unsigned long Leases = 0;
+    unsigned long Reuses = 0;
+    unsigned long Mappings = 0;
+    double MappedBytes = 0.0;
+    double IdleBytes = 0.0;
+  };
+
+  // Never destroyed: buffers may be freed during the static destruction.
+  static ImageBufferPool& GetInstance()
+  {
+    static ImageBufferPool* instance = new ImageBufferPool;
+    return *instance;
+  }
+
+  void SetEnabled(bool enabled) { m_Enabled = enabled; }
+  bool IsEnabled() const { return m_Enabled; }
+
+  void SetHugePages(bool hugePages) { m_HugePages = hugePages; }
+  bool GetHugePages() const { return m_HugePages; }
+
+  // Smallest pooled allocation, 1 MiB by default.
+  void SetMinimumSize(size_t minimumSize) { m_MinimumSize = minimumSize; }
+  size_t GetMinimumSize() const { return m_MinimumSize; }
+
+  void SetMaximumIdleBytes(size_t maximumIdleBytes)
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_MaximumIdleBytes = maximumIdleBytes;
+    this->TrimIdle(0);
+  }
+
+  Statistics GetStatistics() const
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    Statistics statistics = m_Statistics;
+    statistics.IdleBytes = m_IdleBytes;
+    return statistics;
+  }
+
+  // Unmap every idle buffer.
+  void Trim()
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    const size_t maximumIdleBytes = m_MaximumIdleBytes;
+    m_MaximumIdleBytes = 0;
+    this->TrimIdle(0);
+    m_MaximumIdleBytes = maximumIdleBytes;
+  }
+
+  // A buffer of size bytes, leased when the pool is enabled and size at
+  // least GetMinimumSize(), from malloc() otherwise. Give it back with
+  // FreeArray().
+  void* AllocateArray(size_t size)
+  {
+    if (m_Enabled && size >= m_MinimumSize)
+    {
+      void* buffer = this->Lease(size + HeaderSize);
+      if (buffer)
+      {
+        return buffer;
+      }
+    }
+    void* block = std::malloc(size + HeaderSize);
+    if (!block)
+    {
+      return nullptr;
+    }
+    static_cast<uint64_t*>(block)[0] = 0;
+    return static_cast<char*>(block) + HeaderSize;
+  }
+
+  void FreeArray(void* buffer)
+  {
+    if (!buffer)
+    {
+      return;
+    }
+    char* block = static_cast<char*>(buffer) - HeaderSize;
+    const uint64_t length = reinterpret_cast<uint64_t*>(block)[0];
+    if (length == 0)
+    {
+      std::free(block);
+    }
+    else
+    {
+      this->Return(block, length);
+    }
+  }
+
+private:
+  // Length of the mapping (0: malloc() block), padded to keep the 16 byte
+  // alignment of malloc().
+  static const size_t HeaderSize = 16;
+  static const size_t HugePageSize = 2 << 20;
+
+  typedef std::multimap<size_t, void*> IdleMapType;
+
+  ImageBufferPool()
+      : m_Enabled{false}, m_HugePages{false}, m_MinimumSize{1 << 20},
+        m_MaximumIdleBytes{std::numeric_limits<size_t>::max()},
+        m_IdleBytes{0}, m_Age{0}
+  {
+  }
+
+  // A mapping of at least bytes, with its length in the header. nullptr if
+  // none could be mapped.
+  void* Lease(size_t bytes)
+  {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    if (m_HugePages)
+    {
+      pageSize = HugePageSize;
+    }
+    const size_t length = (bytes + pageSize - 1) / pageSize * pageSize;
+
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      ++m_Statistics.Leases;
+
+      // The same size, or at most 1/8 larger.
+      IdleMapType::iterator it = m_Idle.lower_bound(length);
+      if (it != m_Idle.end() && it->first <= length + length / 8)
+      {
+        void* block = it->second;
+        m_IdleBytes -= it->first;
+        this->EraseAge(block);
+        m_Idle.erase(it);
+        ++m_Statistics.Reuses;
+        return static_cast<char*>(block) + HeaderSize;
+      }
+      this->TrimIdle(length);
+    }
+
+    StageTimerScope timer("ImageBufferPool::Map");
+    void* block = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+    if (m_HugePages)
+    {
+      block = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (block == MAP_FAILED)
+    {
+      block = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (block == MAP_FAILED)
+      {
+        return nullptr;
+      }
+#if defined(MADV_HUGEPAGE)
+      if (m_HugePages)
+      {
+        madvise(block, length, MADV_HUGEPAGE);
+      }
+#endif
+    }
+    timer.AddBytesAllocated(length);
+
+    reinterpret_cast<uint64_t*>(block)[0] = length;
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    ++m_Statistics.Mappings;
+    m_Statistics.MappedBytes += length;
+    return static_cast<char*>(block) + HeaderSize;
+  }
+
+  void Return(void* block, size_t length)
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (!m_Enabled || length > m_MaximumIdleBytes)
+    {
+      munmap(block, length);
+      return;
+    }
+    m_Idle.insert(std::make_pair(length, block));
+    m_Ages[++m_Age] = block;
+    m_IdleBytes += length;
+    this->TrimIdle(0);
+  }
+
+  // Unmap the oldest idle buffers until bytes more fit under the maximum.
+  // Called with m_Mutex held.
+  void TrimIdle(size_t bytes)
+  {
+    while (!m_Ages.empty() &&
+           (m_IdleBytes > m_MaximumIdleBytes ||
+            bytes > m_MaximumIdleBytes - m_IdleBytes))
+    {
+      void* block = m_Ages.begin()->second;
+      m_Ages.erase(m_Ages.begin());
+      for (IdleMapType::iterator it = m_Idle.begin(); it != m_Idle.end();
+           ++it)
+      {
+        if (it->second == block)
+        {
+          m_IdleBytes -= it->first;
+          munmap(block, it->first);
+          m_Idle.erase(it);
+          break;
+        }
+      }
+    }
+  }
+
+  void EraseAge(void* block)
+  {
+    for (std::map<unsigned long, void*>::iterator it = m_Ages.begin();
+         it != m_Ages.end(); ++it)
+    {
+      if (it->second == block)
+      {
+        m_Ages.erase(it);
+        return;
+      }
+    }
+  }
+
+  ImageBufferPool(const ImageBufferPool&); // purposely not implemented
+  void operator=(const ImageBufferPool&);  // purposely not implemented
+
+  std::atomic<bool> m_Enabled;
+  std::atomic<bool> m_HugePages;
+  std::atomic<size_t> m_MinimumSize;
+  size_t m_MaximumIdleBytes;
+
+  mutable std::mutex m_Mutex;
+  IdleMapType m_Idle;
+  std::map<unsigned long, void*> m_Ages; // idle buffers, oldest first
+  size_t m_IdleBytes;
+  unsigned long m_Age;
+  Statistics m_Statistics;
+};
+
+#endif
@@ -0,0 +1,728 @@
+#ifndef __itkMappedImageIO_h
+#define __itkMappedImageIO_h
+
+#include "itkByteSwapper.h"
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
+#include "itkImportImageContainer.h"
+#include "itkMacro.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// \class MappedImageIO
+// \brief Read and write uncompressed images without intermediate copies.
+//
+// Read() memory-maps an uncompressed NIfTI-1 file (.nii) or a MetaImage
+// header with its raw sidecar (.mhd + .raw). When the voxels are stored with
+// the pixel type of the image, in the byte order of the machine, the image
+// gets the mapped pages as pixel buffer (private mapping: the file is never
+// modified); otherwise the mapped voxels are converted once into the image
+// buffer. The geometry is read by the ITK image IO, so it is the one
+// ImageFileReader would give. Compressed, scaled (NIfTI scl_slope) and
+// multi-component files, and the other formats, go through ImageFileReader.
+//
+// Write() writes the header of a .nii or .mhd file, then the pixel buffer
+// with pwrite, without converting or compressing it. The other formats go
+// through ImageFileWriter. WriteHeader() and WriteFile() write the same
+// files by parts, for images never held whole in memory.
+
+class MappedImageIO
+{
+public:
+  // Pixel container owning a file mapping.
+  template <typename TElement>
+  class MappedImageContainer
+      : public itk::ImportImageContainer<itk::SizeValueType, TElement>
+  {
+  public:
+    typedef MappedImageContainer Self;
+    typedef itk::ImportImageContainer<itk::SizeValueType, TElement>
+        Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    typedef itk::SmartPointer<const Self> ConstPointer;
+
+    itkNewMacro(Self);
+
+    itkTypeMacro(MappedImageContainer, ImportImageContainer);
+
+    // Take the mapping [mapping, mapping + length) holding numberOfElements
+    // elements at offset.
+    void SetMapping(void* mapping, size_t length, size_t offset,
+                    itk::SizeValueType numberOfElements)
+    {
+      this->ReleaseMapping();
+      m_Mapping = mapping;
+      m_MappingLength = length;
+      this->SetImportPointer(
+          reinterpret_cast<TElement*>(static_cast<char*>(mapping) + offset),
+          numberOfElements, false);
+    }
+
+  protected:
+    MappedImageContainer() : m_Mapping{nullptr}, m_MappingLength{0} {}
+    ~MappedImageContainer() { this->ReleaseMapping(); }
+
+  private:
+    MappedImageContainer(const Self&); // purposely not implemented
+    void operator=(const Self&);       // purposely not implemented
+
+    void ReleaseMapping()
+    {
+      if (m_Mapping)
+      {
+        munmap(m_Mapping, m_MappingLength);
+        m_Mapping = nullptr;
+      }
+    }
+
+    void* m_Mapping;
+    size_t m_MappingLength;
+  };
+
+  // Whether Read() and Write() handle fileName themselves.
+  static bool IsMappedFormat(const std::string& fileName)
+  {
+    return HasExtension(fileName, ".nii") || HasExtension(fileName, ".mhd");
+  }
+
+  template <typename TImage>
+  static typename TImage::Pointer Read(const std::string& fileName)
+  {
+    typedef typename TImage::PixelType PixelType;
+    const unsigned int Dimension = TImage::ImageDimension;
+
+    itk::ImageIOBase::Pointer imageIO;
+    DataLocation location;
+    if (IsMappedFormat(fileName))
+    {
+      imageIO = itk::ImageIOFactory::CreateImageIO(
+          fileName.c_str(), itk::ImageIOFactory::ReadMode);
+    }
+    if (imageIO)
+    {
+      imageIO->SetFileName(fileName);
+      imageIO->ReadImageInformation();
+    }
+    if (!imageIO || imageIO->GetNumberOfDimensions() != Dimension ||
+        imageIO->GetNumberOfComponents() != 1 ||
+        (imageIO->GetByteOrder() != GetSystemByteOrder() &&
+         imageIO->GetByteOrder() != itk::ImageIOBase::OrderNotApplicable) ||
+        !GetDataLocation(fileName, imageIO, location))
+    {
+      typedef itk::ImageFileReader<TImage> ReaderType;
+      typename ReaderType::Pointer reader = ReaderType::New();
+      reader->SetFileName(fileName);
+      reader->Update();
+      typename TImage::Pointer image = reader->GetOutput();
+      image->DisconnectPipeline();
+      return image;
+    }
+
+    typename TImage::Pointer image = TImage::New();
+    typename TImage::RegionType region;
+    typename TImage::SpacingType spacing;
+    typename TImage::PointType origin;
+    typename TImage::DirectionType direction;
+    for (unsigned int i = 0; i < Dimension; ++i)
+    {
+      region.SetSize(i, imageIO->GetDimensions(i));
+      spacing[i] = imageIO->GetSpacing(i);
+      origin[i] = imageIO->GetOrigin(i);
+      const std::vector<double> axis = imageIO->GetDirection(i);
+      for (unsigned int j = 0; j < Dimension; ++j)
+      {
+        direction[j][i] = axis[j];
+      }
+    }
+    image->SetRegions(region);
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->SetDirection(direction);
+
+    const itk::SizeValueType numberOfPixels = region.GetNumberOfPixels();
+    const size_t dataLength = numberOfPixels * imageIO->GetComponentSize();
+
+    const int file = open(location.DataFileName.c_str(), O_RDONLY);
+    if (file < 0)
+    {
+      itkGenericExceptionMacro(<< "Cannot open " << location.DataFileName
+                               << ": " << std::strerror(errno));
+    }
+    struct stat status;
+    if (fstat(file, &status) != 0 ||
+        static_cast<size_t>(status.st_size) < location.Offset + dataLength)
+    {
+      close(file);
+      itkGenericExceptionMacro(<< location.DataFileName
+                               << " is shorter than its header says.");
+    }
+    const size_t mappingLength = location.Offset + dataLength;
+    void* mapping = mmap(nullptr, mappingLength, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, file, 0);
+    close(file);
+    if (mapping == MAP_FAILED)
+    {
+      itkGenericExceptionMacro(<< "Cannot map " << location.DataFileName
+                               << ": " << std::strerror(errno));
+    }
+    madvise(mapping, mappingLength, MADV_SEQUENTIAL);
+
+    if (imageIO->GetComponentType() ==
+            itk::ImageIOBase::MapPixelType<PixelType>::CType &&
+        location.Offset % sizeof(PixelType) == 0)
+    {
+      typedef MappedImageContainer<PixelType> ContainerType;
+      typename ContainerType::Pointer container = ContainerType::New();
+      container->SetMapping(mapping, mappingLength, location.Offset,
+                            numberOfPixels);
+      image->SetPixelContainer(container);
+      return image;
+    }
+
+    image->Allocate();
+    const char* data = static_cast<const char*>(mapping) + location.Offset;
+    bool converted = true;
+    switch (imageIO->GetComponentType())
+    {
+    case itk::ImageIOBase::UCHAR:
+      Convert<unsigned char>(data, image->GetBufferPointer(), numberOfPixels);
+      break;
+    case itk::ImageIOBase::CHAR:
+      Convert<signed char>(data, image->GetBufferPointer(), numberOfPixels);
+      break;
+    case itk::ImageIOBase::USHORT:
+      Convert<unsigned short>(data, image->GetBufferPointer(), numberOfPixels);
+      break;
+    case itk::ImageIOBase::SHORT:
+      Convert<short>(data, image->GetBufferPointer(), numberOfPixels);
+      break;
+    case itk::ImageIOBase::UINT:
+      Convert<unsigned int>(data, image->GetBufferPointer(), numberOfPixels);
+      break;
+    case itk::ImageIOBase::INT:
+      Convert<int>(data, image->GetBufferPointer(), numberOfPixels);
+      break;
+    case itk::ImageIOBase::FLOAT:
+      Convert<float>(data, image->GetBufferPointer(), numberOfPixels);
+      break;
+    case itk::ImageIOBase::DOUBLE:
+      Convert<double>(data, image->GetBufferPointer(), numberOfPixels);
+      break;
+    default:
+      converted = false;
+      break;
+    }
+    munmap(mapping, mappingLength);
+    if (!converted)
+    {
+      itkGenericExceptionMacro(<< "Unsupported voxel type in " << fileName
+                               << ".");
+    }
+    return image;
+  }
+
+  template <typename TImage>
+  static void Write(const TImage* image, const std::string& fileName)
+  {
+    typedef typename TImage::PixelType PixelType;
+
+    if (!CanWriteHeader<TImage>(fileName) ||
+        image->GetBufferedRegion() != image->GetLargestPossibleRegion())
+    {
+      typedef itk::ImageFileWriter<TImage> WriterType;
+      typename WriterType::Pointer writer = WriterType::New();
+      writer->SetFileName(fileName);
+      writer->SetInput(image);
+      writer->Update();
+      return;
+    }
+
+    std::string dataFileName;
+    size_t offset = 0;
+    WriteHeader(image, fileName, dataFileName, offset);
+
+    const size_t dataLength =
+        image->GetBufferedRegion().GetNumberOfPixels() * sizeof(PixelType);
+    WriteFile(dataFileName, image->GetBufferPointer(), dataLength, offset,
+              false);
+  }
+
+  // Whether WriteHeader() can write fileName for an image of type TImage.
+  template <typename TImage>
+  static bool CanWriteHeader(const std::string& fileName)
+  {
+    typedef typename TImage::PixelType PixelType;
+    return (HasExtension(fileName, ".nii") ||
+            HasExtension(fileName, ".mhd")) &&
+           GetNiftiDatatype(
+               itk::ImageIOBase::MapPixelType<PixelType>::CType) != 0 &&
+           TImage::ImageDimension <= 7;
+  }
+
+  // Write the header of a .nii or .mhd file of the geometry of image (its
+  // largest possible region; the buffer is not read) and empty the data
+  // file. The voxels are then written with WriteFile(dataFileName, ...,
+  // offset + index * sizeof(PixelType), false), in any order, e.g. slab by
+  // slab.
+  template <typename TImage>
+  static void WriteHeader(const TImage* image, const std::string& fileName,
+                          std::string& dataFileName, size_t& offset)
+  {
+    typedef typename TImage::PixelType PixelType;
+    const unsigned int Dimension = TImage::ImageDimension;
+
+    if (!CanWriteHeader<TImage>(fileName))
+    {
+      itkGenericExceptionMacro(<< "Cannot write " << fileName
+                               << " by parts: only .nii and .mhd files of "
+                                  "scalar voxels are.");
+    }
+
+    std::vector<size_t> size(Dimension);
+    std::vector<double> spacing(Dimension);
+    std::vector<double> origin(Dimension);
+    std::vector<double> direction(Dimension * Dimension);
+    for (unsigned int i = 0; i < Dimension; ++i)
+    {
+      size[i] = image->GetLargestPossibleRegion().GetSize(i);
+      spacing[i] = image->GetSpacing()[i];
+      origin[i] = image->GetOrigin()[i];
+      for (unsigned int j = 0; j < Dimension; ++j)
+      {
+        direction[i * Dimension + j] = image->GetDirection()[i][j];
+      }
+    }
+
+    const itk::ImageIOBase::IOComponentType componentType =
+        itk::ImageIOBase::MapPixelType<PixelType>::CType;
+    if (HasExtension(fileName, ".nii"))
+    {
+      const std::string header =
+          MakeNiftiHeader(size, spacing, origin, direction,
+                          GetNiftiDatatype(componentType),
+                          8 * sizeof(PixelType));
+      dataFileName = fileName;
+      offset = header.size();
+      WriteFile(dataFileName, header.data(), header.size(), 0, true);
+    }
+    else
+    {
+      dataFileName = fileName.substr(0, fileName.size() - 4) + ".raw";
+      const std::string header = MakeMetaImageHeader(
+          size, spacing, origin, direction, GetMetaElementType(componentType),
+          dataFileName.substr(dataFileName.find_last_of("/\\") + 1));
+      offset = 0;
+      WriteFile(fileName, header.data(), header.size(), 0, true);
+      WriteFile(dataFileName, nullptr, 0, 0, true);
+    }
+  }
+
+  // The 352 bytes (header and empty extension flag) of a NIfTI-1 file of
+  // the given ITK geometry (LPS, direction row major), with the qform and
+  // sform ImageFileWriter writes.
+  static std::string MakeNiftiHeader(const std::vector<size_t>& size,
+                                     const std::vector<double>& spacing,
+                                     const std::vector<double>& origin,
+                                     const std::vector<double>& direction,
+                                     int datatype, int bitpix)
+  {
+    const unsigned int dimension = size.size();
+    std::string header(352, '\0');
+
+    SetField<int32_t>(header, 0, 348);
+    header[38] = 'r';
+    SetField<int16_t>(header, 40, dimension);
+    for (unsigned int i = 0; i < dimension; ++i)
+    {
+      SetField<int16_t>(header, 42 + 2 * i, size[i]);
+      SetField<float>(header, 80 + 4 * i, spacing[i]);
+    }
+    for (unsigned int i = dimension; i < 7; ++i)
+    {
+      SetField<int16_t>(header, 42 + 2 * i, 1);
+      SetField<float>(header, 80 + 4 * i, 1.0f);
+    }
+    SetField<int16_t>(header, 70, datatype);
+    SetField<int16_t>(header, 72, bitpix);
+    SetField<float>(header, 108, 352.0f);
+    SetField<float>(header, 112, 1.0f);
+    header[123] = 2 | 8; // NIFTI_UNITS_MM | NIFTI_UNITS_SEC
+
+    // Voxel to RAS: the ITK (LPS) matrix with the first two rows negated.
+    double rotation[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+    double offset[3] = {0, 0, 0};
+    const unsigned int spatial = std::min(3u, dimension);
+    for (unsigned int i = 0; i < spatial; ++i)
+    {
+      const double sign = i < 2 ? -1.0 : 1.0;
+      offset[i] = sign * origin[i];
+      for (unsigned int j = 0; j < spatial; ++j)
+      {
+        rotation[i][j] = sign * direction[i * dimension + j];
+      }
+    }
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      for (unsigned int j = 0; j < 3; ++j)
+      {
+        const double pixdim = j < spatial ? spacing[j] : 1.0;
+        SetField<float>(header, 280 + 16 * i + 4 * j, rotation[i][j] * pixdim);
+      }
+      SetField<float>(header, 292 + 16 * i, offset[i]);
+    }
+
+    double qfac = 1.0;
+    double quaternion[3];
+    RotationToQuaternion(rotation, quaternion, qfac);
+    SetField<float>(header, 76, qfac);
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      SetField<float>(header, 256 + 4 * i, quaternion[i]);
+      SetField<float>(header, 268 + 4 * i, offset[i]);
+    }
+    SetField<int16_t>(header, 252, 1); // NIFTI_XFORM_SCANNER_ANAT
+    SetField<int16_t>(header, 254, 1);
+
+    std::memcpy(&header[344], "n+1", 4);
+    return header;
+  }
+
+  // The quaternion (b, c, d) and qfac of the orthonormal rotation, as
+  // nifti_mat44_to_quatern computes them.
+  static void RotationToQuaternion(const double rotation[3][3],
+                                   double quaternion[3], double& qfac)
+  {
+    double r[3][3];
+    std::memcpy(r, rotation, sizeof(r));
+
+    const double determinant =
+        r[0][0] * (r[1][1] * r[2][2] - r[1][2] * r[2][1]) -
+        r[0][1] * (r[1][0] * r[2][2] - r[1][2] * r[2][0]) +
+        r[0][2] * (r[1][0] * r[2][1] - r[1][1] * r[2][0]);
+    qfac = 1.0;
+    if (determinant < 0.0)
+    {
+      qfac = -1.0;
+      r[0][2] = -r[0][2];
+      r[1][2] = -r[1][2];
+      r[2][2] = -r[2][2];
+    }
+
+    double a = r[0][0] + r[1][1] + r[2][2] + 1.0;
+    double b, c, d;
+    if (a > 0.5)
+    {
+      a = 0.5 * std::sqrt(a);
+      b = 0.25 * (r[2][1] - r[1][2]) / a;
+      c = 0.25 * (r[0][2] - r[2][0]) / a;
+      d = 0.25 * (r[1][0] - r[0][1]) / a;
+    }
+    else
+    {
+      const double xd = 1.0 + r[0][0] - (r[1][1] + r[2][2]);
+      const double yd = 1.0 + r[1][1] - (r[0][0] + r[2][2]);
+      const double zd = 1.0 + r[2][2] - (r[0][0] + r[1][1]);
+      if (xd > 1.0)
+      {
+        b = 0.5 * std::sqrt(xd);
+        c = 0.25 * (r[0][1] + r[1][0]) / b;
+        d = 0.25 * (r[0][2] + r[2][0]) / b;
+        a = 0.25 * (r[2][1] - r[1][2]) / b;
+      }
+      else if (yd > 1.0)
+      {
+        c = 0.5 * std::sqrt(yd);
+        b = 0.25 * (r[0][1] + r[1][0]) / c;
+        d = 0.25 * (r[1][2] + r[2][1]) / c;
+        a = 0.25 * (r[0][2] - r[2][0]) / c;
+      }
+      else
+      {
+        d = 0.5 * std::sqrt(zd);
+        b = 0.25 * (r[0][2] + r[2][0]) / d;
+        c = 0.25 * (r[1][2] + r[2][1]) / d;
+        a = 0.25 * (r[1][0] - r[0][1]) / d;
+      }
+      if (a < 0.0)
+      {
+        b = -b;
+        c = -c;
+        d = -d;
+      }
+    }
+    quaternion[0] = b;
+    quaternion[1] = c;
+    quaternion[2] = d;
+  }
+
+  // The text header of a MetaImage whose voxels are in dataFileName.
+  static std::string MakeMetaImageHeader(const std::vector<size_t>& size,
+                                         const std::vector<double>& spacing,
+                                         const std::vector<double>& origin,
+                                         const std::vector<double>& direction,
+                                         const std::string& elementType,
+                                         const std::string& dataFileName)
+  {
+    const unsigned int dimension = size.size();
+    std::ostringstream header;
+    header.precision(17);
+    header << "ObjectType = Image\nNDims = " << dimension
+           << "\nBinaryData = True\nBinaryDataByteOrderMSB = "
+           << (GetSystemByteOrder() == itk::ImageIOBase::BigEndian ? "True"
+                                                                  : "False")
+           << "\nCompressedData = False\nTransformMatrix =";
+    // Axis after axis, as MetaImageIO writes it.
+    for (unsigned int i = 0; i < dimension; ++i)
+    {
+      for (unsigned int j = 0; j < dimension; ++j)
+      {
+        header << " " << direction[j * dimension + i];
+      }
+    }
+    header << "\nOffset =";
+    for (unsigned int i = 0; i < dimension; ++i)
+    {
+      header << " " << origin[i];
+    }
+    header << "\nElementSpacing =";
+    for (unsigned int i = 0; i < dimension; ++i)
+    {
+      header << " " << spacing[i];
+    }
+    header << "\nDimSize =";
+    for (unsigned int i = 0; i < dimension; ++i)
+    {
+      header << " " << size[i];
+    }
+    header << "\nElementType = " << elementType
+           << "\nElementDataFile = " << dataFileName << "\n";
+    return header.str();
+  }
+
+  static bool HasExtension(const std::string& fileName,
+                           const std::string& extension)
+  {
+    return fileName.size() > extension.size() &&
+           fileName.compare(fileName.size() - extension.size(),
+                            extension.size(), extension) == 0;
+  }
+
+  // Store value as a T at offset of a binary header.
+  template <typename T>
+  static void SetField(std::string& header, size_t offset, double value)
+  {
+    const T field = static_cast<T>(value);
+    std::memcpy(&header[offset], &field, sizeof(T));
+  }
+
+  // Write length bytes of data at offset of fileName, by pwrite calls of at
+  // most 64 MB.
+  static void WriteFile(const std::string& fileName, const void* data,
+                        size_t length, size_t offset, bool truncate)
+  {
+    const int file = open(fileName.c_str(),
+                          O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+    if (file < 0)
+    {
+      itkGenericExceptionMacro(<< "Cannot open " << fileName << ": "
+                               << std::strerror(errno));
+    }
+    const char* bytes = static_cast<const char*>(data);
+    size_t written = 0;
+    while (written < length)
+    {
+      const size_t chunk = std::min<size_t>(length - written, 64 << 20);
+      const ssize_t count = pwrite(file, bytes + written, chunk,
+                                   static_cast<off_t>(offset + written));
+      if (count < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (count <= 0)
+      {
+        const int error = errno;
+        close(file);
+        itkGenericExceptionMacro(<< "Cannot write " << fileName << ": "
+                                 << std::strerror(error));
+      }
+      written += count;
+    }
+    if (close(file) != 0)
+    {
+      itkGenericExceptionMacro(<< "Cannot write " << fileName << ": "
+                               << std::strerror(errno));
+    }
+  }
+
+private:
+  struct DataLocation
+  {
+    std::string DataFileName;
+    size_t Offset;
+  };
+
+  static itk::ImageIOBase::ByteOrder GetSystemByteOrder()
+  {
+    return itk::ByteSwapper<int>::SystemIsBigEndian()
+               ? itk::ImageIOBase::BigEndian
+               : itk::ImageIOBase::LittleEndian;
+  }
+
+  template <typename T>
+  static T GetField(const char* header, size_t offset)
+  {
+    T field;
+    std::memcpy(&field, header + offset, sizeof(T));
+    return field;
+  }
+
+  // Where the voxels of a mapped format file are, false if they cannot be
+  // mapped (compressed, scaled, external lists of files).
+  static bool GetDataLocation(const std::string& fileName,
+                              const itk::ImageIOBase* imageIO,
+                              DataLocation& location)
+  {
+    if (HasExtension(fileName, ".nii"))
+    {
+      char header[348];
+      std::ifstream file(fileName.c_str(), std::ios::binary);
+      if (!file.read(header, sizeof(header)) ||
+          GetField<int32_t>(header, 0) != 348 ||
+          std::memcmp(header + 344, "n+1", 4) != 0)
+      {
+        return false;
+      }
+      const float slope = GetField<float>(header, 112);
+      const float intercept = GetField<float>(header, 116);
+      if (slope != 0.0f && (slope != 1.0f || intercept != 0.0f))
+      {
+        return false;
+      }
+      location.DataFileName = fileName;
+      location.Offset = static_cast<size_t>(GetField<float>(header, 108));
+      return true;
+    }
+
+    // MetaImage: the data file and header size of the header lines.
+    std::ifstream file(fileName.c_str());
+    std::string line;
+    std::string dataFile;
+    long headerSize = 0;
+    while (std::getline(file, line))
+    {
+      const size_t equal = line.find('=');
+      if (equal == std::string::npos)
+      {
+        continue;
+      }
+      std::string key = line.substr(0, equal);
+      std::string value = line.substr(equal + 1);
+      key.erase(key.find_last_not_of(" \t\r") + 1);
+      value.erase(0, value.find_first_not_of(" \t"));
+      value.erase(value.find_last_not_of(" \t\r") + 1);
+      if (key == "CompressedData" && value == "True")
+      {
+        return false;
+      }
+      else if (key == "HeaderSize")
+      {
+        headerSize = std::atol(value.c_str());
+      }
+      else if (key == "ElementDataFile")
+      {
+        dataFile = value;
+      }
+    }
+    if (dataFile.empty() || dataFile == "LOCAL" || dataFile == "LIST" ||
+        dataFile.find('%') != std::string::npos || headerSize < 0)
+    {
+      return false;
+    }
+    const size_t separator = fileName.find_last_of("/\\");
+    location.DataFileName =
+        (separator == std::string::npos || dataFile[0] == '/')
+            ? dataFile
+            : fileName.substr(0, separator + 1) + dataFile;
+    location.Offset = headerSize;
+    return imageIO->GetComponentSize() > 0;
+  }
+
+  template <typename TInput, typename TOutput>
+  static void Convert(const char* data, TOutput* output,
+                      itk::SizeValueType numberOfPixels)
+  {
+    for (itk::SizeValueType i = 0; i < numberOfPixels; ++i)
+    {
+      TInput value;
+      std::memcpy(&value, data + i * sizeof(TInput), sizeof(TInput));
+      output[i] = static_cast<TOutput>(value);
+    }
+  }
+
+  static int GetNiftiDatatype(itk::ImageIOBase::IOComponentType type)
+  {
+    switch (type)
+    {
+    case itk::ImageIOBase::UCHAR:
+      return 2;
+    case itk::ImageIOBase::SHORT:
+      return 4;
+    case itk::ImageIOBase::INT:
+      return 8;
+    case itk::ImageIOBase::FLOAT:
+      return 16;
+    case itk::ImageIOBase::DOUBLE:
+      return 64;
+    case itk::ImageIOBase::CHAR:
+      return 256;
+    case itk::ImageIOBase::USHORT:
+      return 512;
+    case itk::ImageIOBase::UINT:
+      return 768;
+    default:
+      return 0;
+    }
+  }
+
+  static std::string GetMetaElementType(itk::ImageIOBase::IOComponentType type)
+  {
+    switch (type)
+    {
+    case itk::ImageIOBase::UCHAR:
+      return "MET_UCHAR";
+    case itk::ImageIOBase::SHORT:
+      return "MET_SHORT";
+    case itk::ImageIOBase::INT:
+      return "MET_INT";
+    case itk::ImageIOBase::FLOAT:
+      return "MET_FLOAT";
+    case itk::ImageIOBase::DOUBLE:
+      return "MET_DOUBLE";
+    case itk::ImageIOBase::CHAR:
+      return "MET_CHAR";
+    case itk::ImageIOBase::USHORT:
+      return "MET_USHORT";
+    case itk::ImageIOBase::UINT:
+      return "MET_UINT";
+    default:
+      return "MET_OTHER";
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,300 @@
+#if defined(_MSC_VER)
+#pragma warning(disable : 4786)
+#endif
+
+#include "itkMappedImageIO.h"
+#include "itkRunLengthMask.h"
+
+#include "boost/program_options.hpp"
+#include "itkMultiThreader.h"
+
+#include <cmath>
+#include <sstream>
+
+// Post-processing of the thresholded VED outputs (step 5 of
+// extract_vessels.sh). For each variant "input,threshold,clean[,thr]" the
+// binary mask step(mask)*astep(input, threshold) is built, closed by one
+// voxel (3dmask_tool -dilate_inputs 1 -1) and cleaned from its small
+// clusters (3dmerge -1clust 1.01 <size>). All the variants are thresholded
+// in the same sweep over the images, straight into run-length masks.
+
+const int Dimension = 3;
+typedef itk::Image<float, Dimension> ImageType;
+typedef itk::Image<unsigned char, Dimension> BinaryImageType;
+
+struct VariantInfo
+{
+  std::string Input;
+  double Threshold;
+  std::string CleanOutput;
+  std::string ThresholdOutput;
+
+  ImageType::Pointer Image;
+  RunLengthMask Mask;
+};
+
+bool process_command_line(int argc, char** argv,
+                          boost::program_options::variables_map& vm)
+{
+  try
+  {
+    boost::program_options::options_description program(
+        "Program allowed options\n");
+    program.add_options()("help,h", "produce help message.");
+
+    boost::program_options::options_description requiredVariable("Required\n");
+    requiredVariable.add_options()(
+        "mask,m", boost::program_options::value<std::string>()->required(),
+        "the brain mask file name (voxels outside are never kept).")(
+        "variant,v",
+        boost::program_options::value<std::vector<std::string>>()->required(),
+        "'input,threshold,clean_output[,thr_output]'. Can be repeated; all "
+        "the variants are processed in one pass.");
+
+    boost::program_options::options_description cleanupVariable(
+        "Cleanup\n");
+    cleanupVariable.add_options()(
+        "connectivity,c",
+        boost::program_options::value<int>()->default_value(2),
+        "Neighbourhood of the closing, as in 3dmask_tool (1: faces, 2: "
+        "faces and edges, 3: faces, edges and corners).")(
+        "minimumSize,s",
+        boost::program_options::value<int>()->default_value(60),
+        "Minimum size in voxels of the face-connected clusters kept.")(
+        "threads,n", boost::program_options::value<int>()->default_value(0),
+        "The number of threads (0: ITK default).");
+
+    boost::program_options::options_description global;
+
+    global.add(program).add(requiredVariable).add(cleanupVariable);
+
+    boost::program_options::store(
+        boost::program_options::parse_command_line(argc, argv, global), vm);
+
+    if (vm.count("help"))
+    {
+      std::cout << global << std::endl;
+      return false;
+    }
+
+    boost::program_options::notify(vm);
+
+    const int connectivity = vm["connectivity"].as<int>();
+    if (connectivity < 1 || connectivity > 3)
+    {
+      throw std::logic_error("connectivity must be 1, 2 or 3.");
+    }
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Error: " << e.what() << "\n";
+    return false;
+  }
+  catch (...)
+  {
+    std::cerr << "Unknown error!\n";
+    return false;
+  }
+  return true;
+}
+
+VariantInfo parse_variant(const std::string& description)
+{
+  std::vector<std::string> fields;
+  std::stringstream stream(description);
+  std::string field;
+  while (std::getline(stream, field, ','))
+  {
+    fields.push_back(field);
+  }
+
+  if (fields.size() < 3 || fields.size() > 4)
+  {
+    throw std::runtime_error("Invalid variant '" + description +
+                             "', expected input,threshold,clean[,thr].");
+  }
+
+  VariantInfo variant;
+  variant.Input = fields[0];
+  variant.Threshold = std::stod(fields[1]);
+  variant.CleanOutput = fields[2];
+  if (fields.size() == 4)
+  {
+    variant.ThresholdOutput = fields[3];
+  }
+  return variant;
+}
+
+// Uncompressed .nii and .mhd files are memory mapped.
+ImageType::Pointer read_image(const std::string& fileName)
+{
+  return MappedImageIO::Read<ImageType>(fileName);
+}
+
+void write_mask(const RunLengthMask& mask, const ImageType* reference,
+                const std::string& fileName)
+{
+  BinaryImageType::Pointer image = BinaryImageType::New();
+  image->CopyInformation(reference);
+  image->SetRegions(reference->GetBufferedRegion());
+  image->Allocate();
+  image->FillBuffer(0);
+
+  const int* size = mask.GetSize();
+  unsigned char* buffer = image->GetBufferPointer();
+  ParallelForSlices(size[2], mask.GetNumberOfThreads(),
+                    [&](int, int first, int end) {
+                      for (int z = first; z < end; ++z)
+                      {
+                        for (int y = 0; y < size[1]; ++y)
+                        {
+                          unsigned char* row =
+                              buffer + (static_cast<size_t>(z) * size[1] + y) *
+                                           size[0];
+                          for (const RunLengthMask::Run& run :
+                               mask.GetRow(y, z))
+                          {
+                            std::fill(row + run.Begin, row + run.End, 1);
+                          }
+                        }
+                      }
+                    });
+
+  MappedImageIO::Write(image.GetPointer(), fileName);
+}
+
+// =============================================================================
+// Threshold every variant in one sweep: each row of the brain mask is read
+// once and the runs of all the variants are built together.
+// =============================================================================
+void threshold_variants(const ImageType* mask,
+                        std::vector<VariantInfo>& variants,
+                        int numberOfThreads)
+{
+  const ImageType::SizeType size = mask->GetBufferedRegion().GetSize();
+  const int nx = size[0];
+  const int ny = size[1];
+  const int nz = size[2];
+
+  std::vector<const float*> buffers;
+  for (unsigned int v = 0; v < variants.size(); ++v)
+  {
+    variants[v].Mask.SetSize(nx, ny, nz);
+    variants[v].Mask.SetNumberOfThreads(numberOfThreads);
+    buffers.push_back(variants[v].Image->GetBufferPointer());
+  }
+  const float* maskBuffer = mask->GetBufferPointer();
+
+  ParallelForSlices(nz, numberOfThreads, [&](int, int first, int end) {
+    for (int z = first; z < end; ++z)
+    {
+      for (int y = 0; y < ny; ++y)
+      {
+        const size_t rowOffset = (static_cast<size_t>(z) * ny + y) * nx;
+        for (unsigned int v = 0; v < variants.size(); ++v)
+        {
+          const float* values = buffers[v] + rowOffset;
+          const float* brain = maskBuffer + rowOffset;
+          const double threshold = variants[v].Threshold;
+          RunLengthMask::RowType& row = variants[v].Mask.GetRow(y, z);
+
+          int x = 0;
+          while (x < nx)
+          {
+            while (x < nx &&
+                   !(brain[x] > 0 && std::abs(values[x]) > threshold))
+            {
+              ++x;
+            }
+            const int begin = x;
+            while (x < nx && brain[x] > 0 && std::abs(values[x]) > threshold)
+            {
+              ++x;
+            }
+            if (begin < x)
+            {
+              row.push_back(RunLengthMask::Run{begin, x});
+            }
+          }
+        }
+      }
+    }
+  });
+}
+
+int main(int argc, char* argv[])
+{
+  boost::program_options::variables_map vm;
+  if (!process_command_line(argc, argv, vm))
+  {
+    return EXIT_FAILURE;
+  }
+
+  int numberOfThreads = vm["threads"].as<int>();
+  if (numberOfThreads <= 0)
+  {
+    numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  }
+  const int connectivity = vm["connectivity"].as<int>();
+  const size_t minimumSize = std::max(0, vm["minimumSize"].as<int>());
+
+  try
+  {
+    const std::vector<std::string> descriptions =
+        vm["variant"].as<std::vector<std::string>>();
+    std::vector<VariantInfo> variants;
+    for (unsigned int v = 0; v < descriptions.size(); ++v)
+    {
+      variants.push_back(parse_variant(descriptions[v]));
+    }
+
+    std::cout << "Reading mask : " << vm["mask"].as<std::string>()
+              << std::endl;
+    ImageType::Pointer mask = read_image(vm["mask"].as<std::string>());
+
+    for (unsigned int v = 0; v < variants.size(); ++v)
+    {
+      std::cout << "Reading input : " << variants[v].Input << std::endl;
+      variants[v].Image = read_image(variants[v].Input);
+      if (variants[v].Image->GetBufferedRegion() !=
+          mask->GetBufferedRegion())
+      {
+        throw std::runtime_error(variants[v].Input +
+                                 " is not on the grid of the mask.");
+      }
+    }
+
+    threshold_variants(mask, variants, numberOfThreads);
+
+    for (unsigned int v = 0; v < variants.size(); ++v)
+    {
+      VariantInfo& variant = variants[v];
+      if (!variant.ThresholdOutput.empty())
+      {
+        write_mask(variant.Mask, mask, variant.ThresholdOutput);
+      }
+      // The input is not needed anymore.
+      variant.Image = nullptr;
+
+      variant.Mask.Close(connectivity);
+      const size_t kept = variant.Mask.RemoveSmallComponents(minimumSize);
+
+      std::cout << variant.CleanOutput << " : " << kept << " clusters, "
+                << variant.Mask.GetNumberOfVoxels() << " voxels."
+                << std::endl;
+      write_mask(variant.Mask, mask, variant.CleanOutput);
+    }
+  }
+  catch (itk::ExceptionObject& err)
+  {
+    std::cerr << "Exception caught: " << err << std::endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::exception& err)
+  {
+    std::cerr << "Error: " << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,159 @@
+#ifndef __itkMultiHistogramThreshold_h
+#define __itkMultiHistogramThreshold_h
+
+#include "itkHistogram.h"
+#include "itkHistogramThresholdCalculator.h"
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// \class MultiHistogramThreshold
+// \brief Several automatic thresholds computed from one shared histogram.
+//
+// The HistogramThresholdImageFilter subclasses (Huang, Otsu, ...) each scan
+// the image to build their own histogram. Here the (optionally masked)
+// histogram is shared by every requested HistogramThresholdCalculator. It
+// takes two parallel passes over the input, as ImageToHistogramFilter does:
+// one for the minimum and maximum (the bin bounds), one for the counts. The
+// binary images of all the methods are then written together in a third
+// pass, instead of two passes per method.
+//
+// The binarisation follows HistogramThresholdImageFilter: voxels below or at
+// the threshold get InsideValue, the others (and the voxels outside the mask)
+// get OutsideValue.
+
+template <typename TInputImage, typename TOutputImage,
+          typename TMaskImage = TOutputImage>
+class MultiHistogramThreshold : public itk::Object
+{
+public:
+  typedef MultiHistogramThreshold Self;
+  typedef itk::Object Superclass;
+
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  itkNewMacro(Self);
+
+  itkTypeMacro(MultiHistogramThreshold, Object);
+
+  typedef TInputImage InputImageType;
+  typedef TOutputImage OutputImageType;
+  typedef TMaskImage MaskImageType;
+
+  typedef typename InputImageType::PixelType InputPixelType;
+  typedef typename OutputImageType::PixelType OutputPixelType;
+  typedef typename MaskImageType::PixelType MaskPixelType;
+
+  typedef itk::Statistics::Histogram<double> HistogramType;
+  typedef itk::HistogramThresholdCalculator<HistogramType, double>
+      CalculatorType;
+
+  typedef std::map<std::string, double> ThresholdMapType;
+  typedef std::map<std::string, typename OutputImageType::Pointer>
+      OutputMapType;
+
+  void SetInput(const InputImageType* input);
+
+  // Only the voxels where the mask is not zero are counted and segmented.
+  void SetMaskImage(const MaskImageType* mask);
+
+  itkSetMacro(NumberOfHistogramBins, unsigned int);
+  itkGetConstMacro(NumberOfHistogramBins, unsigned int);
+
+  itkSetMacro(NumberOfThreads, int);
+  itkGetConstMacro(NumberOfThreads, int);
+
+  itkSetMacro(InsideValue, OutputPixelType);
+  itkGetConstMacro(InsideValue, OutputPixelType);
+
+  itkSetMacro(OutsideValue, OutputPixelType);
+  itkGetConstMacro(OutsideValue, OutputPixelType);
+
+  // Huang, Intermodes, IsoData, KittlerIllingworth, Li, MaximumEntropy,
+  // Moments, Otsu, RenyiEntropy, Shanbhag, Triangle and Yen.
+  static std::vector<std::string> GetAvailableMethods();
+
+  // Request a method by its name. Throws if the name is unknown.
+  void AddMethod(const std::string& name);
+  void ClearMethods();
+
+  // Build the histogram and evaluate every requested method.
+  void Compute();
+
+  // Extrema of the (masked) input, available after Compute().
+  double GetMinimum() const { return m_Minimum; }
+  double GetMaximum() const { return m_Maximum; }
+
+  const HistogramType* GetHistogram() const { return m_Histogram; }
+  const ThresholdMapType& GetThresholds() const { return m_Thresholds; }
+
+  // The binary image of every method, written in a single pass.
+  OutputMapType GenerateSegmentations() const;
+
+protected:
+  MultiHistogramThreshold();
+  ~MultiHistogramThreshold() {}
+
+  void PrintSelf(std::ostream& os, itk::Indent indent) const;
+
+private:
+  MultiHistogramThreshold(const Self&); // purposely not implemented
+  void operator=(const Self&);          // purposely not implemented
+
+  typedef enum
+  {
+    MinimumMaximumPass = 0,
+    HistogramPass = 1,
+    SegmentationPass = 2
+  } PassType;
+
+  // Structure for passing information into the static callback method.
+  struct ThreadStruct
+  {
+    const Self* Filter;
+    PassType Pass;
+    std::vector<double> Minimum;
+    std::vector<double> Maximum;
+    std::vector<std::vector<itk::SizeValueType>> Counts;
+    std::vector<double> Thresholds;
+    std::vector<OutputPixelType*> Outputs;
+  };
+
+  static ITK_THREAD_RETURN_TYPE ThreaderCallback(void* arg);
+
+  void ThreadedPass(ThreadStruct* str, itk::SizeValueType first,
+                    itk::SizeValueType end, int threadId) const;
+
+  void Execute(ThreadStruct& str) const;
+
+  static typename CalculatorType::Pointer
+  MakeCalculator(const std::string& name);
+
+  typename InputImageType::ConstPointer m_Input;
+  typename MaskImageType::ConstPointer m_MaskImage;
+
+  unsigned int m_NumberOfHistogramBins;
+  int m_NumberOfThreads;
+
+  OutputPixelType m_InsideValue;
+  OutputPixelType m_OutsideValue;
+
+  std::vector<std::string> m_Methods;
+
+  double m_Minimum;
+  double m_Maximum;
+  HistogramType::Pointer m_Histogram;
+  ThresholdMapType m_Thresholds;
+};
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkMultiHistogramThreshold.hxx"
+#endif
+
+#endif
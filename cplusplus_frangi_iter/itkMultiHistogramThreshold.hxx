@@ -0,0 +1,377 @@
+#ifndef __itkMultiHistogramThreshold_hxx
+#define __itkMultiHistogramThreshold_hxx
+
+#include "itkMultiHistogramThreshold.h"
+
+#include "itkHuangThresholdCalculator.h"
+#include "itkIntermodesThresholdCalculator.h"
+#include "itkIsoDataThresholdCalculator.h"
+#include "itkKittlerIllingworthThresholdCalculator.h"
+#include "itkLiThresholdCalculator.h"
+#include "itkMaximumEntropyThresholdCalculator.h"
+#include "itkMomentsThresholdCalculator.h"
+#include "itkOtsuThresholdCalculator.h"
+#include "itkRenyiEntropyThresholdCalculator.h"
+#include "itkShanbhagThresholdCalculator.h"
+#include "itkTriangleThresholdCalculator.h"
+#include "itkYenThresholdCalculator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+MultiHistogramThreshold<TInputImage, TOutputImage,
+                        TMaskImage>::MultiHistogramThreshold()
+    : m_NumberOfHistogramBins{100}, m_NumberOfThreads{0},
+      m_InsideValue{itk::NumericTraits<OutputPixelType>::max()},
+      m_OutsideValue{itk::NumericTraits<OutputPixelType>::Zero},
+      m_Minimum{0.0}, m_Maximum{0.0}
+{
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+void MultiHistogramThreshold<TInputImage, TOutputImage, TMaskImage>::SetInput(
+    const InputImageType* input)
+{
+  m_Input = input;
+  this->Modified();
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+void MultiHistogramThreshold<TInputImage, TOutputImage,
+                             TMaskImage>::SetMaskImage(const MaskImageType*
+                                                           mask)
+{
+  m_MaskImage = mask;
+  this->Modified();
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+std::vector<std::string>
+MultiHistogramThreshold<TInputImage, TOutputImage,
+                        TMaskImage>::GetAvailableMethods()
+{
+  const char* names[] = {"Huang",          "Intermodes",
+                         "IsoData",        "KittlerIllingworth",
+                         "Li",             "MaximumEntropy",
+                         "Moments",        "Otsu",
+                         "RenyiEntropy",   "Shanbhag",
+                         "Triangle",       "Yen"};
+  return std::vector<std::string>(names, names + 12);
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+typename MultiHistogramThreshold<TInputImage, TOutputImage,
+                                 TMaskImage>::CalculatorType::Pointer
+MultiHistogramThreshold<TInputImage, TOutputImage,
+                        TMaskImage>::MakeCalculator(const std::string& name)
+{
+  typename CalculatorType::Pointer calculator;
+  if (name == "Huang")
+    calculator = itk::HuangThresholdCalculator<HistogramType, double>::New();
+  else if (name == "Intermodes")
+    calculator =
+        itk::IntermodesThresholdCalculator<HistogramType, double>::New();
+  else if (name == "IsoData")
+    calculator = itk::IsoDataThresholdCalculator<HistogramType, double>::New();
+  else if (name == "KittlerIllingworth")
+    calculator = itk::KittlerIllingworthThresholdCalculator<HistogramType,
+                                                           double>::New();
+  else if (name == "Li")
+    calculator = itk::LiThresholdCalculator<HistogramType, double>::New();
+  else if (name == "MaximumEntropy")
+    calculator =
+        itk::MaximumEntropyThresholdCalculator<HistogramType, double>::New();
+  else if (name == "Moments")
+    calculator = itk::MomentsThresholdCalculator<HistogramType, double>::New();
+  else if (name == "Otsu")
+    calculator = itk::OtsuThresholdCalculator<HistogramType, double>::New();
+  else if (name == "RenyiEntropy")
+    calculator =
+        itk::RenyiEntropyThresholdCalculator<HistogramType, double>::New();
+  else if (name == "Shanbhag")
+    calculator =
+        itk::ShanbhagThresholdCalculator<HistogramType, double>::New();
+  else if (name == "Triangle")
+    calculator =
+        itk::TriangleThresholdCalculator<HistogramType, double>::New();
+  else if (name == "Yen")
+    calculator = itk::YenThresholdCalculator<HistogramType, double>::New();
+  return calculator;
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+void MultiHistogramThreshold<TInputImage, TOutputImage, TMaskImage>::AddMethod(
+    const std::string& name)
+{
+  if (MakeCalculator(name).IsNull())
+  {
+    itkExceptionMacro(<< "Unknown threshold method " << name << ".");
+  }
+  if (std::find(m_Methods.begin(), m_Methods.end(), name) == m_Methods.end())
+  {
+    m_Methods.push_back(name);
+    this->Modified();
+  }
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+void MultiHistogramThreshold<TInputImage, TOutputImage,
+                             TMaskImage>::ClearMethods()
+{
+  m_Methods.clear();
+  this->Modified();
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+ITK_THREAD_RETURN_TYPE
+MultiHistogramThreshold<TInputImage, TOutputImage,
+                        TMaskImage>::ThreaderCallback(void* arg)
+{
+  const auto threadInfo =
+      static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+  const int threadId = threadInfo->ThreadID;
+  const int threadCount = threadInfo->NumberOfThreads;
+  const auto str = static_cast<ThreadStruct*>(threadInfo->UserData);
+
+  const itk::SizeValueType numberOfPixels =
+      str->Filter->m_Input->GetBufferedRegion().GetNumberOfPixels();
+  const itk::SizeValueType first = (numberOfPixels * threadId) / threadCount;
+  const itk::SizeValueType end =
+      (numberOfPixels * (threadId + 1)) / threadCount;
+
+  str->Filter->ThreadedPass(str, first, end, threadId);
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+// =============================================================================
+// One pass over the buffer range [first, end) of the input. The extrema and
+// the bin counts are accumulated per thread and merged afterwards.
+// =============================================================================
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+void MultiHistogramThreshold<TInputImage, TOutputImage,
+                             TMaskImage>::ThreadedPass(ThreadStruct* str,
+                                                       itk::SizeValueType first,
+                                                       itk::SizeValueType end,
+                                                       int threadId) const
+{
+  const InputPixelType* input = m_Input->GetBufferPointer();
+  const MaskPixelType* mask =
+      m_MaskImage.IsNull() ? nullptr : m_MaskImage->GetBufferPointer();
+  const MaskPixelType maskZero = itk::NumericTraits<MaskPixelType>::Zero;
+
+  switch (str->Pass)
+  {
+  case MinimumMaximumPass:
+  {
+    double minimum = std::numeric_limits<double>::max();
+    double maximum = -std::numeric_limits<double>::max();
+    for (itk::SizeValueType i = first; i < end; ++i)
+    {
+      if (mask && mask[i] == maskZero)
+      {
+        continue;
+      }
+      const double value = static_cast<double>(input[i]);
+      minimum = std::min(minimum, value);
+      maximum = std::max(maximum, value);
+    }
+    str->Minimum[threadId] = minimum;
+    str->Maximum[threadId] = maximum;
+    break;
+  }
+  case HistogramPass:
+  {
+    std::vector<itk::SizeValueType>& counts = str->Counts[threadId];
+    counts.assign(m_NumberOfHistogramBins, 0);
+
+    const double lower = m_Histogram->GetBinMin(0, 0);
+    const double binWidth =
+        m_Histogram->GetBinMax(0, 0) - m_Histogram->GetBinMin(0, 0);
+    const long lastBin = m_NumberOfHistogramBins - 1;
+    for (itk::SizeValueType i = first; i < end; ++i)
+    {
+      if (mask && mask[i] == maskZero)
+      {
+        continue;
+      }
+      const long bin = static_cast<long>(
+          std::floor((static_cast<double>(input[i]) - lower) / binWidth));
+      ++counts[std::max(0L, std::min(bin, lastBin))];
+    }
+    break;
+  }
+  case SegmentationPass:
+  {
+    const unsigned int numberOfMethods = str->Outputs.size();
+    for (itk::SizeValueType i = first; i < end; ++i)
+    {
+      if (mask && mask[i] == maskZero)
+      {
+        for (unsigned int m = 0; m < numberOfMethods; ++m)
+        {
+          str->Outputs[m][i] = m_OutsideValue;
+        }
+        continue;
+      }
+      const double value = static_cast<double>(input[i]);
+      for (unsigned int m = 0; m < numberOfMethods; ++m)
+      {
+        str->Outputs[m][i] =
+            value <= str->Thresholds[m] ? m_InsideValue : m_OutsideValue;
+      }
+    }
+    break;
+  }
+  }
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+void MultiHistogramThreshold<TInputImage, TOutputImage, TMaskImage>::Execute(
+    ThreadStruct& str) const
+{
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  if (m_NumberOfThreads > 0)
+  {
+    threader->SetNumberOfThreads(m_NumberOfThreads);
+  }
+  const int numberOfThreads = threader->GetNumberOfThreads();
+
+  str.Filter = this;
+  str.Minimum.resize(numberOfThreads);
+  str.Maximum.resize(numberOfThreads);
+  str.Counts.resize(numberOfThreads);
+
+  threader->SetSingleMethod(ThreaderCallback, &str);
+  threader->SingleMethodExecute();
+}
+
+// =============================================================================
+// Build the shared histogram and evaluate every requested method on it. The
+// bins span [minimum, maximum] with the same small upper margin as
+// ImageToHistogramFilter, so that the maximum falls in the last bin.
+// =============================================================================
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+void MultiHistogramThreshold<TInputImage, TOutputImage, TMaskImage>::Compute()
+{
+  if (m_Input.IsNull())
+  {
+    itkExceptionMacro(<< "Input image is not set. Use SetInput().");
+  }
+  if (m_MaskImage.IsNotNull() &&
+      m_MaskImage->GetBufferedRegion() != m_Input->GetBufferedRegion())
+  {
+    itkExceptionMacro(<< "The mask must have the same region as the input.");
+  }
+  if (m_NumberOfHistogramBins < 1)
+  {
+    itkExceptionMacro(<< "The number of histogram bins must be positive.");
+  }
+
+  ThreadStruct str;
+  str.Pass = MinimumMaximumPass;
+  this->Execute(str);
+
+  m_Minimum = *std::min_element(str.Minimum.begin(), str.Minimum.end());
+  m_Maximum = *std::max_element(str.Maximum.begin(), str.Maximum.end());
+  if (m_Minimum > m_Maximum)
+  {
+    itkExceptionMacro(<< "The mask does not contain any voxel.");
+  }
+
+  double margin = (m_Maximum - m_Minimum) / m_NumberOfHistogramBins / 100.0;
+  if (margin <= 0.0)
+  {
+    margin = 1.0;
+  }
+
+  m_Histogram = HistogramType::New();
+  m_Histogram->SetMeasurementVectorSize(1);
+  typename HistogramType::SizeType size(1);
+  size.Fill(m_NumberOfHistogramBins);
+  typename HistogramType::MeasurementVectorType lower(1);
+  typename HistogramType::MeasurementVectorType upper(1);
+  lower.Fill(m_Minimum);
+  upper.Fill(m_Maximum + margin);
+  m_Histogram->Initialize(size, lower, upper);
+
+  str.Pass = HistogramPass;
+  this->Execute(str);
+
+  for (unsigned int bin = 0; bin < m_NumberOfHistogramBins; ++bin)
+  {
+    itk::SizeValueType count = 0;
+    for (unsigned int t = 0; t < str.Counts.size(); ++t)
+    {
+      count += str.Counts[t].empty() ? 0 : str.Counts[t][bin];
+    }
+    m_Histogram->SetFrequency(bin, count);
+  }
+
+  m_Thresholds.clear();
+  for (unsigned int m = 0; m < m_Methods.size(); ++m)
+  {
+    typename CalculatorType::Pointer calculator = MakeCalculator(m_Methods[m]);
+    calculator->SetInput(m_Histogram);
+    calculator->Update();
+    m_Thresholds[m_Methods[m]] = calculator->GetThreshold();
+
+    itkDebugMacro(<< m_Methods[m] << " threshold: "
+                  << m_Thresholds[m_Methods[m]]);
+  }
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+typename MultiHistogramThreshold<TInputImage, TOutputImage,
+                                 TMaskImage>::OutputMapType
+MultiHistogramThreshold<TInputImage, TOutputImage,
+                        TMaskImage>::GenerateSegmentations() const
+{
+  if (m_Thresholds.size() != m_Methods.size())
+  {
+    itkExceptionMacro(<< "Compute() must be called before "
+                         "GenerateSegmentations().");
+  }
+
+  OutputMapType outputs;
+  ThreadStruct str;
+  str.Pass = SegmentationPass;
+  for (unsigned int m = 0; m < m_Methods.size(); ++m)
+  {
+    typename OutputImageType::Pointer output = OutputImageType::New();
+    output->CopyInformation(m_Input);
+    output->SetRegions(m_Input->GetBufferedRegion());
+    output->Allocate();
+
+    outputs[m_Methods[m]] = output;
+    str.Outputs.push_back(output->GetBufferPointer());
+    str.Thresholds.push_back(m_Thresholds.at(m_Methods[m]));
+  }
+
+  if (!m_Methods.empty())
+  {
+    this->Execute(str);
+  }
+  return outputs;
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+void MultiHistogramThreshold<TInputImage, TOutputImage, TMaskImage>::PrintSelf(
+    std::ostream& os, itk::Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "NumberOfHistogramBins: " << m_NumberOfHistogramBins
+     << std::endl;
+  os << indent << "Minimum: " << m_Minimum << std::endl;
+  os << indent << "Maximum: " << m_Maximum << std::endl;
+  for (typename ThresholdMapType::const_iterator it = m_Thresholds.begin();
+       it != m_Thresholds.end(); ++it)
+  {
+    os << indent << it->first << " threshold: " << it->second << std::endl;
+  }
+}
+
+#endif
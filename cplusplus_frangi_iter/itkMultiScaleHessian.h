@@ -2,11 +2,17 @@
 #define __itkMultiScaleHessian_h
 
 #include "itkVesselnessMeasurement.h"
+#include "itkGaussianCascadeHessian.h"
+#include "itkGaussianDeconvolution.h"
+#include "itkVEDMemoryPlan.h"
+#include "itkSparseScaleStack.h"
 #include "itkImageFileWriter.h"
 
 #include "itkImageToImageFilter.h"
 #include "itkHessianRecursiveGaussianImageFilter.h"
 
+#include <vector>
+
 
 //\class MultiScaleHessian
 // \brief A filter to enhance structures using Hessian eigensystem-based
@@ -81,6 +87,20 @@ public:
   itkSetMacro(NumberOfSigmaSteps, unsigned int);
   itkGetConstMacro(NumberOfSigmaSteps, unsigned int);
 
+  // Adaptive scale search: only this number of log-spaced coarse scales is
+  // computed over the whole volume, and the peak of the response is
+  // interpolated (parabola in log sigma) between the coarse scales around
+  // the best one, where the best response is significant. The scales output
+  // is then continuous. 0 (default) or at least NumberOfSigmaSteps: every
+  // scale is computed.
+  itkSetMacro(NumberOfCoarseScales, unsigned int);
+  itkGetConstMacro(NumberOfCoarseScales, unsigned int);
+
+  // Fraction of the largest best response below which the peak is not
+  // interpolated. 0.01 by default.
+  itkSetMacro(AdaptiveSignificance, double);
+  itkGetConstMacro(AdaptiveSignificance, double);
+
   itkSetMacro(GenerateScalesOutput, bool);
   itkGetConstMacro(GenerateScalesOutput, bool);
   itkBooleanMacro(GenerateScalesOutput);
@@ -89,6 +109,45 @@ public:
   itkGetConstMacro(GenerateHessianOutput, bool);
   itkBooleanMacro(GenerateHessianOutput);
 
+  // Write the Scale_*_Vesselness.nii.gz files of every scale. On by default.
+  itkSetMacro(GenerateScaleFiles, bool);
+  itkGetConstMacro(GenerateScaleFiles, bool);
+  itkBooleanMacro(GenerateScaleFiles);
+
+  // Keep the scale files as sparse stacks, written after the last scale as
+  // Scale_{NOWEINER,processed,rescaled}_stack.vss, in place of one dense
+  // file per scale. Off by default.
+  itkSetMacro(SparseScaleFiles, bool);
+  itkGetConstMacro(SparseScaleFiles, bool);
+  itkBooleanMacro(SparseScaleFiles);
+
+  // Compute the scales in increasing sigma order, each Hessian from the
+  // input smoothed at the previous scale smoothed again with the missing
+  // variance, and finite differences (GaussianCascadeHessian), in place of
+  // HessianRecursiveGaussianImageFilter from the input at every scale. Off
+  // by default.
+  itkSetMacro(GaussianCascade, bool);
+  itkGetConstMacro(GaussianCascade, bool);
+  itkBooleanMacro(GaussianCascade);
+
+  // Deconvolve the vesselness of every scale by a Gaussian of variance
+  // 2 sigma (voxels) before the processed scale files and the best response
+  // (GaussianDeconvolution). The NOWEINER scale files stay raw. Off by
+  // default.
+  itkSetMacro(Deconvolution, bool);
+  itkGetConstMacro(Deconvolution, bool);
+  itkBooleanMacro(Deconvolution);
+
+  // Tikhonov regularization of the deconvolution, 0.01 by default.
+  itkSetMacro(DeconvolutionRegularization, double);
+  itkGetConstMacro(DeconvolutionRegularization, double);
+
+  // Release the Hessian and vesselness images of the last scale once the
+  // best response is known. Off by default.
+  itkSetMacro(ReleaseInternalBuffers, bool);
+  itkGetConstMacro(ReleaseInternalBuffers, bool);
+  itkBooleanMacro(ReleaseInternalBuffers);
+
   // Set/Get HessianToMeasureFilter. This will be a filter that takes
   // Hessian input image and produces enhanced output scalar image. The filter
   // must derive from itk::ImageToImage filter
@@ -146,6 +205,14 @@ public:
   void SetC(double);
   double GetC();
 
+  void SetFrangiKernel(FrangiKernel::KernelType);
+  FrangiKernel::KernelType GetFrangiKernel();
+
+  // Add the buffers allocated by the filter for an image of numberOfPixels.
+  // lastPhase is the last phase the filter itself is kept alive.
+  void AddBuffersToPlan(VEDMemoryPlan* plan, double numberOfPixels,
+                        VEDMemoryPlan::PhaseType lastPhase) const;
+
 protected:
   MultiScaleHessian();
   MultiScaleHessian(const bool nonNeg, double const& sigmaMin,
@@ -157,9 +224,32 @@ protected:
   void GenerateData(void);
 
 private:
+  typedef typename HessianToMeasureFilterType::OutputImageType
+      MeasureImageType;
+
+  // The vesselness of the current scale, deconvolved or not.
+  const MeasureImageType* GetScaleResponse() const;
+
+  // The Hessian of the current scale, of the cascade or not.
+  const HessianImageType* GetScaleHessian() const;
+
+  // Compute the Hessian of a scale into GetScaleHessian().
+  void ComputeHessian(double sigma);
+
   void UpdateMaximumResponse(double sigma);
+  double UpdateMaximumResponse(double sigma, const OutputRegionType& region);
+
+  void WriteScaleFiles(double sigma);
+  void WriteSparseScaleFiles();
 
   double ComputeSigmaValue(int scaleLevel);
+  double ComputeSigmaValue(int scaleLevel, unsigned int numberOfSteps);
+
+  // Number of scales computed over the whole volume.
+  unsigned int GetNumberOfComputedScales() const;
+
+  void AllocateRefinementBuffers();
+  void RefineMaximumResponse();
 
   void AllocateUpdateBuffer();
 
@@ -180,8 +270,39 @@ private:
 
   typename UpdateBufferType::Pointer m_UpdateBuffer;
 
+  // Smallest best response of every block of m_HessianToMeasureFilter.
+  std::vector<double> m_BlockMinimumResponse;
+
+  unsigned int m_NumberOfCoarseScales;
+  double m_AdaptiveSignificance;
+
+  // Adaptive search: the response of the last scale, and the responses of
+  // the scales computed just before and after the best one (NaN if none).
+  typedef itk::Image<float, ImageDimension> RefinementImageType;
+  typename RefinementImageType::Pointer m_LastResponse;
+  typename RefinementImageType::Pointer m_PreviousResponse;
+  typename RefinementImageType::Pointer m_NextResponse;
+
   bool m_GenerateScalesOutput;
   bool m_GenerateHessianOutput;
+  bool m_GenerateScaleFiles;
+  bool m_ReleaseInternalBuffers;
+
+  // Raw, processed and rescaled vesselness of the scales, when the scale
+  // files are sparse.
+  bool m_SparseScaleFiles;
+  SparseScaleStack m_NoWeinerStack;
+  SparseScaleStack m_ProcessedStack;
+  SparseScaleStack m_RescaledStack;
+
+  bool m_GaussianCascade;
+  GaussianCascadeHessian<InputImageType, HessianImageType> m_Cascade;
+  typename HessianImageType::Pointer m_CascadeHessian;
+
+  bool m_Deconvolution;
+  double m_DeconvolutionRegularization;
+  GaussianDeconvolution<MeasureImageType> m_Deconvolver;
+  typename MeasureImageType::Pointer m_DeconvolvedResponse;
 };
 
 #ifndef ITK_MANUAL_INSTANTIATION
@@ -2,21 +2,19 @@
 #define __itkMultiScaleHessian_hxx
 
 #include "itkMultiScaleHessian.h"
+#include "itkFirstTouchAllocator.h"
+#include "itkFusedScalePostProcessingImageFilter.h"
+#include "itkStageTimer.h"
 
 #include "itkImageRegionIterator.h"
 #include "itkCastImageFilter.h"
-#include "itkThresholdImageFilter.h"
-#include "itkInverseDeconvolutionImageFilter.h"
-#include "itkProjectedLandweberDeconvolutionImageFilter.h"
-#include "itkParametricBlindLeastSquaresDeconvolutionImageFilter.h"
-#include "itkRichardsonLucyDeconvolutionImageFilter.h"
-#include "itkIterativeDeconvolutionImageFilter.h"
-#include "itkLaplacianSharpeningImageFilter.h"
-#include "itkDiscreteGaussianImageFilter.h"
-#include "itkRescaleIntensityImageFilter.h"
-#include "itkSqrtImageFilter.h"
 #include "vnl/vnl_math.h"
 
+#include <cmath>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+
 
 template <typename TInputImage, typename THessianImage, typename TOutputImage>
 MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::MultiScaleHessian()
@@ -34,7 +32,11 @@ MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::MultiScaleHessian(
     : m_NonNegativeHessianBasedMeasure{nonNeg}, m_SigmaMinimum{sigmaMin},
       m_SigmaMaximum{sigmaMax}, m_NumberOfSigmaSteps{nbSigma},
       m_GenerateScalesOutput{generateScale},
-      m_GenerateHessianOutput{generateHessian}
+      m_GenerateHessianOutput{generateHessian}, m_GenerateScaleFiles{true},
+      m_ReleaseInternalBuffers{false}, m_NumberOfCoarseScales{0},
+      m_AdaptiveSignificance{0.01}, m_SparseScaleFiles{false},
+      m_GaussianCascade{false}, m_Deconvolution{false},
+      m_DeconvolutionRegularization{0.01}
 {
 
   m_SigmaStepMethod = Self::LogarithmicSigmaSteps;
@@ -85,17 +87,37 @@ void MultiScaleHessian<TInputImage, THessianImage,
   m_UpdateBuffer->CopyInformation(output);
   m_UpdateBuffer->SetRequestedRegion(output->GetRequestedRegion());
   m_UpdateBuffer->SetBufferedRegion(output->GetBufferedRegion());
-  m_UpdateBuffer->Allocate();
 
   // Update buffer is used for > comparisons.
-  if (m_NonNegativeHessianBasedMeasure)
-  {
-    m_UpdateBuffer->FillBuffer(itk::NumericTraits<BufferValueType>::Zero);
-  }
-  else
+  FirstTouchAllocator::Allocate(
+      m_UpdateBuffer.GetPointer(),
+      m_NonNegativeHessianBasedMeasure
+          ? itk::NumericTraits<BufferValueType>::Zero
+          : itk::NumericTraits<BufferValueType>::NonpositiveMin(),
+      this->GetNumberOfThreads());
+
+  // Set again by the first UpdateMaximumResponse.
+  m_BlockMinimumResponse.clear();
+}
+
+template <typename TInputImage, typename THessianImage, typename TOutputImage>
+void MultiScaleHessian<TInputImage, THessianImage,
+                       TOutputImage>::AllocateRefinementBuffers()
+{
+  typename TOutputImage::Pointer output = this->GetOutput();
+
+  typename RefinementImageType::Pointer* buffers[] = {
+      &m_LastResponse, &m_PreviousResponse, &m_NextResponse};
+  for (unsigned int b = 0; b < 3; ++b)
   {
-    m_UpdateBuffer->FillBuffer(
-        itk::NumericTraits<BufferValueType>::NonpositiveMin());
+    typename RefinementImageType::Pointer& buffer = *buffers[b];
+    buffer = RefinementImageType::New();
+    buffer->CopyInformation(output);
+    buffer->SetRequestedRegion(output->GetRequestedRegion());
+    buffer->SetBufferedRegion(output->GetBufferedRegion());
+    FirstTouchAllocator::Allocate(buffer.GetPointer(),
+                                  std::numeric_limits<float>::quiet_NaN(),
+                                  this->GetNumberOfThreads());
   }
 }
 
@@ -180,6 +202,20 @@ double MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::GetC()
   return m_HessianToMeasureFilter->GetC();
 }
 
+template <class TInputImage, class THessianImage, class TOutputImage>
+void MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::
+    SetFrangiKernel(FrangiKernel::KernelType value)
+{
+  m_HessianToMeasureFilter->SetFrangiKernel(value);
+}
+
+template <class TInputImage, class THessianImage, class TOutputImage>
+FrangiKernel::KernelType
+MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::GetFrangiKernel()
+{
+  return m_HessianToMeasureFilter->GetFrangiKernel();
+}
+
 // =============================================================================
 // Called by the getoutput into
 // AnisotropicDiffusionVesselEnhancementImageFilter. This generates a
@@ -188,8 +224,12 @@ double MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::GetC()
 template <typename TInputImage, typename THessianImage, typename TOutputImage>
 void MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::GenerateData()
 {
+  StageTimerScope allocateTimer("MultiScaleHessian::Allocate");
+
   this->GetOutput()->SetBufferedRegion(this->GetOutput()->GetRequestedRegion());
-  this->GetOutput()->Allocate();
+  FirstTouchAllocator::Allocate(this->GetOutput(), OutputPixelType(),
+                                this->GetNumberOfThreads());
+  allocateTimer.AddBytesAllocated(StageTimer::ImageBytes(this->GetOutput()));
 
   if (m_HessianToMeasureFilter.IsNull())
   {
@@ -203,47 +243,159 @@ void MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::GenerateData()
         dynamic_cast<ScalesImageType*>(this->itk::ProcessObject::GetOutput(1));
 
     scalesImage->SetBufferedRegion(scalesImage->GetRequestedRegion());
-    scalesImage->Allocate(true);
+    FirstTouchAllocator::Allocate(
+        scalesImage.GetPointer(),
+        itk::NumericTraits<typename ScalesImageType::PixelType>::Zero,
+        this->GetNumberOfThreads());
+    allocateTimer.AddBytesAllocated(
+        StageTimer::ImageBytes(scalesImage.GetPointer()));
   }
 
   typename HessianImageType::Pointer hessianImage =
       dynamic_cast<HessianImageType*>(this->itk::ProcessObject::GetOutput(2));
 
   hessianImage->SetBufferedRegion(hessianImage->GetRequestedRegion());
-  hessianImage->Allocate();
+  typename HessianImageType::PixelType zeroHessian;
+  zeroHessian.Fill(0.0);
+  FirstTouchAllocator::Allocate(hessianImage.GetPointer(), zeroHessian,
+                                this->GetNumberOfThreads());
+  allocateTimer.AddBytesAllocated(
+      StageTimer::ImageBytes(hessianImage.GetPointer()));
 
   AllocateUpdateBuffer();
+  allocateTimer.AddBytesAllocated(
+      StageTimer::ImageBytes(m_UpdateBuffer.GetPointer()));
+  const unsigned int numberOfComputedScales =
+      this->GetNumberOfComputedScales();
+  if (numberOfComputedScales < m_NumberOfSigmaSteps)
+  {
+    AllocateRefinementBuffers();
+    allocateTimer.AddBytesAllocated(
+        3 * StageTimer::ImageBytes(m_LastResponse.GetPointer()));
+  }
+  if (m_GaussianCascade)
+  {
+    // The Hessian of the cascade, on the region of the smoothed input.
+    m_CascadeHessian = HessianImageType::New();
+    m_CascadeHessian->CopyInformation(this->GetInput());
+    m_CascadeHessian->SetRegions(this->GetInput()->GetLargestPossibleRegion());
+    FirstTouchAllocator::Allocate(m_CascadeHessian.GetPointer(), zeroHessian,
+                                  this->GetNumberOfThreads());
+    allocateTimer.AddBytesAllocated(
+        StageTimer::ImageBytes(m_CascadeHessian.GetPointer()));
+  }
+  else
+  {
+    m_CascadeHessian = nullptr;
+  }
+  if (m_Deconvolution && numberOfComputedScales > 0)
+  {
+    const OutputRegionType region = this->GetOutput()->GetBufferedRegion();
+    m_DeconvolvedResponse = MeasureImageType::New();
+    m_DeconvolvedResponse->CopyInformation(this->GetOutput());
+    m_DeconvolvedResponse->SetRequestedRegion(region);
+    m_DeconvolvedResponse->SetBufferedRegion(region);
+    FirstTouchAllocator::Allocate(
+        m_DeconvolvedResponse.GetPointer(),
+        itk::NumericTraits<typename MeasureImageType::PixelType>::Zero,
+        this->GetNumberOfThreads());
+    allocateTimer.AddBytesAllocated(
+        StageTimer::ImageBytes(m_DeconvolvedResponse.GetPointer()));
+
+    // The FFT size and the spectra are kept from the previous iterations.
+    m_Deconvolver.SetRegularization(m_DeconvolutionRegularization);
+    m_Deconvolver.SetNonNegative(m_NonNegativeHessianBasedMeasure);
+    m_Deconvolver.SetNumberOfThreads(this->GetNumberOfThreads());
+    m_Deconvolver.SetSpacing(this->GetOutput()->GetSpacing());
+    m_Deconvolver.Initialize(region, std::max(m_SigmaMinimum, m_SigmaMaximum));
+  }
+  else
+  {
+    m_DeconvolvedResponse = nullptr;
+  }
+  allocateTimer.Stop();
+
+  if (m_GenerateScaleFiles && m_SparseScaleFiles)
+  {
+    const TOutputImage* output = this->GetOutput();
+    int size[ImageDimension];
+    double spacing[ImageDimension];
+    double origin[ImageDimension];
+    double direction[ImageDimension * ImageDimension];
+    for (unsigned int i = 0; i < ImageDimension; ++i)
+    {
+      size[i] = output->GetBufferedRegion().GetSize()[i];
+      spacing[i] = output->GetSpacing()[i];
+      origin[i] = output->GetOrigin()[i];
+      for (unsigned int j = 0; j < ImageDimension; ++j)
+      {
+        direction[i * ImageDimension + j] = output->GetDirection()[i][j];
+      }
+    }
+    SparseScaleStack* stacks[3] = {&m_NoWeinerStack, &m_ProcessedStack,
+                                   &m_RescaledStack};
+    for (unsigned int s = 0; s < 3; ++s)
+    {
+      stacks[s]->SetGeometry(size, spacing, origin, direction);
+      stacks[s]->SetNumberOfThreads(this->GetNumberOfThreads());
+    }
+  }
+
   typename InputImageType::ConstPointer input = this->GetInput();
 
   this->m_HessianFilter->SetInput(input);
   this->m_HessianFilter->SetNormalizeAcrossScale(false);
+  m_Cascade.SetInput(input);
+  m_Cascade.SetNumberOfThreads(this->GetNumberOfThreads());
 
   // Create a process accumulator for tracking the progress of this
   // minipipeline
   itk::ProgressAccumulator::Pointer progress = itk::ProgressAccumulator::New();
   progress->SetMiniPipelineFilter(this);
 
-  if (m_NumberOfSigmaSteps > 0)
+  if (numberOfComputedScales > 0)
   {
-    const double filterStep = 0.5 / m_NumberOfSigmaSteps;
+    const double filterStep = 0.5 / numberOfComputedScales;
     progress->RegisterInternalFilter(this->m_HessianFilter, filterStep);
     progress->RegisterInternalFilter(this->m_HessianToMeasureFilter,
                                      filterStep);
   }
 
 
-  int scalemax= m_NumberOfSigmaSteps-1 ;
-  for (int scaleLevel = scalemax; scaleLevel >= 0;
-       --scaleLevel)
+  const double numberOfPixels =
+      this->GetOutput()->GetBufferedRegion().GetNumberOfPixels();
+
+  // From the largest scale down, or up from the smallest one for the
+  // cascade.
+  const int scalemax = numberOfComputedScales - 1;
+  for (int step = 0; step <= scalemax; ++step)
   {
-    const double sigma = this->ComputeSigmaValue(scaleLevel);
+    const int scaleLevel = m_GaussianCascade ? step : scalemax - step;
+    const double sigma =
+        this->ComputeSigmaValue(scaleLevel, numberOfComputedScales);
 
     std::cout
         << "(In MultiScaleHessian) Computing measure for scale with sigma = "
         << sigma << std::endl;
 
-    m_HessianFilter->SetSigma(sigma);
-    m_HessianToMeasureFilter->SetInput(m_HessianFilter->GetOutput());
+    StageTimerScope scaleTimer("MultiScaleHessian::Scale", numberOfPixels);
+    scaleTimer.SetArgument("sigma", sigma);
+
+    {
+      std::ostringstream stageName;
+      stageName << "MultiScaleHessian::Hessian[sigma=" << std::fixed
+                << std::setprecision(4) << sigma << "]";
+      StageTimerScope timer(stageName.str(), numberOfPixels);
+      timer.SetArgument("sigma", sigma);
+      this->ComputeHessian(sigma);
+      if (step == 0 && !m_GaussianCascade)
+      {
+        // The Hessian buffer is reused by the next scales.
+        timer.AddBytesAllocated(
+            StageTimer::ImageBytes(m_HessianFilter->GetOutput()));
+      }
+    }
+    m_HessianToMeasureFilter->SetInput(this->GetScaleHessian());
 
     /*
     m_HessianToMeasureFilter->GetFlippedHessian()->SetSpacing(this->GetOutput()->GetSpacing());
@@ -256,154 +408,56 @@ void MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::GenerateData()
     */
 
     std::cout << "..doing first pass to obtain strongest Lambda per scale" << std::endl ; 
-    m_HessianToMeasureFilter->FirstPassOn();
-    m_HessianToMeasureFilter->Update(); //First pass to update strongest Lambda3
+    {
+      StageTimerScope timer("VesselnessMeasurement::FirstPass", numberOfPixels);
+      timer.SetArgument("sigma", sigma);
+      m_HessianToMeasureFilter->FirstPassOn();
+      m_HessianToMeasureFilter->Update(); //First pass to update strongest Lambda3
+    }
     
     std::cout << "..doing second pass to compute regularized vesselness" << std::endl ; 
-    m_HessianToMeasureFilter->FirstPassOff();
-    m_HessianToMeasureFilter->Update();
-
-    typedef itk::Image<double, ImageDimension> doubleImageType;
-   
-
-    //WRITE OUTPUT TO FILE
-    std::string sig = std::to_string(int(sigma*100000));
-    std::string padded_sig = sig.insert(0,7-sig.length(), '0');
-    
-    typedef itk::Image<float, ImageDimension> floatImageType;
-    typedef itk::ImageFileWriter<floatImageType> ImageWriterType;
-    typedef itk::CastImageFilter< doubleImageType, floatImageType > CastFilterType;
-    typename CastFilterType::Pointer castFilterFirst = CastFilterType::New();
-    castFilterFirst->SetInput(m_HessianToMeasureFilter->GetOutput());
- 
-    typename ImageWriterType::Pointer writerfirst = ImageWriterType::New();
-    writerfirst->SetFileName("Scale_NOWEINER_" + padded_sig + "_Vesselness.nii.gz");
-    writerfirst->SetInput(castFilterFirst->GetOutput());
-    writerfirst->Update();
-    //////////////////////
-
-    /*//////////////
-    const unsigned int vectorlength = 6; 
-    typedef itk::Vector<double, vectorlength> EigenVectorType;
-    typedef itk::Image<EigenVectorType, ImageDimension> newHessianImageType;
-    typedef itk::ImageFileWriter<newHessianImageType> ImageVectorWriterType;
-    typename ImageVectorWriterType::Pointer writerVec = ImageVectorWriterType::New();
-    writerVec->SetFileName("Hessian_" + padded_sig + "__D11_D22_D33_D12_D13_D23.nii.gz");
-    writerVec->SetInput(m_HessianToMeasureFilter->GetFlippedHessian());
-    writerVec->Update();
-    //////////////*/
-
-  
-    //APPLY A CONVOLUTION FILTER TO REVERSE THE SMOOTHING EFFECT (maybe try weiner)
-    typedef itk::ProjectedLandweberDeconvolutionImageFilter<doubleImageType>  InverseFilterImageType;
-    //typedef itk::RichardsonLucyDeconvolutionImageFilter<doubleImageType>  InverseFilterImageType;
-    
-    typename  InverseFilterImageType::Pointer InverseFilterType =  InverseFilterImageType::New();
-    
-    typename doubleImageType::Pointer gaussKernel = doubleImageType::New();
-    typename doubleImageType::IndexType start;
-      start.Fill(0);
-    typename doubleImageType::SizeType size;
-      int sizeodd = 2 * ( (int)( 9*sigma / 2.0f ) ) + 1 ; //9 times.. might be 3 or 6
-      sizeodd = vnl_math_max(7, sizeodd);
-      std::cout << "..filter size is: " << std::to_string(sizeodd) << std::endl ; 
-      size.Fill(sizeodd);
-    typename doubleImageType::RegionType region;
-      region.SetSize(size);
-      region.SetIndex(start);
-    typename doubleImageType::IndexType pixelIndex;
-      pixelIndex[0] = (size[0]-1)/2;
-      pixelIndex[1] = (size[1]-1)/2;
-      pixelIndex[2] = (size[2]-1)/2;
-
-    gaussKernel->SetRegions(region);
-    //gaussKernel->SetOrigin(this->GetInput()->GetOrigin());
-    //gaussKernel->SetSpacing(this->GetInput()->GetSpacing());
-    gaussKernel->Allocate();
-    gaussKernel->SetPixel(pixelIndex, 1.0);
-    gaussKernel->Update();
-  
-    typedef itk::DiscreteGaussianImageFilter<doubleImageType, doubleImageType> gaussBlurType;
-    typename gaussBlurType::Pointer blurfilter = gaussBlurType::New();
-    blurfilter->SetInput( gaussKernel );
-    blurfilter->SetVariance( 2.0*sigma );
-    blurfilter->SetMaximumKernelWidth( sizeodd );
-    blurfilter->Update();
-
-    typedef itk::ThresholdImageFilter <doubleImageType> ThresholdImageFilterType;
-    typename ThresholdImageFilterType::Pointer thresholdBelow  = ThresholdImageFilterType::New();
-    if (sigma >= 99.35) //deconvolution relevant here
     {
-      std::cout << "..deconvolve the scale with a R-L filter" << std::endl ; 
-      InverseFilterType->SetInput(m_HessianToMeasureFilter->GetOutput());
-      InverseFilterType->SetKernelImage(blurfilter->GetOutput());
-      InverseFilterType->Update();
-
-      thresholdBelow->SetInput(InverseFilterType->GetOutput());
+      StageTimerScope timer("VesselnessMeasurement::SecondPass",
+                            numberOfPixels);
+      timer.SetArgument("sigma", sigma);
+      m_HessianToMeasureFilter->FirstPassOff();
+      m_HessianToMeasureFilter->Update();
     }
-    else
+
+    if (m_DeconvolvedResponse.IsNotNull())
     {
-      thresholdBelow->SetInput(m_HessianToMeasureFilter->GetOutput());
+      std::cout << "..deconvolving the scale" << std::endl;
+      StageTimerScope timer("MultiScaleHessian::Deconvolution",
+                            numberOfPixels);
+      timer.SetArgument("sigma", sigma);
+      m_Deconvolver.Deconvolve(m_HessianToMeasureFilter->GetOutput(), sigma,
+                               m_DeconvolvedResponse);
     }
-    thresholdBelow->ThresholdBelow(0.0001);
-    thresholdBelow->SetOutsideValue(0);
 
+    if (m_GenerateScaleFiles)
+    {
+      this->WriteScaleFiles(sigma);
+    }
 
-//Ignore above, it gives crappy results for Clarity
-    
-    /*
-    typedef itk::ThresholdImageFilter <doubleImageType> ThresholdImageFilterType;
-    typename ThresholdImageFilterType::Pointer thresholdBelow  = ThresholdImageFilterType::New();
-    thresholdBelow->SetInput(m_HessianToMeasureFilter->GetOutput());
-    thresholdBelow->ThresholdBelow(0.0001);
-    thresholdBelow->SetOutsideValue(0);*/
+    StageTimerScope timer("MultiScaleHessian::UpdateMaximumResponse",
+                          numberOfPixels);
+    timer.SetArgument("sigma", sigma);
+    this->UpdateMaximumResponse(sigma);
+  }
 
+  // The smoothed volume of the last scale, and the input.
+  m_Cascade.SetInput(nullptr);
 
-    /*typename ThresholdImageFilterType::Pointer thresholdUpper  = ThresholdImageFilterType::New();
-    thresholdUpper->SetInput(thresholdBelow->GetOutput());
-    thresholdUpper->ThresholdAbove(1.0);
-    thresholdUpper->SetOutsideValue(1.0);*/
+  if (m_LastResponse.IsNotNull())
+  {
+    StageTimerScope timer("MultiScaleHessian::RefineMaximumResponse",
+                          numberOfPixels);
+    this->RefineMaximumResponse();
+  }
 
-    typedef itk::LaplacianSharpeningImageFilter <doubleImageType, doubleImageType> LaplacianSharpeningFilterType;
-    typename LaplacianSharpeningFilterType::Pointer sharpened  = LaplacianSharpeningFilterType::New();
-    sharpened->SetInput(thresholdBelow->GetOutput());
-    
-    //WRITE OUTPUT TO FILE
-    typename CastFilterType::Pointer castFilter = CastFilterType::New();
-    castFilter->SetInput(sharpened->GetOutput());
- 
-    typename ImageWriterType::Pointer writer = ImageWriterType::New();
-    writer->SetFileName("Scale_processed_" + padded_sig + "_Vesselness.nii.gz");
-    writer->SetInput(castFilter->GetOutput());
-    writer->Update();
-    //////////////////////
-    
-    
-    typedef itk::SqrtImageFilter<doubleImageType,doubleImageType> SqrtFilterType;
-    typename SqrtFilterType::Pointer sqrter = SqrtFilterType::New();
-    sqrter->SetInput(sharpened->GetOutput());
-    
-    //typedef itk::ThresholdImageFilter <doubleImageType> ThresholdImageFilterType;
-    typename ThresholdImageFilterType::Pointer thresholdUpper  = ThresholdImageFilterType::New();
-    thresholdUpper->SetInput(sqrter->GetOutput());
-    thresholdUpper->ThresholdAbove(20.0);
-    thresholdUpper->SetOutsideValue(20.0);
-    
-    typedef itk::RescaleIntensityImageFilter<doubleImageType> RescaleFilterType;
-    typename RescaleFilterType::Pointer rescaler = RescaleFilterType::New();
-    rescaler->SetOutputMinimum(   0 );
-    rescaler->SetOutputMaximum( 1000 );
-    rescaler->SetInput(thresholdUpper->GetOutput());
-    
-    
-    //WRITE OUTPUT TO FILE
-    castFilter->SetInput(rescaler->GetOutput());
-    writer->SetFileName("Scale_rescaled_" + padded_sig + "_Vesselness.nii.gz");
-    writer->SetInput(castFilter->GetOutput());
-    writer->Update();
-    //////////////////////
-  
-    this->UpdateMaximumResponse(sigma);
+  if (m_GenerateScaleFiles && m_SparseScaleFiles)
+  {
+    this->WriteSparseScaleFiles();
   }
 
   // Write out the best response to the output image.
@@ -423,9 +477,284 @@ void MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::GenerateData()
     ++itUpdate;
   }
   m_UpdateBuffer->ReleaseData();
+
+  if (m_ReleaseInternalBuffers)
+  {
+    m_HessianFilter->GetOutput()->ReleaseData();
+    m_HessianToMeasureFilter->GetOutput()->ReleaseData();
+    m_DeconvolvedResponse = nullptr;
+    m_Deconvolver.ReleaseBuffers();
+    m_CascadeHessian = nullptr;
+  }
+}
+
+template <typename TInputImage, typename THessianImage, typename TOutputImage>
+void MultiScaleHessian<TInputImage, THessianImage,
+                       TOutputImage>::ComputeHessian(double sigma)
+{
+  if (m_CascadeHessian.IsNotNull())
+  {
+    m_Cascade.Compute(sigma, m_CascadeHessian);
+  }
+  else
+  {
+    m_HessianFilter->SetSigma(sigma);
+    m_HessianFilter->Update();
+  }
+}
+
+template <typename TInputImage, typename THessianImage, typename TOutputImage>
+const typename MultiScaleHessian<TInputImage, THessianImage,
+                                 TOutputImage>::HessianImageType*
+MultiScaleHessian<TInputImage, THessianImage,
+                  TOutputImage>::GetScaleHessian() const
+{
+  if (m_CascadeHessian.IsNotNull())
+  {
+    return m_CascadeHessian;
+  }
+  return m_HessianFilter->GetOutput();
+}
+
+template <typename TInputImage, typename THessianImage, typename TOutputImage>
+const typename MultiScaleHessian<TInputImage, THessianImage,
+                                 TOutputImage>::MeasureImageType*
+MultiScaleHessian<TInputImage, THessianImage,
+                  TOutputImage>::GetScaleResponse() const
+{
+  if (m_DeconvolvedResponse.IsNotNull())
+  {
+    return m_DeconvolvedResponse;
+  }
+  return m_HessianToMeasureFilter->GetOutput();
 }
 
 
+// =============================================================================
+// Write the vesselness of one scale, raw, sharpened and rescaled.
+// =============================================================================
+template <typename TInputImage, typename THessianImage, typename TOutputImage>
+void MultiScaleHessian<TInputImage, THessianImage,
+                       TOutputImage>::WriteScaleFiles(double sigma)
+{
+  const double numberOfPixels =
+      this->GetOutput()->GetBufferedRegion().GetNumberOfPixels();
+
+  StageTimerScope scaleFilesTimer("MultiScaleHessian::ScaleFiles",
+                                  numberOfPixels);
+  scaleFilesTimer.SetArgument("sigma", sigma);
+
+  typedef itk::Image<double, ImageDimension> doubleImageType;
+ 
+
+  //WRITE OUTPUT TO FILE
+  std::string sig = std::to_string(int(sigma*100000));
+  std::string padded_sig = sig.insert(0,7-sig.length(), '0');
+  
+  typedef itk::Image<float, ImageDimension> floatImageType;
+  typedef itk::ImageFileWriter<floatImageType> ImageWriterType;
+  typedef itk::CastImageFilter< doubleImageType, floatImageType > CastFilterType;
+  typename CastFilterType::Pointer castFilterFirst = CastFilterType::New();
+  castFilterFirst->SetInput(m_HessianToMeasureFilter->GetOutput());
+ 
+  if (m_SparseScaleFiles)
+  {
+    m_NoWeinerStack.AddScale(
+        sigma, m_HessianToMeasureFilter->GetOutput()->GetBufferPointer());
+  }
+  else
+  {
+    typename ImageWriterType::Pointer writerfirst = ImageWriterType::New();
+    writerfirst->SetFileName("Scale_NOWEINER_" + padded_sig +
+                             "_Vesselness.nii.gz");
+    writerfirst->SetInput(castFilterFirst->GetOutput());
+    writerfirst->Update();
+    scaleFilesTimer.AddFileWritten(writerfirst->GetFileName());
+  }
+  //////////////////////
+
+  /*//////////////
+  const unsigned int vectorlength = 6; 
+  typedef itk::Vector<double, vectorlength> EigenVectorType;
+  typedef itk::Image<EigenVectorType, ImageDimension> newHessianImageType;
+  typedef itk::ImageFileWriter<newHessianImageType> ImageVectorWriterType;
+  typename ImageVectorWriterType::Pointer writerVec = ImageVectorWriterType::New();
+  writerVec->SetFileName("Hessian_" + padded_sig + "__D11_D22_D33_D12_D13_D23.nii.gz");
+  writerVec->SetInput(m_HessianToMeasureFilter->GetFlippedHessian());
+  writerVec->Update();
+  //////////////*/
+
+
+  // Threshold, sharpening, square root, clamp and rescale in two sweeps, of
+  // the deconvolved vesselness in the deconvolution mode.
+  typedef FusedScalePostProcessingImageFilter<doubleImageType, floatImageType>
+      PostProcessingFilterType;
+  typename PostProcessingFilterType::Pointer postProcessing =
+      PostProcessingFilterType::New();
+  postProcessing->SetNumberOfThreads(this->GetNumberOfThreads());
+  postProcessing->SetInput(this->GetScaleResponse());
+  postProcessing->SetLowerThreshold(0.0001);
+  postProcessing->SetUpperThreshold(20.0);
+  postProcessing->SetOutputMinimum(0);
+  postProcessing->SetOutputMaximum(1000);
+  postProcessing->Update();
+
+  //WRITE OUTPUT TO FILE
+  if (m_SparseScaleFiles)
+  {
+    m_ProcessedStack.AddScale(
+        sigma, postProcessing->GetProcessedOutput()->GetBufferPointer());
+    m_RescaledStack.AddScale(
+        sigma, postProcessing->GetRescaledOutput()->GetBufferPointer());
+    return;
+  }
+
+  typename ImageWriterType::Pointer writer = ImageWriterType::New();
+  writer->SetFileName("Scale_processed_" + padded_sig + "_Vesselness.nii.gz");
+  writer->SetInput(postProcessing->GetProcessedOutput());
+  writer->Update();
+  scaleFilesTimer.AddFileWritten(writer->GetFileName());
+
+  writer->SetFileName("Scale_rescaled_" + padded_sig + "_Vesselness.nii.gz");
+  writer->SetInput(postProcessing->GetRescaledOutput());
+  writer->Update();
+  scaleFilesTimer.AddFileWritten(writer->GetFileName());
+  //////////////////////
+}
+
+// =============================================================================
+// Write the sparse stacks of the scale files, in increasing sigma order.
+// =============================================================================
+template <typename TInputImage, typename THessianImage, typename TOutputImage>
+void MultiScaleHessian<TInputImage, THessianImage,
+                       TOutputImage>::WriteSparseScaleFiles()
+{
+  StageTimerScope timer(
+      "MultiScaleHessian::SparseScaleFiles",
+      this->GetOutput()->GetBufferedRegion().GetNumberOfPixels());
+
+  const char* names[3] = {"Scale_NOWEINER_stack.vss",
+                          "Scale_processed_stack.vss",
+                          "Scale_rescaled_stack.vss"};
+  SparseScaleStack* stacks[3] = {&m_NoWeinerStack, &m_ProcessedStack,
+                                 &m_RescaledStack};
+  for (unsigned int s = 0; s < 3; ++s)
+  {
+    const SparseScaleStack& stack = *stacks[s];
+    size_t values = 0;
+    for (unsigned int scale = 0; scale < stack.GetNumberOfScales(); ++scale)
+    {
+      values += stack.GetNumberOfValues(scale);
+    }
+    std::cout << "..writing " << names[s] << ": " << stack.GetNumberOfScales()
+              << " scales, "
+              << 100.0 * values /
+                     std::max<double>(1.0, stack.GetNumberOfScales() *
+                                               stack.GetNumberOfVoxels())
+              << "% non-zero, " << stack.GetMemorySize() / 1048576.0
+              << " MiB" << std::endl;
+    try
+    {
+      stack.Write(names[s]);
+    }
+    catch (const std::exception& e)
+    {
+      itkExceptionMacro(<< e.what());
+    }
+    timer.AddFileWritten(names[s]);
+    stacks[s]->Clear();
+  }
+}
+
+// =============================================================================
+// Buffers of the multi-scale analysis, for the memory plan.
+// =============================================================================
+template <typename TInputImage, typename THessianImage, typename TOutputImage>
+void MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::
+    AddBuffersToPlan(VEDMemoryPlan* plan, double numberOfPixels,
+                     VEDMemoryPlan::PhaseType lastPhase) const
+{
+  typedef typename HessianFilterType::OutputImageType::PixelType
+      HessianPixelType;
+  typedef typename HessianToMeasureFilterType::OutputImageType::PixelType
+      MeasurePixelType;
+  typedef typename itk::NumericTraits<InputPixelType>::RealType RealType;
+
+  const VEDMemoryPlan::PhaseType scaleLastPhase =
+      m_ReleaseInternalBuffers ? VEDMemoryPlan::ScaleFilesPhase : lastPhase;
+
+  plan->AddBuffer("best vesselness", numberOfPixels * sizeof(OutputPixelType),
+                  VEDMemoryPlan::HessianPhase, lastPhase);
+  plan->AddBuffer("best Hessian",
+                  numberOfPixels * sizeof(typename HessianImageType::PixelType),
+                  VEDMemoryPlan::HessianPhase,
+                  m_GenerateHessianOutput ? VEDMemoryPlan::PostPhase
+                                          : lastPhase);
+  if (m_GenerateScalesOutput)
+  {
+    plan->AddBuffer("best scale", numberOfPixels * sizeof(ScalesPixelType),
+                    VEDMemoryPlan::HessianPhase, VEDMemoryPlan::PostPhase);
+  }
+  plan->AddBuffer("multi-scale update buffer",
+                  numberOfPixels * sizeof(BufferValueType),
+                  VEDMemoryPlan::HessianPhase, VEDMemoryPlan::ScaleFilesPhase);
+
+  if (this->GetNumberOfComputedScales() < m_NumberOfSigmaSteps)
+  {
+    // Last, previous and next responses of the adaptive search.
+    plan->AddBuffer("adaptive scale refinement",
+                    3 * numberOfPixels * sizeof(float),
+                    VEDMemoryPlan::HessianPhase, VEDMemoryPlan::HessianPhase);
+  }
+
+  if (m_GaussianCascade)
+  {
+    // The smoothed volume kept between the scales, the next one and the
+    // intermediate image of the separable smoothing.
+    plan->AddBuffer("Gaussian cascade", 3 * numberOfPixels * sizeof(double),
+                    VEDMemoryPlan::HessianPhase, VEDMemoryPlan::HessianPhase);
+  }
+  else
+  {
+    // The recursive Gaussian filters keep about two real images while the
+    // Hessian of a scale is computed.
+    plan->AddBuffer("Hessian smoothing",
+                    2 * numberOfPixels * sizeof(RealType),
+                    VEDMemoryPlan::HessianPhase, VEDMemoryPlan::HessianPhase);
+  }
+  plan->AddBuffer("Hessian of the scale",
+                  numberOfPixels * sizeof(HessianPixelType),
+                  VEDMemoryPlan::HessianPhase, scaleLastPhase);
+  plan->AddBuffer("vesselness of the scale",
+                  numberOfPixels * sizeof(MeasurePixelType),
+                  m_ReleaseInternalBuffers ? VEDMemoryPlan::VesselnessPhase
+                                           : VEDMemoryPlan::HessianPhase,
+                  scaleLastPhase);
+
+  if (m_Deconvolution)
+  {
+    // The deconvolved vesselness, and the padded image, half spectrum and
+    // inverse FFT of GaussianDeconvolution (margins not counted).
+    plan->AddBuffer("deconvolved vesselness",
+                    numberOfPixels * sizeof(MeasurePixelType),
+                    VEDMemoryPlan::HessianPhase, scaleLastPhase);
+    plan->AddBuffer("deconvolution FFT", 3 * numberOfPixels * sizeof(double),
+                    VEDMemoryPlan::HessianPhase, scaleLastPhase);
+  }
+
+  if (m_GenerateScaleFiles)
+  {
+    // The float cast of the raw vesselness (none for the sparse stacks,
+    // whose size depends on the data) and the processed and rescaled outputs
+    // of the post-processing of WriteScaleFiles().
+    const unsigned int numberOfCasts = m_SparseScaleFiles ? 0 : 1;
+    plan->AddBuffer("scale files",
+                    numberOfPixels * (numberOfCasts + 2) * sizeof(float),
+                    VEDMemoryPlan::ScaleFilesPhase,
+                    VEDMemoryPlan::ScaleFilesPhase);
+  }
+}
+
 // =============================================================================
 // Keep the best sigma scale in memory (Hessian, scale and vesselness)
 // =============================================================================
@@ -433,9 +762,51 @@ template <typename TInputImage, typename THessianImage, typename TOutputImage>
 void MultiScaleHessian<TInputImage, THessianImage,
                        TOutputImage>::UpdateMaximumResponse(double sigma)
 {
-
   const OutputRegionType outputRegion = this->GetOutput()->GetBufferedRegion();
 
+  // The blocks whose largest measure does not beat the smallest best
+  // response are left as they are.
+  const std::vector<double>& blockMaximum =
+      m_HessianToMeasureFilter->GetBlockMaximum();
+  const itk::SizeValueType numberOfBlocks =
+      m_HessianToMeasureFilter->GetNumberOfBlocks();
+  // The block maxima are those of the raw vesselness, not of the
+  // deconvolved one.
+  if (m_HessianToMeasureFilter->GetOutput()->GetRequestedRegion() !=
+          outputRegion ||
+      blockMaximum.size() != numberOfBlocks || m_LastResponse.IsNotNull() ||
+      m_DeconvolvedResponse.IsNotNull())
+  {
+    this->UpdateMaximumResponse(sigma, outputRegion);
+    m_BlockMinimumResponse.clear();
+    return;
+  }
+
+  if (m_BlockMinimumResponse.size() != numberOfBlocks)
+  {
+    m_BlockMinimumResponse.assign(
+        numberOfBlocks,
+        m_NonNegativeHessianBasedMeasure
+            ? itk::NumericTraits<BufferValueType>::Zero
+            : itk::NumericTraits<BufferValueType>::NonpositiveMin());
+  }
+
+  for (itk::SizeValueType block = 0; block < numberOfBlocks; ++block)
+  {
+    if (blockMaximum[block] <= m_BlockMinimumResponse[block])
+    {
+      continue;
+    }
+    m_BlockMinimumResponse[block] = this->UpdateMaximumResponse(
+        sigma, m_HessianToMeasureFilter->GetBlockRegion(block));
+  }
+}
+
+// Returns the smallest best response of the region.
+template <typename TInputImage, typename THessianImage, typename TOutputImage>
+double MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::
+    UpdateMaximumResponse(double sigma, const OutputRegionType& outputRegion)
+{
   itk::ImageRegionIterator<UpdateBufferType> itOutput(m_UpdateBuffer,
                                                       outputRegion);
 
@@ -458,29 +829,61 @@ void MultiScaleHessian<TInputImage, THessianImage,
       itk::ImageRegionIterator<HessianImageType>(hessianImage, outputRegion);
   itHessian.GoToBegin();
 
-  typedef typename HessianToMeasureFilterType::OutputImageType
-      HessianToMeasureOutputImageType;
-
-  itk::ImageRegionIterator<HessianToMeasureOutputImageType> itHessianOutput(
-      m_HessianToMeasureFilter->GetOutput(), outputRegion);
-  itk::ImageRegionIterator<HessianImageType> itHessianImage(
-      m_HessianFilter->GetOutput(), outputRegion);
+  itk::ImageRegionConstIterator<MeasureImageType> itHessianOutput(
+      this->GetScaleResponse(), outputRegion);
+  itk::ImageRegionConstIterator<HessianImageType> itHessianImage(
+      this->GetScaleHessian(), outputRegion);
 
   itHessianOutput.GoToBegin();
   itHessianImage.GoToBegin();
 
+  // Adaptive search: responses around the best scale.
+  const bool adaptive = m_LastResponse.IsNotNull();
+  itk::ImageRegionIterator<RefinementImageType> itLast;
+  itk::ImageRegionIterator<RefinementImageType> itPrevious;
+  itk::ImageRegionIterator<RefinementImageType> itNext;
+  if (adaptive)
+  {
+    itLast = itk::ImageRegionIterator<RefinementImageType>(m_LastResponse,
+                                                           outputRegion);
+    itPrevious = itk::ImageRegionIterator<RefinementImageType>(
+        m_PreviousResponse, outputRegion);
+    itNext = itk::ImageRegionIterator<RefinementImageType>(m_NextResponse,
+                                                           outputRegion);
+  }
+
+  double minimum = itk::NumericTraits<double>::max();
   while (!itOutput.IsAtEnd())
   {
-    if (itOutput.Value() < itHessianOutput.Value())
+    const double response = itHessianOutput.Value();
+    if (itOutput.Value() < response)
     {
-      itOutput.Value() = itHessianOutput.Value();
+      itOutput.Value() = response;
 
       if (m_GenerateScalesOutput)
       {
         itOutputScale.Value() = static_cast<ScalesPixelType>(sigma);
       }
       itHessian.Value() = itHessianImage.Value();
+
+      if (adaptive)
+      {
+        itPrevious.Set(itLast.Get());
+        itNext.Set(std::numeric_limits<float>::quiet_NaN());
+      }
+    }
+    else if (adaptive && std::isnan(itNext.Get()))
+    {
+      itNext.Set(static_cast<float>(response));
+    }
+    if (adaptive)
+    {
+      itLast.Set(static_cast<float>(response));
+      ++itLast;
+      ++itPrevious;
+      ++itNext;
     }
+    minimum = std::min<double>(minimum, itOutput.Value());
     ++itOutput;
     ++itHessianOutput;
     if (m_GenerateScalesOutput)
@@ -490,6 +893,81 @@ void MultiScaleHessian<TInputImage, THessianImage,
     ++itHessian;
     ++itHessianImage;
   }
+  return minimum;
+}
+
+// =============================================================================
+// Adaptive search: where the best response is significant and computed
+// between two coarse scales, the peak of the parabola through the three
+// responses (in log sigma) replaces the best response and its scale.
+// =============================================================================
+template <typename TInputImage, typename THessianImage, typename TOutputImage>
+void MultiScaleHessian<TInputImage, THessianImage,
+                       TOutputImage>::RefineMaximumResponse()
+{
+  const OutputRegionType outputRegion = this->GetOutput()->GetBufferedRegion();
+  const unsigned int numberOfComputedScales =
+      this->GetNumberOfComputedScales();
+  const double logStep =
+      numberOfComputedScales > 1
+          ? (std::log(this->ComputeSigmaValue(numberOfComputedScales - 1,
+                                              numberOfComputedScales)) -
+             std::log(this->ComputeSigmaValue(0, numberOfComputedScales))) /
+                (numberOfComputedScales - 1)
+          : 0.0;
+
+  itk::ImageRegionIterator<UpdateBufferType> itOutput(m_UpdateBuffer,
+                                                      outputRegion);
+  double maximum = 0.0;
+  for (itOutput.GoToBegin(); !itOutput.IsAtEnd(); ++itOutput)
+  {
+    maximum = std::max<double>(maximum, itOutput.Value());
+  }
+  const double threshold = m_AdaptiveSignificance * maximum;
+
+  itk::ImageRegionIterator<ScalesImageType> itOutputScale;
+  if (m_GenerateScalesOutput)
+  {
+    itOutputScale = itk::ImageRegionIterator<ScalesImageType>(
+        dynamic_cast<ScalesImageType*>(this->itk::ProcessObject::GetOutput(1)),
+        outputRegion);
+  }
+  itk::ImageRegionConstIterator<RefinementImageType> itPrevious(
+      m_PreviousResponse, outputRegion);
+  itk::ImageRegionConstIterator<RefinementImageType> itNext(m_NextResponse,
+                                                            outputRegion);
+
+  for (itOutput.GoToBegin(); !itOutput.IsAtEnd(); ++itOutput, ++itPrevious,
+                                                  ++itNext)
+  {
+    // The previous scale is the larger sigma (+1), the next the smaller
+    // (-1). The cascade computes the scales the other way round.
+    const double best = itOutput.Value();
+    const double previous =
+        m_GaussianCascade ? itNext.Get() : itPrevious.Get();
+    const double next = m_GaussianCascade ? itPrevious.Get() : itNext.Get();
+    const double curvature = previous + next - 2.0 * best;
+    if (best > threshold && !std::isnan(previous) && !std::isnan(next) &&
+        curvature < 0.0)
+    {
+      const double offset = (next - previous) / (2.0 * curvature);
+      itOutput.Value() =
+          best - (previous - next) * (previous - next) / (8.0 * curvature);
+      if (m_GenerateScalesOutput)
+      {
+        itOutputScale.Value() = static_cast<ScalesPixelType>(
+            itOutputScale.Value() * std::exp(offset * logStep));
+      }
+    }
+    if (m_GenerateScalesOutput)
+    {
+      ++itOutputScale;
+    }
+  }
+
+  m_LastResponse = nullptr;
+  m_PreviousResponse = nullptr;
+  m_NextResponse = nullptr;
 }
 
 // =============================================================================
@@ -500,7 +978,15 @@ double
 MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::ComputeSigmaValue(
     int scaleLevel)
 {
-  if (m_NumberOfSigmaSteps < 2)
+  return this->ComputeSigmaValue(scaleLevel, m_NumberOfSigmaSteps);
+}
+
+template <typename TInputImage, typename THessianImage, typename TOutputImage>
+double
+MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::ComputeSigmaValue(
+    int scaleLevel, unsigned int numberOfSteps)
+{
+  if (numberOfSteps < 2)
   {
     return m_SigmaMinimum;
   }
@@ -513,14 +999,14 @@ MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::ComputeSigmaValue(
   case Self::EquispacedSigmaSteps:
   {
     const double stepSize = vnl_math_max(
-        1e-10, (m_SigmaMaximum - m_SigmaMinimum) / (m_NumberOfSigmaSteps - 1));
+        1e-10, (m_SigmaMaximum - m_SigmaMinimum) / (numberOfSteps - 1));
     return m_SigmaMinimum + stepSize * scaleLevel;
   }
   case Self::LogarithmicSigmaSteps:
   {
     const double stepSize = vnl_math_max(
         1e-10, (std::log(m_SigmaMaximum) - std::log(m_SigmaMinimum)) /
-                   (m_NumberOfSigmaSteps - 1));
+                   (numberOfSteps - 1));
     return std::exp(std::log(m_SigmaMinimum) + stepSize * scaleLevel);
   }
   default:
@@ -530,6 +1016,18 @@ MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::ComputeSigmaValue(
   }
 }
 
+template <typename TInputImage, typename THessianImage, typename TOutputImage>
+unsigned int MultiScaleHessian<TInputImage, THessianImage,
+                               TOutputImage>::GetNumberOfComputedScales() const
+{
+  if (m_NumberOfCoarseScales > 0 &&
+      m_NumberOfCoarseScales < m_NumberOfSigmaSteps)
+  {
+    return m_NumberOfCoarseScales;
+  }
+  return m_NumberOfSigmaSteps;
+}
+
 template <typename TInputImage, typename THessianImage, typename TOutputImage>
 void MultiScaleHessian<TInputImage, THessianImage,
                        TOutputImage>::SetSigmaStepMethodToEquispaced()
@@ -587,6 +1085,18 @@ void MultiScaleHessian<TInputImage, THessianImage, TOutputImage>::PrintSelf(
      << std::endl;
   os << indent << "GenerateHessianOutput: " << m_GenerateHessianOutput
      << std::endl;
+  os << indent << "GenerateScaleFiles: " << m_GenerateScaleFiles << std::endl;
+  os << indent << "SparseScaleFiles: " << m_SparseScaleFiles << std::endl;
+  os << indent << "ReleaseInternalBuffers: " << m_ReleaseInternalBuffers
+     << std::endl;
+  os << indent << "NumberOfCoarseScales: " << m_NumberOfCoarseScales
+     << std::endl;
+  os << indent << "AdaptiveSignificance: " << m_AdaptiveSignificance
+     << std::endl;
+  os << indent << "GaussianCascade: " << m_GaussianCascade << std::endl;
+  os << indent << "Deconvolution: " << m_Deconvolution << std::endl;
+  os << indent << "DeconvolutionRegularization: "
+     << m_DeconvolutionRegularization << std::endl;
 }
 
 #endif
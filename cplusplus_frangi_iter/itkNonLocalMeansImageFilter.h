@@ -0,0 +1,136 @@
+#ifndef __itkNonLocalMeansImageFilter_h
+#define __itkNonLocalMeansImageFilter_h
+
+#include "itkImageToImageFilter.h"
+#include "itkWorkStealingPool.h"
+
+//*\class NonLocalMeansImageFilter
+//  \brief Non-local means denoising, in memory ahead of the VED.
+//
+// Every voxel becomes the weighted mean of the voxels of its search window
+// (SearchRadius, 5 by default), each weighted by the similarity of the
+// patches (PatchRadius, 1 by default) around the two voxels:
+//
+//   w = exp(-mean squared patch difference / (sqrt(2) sigma^2))
+//
+// as dipy's non_local_means (dipy_nlmeans.py, step 2 of extract_vessels.sh),
+// voxelwise. With Rician noise (the default, magnitude images) the squares
+// are averaged and 2 sigma^2 is removed before the square root.
+//
+// The patch distances are computed one offset of the search window at a
+// time for a whole tile: the squared differences of the tile and its
+// shifted copy, then their separable box sums over the patch, all of them
+// contiguous row loops instead of one patch comparison per pair of voxels.
+// The tiles are the chunks of the WorkStealingPool (rows of 16x16), each
+// copied once with its margin (mirrored at the image border).
+//
+// A Sigma of 0 (the default) is estimated from the median absolute
+// deviation of the residual of the input to the mean of its 6 neighbours,
+// inside the mask. Voxels outside the mask (> 0 inside) are set to 0, as
+// dipy does, but still take part in the patches of the voxels inside.
+template <typename TInputImage, typename TOutputImage,
+          typename TMaskImage = TOutputImage>
+class NonLocalMeansImageFilter
+    : public itk::ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  typedef NonLocalMeansImageFilter Self;
+  typedef itk::ImageToImageFilter<TInputImage, TOutputImage> Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  typedef typename Superclass::InputImageType InputImageType;
+  typedef typename Superclass::OutputImageType OutputImageType;
+  typedef TMaskImage MaskImageType;
+  typedef typename InputImageType::PixelType InputPixelType;
+  typedef typename OutputImageType::PixelType OutputPixelType;
+  typedef typename MaskImageType::PixelType MaskPixelType;
+  typedef typename OutputImageType::RegionType OutputImageRegionType;
+
+  static const unsigned int ImageDimension = InputImageType::ImageDimension;
+  static_assert(ImageDimension == 3, "The tiles are 3D.");
+
+  itkNewMacro(Self);
+
+  itkTypeMacro(NonLocalMeansImageFilter, ImageToImageFilter);
+
+  // Standard deviation of the noise, 0 (estimated) by default.
+  itkSetMacro(Sigma, double);
+  itkGetConstMacro(Sigma, double);
+
+  // The sigma of the last update, set or estimated.
+  itkGetConstMacro(NoiseSigma, double);
+
+  // Radius of the patches compared, 1 (3x3x3) by default.
+  itkSetMacro(PatchRadius, unsigned int);
+  itkGetConstMacro(PatchRadius, unsigned int);
+
+  // Radius of the search window, 5 (11x11x11) by default.
+  itkSetMacro(SearchRadius, unsigned int);
+  itkGetConstMacro(SearchRadius, unsigned int);
+
+  // Rician noise correction, on by default.
+  itkSetMacro(Rician, bool);
+  itkGetConstMacro(Rician, bool);
+  itkBooleanMacro(Rician);
+
+  // Only the voxels of the mask are denoised, all of them if none.
+  void SetMaskImage(const MaskImageType* mask)
+  {
+    if (m_MaskImage != mask)
+    {
+      m_MaskImage = mask;
+      this->Modified();
+    }
+  }
+  const MaskImageType* GetMaskImage() const { return m_MaskImage; }
+
+protected:
+  NonLocalMeansImageFilter();
+  ~NonLocalMeansImageFilter() {}
+  void PrintSelf(std::ostream& os, itk::Indent indent) const;
+
+  // The whole image: the search windows cross the tiles.
+  void GenerateInputRequestedRegion();
+  void EnlargeOutputRequestedRegion(itk::DataObject* output);
+
+  void GenerateData();
+
+private:
+  NonLocalMeansImageFilter(const Self&); // purposely not implemented
+  void operator=(const Self&);           // purposely not implemented
+
+  // Buffers of the tile of one thread.
+  struct TileBuffers
+  {
+    std::vector<double> Padded;
+    std::vector<double> Distance;
+    std::vector<double> SumX;
+    std::vector<double> SumY;
+    std::vector<double> Row;
+    std::vector<double> WeightSum;
+    std::vector<double> ValueSum;
+    std::vector<unsigned char> Inside;
+  };
+
+  // Sigma from the residual to the mean of the 6 neighbours.
+  double EstimateNoise() const;
+
+  bool IsInside(itk::OffsetValueType offset) const
+  {
+    return !m_MaskImage || m_MaskImage->GetBufferPointer()[offset] > 0;
+  }
+
+  double m_Sigma;
+  double m_NoiseSigma;
+  unsigned int m_PatchRadius;
+  unsigned int m_SearchRadius;
+  bool m_Rician;
+  typename MaskImageType::ConstPointer m_MaskImage;
+};
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkNonLocalMeansImageFilter.hxx"
+#endif
+
+#endif
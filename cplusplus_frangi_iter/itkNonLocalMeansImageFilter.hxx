@@ -0,0 +1,390 @@
+#ifndef __itkNonLocalMeansImageFilter_hxx
+#define __itkNonLocalMeansImageFilter_hxx
+
+#include "itkNonLocalMeansImageFilter.h"
+#include "itkStageTimer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+NonLocalMeansImageFilter<TInputImage, TOutputImage,
+                         TMaskImage>::NonLocalMeansImageFilter()
+    : m_Sigma{0.0}, m_NoiseSigma{0.0}, m_PatchRadius{1}, m_SearchRadius{5},
+      m_Rician{true}
+{
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+void NonLocalMeansImageFilter<TInputImage, TOutputImage,
+                              TMaskImage>::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  InputImageType* input = const_cast<InputImageType*>(this->GetInput());
+  if (input)
+  {
+    input->SetRequestedRegionToLargestPossibleRegion();
+  }
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+void NonLocalMeansImageFilter<TInputImage, TOutputImage, TMaskImage>::
+    EnlargeOutputRequestedRegion(itk::DataObject* output)
+{
+  Superclass::EnlargeOutputRequestedRegion(output);
+  output->SetRequestedRegionToLargestPossibleRegion();
+}
+
+// =============================================================================
+// The residual of every voxel inside the mask (not on the border) to the
+// mean of its 6 neighbours has the variance 7/6 sigma^2; its median absolute
+// deviation is robust to the edges and vessels.
+// =============================================================================
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+double NonLocalMeansImageFilter<TInputImage, TOutputImage,
+                                TMaskImage>::EstimateNoise() const
+{
+  const InputImageType* input = this->GetInput();
+  const OutputImageRegionType region = input->GetBufferedRegion();
+  StageTimerScope timer("NonLocalMeans::NoiseEstimate",
+                        region.GetNumberOfPixels());
+
+  const InputPixelType* buffer = input->GetBufferPointer();
+  const itk::OffsetValueType* strides = input->GetOffsetTable();
+  const int nx = region.GetSize(0);
+  const int ny = region.GetSize(1);
+  const int nz = region.GetSize(2);
+
+  std::vector<float> residuals;
+  for (int z = 1; z < nz - 1; ++z)
+  {
+    for (int y = 1; y < ny - 1; ++y)
+    {
+      const itk::OffsetValueType rowOffset = z * strides[2] + y * strides[1];
+      for (int x = 1; x < nx - 1; ++x)
+      {
+        const itk::OffsetValueType offset = rowOffset + x;
+        if (!this->IsInside(offset))
+        {
+          continue;
+        }
+        const double neighbours =
+            static_cast<double>(buffer[offset - 1]) + buffer[offset + 1] +
+            buffer[offset - strides[1]] + buffer[offset + strides[1]] +
+            buffer[offset - strides[2]] + buffer[offset + strides[2]];
+        residuals.push_back(std::abs(buffer[offset] - neighbours / 6.0));
+      }
+    }
+  }
+  if (residuals.empty())
+  {
+    return 0.0;
+  }
+
+  std::nth_element(residuals.begin(),
+                   residuals.begin() + residuals.size() / 2, residuals.end());
+  const double median = residuals[residuals.size() / 2];
+  return 1.4826 * median / std::sqrt(7.0 / 6.0);
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+void NonLocalMeansImageFilter<TInputImage, TOutputImage,
+                              TMaskImage>::GenerateData()
+{
+  this->AllocateOutputs();
+
+  const InputImageType* input = this->GetInput();
+  OutputImageType* output = this->GetOutput();
+  const OutputImageRegionType region = output->GetBufferedRegion();
+  if (input->GetBufferedRegion() != region)
+  {
+    itkExceptionMacro(<< "The input and output must have the same buffer.");
+  }
+  if (m_MaskImage && m_MaskImage->GetBufferedRegion() != region)
+  {
+    itkExceptionMacro(<< "The mask must be on the grid of the input.");
+  }
+  const itk::SizeValueType numberOfPixels = region.GetNumberOfPixels();
+  if (numberOfPixels == 0)
+  {
+    return;
+  }
+
+  const InputPixelType* inputBuffer = input->GetBufferPointer();
+  OutputPixelType* outputBuffer = output->GetBufferPointer();
+
+  m_NoiseSigma = m_Sigma > 0.0 ? m_Sigma : this->EstimateNoise();
+  if (m_NoiseSigma <= 0.0)
+  {
+    // Nothing to remove: the input, masked.
+    for (itk::SizeValueType i = 0; i < numberOfPixels; ++i)
+    {
+      outputBuffer[i] = this->IsInside(i)
+                            ? static_cast<OutputPixelType>(inputBuffer[i])
+                            : OutputPixelType(0);
+    }
+    return;
+  }
+
+  const int patchRadius = m_PatchRadius;
+  const int searchRadius = m_SearchRadius;
+  const int margin = patchRadius + searchRadius;
+  const double patchVolume = std::pow(2.0 * patchRadius + 1.0, 3);
+  const double weightFactor =
+      1.0 / (patchVolume * std::sqrt(2.0) * m_NoiseSigma * m_NoiseSigma);
+  const double bias = m_Rician ? 2.0 * m_NoiseSigma * m_NoiseSigma : 0.0;
+
+  // Offset in the buffer of every coordinate of the padded axes, [-margin,
+  // size + margin), mirrored at the border (without repeating it).
+  const itk::OffsetValueType* strides = input->GetOffsetTable();
+  std::vector<itk::OffsetValueType> mirror[ImageDimension];
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    const int size = region.GetSize(d);
+    const int period = std::max(1, 2 * (size - 1));
+    for (int i = -margin; i < size + margin; ++i)
+    {
+      int m = std::abs(i) % period;
+      if (m >= size)
+      {
+        m = period - m;
+      }
+      mirror[d].push_back(m * strides[d]);
+    }
+  }
+
+  WorkStealingPool& pool = WorkStealingPool::GetInstance();
+  const itk::SizeValueType numberOfChunks = pool.GetNumberOfChunks(region);
+  std::vector<TileBuffers> buffers(pool.GetNumberOfThreads());
+  pool.ParallelFor(
+      "NonLocalMeans::Denoise", numberOfChunks, this->GetNumberOfThreads(),
+      [&](unsigned int threadId, size_t chunk) {
+        const OutputImageRegionType chunkRegion =
+            pool.GetChunkRegion(region, chunk);
+        int first[ImageDimension];
+        int size[ImageDimension];
+        for (unsigned int d = 0; d < ImageDimension; ++d)
+        {
+          first[d] = chunkRegion.GetIndex(d) - region.GetIndex(d);
+          size[d] = chunkRegion.GetSize(d);
+        }
+        const int nx = size[0];
+        const int ny = size[1];
+        const int nz = size[2];
+        const size_t tileSize = static_cast<size_t>(nx) * ny * nz;
+
+        // The mask of the tile; nothing to compute if it is empty.
+        TileBuffers& tile = buffers[threadId];
+        tile.Inside.assign(tileSize, 0);
+        bool any = false;
+        for (int k = 0; k < nz; ++k)
+        {
+          for (int j = 0; j < ny; ++j)
+          {
+            const itk::OffsetValueType rowOffset =
+                (first[2] + k) * strides[2] + (first[1] + j) * strides[1] +
+                first[0];
+            for (int i = 0; i < nx; ++i)
+            {
+              const bool inside = this->IsInside(rowOffset + i);
+              tile.Inside[(k * ny + j) * nx + i] = inside;
+              any = any || inside;
+              outputBuffer[rowOffset + i] = OutputPixelType(0);
+            }
+          }
+        }
+        if (!any)
+        {
+          return;
+        }
+
+        // The tile with the margin of the patches and search windows.
+        const int px = nx + 2 * margin;
+        const int py = ny + 2 * margin;
+        const int pz = nz + 2 * margin;
+        tile.Padded.resize(static_cast<size_t>(px) * py * pz);
+        for (int k = 0; k < pz; ++k)
+        {
+          for (int j = 0; j < py; ++j)
+          {
+            const itk::OffsetValueType rowOffset =
+                mirror[2][first[2] + k] + mirror[1][first[1] + j];
+            double* row = &tile.Padded[(static_cast<size_t>(k) * py + j) * px];
+            for (int i = 0; i < px; ++i)
+            {
+              row[i] = inputBuffer[rowOffset + mirror[0][first[0] + i]];
+            }
+          }
+        }
+
+        // The tile with the margin of the patches.
+        const int ex = nx + 2 * patchRadius;
+        const int ey = ny + 2 * patchRadius;
+        const int ez = nz + 2 * patchRadius;
+        tile.Distance.resize(static_cast<size_t>(ex) * ey * ez);
+        tile.SumX.resize(static_cast<size_t>(nx) * ey * ez);
+        tile.SumY.resize(static_cast<size_t>(nx) * ny * ez);
+        tile.Row.resize(nx);
+        tile.WeightSum.assign(tileSize, 0.0);
+        tile.ValueSum.assign(tileSize, 0.0);
+
+        const int patchWidth = 2 * patchRadius + 1;
+        for (int oz = -searchRadius; oz <= searchRadius; ++oz)
+        {
+          for (int oy = -searchRadius; oy <= searchRadius; ++oy)
+          {
+            for (int ox = -searchRadius; ox <= searchRadius; ++ox)
+            {
+              const ptrdiff_t shift =
+                  (static_cast<ptrdiff_t>(oz) * py + oy) * px + ox;
+
+              // Squared differences to the shifted tile.
+              for (int k = 0; k < ez; ++k)
+              {
+                for (int j = 0; j < ey; ++j)
+                {
+                  const double* a =
+                      &tile.Padded[((static_cast<size_t>(k) + searchRadius) *
+                                        py +
+                                    j + searchRadius) *
+                                       px +
+                                   searchRadius];
+                  const double* b = a + shift;
+                  double* distance =
+                      &tile.Distance[(static_cast<size_t>(k) * ey + j) * ex];
+                  for (int i = 0; i < ex; ++i)
+                  {
+                    const double difference = a[i] - b[i];
+                    distance[i] = difference * difference;
+                  }
+                }
+              }
+
+              // Box sums over the patch, along x, then y.
+              for (int k = 0; k < ez; ++k)
+              {
+                for (int j = 0; j < ey; ++j)
+                {
+                  const double* distance =
+                      &tile.Distance[(static_cast<size_t>(k) * ey + j) * ex];
+                  double* sum =
+                      &tile.SumX[(static_cast<size_t>(k) * ey + j) * nx];
+                  std::fill(sum, sum + nx, 0.0);
+                  for (int t = 0; t < patchWidth; ++t)
+                  {
+                    for (int i = 0; i < nx; ++i)
+                    {
+                      sum[i] += distance[i + t];
+                    }
+                  }
+                }
+                for (int j = 0; j < ny; ++j)
+                {
+                  double* sum =
+                      &tile.SumY[(static_cast<size_t>(k) * ny + j) * nx];
+                  std::fill(sum, sum + nx, 0.0);
+                  for (int t = 0; t < patchWidth; ++t)
+                  {
+                    const double* row =
+                        &tile.SumX[(static_cast<size_t>(k) * ey + j + t) * nx];
+                    for (int i = 0; i < nx; ++i)
+                    {
+                      sum[i] += row[i];
+                    }
+                  }
+                }
+              }
+
+              // Along z, then the weights of the shifted voxels.
+              double* patchDistance = tile.Row.data();
+              for (int k = 0; k < nz; ++k)
+              {
+                for (int j = 0; j < ny; ++j)
+                {
+                  std::fill(patchDistance, patchDistance + nx, 0.0);
+                  for (int t = 0; t < patchWidth; ++t)
+                  {
+                    const double* row =
+                        &tile.SumY[(static_cast<size_t>(k + t) * ny + j) * nx];
+                    for (int i = 0; i < nx; ++i)
+                    {
+                      patchDistance[i] += row[i];
+                    }
+                  }
+
+                  const size_t tileRow = (static_cast<size_t>(k) * ny + j) * nx;
+                  const double* shifted =
+                      &tile.Padded[((static_cast<size_t>(k) + margin) * py +
+                                    j + margin) *
+                                       px +
+                                   margin] +
+                      shift;
+                  for (int i = 0; i < nx; ++i)
+                  {
+                    if (!tile.Inside[tileRow + i])
+                    {
+                      continue;
+                    }
+                    const double weight =
+                        std::exp(-patchDistance[i] * weightFactor);
+                    const double value = shifted[i];
+                    tile.WeightSum[tileRow + i] += weight;
+                    tile.ValueSum[tileRow + i] +=
+                        weight * (m_Rician ? value * value : value);
+                  }
+                }
+              }
+            }
+          }
+        }
+
+        for (int k = 0; k < nz; ++k)
+        {
+          for (int j = 0; j < ny; ++j)
+          {
+            const size_t tileRow = (static_cast<size_t>(k) * ny + j) * nx;
+            const itk::OffsetValueType rowOffset =
+                (first[2] + k) * strides[2] + (first[1] + j) * strides[1] +
+                first[0];
+            for (int i = 0; i < nx; ++i)
+            {
+              if (!tile.Inside[tileRow + i])
+              {
+                continue;
+              }
+              // The voxel itself has the weight 1: the sum is never 0.
+              double value =
+                  tile.ValueSum[tileRow + i] / tile.WeightSum[tileRow + i];
+              if (m_Rician)
+              {
+                value = std::sqrt(std::max(value - bias, 0.0));
+              }
+              outputBuffer[rowOffset + i] =
+                  static_cast<OutputPixelType>(value);
+            }
+          }
+        }
+      },
+      static_cast<double>(numberOfPixels) / numberOfChunks *
+          (sizeof(InputPixelType) + sizeof(OutputPixelType)));
+}
+
+template <typename TInputImage, typename TOutputImage, typename TMaskImage>
+void NonLocalMeansImageFilter<TInputImage, TOutputImage,
+                              TMaskImage>::PrintSelf(std::ostream& os,
+                                                     itk::Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "Sigma: " << m_Sigma << std::endl;
+  os << indent << "NoiseSigma: " << m_NoiseSigma << std::endl;
+  os << indent << "PatchRadius: " << m_PatchRadius << std::endl;
+  os << indent << "SearchRadius: " << m_SearchRadius << std::endl;
+  os << indent << "Rician: " << m_Rician << std::endl;
+  os << indent << "MaskImage: " << m_MaskImage.GetPointer() << std::endl;
+}
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef __itkNumaTopology_h
+#define __itkNumaTopology_h
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// \class NumaTopology
+// \brief The NUMA nodes of the machine and their CPUs.
+//
+// Read once from /sys/devices/system/node. A machine without that
+// directory (single node, or not Linux) is one node holding every CPU, so
+// the callers do not need a special case.
+//
+// GetThreadCpu() gives the threads of a loop to the nodes in contiguous
+// blocks, in proportion to their number of CPUs: the first threads, which
+// start on the first chunks of a WorkStealingPool loop (the first slabs of
+// the image), are on the first node. Buffers first touched by the same
+// threads then have the pages of each slab on the node which processes it.
+class NumaTopology
+{
+public:
+  static const NumaTopology& GetInstance()
+  {
+    static const NumaTopology instance;
+    return instance;
+  }
+
+  unsigned int GetNumberOfNodes() const { return m_NodeCpus.size(); }
+  const std::vector<int>& GetNodeCpus(unsigned int node) const
+  {
+    return m_NodeCpus[node];
+  }
+
+  // Node of a CPU, 0 if unknown.
+  unsigned int GetNodeOfCpu(int cpu) const
+  {
+    return cpu >= 0 && cpu < static_cast<int>(m_CpuNode.size())
+               ? m_CpuNode[cpu]
+               : 0;
+  }
+
+  // Node of the CPU running the calling thread, 0 if unknown.
+  unsigned int GetCurrentNode() const
+  {
+#if defined(__linux__)
+    return this->GetNodeOfCpu(sched_getcpu());
+#else
+    return 0;
+#endif
+  }
+
+  // CPU of thread threadId out of numberOfThreads.
+  int GetThreadCpu(unsigned int threadId, unsigned int numberOfThreads) const
+  {
+    const size_t index = static_cast<size_t>(threadId) * m_Cpus.size() /
+                         std::max(1u, numberOfThreads);
+    return m_Cpus[std::min(index, m_Cpus.size() - 1)];
+  }
+
+  // Bind the calling thread to one CPU. False if not supported.
+  static bool PinCurrentThread(int cpu)
+  {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+  }
+
+  // Pin the calling thread to a CPU for the life of the scope, then give it
+  // back its previous CPUs.
+  class PinScope
+  {
+  public:
+    explicit PinScope(int cpu) : m_Pinned{false}
+    {
+#if defined(__linux__)
+      m_Pinned = pthread_getaffinity_np(pthread_self(), sizeof(m_Previous),
+                                        &m_Previous) == 0 &&
+                 PinCurrentThread(cpu);
+#else
+      (void)cpu;
+#endif
+    }
+
+    ~PinScope()
+    {
+#if defined(__linux__)
+      if (m_Pinned)
+      {
+        pthread_setaffinity_np(pthread_self(), sizeof(m_Previous),
+                               &m_Previous);
+      }
+#endif
+    }
+
+  private:
+    PinScope(const PinScope&);       // purposely not implemented
+    void operator=(const PinScope&); // purposely not implemented
+
+    bool m_Pinned;
+#if defined(__linux__)
+    cpu_set_t m_Previous;
+#endif
+  };
+
+  // Number of pages of [buffer, buffer + bytes) on every node, estimated
+  // from at most maximumSamples pages spread over the buffer. The pages not
+  // touched yet are not counted. Empty if the kernel cannot tell.
+  std::vector<double> GetPagesPerNode(const void* buffer, size_t bytes,
+                                      size_t maximumSamples = 1024) const
+  {
+    std::vector<double> pages;
+#if defined(__linux__) && defined(SYS_move_pages)
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    const uintptr_t first = reinterpret_cast<uintptr_t>(buffer) / pageSize;
+    const uintptr_t last =
+        (reinterpret_cast<uintptr_t>(buffer) + bytes + pageSize - 1) /
+        pageSize;
+    if (bytes == 0 || last <= first)
+    {
+      return pages;
+    }
+    const size_t numberOfPages = last - first;
+    const size_t numberOfSamples = std::min(numberOfPages, maximumSamples);
+
+    std::vector<void*> addresses(numberOfSamples);
+    for (size_t s = 0; s < numberOfSamples; ++s)
+    {
+      addresses[s] = reinterpret_cast<void*>(
+          (first + s * numberOfPages / numberOfSamples) * pageSize);
+    }
+    std::vector<int> status(numberOfSamples, -1);
+    // With no target nodes, move_pages only returns the node of each page.
+    if (syscall(SYS_move_pages, 0, numberOfSamples, addresses.data(), nullptr,
+                status.data(), 0) != 0)
+    {
+      return pages;
+    }
+
+    pages.assign(this->GetNumberOfNodes(), 0.0);
+    const double pagesPerSample =
+        static_cast<double>(numberOfPages) / numberOfSamples;
+    for (size_t s = 0; s < numberOfSamples; ++s)
+    {
+      if (status[s] >= 0 && status[s] < static_cast<int>(pages.size()))
+      {
+        pages[status[s]] += pagesPerSample;
+      }
+    }
+#else
+    (void)buffer;
+    (void)bytes;
+    (void)maximumSamples;
+#endif
+    return pages;
+  }
+
+private:
+  NumaTopology()
+  {
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string nodes;
+    if (online && std::getline(online, nodes))
+    {
+      const std::vector<int> nodeIds = ParseCpuList(nodes);
+      for (size_t n = 0; n < nodeIds.size(); ++n)
+      {
+        std::ifstream file("/sys/devices/system/node/node" +
+                           std::to_string(nodeIds[n]) + "/cpulist");
+        std::string list;
+        if (file && std::getline(file, list))
+        {
+          m_NodeCpus.resize(std::max<size_t>(m_NodeCpus.size(),
+                                             nodeIds[n] + 1));
+          m_NodeCpus[nodeIds[n]] = ParseCpuList(list);
+        }
+      }
+    }
+
+    if (m_NodeCpus.empty())
+    {
+      const int numberOfCpus =
+          std::max(1u, std::thread::hardware_concurrency());
+      m_NodeCpus.resize(1);
+      for (int cpu = 0; cpu < numberOfCpus; ++cpu)
+      {
+        m_NodeCpus[0].push_back(cpu);
+      }
+    }
+
+    for (unsigned int node = 0; node < m_NodeCpus.size(); ++node)
+    {
+      for (size_t c = 0; c < m_NodeCpus[node].size(); ++c)
+      {
+        const int cpu = m_NodeCpus[node][c];
+        if (cpu >= static_cast<int>(m_CpuNode.size()))
+        {
+          m_CpuNode.resize(cpu + 1, 0);
+        }
+        m_CpuNode[cpu] = node;
+        m_Cpus.push_back(cpu);
+      }
+    }
+    if (m_Cpus.empty())
+    {
+      m_Cpus.push_back(0);
+    }
+  }
+
+  // "0-3,8-11" -> 0 1 2 3 8 9 10 11 (CPU or node lists)
+  static std::vector<int> ParseCpuList(const std::string& list)
+  {
+    std::vector<int> cpus;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ','))
+    {
+      const size_t dash = range.find('-');
+      try
+      {
+        const int first = std::stoi(range.substr(0, dash));
+        const int last = dash == std::string::npos
+                             ? first
+                             : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu)
+        {
+          cpus.push_back(cpu);
+        }
+      }
+      catch (const std::exception&)
+      {
+        // Empty list (memory-only node) or unexpected text.
+      }
+    }
+    return cpus;
+  }
+
+  NumaTopology(const NumaTopology&);   // purposely not implemented
+  void operator=(const NumaTopology&); // purposely not implemented
+
+  std::vector<std::vector<int>> m_NodeCpus;
+  std::vector<unsigned int> m_CpuNode;
+  std::vector<int> m_Cpus; // node by node
+};
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef __itkPooledImageContainer_h
+#define __itkPooledImageContainer_h
+
+#include "itkDiffusionTensor3D.h"
+#include "itkFixedArray.h"
+#include "itkImageBufferPool.h"
+#include "itkImportImageContainer.h"
+#include "itkMatrix.h"
+#include "itkObjectFactoryBase.h"
+#include "itkSymmetricSecondRankTensor.h"
+#include "itkVector.h"
+#include "itkVersion.h"
+
+#include <algorithm>
+#include <new>
+#include <typeinfo>
+#include <vector>
+
+// \class PooledImageContainer
+// \brief Pixel container whose buffers come from the ImageBufferPool.
+//
+// ImportImageContainer allocates its elements with new[]. This one leases
+// them from the ImageBufferPool (malloc() below GetMinimumSize() or when the
+// pool is disabled) and returns them when the container releases them. The
+// buffers set with SetImportPointer() are left to ImportImageContainer.
+template <typename TElement>
+class PooledImageContainer
+    : public itk::ImportImageContainer<itk::SizeValueType, TElement>
+{
+public:
+  typedef PooledImageContainer Self;
+  typedef itk::ImportImageContainer<itk::SizeValueType, TElement> Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  typedef typename Superclass::ElementIdentifier ElementIdentifier;
+
+  itkNewMacro(Self);
+
+  itkTypeMacro(PooledImageContainer, ImportImageContainer);
+
+protected:
+  PooledImageContainer() {}
+
+  // Before ~ImportImageContainer(), which would delete[] a leased buffer.
+  ~PooledImageContainer() { this->DeallocateManagedMemory(); }
+
+  TElement* AllocateElements(ElementIdentifier size,
+                             bool UseDefaultConstructor = false) const
+  {
+    TElement* elements = static_cast<TElement*>(
+        ImageBufferPool::GetInstance().AllocateArray(size * sizeof(TElement)));
+    if (!elements)
+    {
+      // As ImportImageContainer: no message built, we may be out of memory.
+      throw itk::MemoryAllocationError(__FILE__, __LINE__,
+                                       "Failed to allocate memory for image.",
+                                       ITK_LOCATION);
+    }
+
+    // The initialization of new TElement[size] (and [size]()).
+    if (UseDefaultConstructor)
+    {
+      for (ElementIdentifier i = 0; i < size; ++i)
+      {
+        new (elements + i) TElement();
+      }
+    }
+    else
+    {
+      for (ElementIdentifier i = 0; i < size; ++i)
+      {
+        new (elements + i) TElement;
+      }
+    }
+    m_Leased.push_back(elements);
+    return elements;
+  }
+
+  void DeallocateManagedMemory()
+  {
+    TElement* elements = this->GetImportPointer();
+    typename std::vector<TElement*>::iterator leased =
+        std::find(m_Leased.begin(), m_Leased.end(), elements);
+    if (!elements || leased == m_Leased.end() ||
+        !this->GetContainerManageMemory())
+    {
+      Superclass::DeallocateManagedMemory();
+      return;
+    }
+
+    for (ElementIdentifier i = 0; i < this->Capacity(); ++i)
+    {
+      elements[i].~TElement();
+    }
+    m_Leased.erase(leased);
+
+    // Reset the pointer, size and capacity without delete[].
+    this->SetContainerManageMemory(false);
+    Superclass::DeallocateManagedMemory();
+    this->SetContainerManageMemory(true);
+    ImageBufferPool::GetInstance().FreeArray(elements);
+  }
+
+private:
+  PooledImageContainer(const Self&); // purposely not implemented
+  void operator=(const Self&);       // purposely not implemented
+
+  // The buffers of AllocateElements() not yet returned: Reserve() allocates
+  // the new one before it releases the old one.
+  mutable std::vector<TElement*> m_Leased;
+};
+
+// \class ImageBufferPoolFactory
+// \brief Object factory giving the images a PooledImageContainer.
+//
+// Image::Initialize() creates the pixel container of every image with
+// ImportImageContainer::New(), which asks the object factories first.
+// RegisterOneFactory() overrides it for the pixel types of the pipeline, so
+// that only the image buffers go through the ImageBufferPool.
+class ImageBufferPoolFactory : public itk::ObjectFactoryBase
+{
+public:
+  typedef ImageBufferPoolFactory Self;
+  typedef itk::ObjectFactoryBase Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  itkFactorylessNewMacro(Self);
+
+  itkTypeMacro(ImageBufferPoolFactory, ObjectFactoryBase);
+
+  const char* GetITKSourceVersion() const { return ITK_SOURCE_VERSION; }
+
+  const char* GetDescription() const
+  {
+    return "Image pixel containers from the ImageBufferPool";
+  }
+
+  // Images of TElement get a PooledImageContainer.
+  template <typename TElement>
+  void RegisterContainer()
+  {
+    this->RegisterOverride(
+        typeid(itk::ImportImageContainer<itk::SizeValueType, TElement>).name(),
+        typeid(PooledImageContainer<TElement>).name(),
+        "Pixel container from the ImageBufferPool", true,
+        itk::CreateObjectFunction<PooledImageContainer<TElement>>::New());
+  }
+
+  // Once, before the pipeline is created.
+  static void RegisterOneFactory()
+  {
+    Pointer factory = ImageBufferPoolFactory::New();
+    factory->RegisterContainer<unsigned char>();
+    factory->RegisterContainer<float>();
+    factory->RegisterContainer<double>();
+    factory->RegisterContainer<itk::FixedArray<double, 3>>();
+    factory->RegisterContainer<itk::Vector<double, 3>>();
+    factory->RegisterContainer<itk::Vector<double, 6>>();
+    factory->RegisterContainer<itk::Matrix<double, 3, 3>>();
+    factory->RegisterContainer<itk::SymmetricSecondRankTensor<double, 3>>();
+    factory->RegisterContainer<itk::DiffusionTensor3D<double>>();
+    itk::ObjectFactoryBase::RegisterFactory(factory);
+  }
+
+protected:
+  ImageBufferPoolFactory() {}
+  ~ImageBufferPoolFactory() {}
+
+private:
+  ImageBufferPoolFactory(const Self&); // purposely not implemented
+  void operator=(const Self&);         // purposely not implemented
+};
+
+#endif
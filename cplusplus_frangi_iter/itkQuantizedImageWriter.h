@@ -0,0 +1,403 @@
+#ifndef __itkQuantizedImageWriter_h
+#define __itkQuantizedImageWriter_h
+
+#include "itkMappedImageIO.h"
+#include "itkNumericTraits.h"
+#include "itkSymmetricSecondRankTensor.h"
+#include "itk_zlib.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <ostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// \class QuantizedImageWriter
+// \brief Write the large auxiliary outputs (best Hessian, tensor and peak
+// files, best scale) with fewer bytes per value.
+//
+// Write() stores every component of the image as float32, or as int16 with
+// the NIfTI scl_slope/scl_inter covering the range of the image, in a .nii
+// or .nii.gz file laid out as ImageFileWriter does (components along the
+// fifth dimension, vector or symmetric matrix intent). WriteScaleIndex()
+// stores a scale image as a uint8 index into the sigma values listed in a
+// JSON sidecar. Both return the quantization error, that is the difference
+// between the values read back and the values of the image.
+//
+// NIfTI has no float16 type, so float32 is the reduced floating point
+// precision; the double images are halved, int16 quarters them.
+
+class QuantizedImageWriter
+{
+public:
+  typedef enum
+  {
+    FullPrecision = 0,
+    Float32Precision = 1,
+    Int16Precision = 2
+  } PrecisionType;
+
+  struct QuantizationError
+  {
+    double Minimum = 0.0;
+    double Maximum = 0.0;
+    double MaximumError = 0.0;
+    double RootMeanSquareError = 0.0;
+
+    // Maximum error over the range of the values.
+    double GetRelativeError() const
+    {
+      return Maximum > Minimum ? MaximumError / (Maximum - Minimum) : 0.0;
+    }
+  };
+
+  static const char* GetPrecisionName(PrecisionType precision)
+  {
+    switch (precision)
+    {
+    case Float32Precision:
+      return "float32";
+    case Int16Precision:
+      return "int16";
+    default:
+      return "full";
+    }
+  }
+
+  static PrecisionType GetPrecisionFromName(const std::string& name)
+  {
+    if (name == "full")
+    {
+      return FullPrecision;
+    }
+    if (name == "float32")
+    {
+      return Float32Precision;
+    }
+    if (name == "int16")
+    {
+      return Int16Precision;
+    }
+    throw std::invalid_argument("Unknown precision " + name +
+                                " (full, float32 or int16).");
+  }
+
+  // One line of report: the maximum error (also over the range of the
+  // values) and the RMS error of a quantized file.
+  static void PrintError(std::ostream& os, const std::string& fileName,
+                         const std::string& precision,
+                         const QuantizationError& error)
+  {
+    os << "Quantization of " << fileName << " (" << precision
+       << "): max error " << error.MaximumError << " ("
+       << error.GetRelativeError() << " of the range), RMS error "
+       << error.RootMeanSquareError << "." << std::endl;
+  }
+
+  // Write the image with the given precision. Full precision goes through
+  // MappedImageIO::Write (ImageFileWriter for the compressed files).
+  template <typename TImage>
+  static QuantizationError Write(const TImage* image,
+                                 const std::string& fileName,
+                                 PrecisionType precision)
+  {
+    typedef typename TImage::PixelType PixelType;
+    typedef typename itk::NumericTraits<PixelType>::ValueType ValueType;
+
+    QuantizationError error;
+    if (precision == FullPrecision)
+    {
+      MappedImageIO::Write(image, fileName);
+      return error;
+    }
+
+    const size_t numberOfPixels =
+        image->GetBufferedRegion().GetNumberOfPixels();
+    const unsigned int numberOfComponents =
+        sizeof(PixelType) / sizeof(ValueType);
+    const ValueType* values =
+        reinterpret_cast<const ValueType*>(image->GetBufferPointer());
+
+    // NIfTI stores the lower triangle of symmetric matrices, ITK the upper.
+    std::vector<unsigned int> order(numberOfComponents);
+    for (unsigned int c = 0; c < numberOfComponents; ++c)
+    {
+      order[c] = c;
+    }
+    const bool symmetricMatrix = IsSymmetricMatrix(image->GetBufferPointer());
+    if (symmetricMatrix && numberOfComponents == 6)
+    {
+      std::swap(order[2], order[3]);
+    }
+
+    error.Minimum = std::numeric_limits<double>::max();
+    error.Maximum = -std::numeric_limits<double>::max();
+    const size_t numberOfValues = numberOfPixels * numberOfComponents;
+    for (size_t i = 0; i < numberOfValues; ++i)
+    {
+      error.Minimum = std::min<double>(error.Minimum, values[i]);
+      error.Maximum = std::max<double>(error.Maximum, values[i]);
+    }
+    if (numberOfValues == 0)
+    {
+      error.Minimum = error.Maximum = 0.0;
+    }
+
+    // Components along the fifth dimension, one after the other.
+    std::string data;
+    float slope = 1.0f;
+    float intercept = 0.0f;
+    double squaredErrors = 0.0;
+    if (precision == Float32Precision)
+    {
+      data.resize(numberOfValues * sizeof(float));
+      float* output = reinterpret_cast<float*>(&data[0]);
+      for (unsigned int c = 0; c < numberOfComponents; ++c)
+      {
+        for (size_t i = 0; i < numberOfPixels; ++i)
+        {
+          const double value = values[i * numberOfComponents + order[c]];
+          const float stored = static_cast<float>(value);
+          output[c * numberOfPixels + i] = stored;
+          AddError(error, squaredErrors, stored - value);
+        }
+      }
+    }
+    else
+    {
+      if (error.Maximum > error.Minimum)
+      {
+        slope = static_cast<float>((error.Maximum - error.Minimum) / 65534.0);
+        intercept = static_cast<float>(0.5 * (error.Maximum + error.Minimum));
+      }
+      else
+      {
+        intercept = static_cast<float>(error.Minimum);
+      }
+
+      data.resize(numberOfValues * sizeof(int16_t));
+      int16_t* output = reinterpret_cast<int16_t*>(&data[0]);
+      for (unsigned int c = 0; c < numberOfComponents; ++c)
+      {
+        for (size_t i = 0; i < numberOfPixels; ++i)
+        {
+          const double value = values[i * numberOfComponents + order[c]];
+          const double level = std::max(
+              -32767.0,
+              std::min(32767.0, std::floor((value - intercept) / slope + 0.5)));
+          output[c * numberOfPixels + i] = static_cast<int16_t>(level);
+          AddError(error, squaredErrors,
+                   level * double(slope) + double(intercept) - value);
+        }
+      }
+    }
+    if (numberOfValues > 0)
+    {
+      error.RootMeanSquareError = std::sqrt(squaredErrors / numberOfValues);
+    }
+
+    std::string header = MakeHeader(
+        image, precision == Float32Precision ? 16 : 4,
+        precision == Float32Precision ? 32 : 16, numberOfComponents);
+    MappedImageIO::SetField<float>(header, 112, slope);
+    MappedImageIO::SetField<float>(header, 116, intercept);
+    if (numberOfComponents > 1)
+    {
+      // NIFTI_INTENT_SYMMATRIX or NIFTI_INTENT_VECTOR.
+      MappedImageIO::SetField<int16_t>(header, 68,
+                                       symmetricMatrix ? 1005 : 1007);
+    }
+    WriteNifti(fileName, header, data);
+    return error;
+  }
+
+  // Write the scale image as a uint8 index, 0 for the voxels without scale
+  // and i > 0 for the sigma i of the sidecar. The distinct scales are kept
+  // exactly when there are at most 255 of them (the fixed scale stack);
+  // otherwise (adaptive scales) 255 log-spaced sigmas cover their range.
+  template <typename TImage>
+  static QuantizationError WriteScaleIndex(const TImage* scales,
+                                           const std::string& fileName,
+                                           const std::string& sidecarFileName)
+  {
+    const size_t numberOfPixels =
+        scales->GetBufferedRegion().GetNumberOfPixels();
+    const typename TImage::PixelType* values = scales->GetBufferPointer();
+
+    std::set<double> distinct;
+    QuantizationError error;
+    error.Minimum = std::numeric_limits<double>::max();
+    for (size_t i = 0; i < numberOfPixels; ++i)
+    {
+      if (values[i] > 0)
+      {
+        error.Minimum = std::min<double>(error.Minimum, values[i]);
+        error.Maximum = std::max<double>(error.Maximum, values[i]);
+        if (distinct.size() <= 255)
+        {
+          distinct.insert(values[i]);
+        }
+      }
+    }
+    if (distinct.empty())
+    {
+      error.Minimum = 0.0;
+    }
+
+    std::vector<double> sigmas(1, 0.0);
+    if (distinct.size() <= 255)
+    {
+      sigmas.insert(sigmas.end(), distinct.begin(), distinct.end());
+    }
+    else
+    {
+      const double logMinimum = std::log(error.Minimum);
+      const double logStep = (std::log(error.Maximum) - logMinimum) / 254.0;
+      for (unsigned int s = 0; s < 255; ++s)
+      {
+        sigmas.push_back(std::exp(logMinimum + s * logStep));
+      }
+    }
+
+    std::string data(numberOfPixels, '\0');
+    double squaredErrors = 0.0;
+    for (size_t i = 0; i < numberOfPixels; ++i)
+    {
+      if (!(values[i] > 0))
+      {
+        continue;
+      }
+      const std::vector<double>::const_iterator upper =
+          std::lower_bound(sigmas.begin() + 1, sigmas.end(), values[i]);
+      size_t index = upper - sigmas.begin();
+      if (index == sigmas.size() ||
+          (index > 1 && values[i] - sigmas[index - 1] < *upper - values[i]))
+      {
+        --index;
+      }
+      data[i] = static_cast<char>(index);
+      AddError(error, squaredErrors, sigmas[index] - values[i]);
+    }
+    if (numberOfPixels > 0)
+    {
+      error.RootMeanSquareError = std::sqrt(squaredErrors / numberOfPixels);
+    }
+
+    WriteNifti(fileName, MakeHeader(scales, 2, 8, 1), data);
+
+    std::ofstream sidecar(sidecarFileName.c_str());
+    sidecar << std::setprecision(17) << "{\n  \"image\": \""
+            << fileName.substr(fileName.find_last_of("/\\") + 1)
+            << "\",\n  \"index_to_sigma\": [";
+    for (unsigned int s = 0; s < sigmas.size(); ++s)
+    {
+      sidecar << (s ? ", " : "") << sigmas[s];
+    }
+    sidecar << "]\n}\n";
+    if (!sidecar)
+    {
+      itkGenericExceptionMacro(<< "Cannot write " << sidecarFileName << ".");
+    }
+    return error;
+  }
+
+private:
+  template <typename TPixel>
+  static bool IsSymmetricMatrix(const TPixel*)
+  {
+    return false;
+  }
+
+  template <typename TValue, unsigned int VDimension>
+  static bool
+  IsSymmetricMatrix(const itk::SymmetricSecondRankTensor<TValue, VDimension>*)
+  {
+    return true;
+  }
+
+  static void AddError(QuantizationError& error, double& squaredErrors,
+                       double difference)
+  {
+    error.MaximumError = std::max(error.MaximumError, std::fabs(difference));
+    squaredErrors += difference * difference;
+  }
+
+  template <typename TImage>
+  static std::string MakeHeader(const TImage* image, int datatype,
+                                int bitpix, unsigned int numberOfComponents)
+  {
+    const unsigned int Dimension = TImage::ImageDimension;
+    std::vector<size_t> size(Dimension);
+    std::vector<double> spacing(Dimension);
+    std::vector<double> origin(Dimension);
+    std::vector<double> direction(Dimension * Dimension);
+    for (unsigned int i = 0; i < Dimension; ++i)
+    {
+      size[i] = image->GetBufferedRegion().GetSize(i);
+      spacing[i] = image->GetSpacing()[i];
+      origin[i] = image->GetOrigin()[i];
+      for (unsigned int j = 0; j < Dimension; ++j)
+      {
+        direction[i * Dimension + j] = image->GetDirection()[i][j];
+      }
+    }
+    std::string header = MappedImageIO::MakeNiftiHeader(
+        size, spacing, origin, direction, datatype, bitpix);
+    if (numberOfComponents > 1)
+    {
+      MappedImageIO::SetField<int16_t>(header, 40, 5);
+      MappedImageIO::SetField<int16_t>(header, 50, numberOfComponents);
+    }
+    return header;
+  }
+
+  // .nii.gz through zlib, .nii with pwrite.
+  static void WriteNifti(const std::string& fileName,
+                         const std::string& header, const std::string& data)
+  {
+    if (MappedImageIO::HasExtension(fileName, ".nii"))
+    {
+      MappedImageIO::WriteFile(fileName, header.data(), header.size(), 0,
+                               true);
+      MappedImageIO::WriteFile(fileName, data.data(), data.size(),
+                               header.size(), false);
+      return;
+    }
+    if (!MappedImageIO::HasExtension(fileName, ".nii.gz"))
+    {
+      itkGenericExceptionMacro(<< "Cannot write " << fileName
+                               << ": reduced precision needs a .nii or "
+                               << ".nii.gz file.");
+    }
+
+    gzFile file = gzopen(fileName.c_str(), "wb");
+    bool written = file != nullptr &&
+                   gzwrite(file, header.data(), header.size()) ==
+                       static_cast<int>(header.size());
+    for (size_t offset = 0; written && offset < data.size();
+         offset += 64 << 20)
+    {
+      const unsigned int chunk =
+          std::min<size_t>(data.size() - offset, 64 << 20);
+      written = gzwrite(file, data.data() + offset, chunk) ==
+                static_cast<int>(chunk);
+    }
+    if (file != nullptr && gzclose(file) != Z_OK)
+    {
+      written = false;
+    }
+    if (!written)
+    {
+      itkGenericExceptionMacro(<< "Cannot write " << fileName << ".");
+    }
+  }
+};
+
+#endif
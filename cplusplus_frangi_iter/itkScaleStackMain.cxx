@@ -0,0 +1,223 @@
+#if defined(_MSC_VER)
+#pragma warning(disable : 4786)
+#endif
+
+#include "itkMappedImageIO.h"
+#include "itkSparseScaleStack.h"
+
+#include "boost/program_options.hpp"
+#include "itkMultiThreader.h"
+
+#include <iomanip>
+#include <sstream>
+
+// Reductions of the sparse scale stacks (Scale_*_stack.vss) written by
+// itkVEDMain --sparseScaleFiles, computed from the stored runs without
+// expanding the stack: the maximum over the scales or over a range of them
+// (3dTstat -max stack[first..last]), the sigma of that maximum, and the dense
+// volume of single scales (stack[index]).
+
+const int Dimension = 3;
+typedef itk::Image<float, Dimension> ImageType;
+
+bool process_command_line(int argc, char** argv,
+                          boost::program_options::variables_map& vm)
+{
+  try
+  {
+    boost::program_options::options_description program(
+        "Program allowed options\n");
+    program.add_options()("help,h", "produce help message.");
+
+    boost::program_options::options_description requiredVariable("Required\n");
+    requiredVariable.add_options()(
+        "input,i", boost::program_options::value<std::string>()->required(),
+        "the sparse scale stack file name (.vss).");
+
+    boost::program_options::options_description reductionVariable(
+        "Reductions\n");
+    reductionVariable.add_options()(
+        "info", "Print the scales of the stack and their number of non-zero "
+                "voxels.")(
+        "maximum,o", boost::program_options::value<std::string>(),
+        "Maximum over the scales of each voxel.")(
+        "argmax,a", boost::program_options::value<std::string>(),
+        "Sigma of the maximum of each voxel (0 where every scale is zero).")(
+        "first,f", boost::program_options::value<int>()->default_value(0),
+        "First scale (in increasing sigma order) of the maximum.")(
+        "last,l", boost::program_options::value<int>()->default_value(-1),
+        "Last scale of the maximum (-1: the last scale of the stack).")(
+        "decode,d",
+        boost::program_options::value<std::vector<std::string>>(),
+        "'index,output': write the dense volume of one scale. Can be "
+        "repeated.")(
+        "threads,n", boost::program_options::value<int>()->default_value(0),
+        "The number of threads (0: ITK default).");
+
+    boost::program_options::options_description global;
+
+    global.add(program).add(requiredVariable).add(reductionVariable);
+
+    boost::program_options::store(
+        boost::program_options::parse_command_line(argc, argv, global), vm);
+
+    if (vm.count("help"))
+    {
+      std::cout << global << std::endl;
+      return false;
+    }
+
+    boost::program_options::notify(vm);
+
+    if (!vm.count("info") && !vm.count("maximum") && !vm.count("argmax") &&
+        !vm.count("decode"))
+    {
+      throw std::logic_error(
+          "nothing to do, use --info, --maximum, --argmax or --decode.");
+    }
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Error: " << e.what() << "\n";
+    return false;
+  }
+  catch (...)
+  {
+    std::cerr << "Unknown error!\n";
+    return false;
+  }
+  return true;
+}
+
+// An image on the grid of the stack, without buffer.
+ImageType::Pointer make_image(const SparseScaleStack& stack)
+{
+  ImageType::Pointer image = ImageType::New();
+  ImageType::RegionType region;
+  ImageType::SpacingType spacing;
+  ImageType::PointType origin;
+  ImageType::DirectionType direction;
+  for (unsigned int i = 0; i < Dimension; ++i)
+  {
+    region.SetSize(i, stack.GetSize()[i]);
+    spacing[i] = stack.GetSpacing()[i];
+    origin[i] = stack.GetOrigin()[i];
+    for (unsigned int j = 0; j < Dimension; ++j)
+    {
+      direction[i][j] = stack.GetDirection()[i * Dimension + j];
+    }
+  }
+  image->SetRegions(region);
+  image->SetSpacing(spacing);
+  image->SetOrigin(origin);
+  image->SetDirection(direction);
+  image->Allocate();
+  return image;
+}
+
+int main(int argc, char* argv[])
+{
+  boost::program_options::variables_map vm;
+  if (!process_command_line(argc, argv, vm))
+  {
+    return EXIT_FAILURE;
+  }
+
+  int numberOfThreads = vm["threads"].as<int>();
+  if (numberOfThreads <= 0)
+  {
+    numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  }
+
+  try
+  {
+    SparseScaleStack stack;
+    stack.SetNumberOfThreads(numberOfThreads);
+    std::cout << "Reading stack : " << vm["input"].as<std::string>()
+              << std::endl;
+    stack.Read(vm["input"].as<std::string>());
+
+    const unsigned int numberOfScales = stack.GetNumberOfScales();
+    if (vm.count("info"))
+    {
+      const double numberOfVoxels = stack.GetNumberOfVoxels();
+      std::cout << stack.GetSize()[0] << "x" << stack.GetSize()[1] << "x"
+                << stack.GetSize()[2] << ", " << numberOfScales
+                << " scales, " << stack.GetMemorySize() / 1048576.0
+                << " MiB sparse, "
+                << numberOfScales * numberOfVoxels * sizeof(float) / 1048576.0
+                << " MiB dense." << std::endl;
+      for (unsigned int s = 0; s < numberOfScales; ++s)
+      {
+        std::cout << "  [" << s << "] sigma " << std::setprecision(6)
+                  << stack.GetSigma(s) << " : "
+                  << stack.GetNumberOfValues(s) << " non-zero voxels ("
+                  << 100.0 * stack.GetNumberOfValues(s) /
+                         std::max(1.0, numberOfVoxels)
+                  << "%)" << std::endl;
+      }
+    }
+
+    if (vm.count("maximum") || vm.count("argmax"))
+    {
+      const int last = vm["last"].as<int>();
+      const unsigned int first = std::max(0, vm["first"].as<int>());
+      ImageType::Pointer maximum = make_image(stack);
+      ImageType::Pointer sigmas;
+      if (vm.count("argmax"))
+      {
+        sigmas = make_image(stack);
+      }
+      stack.MaximumProjection(
+          first, last < 0 ? numberOfScales - 1 : last,
+          maximum->GetBufferPointer(),
+          sigmas.IsNotNull() ? sigmas->GetBufferPointer() : nullptr);
+
+      if (vm.count("maximum"))
+      {
+        MappedImageIO::Write(maximum.GetPointer(),
+                             vm["maximum"].as<std::string>());
+      }
+      if (vm.count("argmax"))
+      {
+        MappedImageIO::Write(sigmas.GetPointer(),
+                             vm["argmax"].as<std::string>());
+      }
+    }
+
+    if (vm.count("decode"))
+    {
+      ImageType::Pointer image = make_image(stack);
+      for (const std::string& description :
+           vm["decode"].as<std::vector<std::string>>())
+      {
+        const size_t comma = description.find(',');
+        if (comma == std::string::npos)
+        {
+          throw std::runtime_error("Invalid decode '" + description +
+                                   "', expected index,output.");
+        }
+        const int index = std::stoi(description.substr(0, comma));
+        if (index < 0 || index >= static_cast<int>(numberOfScales))
+        {
+          throw std::out_of_range("Scale index out of range in '" +
+                                  description + "'.");
+        }
+        stack.Decode(index, image->GetBufferPointer());
+        MappedImageIO::Write(image.GetPointer(), description.substr(comma + 1));
+      }
+    }
+  }
+  catch (itk::ExceptionObject& err)
+  {
+    std::cerr << "Exception caught: " << err << std::endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::exception& err)
+  {
+    std::cerr << "Error: " << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,406 @@
+#ifndef __itkSparseScaleStack_h
+#define __itkSparseScaleStack_h
+
+#include "itkWorkStealingPool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// \class SparseScaleStack
+// \brief The per-scale responses of a multi-scale analysis, stored sparsely.
+//
+// The volume is cut into bricks of BrickSize^3 voxels. For every scale, each
+// brick keeps the runs of its non-zero voxels (offsets in the brick, x
+// fastest) and their values; an empty brick costs one word. The scales are
+// kept in increasing sigma order, the order 3dTcat gives to the
+// Scale_*_Vesselness files, so that a scale index is the sub-brick index of
+// the dense 4D stack.
+//
+// Decode(), MaximumProjection() and the file I/O work on the bricks in
+// parallel (WorkStealingPool). MaximumProjection() is the 3dTstat -max of
+// the dense stack (optionally over a range of scales, as stack[first..last]),
+// computed from the runs only: a voxel missing from a scale counts as a zero.
+
+class SparseScaleStack
+{
+public:
+  SparseScaleStack() : m_BrickSize{16}, m_NumberOfThreads{1}
+  {
+    const int size[3] = {0, 0, 0};
+    const double spacing[3] = {1.0, 1.0, 1.0};
+    const double origin[3] = {0.0, 0.0, 0.0};
+    const double direction[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    this->SetGeometry(size, spacing, origin, direction);
+  }
+
+  // Size, spacing, origin and direction (row major) of the volume. Clears
+  // the scales.
+  void SetGeometry(const int size[3], const double spacing[3],
+                   const double origin[3], const double direction[9])
+  {
+    std::copy(size, size + 3, m_Size);
+    std::copy(spacing, spacing + 3, m_Spacing);
+    std::copy(origin, origin + 3, m_Origin);
+    std::copy(direction, direction + 9, m_Direction);
+    m_Scales.clear();
+  }
+
+  // Remove the scales, keeping the geometry.
+  void Clear() { m_Scales.clear(); }
+
+  const int* GetSize() const { return m_Size; }
+  const double* GetSpacing() const { return m_Spacing; }
+  const double* GetOrigin() const { return m_Origin; }
+  const double* GetDirection() const { return m_Direction; }
+
+  // Edge of the bricks, 16 by default. Clears the scales.
+  void SetBrickSize(int brickSize)
+  {
+    m_BrickSize = std::max(1, brickSize);
+    m_Scales.clear();
+  }
+  int GetBrickSize() const { return m_BrickSize; }
+
+  void SetNumberOfThreads(int n) { m_NumberOfThreads = std::max(1, n); }
+  int GetNumberOfThreads() const { return m_NumberOfThreads; }
+
+  size_t GetNumberOfVoxels() const
+  {
+    return static_cast<size_t>(m_Size[0]) * m_Size[1] * m_Size[2];
+  }
+
+  unsigned int GetNumberOfScales() const { return m_Scales.size(); }
+  double GetSigma(unsigned int scale) const { return m_Scales[scale].Sigma; }
+
+  // Number of non-zero voxels of a scale.
+  size_t GetNumberOfValues(unsigned int scale) const
+  {
+    size_t count = 0;
+    for (size_t b = 0; b < m_Scales[scale].Bricks.size(); ++b)
+    {
+      count += m_Scales[scale].Bricks[b].Values.size();
+    }
+    return count;
+  }
+
+  // Bytes used by the runs and values of all the scales.
+  size_t GetMemorySize() const
+  {
+    size_t bytes = 0;
+    for (size_t s = 0; s < m_Scales.size(); ++s)
+    {
+      for (size_t b = 0; b < m_Scales[s].Bricks.size(); ++b)
+      {
+        const BrickType& brick = m_Scales[s].Bricks[b];
+        bytes += sizeof(BrickType) + brick.Runs.size() * sizeof(uint32_t) +
+                 brick.Values.size() * sizeof(float);
+      }
+    }
+    return bytes;
+  }
+
+  // Add the dense response (x fastest) of the scale sigma. Only the
+  // non-zero values are kept, as float.
+  template <typename TValue>
+  void AddScale(double sigma, const TValue* values)
+  {
+    ScaleType scale;
+    scale.Sigma = sigma;
+    scale.Bricks.resize(this->GetNumberOfBricks());
+
+    this->ForEachBrick([&](size_t b, const int begin[3], const int end[3]) {
+      BrickType& brick = scale.Bricks[b];
+      uint32_t offset = 0;
+      bool inRun = false;
+      for (int z = begin[2]; z < end[2]; ++z)
+      {
+        for (int y = begin[1]; y < end[1]; ++y)
+        {
+          const TValue* row =
+              values + (static_cast<size_t>(z) * m_Size[1] + y) * m_Size[0];
+          for (int x = begin[0]; x < end[0]; ++x, ++offset)
+          {
+            if (row[x] != 0)
+            {
+              if (!inRun)
+              {
+                brick.Runs.push_back(offset);
+                brick.Runs.push_back(0);
+                inRun = true;
+              }
+              ++brick.Runs.back();
+              brick.Values.push_back(static_cast<float>(row[x]));
+            }
+            else
+            {
+              inRun = false;
+            }
+          }
+        }
+      }
+    });
+
+    std::vector<ScaleType>::iterator position = m_Scales.begin();
+    while (position != m_Scales.end() && position->Sigma <= sigma)
+    {
+      ++position;
+    }
+    m_Scales.insert(position, scale);
+  }
+
+  // The dense response of a scale.
+  void Decode(unsigned int scale, float* output) const
+  {
+    const ScaleType& stack = m_Scales.at(scale);
+    this->ForEachBrick([&](size_t b, const int begin[3], const int end[3]) {
+      const BrickType& brick = stack.Bricks[b];
+      this->FillBrick(output, begin, end, 0.0f);
+      const float* value = brick.Values.data();
+      for (size_t r = 0; r < brick.Runs.size(); r += 2)
+      {
+        for (uint32_t k = 0; k < brick.Runs[r + 1]; ++k)
+        {
+          output[this->GetVoxel(begin, end, brick.Runs[r] + k)] = *value++;
+        }
+      }
+    });
+  }
+
+  // Maximum over the scales [first, last] of each voxel, and the sigma of
+  // the maximum (0 where every scale is zero) if sigmas is not null.
+  void MaximumProjection(unsigned int first, unsigned int last,
+                         float* maximum, float* sigmas = nullptr) const
+  {
+    last = std::min<unsigned int>(last, m_Scales.size() - 1);
+    if (m_Scales.empty() || first > last)
+    {
+      throw std::out_of_range("Empty scale range.");
+    }
+    const unsigned int numberOfScales = last - first + 1;
+
+    this->ForEachBrick([&](size_t b, const int begin[3], const int end[3]) {
+      const size_t brickVoxels = static_cast<size_t>(end[0] - begin[0]) *
+                                 (end[1] - begin[1]) * (end[2] - begin[2]);
+      std::vector<float> brickMaximum(brickVoxels,
+                                      -std::numeric_limits<float>::max());
+      std::vector<float> brickSigma(brickVoxels, 0.0f);
+      std::vector<unsigned int> count(brickVoxels, 0);
+      for (unsigned int s = first; s <= last; ++s)
+      {
+        const BrickType& brick = m_Scales[s].Bricks[b];
+        const float* value = brick.Values.data();
+        for (size_t r = 0; r < brick.Runs.size(); r += 2)
+        {
+          for (uint32_t k = 0; k < brick.Runs[r + 1]; ++k, ++value)
+          {
+            const uint32_t offset = brick.Runs[r] + k;
+            ++count[offset];
+            if (*value > brickMaximum[offset])
+            {
+              brickMaximum[offset] = *value;
+              brickSigma[offset] = m_Scales[s].Sigma;
+            }
+          }
+        }
+      }
+
+      for (size_t offset = 0; offset < brickVoxels; ++offset)
+      {
+        if (count[offset] < numberOfScales && brickMaximum[offset] <= 0.0f)
+        {
+          brickMaximum[offset] = 0.0f;
+          brickSigma[offset] = 0.0f;
+        }
+        const size_t voxel = this->GetVoxel(begin, end, offset);
+        maximum[voxel] = brickMaximum[offset];
+        if (sigmas)
+        {
+          sigmas[voxel] = brickSigma[offset];
+        }
+      }
+    });
+  }
+
+  // Binary file: geometry, brick size, then for every scale its sigma and,
+  // brick after brick, the number of runs, the runs and the values.
+  void Write(const std::string& fileName) const
+  {
+    std::ofstream file(fileName.c_str(), std::ios::binary);
+    file.write(GetFileMagic(), 8);
+    const uint32_t header[5] = {
+        static_cast<uint32_t>(m_Size[0]), static_cast<uint32_t>(m_Size[1]),
+        static_cast<uint32_t>(m_Size[2]), static_cast<uint32_t>(m_BrickSize),
+        static_cast<uint32_t>(m_Scales.size())};
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(m_Spacing), sizeof(m_Spacing));
+    file.write(reinterpret_cast<const char*>(m_Origin), sizeof(m_Origin));
+    file.write(reinterpret_cast<const char*>(m_Direction),
+               sizeof(m_Direction));
+    for (size_t s = 0; s < m_Scales.size(); ++s)
+    {
+      file.write(reinterpret_cast<const char*>(&m_Scales[s].Sigma),
+                 sizeof(double));
+      for (size_t b = 0; b < m_Scales[s].Bricks.size(); ++b)
+      {
+        const BrickType& brick = m_Scales[s].Bricks[b];
+        const uint32_t numberOfRuns = brick.Runs.size() / 2;
+        file.write(reinterpret_cast<const char*>(&numberOfRuns),
+                   sizeof(numberOfRuns));
+        file.write(reinterpret_cast<const char*>(brick.Runs.data()),
+                   brick.Runs.size() * sizeof(uint32_t));
+        file.write(reinterpret_cast<const char*>(brick.Values.data()),
+                   brick.Values.size() * sizeof(float));
+      }
+    }
+    if (!file)
+    {
+      throw std::runtime_error("Cannot write " + fileName + ".");
+    }
+  }
+
+  void Read(const std::string& fileName)
+  {
+    std::ifstream file(fileName.c_str(), std::ios::binary);
+    char magic[8];
+    uint32_t header[5];
+    if (!file.read(magic, sizeof(magic)) ||
+        std::memcmp(magic, GetFileMagic(), sizeof(magic)) != 0 ||
+        !file.read(reinterpret_cast<char*>(header), sizeof(header)))
+    {
+      throw std::runtime_error(fileName + " is not a sparse scale stack.");
+    }
+    int size[3] = {static_cast<int>(header[0]), static_cast<int>(header[1]),
+                   static_cast<int>(header[2])};
+    double spacing[3];
+    double origin[3];
+    double direction[9];
+    file.read(reinterpret_cast<char*>(spacing), sizeof(spacing));
+    file.read(reinterpret_cast<char*>(origin), sizeof(origin));
+    file.read(reinterpret_cast<char*>(direction), sizeof(direction));
+    this->SetBrickSize(header[3]);
+    this->SetGeometry(size, spacing, origin, direction);
+
+    m_Scales.resize(header[4]);
+    for (size_t s = 0; s < m_Scales.size() && file; ++s)
+    {
+      file.read(reinterpret_cast<char*>(&m_Scales[s].Sigma), sizeof(double));
+      m_Scales[s].Bricks.resize(this->GetNumberOfBricks());
+      for (size_t b = 0; b < m_Scales[s].Bricks.size() && file; ++b)
+      {
+        BrickType& brick = m_Scales[s].Bricks[b];
+        uint32_t numberOfRuns = 0;
+        file.read(reinterpret_cast<char*>(&numberOfRuns),
+                  sizeof(numberOfRuns));
+        brick.Runs.resize(2 * static_cast<size_t>(numberOfRuns));
+        file.read(reinterpret_cast<char*>(brick.Runs.data()),
+                  brick.Runs.size() * sizeof(uint32_t));
+        size_t numberOfValues = 0;
+        for (size_t r = 1; r < brick.Runs.size(); r += 2)
+        {
+          numberOfValues += brick.Runs[r];
+        }
+        brick.Values.resize(numberOfValues);
+        file.read(reinterpret_cast<char*>(brick.Values.data()),
+                  numberOfValues * sizeof(float));
+      }
+    }
+    if (!file)
+    {
+      m_Scales.clear();
+      throw std::runtime_error("Cannot read " + fileName + ".");
+    }
+  }
+
+private:
+  struct BrickType
+  {
+    std::vector<uint32_t> Runs; // (offset, length) pairs
+    std::vector<float> Values;
+  };
+
+  struct ScaleType
+  {
+    double Sigma;
+    std::vector<BrickType> Bricks;
+  };
+
+  // 8 bytes with the terminating zero.
+  static const char* GetFileMagic() { return "VEDSSS1"; }
+
+  int GetNumberOfBricks(int axis) const
+  {
+    return (m_Size[axis] + m_BrickSize - 1) / m_BrickSize;
+  }
+
+  size_t GetNumberOfBricks() const
+  {
+    return static_cast<size_t>(this->GetNumberOfBricks(0)) *
+           this->GetNumberOfBricks(1) * this->GetNumberOfBricks(2);
+  }
+
+  // Run body(brick, begin, end) on every brick, the bricks shared by the
+  // threads of the WorkStealingPool.
+  template <typename TBody>
+  void ForEachBrick(const TBody& body) const
+  {
+    const int bricks[3] = {this->GetNumberOfBricks(0),
+                           this->GetNumberOfBricks(1),
+                           this->GetNumberOfBricks(2)};
+    WorkStealingPool::GetInstance().ParallelFor(
+        "SparseScaleStack::ForEachBrick", this->GetNumberOfBricks(),
+        m_NumberOfThreads, [&](unsigned int, size_t b) {
+          const int brick[3] = {static_cast<int>(b % bricks[0]),
+                                static_cast<int>(b / bricks[0] % bricks[1]),
+                                static_cast<int>(b / bricks[0] / bricks[1])};
+          int begin[3];
+          int end[3];
+          for (unsigned int i = 0; i < 3; ++i)
+          {
+            begin[i] = brick[i] * m_BrickSize;
+            end[i] = std::min(m_Size[i], begin[i] + m_BrickSize);
+          }
+          body(b, begin, end);
+        });
+  }
+
+  // Index in the volume of the voxel at offset in the brick [begin, end).
+  size_t GetVoxel(const int begin[3], const int end[3], uint32_t offset) const
+  {
+    const int nx = end[0] - begin[0];
+    const int ny = end[1] - begin[1];
+    const int x = begin[0] + offset % nx;
+    const int y = begin[1] + (offset / nx) % ny;
+    const int z = begin[2] + offset / (nx * ny);
+    return (static_cast<size_t>(z) * m_Size[1] + y) * m_Size[0] + x;
+  }
+
+  void FillBrick(float* output, const int begin[3], const int end[3],
+                 float value) const
+  {
+    for (int z = begin[2]; z < end[2]; ++z)
+    {
+      for (int y = begin[1]; y < end[1]; ++y)
+      {
+        float* row =
+            output + (static_cast<size_t>(z) * m_Size[1] + y) * m_Size[0];
+        std::fill(row + begin[0], row + end[0], value);
+      }
+    }
+  }
+
+  int m_Size[3];
+  double m_Spacing[3];
+  double m_Origin[3];
+  double m_Direction[9];
+  int m_BrickSize;
+  int m_NumberOfThreads;
+  std::vector<ScaleType> m_Scales;
+};
+
+#endif
@@ -0,0 +1,603 @@
+#ifndef __itkStageTimer_h
+#define __itkStageTimer_h
+
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// \class StageTimer
+// \brief Process wide record of the time and memory traffic of named stages.
+//
+// The filters open a StageTimerScope around their expensive steps (Hessian,
+// vesselness passes, tensor build, diffusion update, file writing). Each
+// scope adds its wall time, CPU time, voxels and bytes allocated or written
+// to the record of its name, and one event to the trace. The threaded loops
+// also report the time of every thread (StageThreadTimes), from which the
+// work imbalance of the loop is computed.
+//
+// Nothing is measured unless the timer is enabled, so the scopes cost one
+// flag test in production runs. WriteJSON() writes the per-stage summary and
+// the events, WriteChromeTrace() the events in the Chrome trace_event format
+// (chrome://tracing or ui.perfetto.dev).
+//
+// The CPU time of a scope is the CPU time of the whole process while it was
+// open, so it includes the ITK worker threads; it is only meaningful for
+// stages which do not run concurrently with other stages.
+
+class StageTimer
+{
+public:
+  struct Record
+  {
+    unsigned long Calls = 0;
+    double Seconds = 0.0;
+    double CpuSeconds = 0.0;
+    double Voxels = 0.0;
+    double BytesAllocated = 0.0;
+    double BytesWritten = 0.0;
+
+    // Threaded loops: slowest thread time over the mean thread time.
+    unsigned long ParallelCalls = 0;
+    double ImbalanceSum = 0.0;
+    double MaximumImbalance = 0.0;
+
+    // Work-stealing loops: chunks run and chunks moved to another thread.
+    double Chunks = 0.0;
+    double StolenChunks = 0.0;
+
+    // Bytes read and written by the threads of each NUMA node, and the time
+    // of the slowest of these threads, summed over the loops.
+    std::vector<double> NodeBytes;
+    std::vector<double> NodeSeconds;
+  };
+
+  struct Event
+  {
+    std::string Name;
+    std::string Arguments; // JSON members, e.g. "sigma": 1.5
+    unsigned int Thread = 0;
+    double Start = 0.0; // seconds since the creation of the timer
+    double Seconds = 0.0;
+    double CpuSeconds = 0.0;
+    double Voxels = 0.0;
+    double BytesAllocated = 0.0;
+    double BytesWritten = 0.0;
+  };
+
+  typedef std::map<std::string, Record> RecordMapType;
+  typedef std::vector<Event> EventListType;
+
+  static StageTimer& GetInstance()
+  {
+    static StageTimer instance;
+    return instance;
+  }
+
+  static bool IsEnabled()
+  {
+    return GetInstance().m_Enabled.load(std::memory_order_relaxed);
+  }
+
+  void SetEnabled(bool enabled) { m_Enabled = enabled; }
+
+  // Seconds since the creation of the timer.
+  double Now() const
+  {
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - m_Origin;
+    return elapsed.count();
+  }
+
+  static double ProcessCpuTime() { return CpuTime(CLOCK_PROCESS_CPUTIME_ID); }
+  static double ThreadCpuTime() { return CpuTime(CLOCK_THREAD_CPUTIME_ID); }
+
+  // Size of a file in bytes, 0 if it does not exist.
+  static double FileSize(const std::string& fileName)
+  {
+    struct stat info;
+    if (stat(fileName.c_str(), &info) != 0)
+    {
+      return 0.0;
+    }
+    return static_cast<double>(info.st_size);
+  }
+
+  // Size of the pixel buffer of an image (or vector image) in bytes.
+  template <typename TImage>
+  static double ImageBytes(const TImage* image)
+  {
+    return static_cast<double>(image->GetPixelContainer()->Size()) *
+           sizeof(typename TImage::InternalPixelType);
+  }
+
+  // One call of a stage: added to its record and to the trace.
+  void Add(Event event)
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    Record& record = m_Records[event.Name];
+    ++record.Calls;
+    record.Seconds += event.Seconds;
+    record.CpuSeconds += event.CpuSeconds;
+    record.Voxels += event.Voxels;
+    record.BytesAllocated += event.BytesAllocated;
+    record.BytesWritten += event.BytesWritten;
+
+    event.Thread = this->GetThreadIndex();
+    m_Events.push_back(event);
+  }
+
+  // The work of one thread in a threaded loop: only added to the trace.
+  void AddThreadEvent(Event event)
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    event.Thread = this->GetThreadIndex();
+    m_Events.push_back(event);
+  }
+
+  // The time of every thread of one threaded loop.
+  void AddThreadTimes(const std::string& name,
+                      const std::vector<double>& seconds, double chunks = 0.0,
+                      double stolenChunks = 0.0)
+  {
+    double total = 0.0;
+    double slowest = 0.0;
+    for (unsigned int t = 0; t < seconds.size(); ++t)
+    {
+      total += seconds[t];
+      slowest = std::max(slowest, seconds[t]);
+    }
+    if (total <= 0.0)
+    {
+      return;
+    }
+    const double imbalance = slowest * seconds.size() / total;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    Record& record = m_Records[name];
+    ++record.ParallelCalls;
+    record.ImbalanceSum += imbalance;
+    record.MaximumImbalance = std::max(record.MaximumImbalance, imbalance);
+    record.Chunks += chunks;
+    record.StolenChunks += stolenChunks;
+  }
+
+  // The memory traffic of one threaded loop on every NUMA node.
+  void AddNodeTraffic(const std::string& name, const std::vector<double>& bytes,
+                      const std::vector<double>& seconds)
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    Record& record = m_Records[name];
+    if (record.NodeBytes.size() < bytes.size())
+    {
+      record.NodeBytes.resize(bytes.size(), 0.0);
+      record.NodeSeconds.resize(bytes.size(), 0.0);
+    }
+    for (unsigned int n = 0; n < bytes.size(); ++n)
+    {
+      record.NodeBytes[n] += bytes[n];
+      record.NodeSeconds[n] += seconds[n];
+    }
+  }
+
+  void Reset()
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Records.clear();
+    m_Events.clear();
+  }
+
+  RecordMapType GetRecords() const
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Records;
+  }
+
+  EventListType GetEvents() const
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Events;
+  }
+
+  // Per-stage summary followed by the list of the events.
+  void WriteJSON(std::ostream& os) const
+  {
+    const RecordMapType records = this->GetRecords();
+    const EventListType events = this->GetEvents();
+
+    os << "{\n  \"stages\": [";
+    RecordMapType::const_iterator it;
+    for (it = records.begin(); it != records.end(); ++it)
+    {
+      const Record& record = it->second;
+      os << (it == records.begin() ? "" : ",") << "\n    {\"name\": \""
+         << Escape(it->first) << "\", \"calls\": " << record.Calls
+         << ", \"seconds\": " << record.Seconds
+         << ", \"cpu_seconds\": " << record.CpuSeconds
+         << ", \"voxels_per_second\": "
+         << (record.Seconds > 0.0 ? record.Voxels / record.Seconds : 0.0)
+         << ", \"bytes_allocated\": " << record.BytesAllocated
+         << ", \"bytes_written\": " << record.BytesWritten;
+      if (record.ParallelCalls > 0)
+      {
+        os << ", \"parallel_calls\": " << record.ParallelCalls
+           << ", \"mean_imbalance\": "
+           << record.ImbalanceSum / record.ParallelCalls
+           << ", \"max_imbalance\": " << record.MaximumImbalance;
+      }
+      if (record.Chunks > 0.0)
+      {
+        os << ", \"chunks\": " << record.Chunks
+           << ", \"stolen_chunks\": " << record.StolenChunks;
+      }
+      if (!record.NodeBytes.empty())
+      {
+        os << ", \"node_bytes_per_second\": [";
+        for (unsigned int n = 0; n < record.NodeBytes.size(); ++n)
+        {
+          os << (n ? ", " : "")
+             << (record.NodeSeconds[n] > 0.0
+                     ? record.NodeBytes[n] / record.NodeSeconds[n]
+                     : 0.0);
+        }
+        os << "]";
+      }
+      os << "}";
+    }
+
+    os << "\n  ],\n  \"events\": [";
+    for (unsigned int e = 0; e < events.size(); ++e)
+    {
+      const Event& event = events[e];
+      os << (e ? "," : "") << "\n    {\"name\": \"" << Escape(event.Name)
+         << "\", \"thread\": " << event.Thread
+         << ", \"start\": " << event.Start
+         << ", \"seconds\": " << event.Seconds
+         << ", \"cpu_seconds\": " << event.CpuSeconds;
+      if (!event.Arguments.empty())
+      {
+        os << ", \"args\": {" << event.Arguments << "}";
+      }
+      os << "}";
+    }
+    os << "\n  ]\n}\n";
+  }
+
+  // The events as complete ("X") events, with counters of the bytes
+  // allocated and written so far.
+  void WriteChromeTrace(std::ostream& os) const
+  {
+    EventListType events = this->GetEvents();
+    std::sort(events.begin(), events.end(),
+              [](const Event& a, const Event& b) {
+                return a.Start + a.Seconds < b.Start + b.Seconds;
+              });
+
+    double allocated = 0.0;
+    double written = 0.0;
+
+    os << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    for (unsigned int e = 0; e < events.size(); ++e)
+    {
+      const Event& event = events[e];
+      const std::string::size_type separator = event.Name.find("::");
+
+      os << (e ? "," : "") << "\n  {\"name\": \"" << Escape(event.Name)
+         << "\", \"cat\": \"" << Escape(event.Name.substr(0, separator))
+         << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.Thread
+         << ", \"ts\": " << Microseconds(event.Start)
+         << ", \"dur\": " << Microseconds(event.Seconds)
+         << ", \"args\": {\"cpu_ms\": " << event.CpuSeconds * 1000.0;
+      if (event.Voxels > 0.0)
+      {
+        os << ", \"voxels\": " << event.Voxels;
+      }
+      if (!event.Arguments.empty())
+      {
+        os << ", " << event.Arguments;
+      }
+      os << "}}";
+
+      if (event.BytesAllocated > 0.0 || event.BytesWritten > 0.0)
+      {
+        allocated += event.BytesAllocated;
+        written += event.BytesWritten;
+        os << ",\n  {\"name\": \"bytes\", \"ph\": \"C\", \"pid\": 1, \"ts\": "
+           << Microseconds(event.Start + event.Seconds)
+           << ", \"args\": {\"allocated\": " << allocated
+           << ", \"written\": " << written << "}}";
+      }
+    }
+    os << "\n]}\n";
+  }
+
+  static std::string Escape(const std::string& text)
+  {
+    std::string escaped;
+    for (unsigned int c = 0; c < text.size(); ++c)
+    {
+      const unsigned char character = text[c];
+      if (character == '"' || character == '\\')
+      {
+        escaped += '\\';
+        escaped += text[c];
+      }
+      else if (character < 0x20)
+      {
+        char code[8];
+        std::snprintf(code, sizeof(code), "\\u%04x", character);
+        escaped += code;
+      }
+      else
+      {
+        escaped += text[c];
+      }
+    }
+    return escaped;
+  }
+
+private:
+  StageTimer()
+      : m_Enabled{false}, m_Origin{std::chrono::steady_clock::now()}
+  {
+  }
+  StageTimer(const StageTimer&);     // purposely not implemented
+  void operator=(const StageTimer&); // purposely not implemented
+
+  static double CpuTime(clockid_t clock)
+  {
+    struct timespec time;
+    if (clock_gettime(clock, &time) != 0)
+    {
+      return 0.0;
+    }
+    return time.tv_sec + time.tv_nsec * 1e-9;
+  }
+
+  static long long Microseconds(double seconds)
+  {
+    return static_cast<long long>(seconds * 1e6 + 0.5);
+  }
+
+  // Small stable thread numbers for the trace. Called with the lock held.
+  unsigned int GetThreadIndex()
+  {
+    const std::thread::id id = std::this_thread::get_id();
+    std::map<std::thread::id, unsigned int>::const_iterator it =
+        m_Threads.find(id);
+    if (it != m_Threads.end())
+    {
+      return it->second;
+    }
+    const unsigned int index = m_Threads.size();
+    m_Threads[id] = index;
+    return index;
+  }
+
+  std::atomic<bool> m_Enabled;
+  const std::chrono::steady_clock::time_point m_Origin;
+  mutable std::mutex m_Mutex;
+  RecordMapType m_Records;
+  EventListType m_Events;
+  std::map<std::thread::id, unsigned int> m_Threads;
+};
+
+// Measure the lifetime of the scope under name. voxels is the number of
+// voxels processed, used to report a throughput.
+class StageTimerScope
+{
+public:
+  explicit StageTimerScope(const char* name, double voxels = 0.0)
+      : m_Active{StageTimer::IsEnabled()}, m_StartCpu{0.0}
+  {
+    if (m_Active)
+    {
+      m_Event.Name = name;
+      m_Event.Voxels = voxels;
+      m_Event.Start = StageTimer::GetInstance().Now();
+      m_StartCpu = StageTimer::ProcessCpuTime();
+    }
+  }
+
+  StageTimerScope(const std::string& name, double voxels = 0.0)
+      : StageTimerScope(name.c_str(), voxels)
+  {
+  }
+
+  ~StageTimerScope() { this->Stop(); }
+
+  // Recorded with the event (scale, iteration, ...).
+  void SetArgument(const char* key, double value)
+  {
+    if (m_Active)
+    {
+      std::ostringstream argument;
+      argument << (m_Event.Arguments.empty() ? "" : ", ") << "\""
+               << StageTimer::Escape(key) << "\": " << value;
+      m_Event.Arguments += argument.str();
+    }
+  }
+
+  void AddBytesAllocated(double bytes)
+  {
+    if (m_Active)
+    {
+      m_Event.BytesAllocated += bytes;
+    }
+  }
+
+  // Count the size of a file written in the scope.
+  void AddFileWritten(const std::string& fileName)
+  {
+    if (m_Active)
+    {
+      m_Event.BytesWritten += StageTimer::FileSize(fileName);
+    }
+  }
+
+  // End the measure before the end of the scope.
+  void Stop()
+  {
+    if (m_Active)
+    {
+      StageTimer& timer = StageTimer::GetInstance();
+      m_Event.Seconds = timer.Now() - m_Event.Start;
+      m_Event.CpuSeconds = StageTimer::ProcessCpuTime() - m_StartCpu;
+      timer.Add(m_Event);
+      m_Active = false;
+    }
+  }
+
+private:
+  StageTimerScope(const StageTimerScope&); // purposely not implemented
+  void operator=(const StageTimerScope&);  // purposely not implemented
+
+  bool m_Active;
+  double m_StartCpu;
+  StageTimer::Event m_Event;
+};
+
+// \class StageThreadTimes
+// \brief Time of every thread of a threaded loop.
+//
+// Start() before the threads are launched, one Scope per thread around its
+// work, Finish() once they are joined: the imbalance of the loop is added to
+// the record of its name and every thread adds an event to the trace.
+class StageThreadTimes
+{
+public:
+  StageThreadTimes() : m_Active{false}, m_Chunks{0.0}, m_StolenChunks{0.0}
+  {
+  }
+
+  void Start(const std::string& name, unsigned int numberOfThreads)
+  {
+    m_Active = StageTimer::IsEnabled();
+    if (m_Active)
+    {
+      m_Name = name;
+      m_Seconds.assign(numberOfThreads, 0.0);
+      m_Chunks = 0.0;
+      m_StolenChunks = 0.0;
+      m_Nodes.assign(numberOfThreads, 0);
+      m_Bytes.assign(numberOfThreads, 0.0);
+    }
+  }
+
+  // Memory traffic of one thread and the NUMA node it ran on. Called by the
+  // thread itself.
+  void SetThreadTraffic(unsigned int threadId, unsigned int node, double bytes)
+  {
+    if (m_Active && threadId < m_Bytes.size())
+    {
+      m_Nodes[threadId] = node;
+      m_Bytes[threadId] = bytes;
+    }
+  }
+
+  // Work-stealing loops: chunks run and chunks stolen by another thread.
+  void SetChunkCounts(double chunks, double stolenChunks)
+  {
+    m_Chunks = chunks;
+    m_StolenChunks = stolenChunks;
+  }
+
+  void Finish()
+  {
+    if (m_Active)
+    {
+      StageTimer::GetInstance().AddThreadTimes(m_Name, m_Seconds, m_Chunks,
+                                               m_StolenChunks);
+
+      std::vector<double> nodeBytes;
+      std::vector<double> nodeSeconds;
+      for (unsigned int t = 0; t < m_Bytes.size(); ++t)
+      {
+        if (m_Bytes[t] <= 0.0)
+        {
+          continue;
+        }
+        if (m_Nodes[t] >= nodeBytes.size())
+        {
+          nodeBytes.resize(m_Nodes[t] + 1, 0.0);
+          nodeSeconds.resize(m_Nodes[t] + 1, 0.0);
+        }
+        nodeBytes[m_Nodes[t]] += m_Bytes[t];
+        nodeSeconds[m_Nodes[t]] =
+            std::max(nodeSeconds[m_Nodes[t]], m_Seconds[t]);
+      }
+      if (!nodeBytes.empty())
+      {
+        StageTimer::GetInstance().AddNodeTraffic(m_Name, nodeBytes,
+                                                 nodeSeconds);
+      }
+      m_Active = false;
+    }
+  }
+
+  class Scope
+  {
+  public:
+    Scope(StageThreadTimes& times, unsigned int threadId)
+        : m_Times{times.m_Active && threadId < times.m_Seconds.size()
+                      ? &times
+                      : nullptr},
+          m_ThreadId{threadId}, m_Start{0.0}, m_StartCpu{0.0}
+    {
+      if (m_Times)
+      {
+        m_Start = StageTimer::GetInstance().Now();
+        m_StartCpu = StageTimer::ThreadCpuTime();
+      }
+    }
+
+    ~Scope()
+    {
+      if (m_Times)
+      {
+        StageTimer& timer = StageTimer::GetInstance();
+        StageTimer::Event event;
+        event.Name = m_Times->m_Name;
+        event.Start = m_Start;
+        event.Seconds = timer.Now() - m_Start;
+        event.CpuSeconds = StageTimer::ThreadCpuTime() - m_StartCpu;
+        event.Arguments = "\"thread\": " + std::to_string(m_ThreadId);
+        m_Times->m_Seconds[m_ThreadId] += event.Seconds;
+        timer.AddThreadEvent(event);
+      }
+    }
+
+  private:
+    Scope(const Scope&);           // purposely not implemented
+    void operator=(const Scope&);  // purposely not implemented
+
+    StageThreadTimes* m_Times;
+    unsigned int m_ThreadId;
+    double m_Start;
+    double m_StartCpu;
+  };
+
+private:
+  StageThreadTimes(const StageThreadTimes&); // purposely not implemented
+  void operator=(const StageThreadTimes&);   // purposely not implemented
+
+  bool m_Active;
+  std::string m_Name;
+  std::vector<double> m_Seconds;
+  double m_Chunks;
+  double m_StolenChunks;
+  std::vector<unsigned int> m_Nodes;
+  std::vector<double> m_Bytes;
+};
+
+#endif
@@ -0,0 +1,502 @@
+#if defined(_MSC_VER)
+#pragma warning(disable : 4786)
+#endif
+
+#include "itkMappedImageIO.h"
+#include "itkRunLengthMask.h"
+
+#include "boost/program_options.hpp"
+#include "itkImageFileReader.h"
+#include "itkMultiThreader.h"
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+// Voxelwise statistics of registered subjects for the template (the
+// mean_data_VED, mean_data_VED_thresh and CAT_data_VED files). The subjects
+// are read slab by slab (a few slices of every subject at a time), so the
+// memory depends on the size of a slab, not on the number of subjects: the
+// mean and variance are accumulated in one pass (Welford), with the mean of
+// the thresholded values and the number of subjects above the threshold,
+// and the slabs of the 4D concatenations are written where they belong in
+// the output files as soon as they are read.
+
+const int Dimension = 3;
+typedef itk::Image<float, Dimension> ImageType;
+typedef itk::Image<float, Dimension + 1> SeriesImageType;
+typedef itk::ImageFileReader<ImageType> ReaderType;
+
+// A 3D output written by slab, or kept whole when its format cannot be
+// written by parts (e.g. .nii.gz).
+struct OutputInfo
+{
+  std::string FileName;
+  ImageType::Pointer Image;
+  std::string DataFileName;
+  size_t Offset;
+};
+
+// A 4D output written by slab.
+struct SeriesOutputInfo
+{
+  std::string FileName;
+  std::string DataFileName;
+  size_t Offset;
+};
+
+bool process_command_line(int argc, char** argv,
+                          boost::program_options::variables_map& vm)
+{
+  try
+  {
+    boost::program_options::options_description program(
+        "Program allowed options\n");
+    program.add_options()("help,h", "produce help message.");
+
+    boost::program_options::options_description inputVariable("Inputs\n");
+    inputVariable.add_options()(
+        "input,i",
+        boost::program_options::value<std::vector<std::string>>(),
+        "a subject file, registered to the template. Can be repeated.")(
+        "inputList,l", boost::program_options::value<std::string>(),
+        "a text file with one subject file per line (lines starting with # "
+        "are skipped).");
+
+    boost::program_options::options_description outputVariable(
+        "Outputs (at least one)\n");
+    outputVariable.add_options()(
+        "mean,m", boost::program_options::value<std::string>(),
+        "the voxelwise mean.")(
+        "thresholdedMean,t", boost::program_options::value<std::string>(),
+        "the voxelwise mean of the values above the threshold (the others "
+        "count as 0).")(
+        "variance,v", boost::program_options::value<std::string>(),
+        "the voxelwise unbiased variance (0 for one subject).")(
+        "count,c", boost::program_options::value<std::string>(),
+        "the number of subjects above the threshold at every voxel.")(
+        "concatenation,C", boost::program_options::value<std::string>(),
+        "the subjects concatenated in a 4D file (.nii or .mhd).")(
+        "thresholdedConcatenation,T",
+        boost::program_options::value<std::string>(),
+        "the thresholded subjects concatenated in a 4D file (.nii or .mhd).");
+
+    boost::program_options::options_description aggregationVariable(
+        "Aggregation\n");
+    aggregationVariable.add_options()(
+        "threshold", boost::program_options::value<double>()->default_value(0),
+        "Values above are kept by the thresholded outputs.")(
+        "slabSlices,s",
+        boost::program_options::value<int>()->default_value(16),
+        "Slices of every subject read at a time. Compressed inputs are "
+        "decompressed again for every slab: use uncompressed .nii files or "
+        "larger slabs.")(
+        "threads,n", boost::program_options::value<int>()->default_value(0),
+        "The number of threads (0: ITK default).");
+
+    boost::program_options::options_description global;
+
+    global.add(program)
+        .add(inputVariable)
+        .add(outputVariable)
+        .add(aggregationVariable);
+
+    boost::program_options::store(
+        boost::program_options::parse_command_line(argc, argv, global), vm);
+
+    if (vm.count("help"))
+    {
+      std::cout << global << std::endl;
+      return false;
+    }
+
+    boost::program_options::notify(vm);
+
+    if (!vm.count("input") && !vm.count("inputList"))
+    {
+      throw std::logic_error("no input: set --input or --inputList.");
+    }
+    if (!vm.count("mean") && !vm.count("thresholdedMean") &&
+        !vm.count("variance") && !vm.count("count") &&
+        !vm.count("concatenation") && !vm.count("thresholdedConcatenation"))
+    {
+      throw std::logic_error("no output.");
+    }
+    if (vm["slabSlices"].as<int>() < 1)
+    {
+      throw std::logic_error("slabSlices must be at least 1.");
+    }
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Error: " << e.what() << "\n";
+    return false;
+  }
+  catch (...)
+  {
+    std::cerr << "Unknown error!\n";
+    return false;
+  }
+  return true;
+}
+
+std::vector<std::string>
+read_subject_list(const boost::program_options::variables_map& vm)
+{
+  std::vector<std::string> subjects;
+  if (vm.count("input"))
+  {
+    subjects = vm["input"].as<std::vector<std::string>>();
+  }
+  if (vm.count("inputList"))
+  {
+    const std::string fileName = vm["inputList"].as<std::string>();
+    std::ifstream file(fileName.c_str());
+    if (!file)
+    {
+      throw std::runtime_error("cannot open the input list " + fileName);
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+      std::istringstream fields(line);
+      std::string subject;
+      if (fields >> subject && subject[0] != '#')
+      {
+        subjects.push_back(subject);
+      }
+    }
+  }
+  if (subjects.empty())
+  {
+    throw std::runtime_error("no subject in the inputs.");
+  }
+  return subjects;
+}
+
+// The geometry of every subject, checked against the first one; no voxel
+// is read.
+ImageType::Pointer read_geometry(const std::vector<std::string>& subjects)
+{
+  ImageType::Pointer reference;
+  for (unsigned int s = 0; s < subjects.size(); ++s)
+  {
+    ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName(subjects[s]);
+    reader->UpdateOutputInformation();
+    ImageType::Pointer image = reader->GetOutput();
+
+    if (reference.IsNull())
+    {
+      reference = ImageType::New();
+      reference->CopyInformation(image);
+      reference->SetRegions(image->GetLargestPossibleRegion());
+      continue;
+    }
+
+    if (image->GetLargestPossibleRegion() !=
+        reference->GetLargestPossibleRegion())
+    {
+      throw std::runtime_error(subjects[s] + " is not on the grid of " +
+                               subjects[0] + " (size).");
+    }
+    // The same relative tolerance for the spacing, the origin (in voxels)
+    // and the direction cosines.
+    for (unsigned int d = 0; d < Dimension; ++d)
+    {
+      const double tolerance = 1e-4 * reference->GetSpacing()[d];
+      if (std::abs(image->GetSpacing()[d] - reference->GetSpacing()[d]) >
+          tolerance)
+      {
+        throw std::runtime_error(subjects[s] + " is not on the grid of " +
+                                 subjects[0] + " (spacing).");
+      }
+      if (std::abs(image->GetOrigin()[d] - reference->GetOrigin()[d]) >
+          tolerance)
+      {
+        throw std::runtime_error(subjects[s] + " is not on the grid of " +
+                                 subjects[0] + " (origin).");
+      }
+      for (unsigned int e = 0; e < Dimension; ++e)
+      {
+        if (std::abs(image->GetDirection()[d][e] -
+                     reference->GetDirection()[d][e]) > 1e-4)
+        {
+          throw std::runtime_error(subjects[s] + " is not on the grid of " +
+                                   subjects[0] + " (direction).");
+        }
+      }
+    }
+  }
+  return reference;
+}
+
+void open_output(OutputInfo& output, const std::string& fileName,
+                 const ImageType* reference)
+{
+  output.FileName = fileName;
+  output.Offset = 0;
+  if (MappedImageIO::CanWriteHeader<ImageType>(fileName))
+  {
+    MappedImageIO::WriteHeader(reference, fileName, output.DataFileName,
+                               output.Offset);
+  }
+  else
+  {
+    output.Image = ImageType::New();
+    output.Image->CopyInformation(reference);
+    output.Image->SetRegions(reference->GetLargestPossibleRegion());
+    output.Image->Allocate();
+  }
+}
+
+void open_series_output(SeriesOutputInfo& output, const std::string& fileName,
+                        const ImageType* reference,
+                        unsigned int numberOfSubjects)
+{
+  if (!MappedImageIO::CanWriteHeader<SeriesImageType>(fileName))
+  {
+    throw std::runtime_error("the concatenation " + fileName +
+                             " must be a .nii or .mhd file.");
+  }
+
+  // The subjects along the 4th axis, 1 apart.
+  SeriesImageType::SizeType size;
+  SeriesImageType::SpacingType spacing;
+  SeriesImageType::PointType origin;
+  SeriesImageType::DirectionType direction;
+  direction.SetIdentity();
+  for (unsigned int d = 0; d < Dimension; ++d)
+  {
+    size[d] = reference->GetLargestPossibleRegion().GetSize(d);
+    spacing[d] = reference->GetSpacing()[d];
+    origin[d] = reference->GetOrigin()[d];
+    for (unsigned int e = 0; e < Dimension; ++e)
+    {
+      direction[d][e] = reference->GetDirection()[d][e];
+    }
+  }
+  size[Dimension] = numberOfSubjects;
+  spacing[Dimension] = 1.0;
+  origin[Dimension] = 0.0;
+
+  // Only the geometry: the buffer is never allocated.
+  SeriesImageType::Pointer series = SeriesImageType::New();
+  series->SetRegions(size);
+  series->SetSpacing(spacing);
+  series->SetOrigin(origin);
+  series->SetDirection(direction);
+
+  output.FileName = fileName;
+  MappedImageIO::WriteHeader(series.GetPointer(), fileName,
+                             output.DataFileName, output.Offset);
+}
+
+// The values of the voxels [first, first + values.size()).
+void write_slab(OutputInfo& output, const std::vector<float>& values,
+                size_t first)
+{
+  if (output.FileName.empty())
+  {
+    return;
+  }
+  if (output.Image.IsNotNull())
+  {
+    std::copy(values.begin(), values.end(),
+              output.Image->GetBufferPointer() + first);
+  }
+  else
+  {
+    MappedImageIO::WriteFile(output.DataFileName, values.data(),
+                             values.size() * sizeof(float),
+                             output.Offset + first * sizeof(float), false);
+  }
+}
+
+void close_output(OutputInfo& output)
+{
+  if (output.Image.IsNotNull())
+  {
+    MappedImageIO::Write(output.Image.GetPointer(), output.FileName);
+    output.Image = nullptr;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  boost::program_options::variables_map vm;
+  if (!process_command_line(argc, argv, vm))
+  {
+    return EXIT_FAILURE;
+  }
+
+  int numberOfThreads = vm["threads"].as<int>();
+  if (numberOfThreads <= 0)
+  {
+    numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  }
+  const double threshold = vm["threshold"].as<double>();
+  const int slabSlices = vm["slabSlices"].as<int>();
+
+  try
+  {
+    const std::vector<std::string> subjects = read_subject_list(vm);
+    const unsigned int numberOfSubjects = subjects.size();
+    std::cout << "Checking " << numberOfSubjects << " subjects" << std::endl;
+    ImageType::Pointer reference = read_geometry(subjects);
+
+    const ImageType::SizeType size =
+        reference->GetLargestPossibleRegion().GetSize();
+    const size_t sliceSize = static_cast<size_t>(size[0]) * size[1];
+    const size_t volumeSize = sliceSize * size[2];
+    const int nz = size[2];
+
+    OutputInfo mean, thresholdedMean, variance, count;
+    const char* names[] = {"mean", "thresholdedMean", "variance", "count"};
+    OutputInfo* outputs[] = {&mean, &thresholdedMean, &variance, &count};
+    for (unsigned int o = 0; o < 4; ++o)
+    {
+      if (vm.count(names[o]))
+      {
+        open_output(*outputs[o], vm[names[o]].as<std::string>(), reference);
+      }
+    }
+    SeriesOutputInfo concatenation, thresholdedConcatenation;
+    if (vm.count("concatenation"))
+    {
+      open_series_output(concatenation, vm["concatenation"].as<std::string>(),
+                         reference, numberOfSubjects);
+    }
+    if (vm.count("thresholdedConcatenation"))
+    {
+      open_series_output(
+          thresholdedConcatenation,
+          vm["thresholdedConcatenation"].as<std::string>(), reference,
+          numberOfSubjects);
+    }
+
+    for (int z0 = 0; z0 < nz; z0 += slabSlices)
+    {
+      const int slices = std::min(slabSlices, nz - z0);
+      const size_t slabSize = sliceSize * slices;
+      const size_t first = sliceSize * z0;
+      std::cout << "Slices " << z0 << " to " << z0 + slices - 1 << " of "
+                << nz << std::endl;
+
+      ImageType::RegionType slab = reference->GetLargestPossibleRegion();
+      slab.SetIndex(2, slab.GetIndex(2) + z0);
+      slab.SetSize(2, slices);
+
+      // Running mean and sum of squared deviations (Welford), sum of the
+      // thresholded values and number of values above the threshold.
+      std::vector<double> slabMean(slabSize, 0.0);
+      std::vector<double> slabM2(slabSize, 0.0);
+      std::vector<double> slabThresholdedSum(slabSize, 0.0);
+      std::vector<unsigned int> slabCount(slabSize, 0);
+      std::vector<float> slabThresholded;
+      if (!thresholdedConcatenation.FileName.empty())
+      {
+        slabThresholded.resize(slabSize);
+      }
+
+      for (unsigned int s = 0; s < numberOfSubjects; ++s)
+      {
+        ReaderType::Pointer reader = ReaderType::New();
+        reader->SetFileName(subjects[s]);
+        reader->UpdateOutputInformation();
+        reader->GetOutput()->SetRequestedRegion(slab);
+        reader->Update();
+
+        // Only the slab if the reader streams, the whole volume otherwise.
+        const ImageType* image = reader->GetOutput();
+        const float* values =
+            image->GetBufferPointer() + image->ComputeOffset(slab.GetIndex());
+
+        const double n = s + 1;
+        ParallelForSlices(slices, numberOfThreads,
+                          [&](int, int firstSlice, int endSlice) {
+                            for (size_t i = sliceSize * firstSlice;
+                                 i < sliceSize * endSlice; ++i)
+                            {
+                              const double value = values[i];
+                              const double delta = value - slabMean[i];
+                              slabMean[i] += delta / n;
+                              slabM2[i] += delta * (value - slabMean[i]);
+
+                              const bool above = value > threshold;
+                              slabThresholdedSum[i] += above ? value : 0.0;
+                              slabCount[i] += above;
+                              if (!slabThresholded.empty())
+                              {
+                                slabThresholded[i] =
+                                    above ? values[i] : 0.0f;
+                              }
+                            }
+                          });
+
+        const size_t seriesFirst = volumeSize * s + first;
+        if (!concatenation.FileName.empty())
+        {
+          MappedImageIO::WriteFile(
+              concatenation.DataFileName, values, slabSize * sizeof(float),
+              concatenation.Offset + seriesFirst * sizeof(float), false);
+        }
+        if (!thresholdedConcatenation.FileName.empty())
+        {
+          MappedImageIO::WriteFile(
+              thresholdedConcatenation.DataFileName, slabThresholded.data(),
+              slabSize * sizeof(float),
+              thresholdedConcatenation.Offset + seriesFirst * sizeof(float),
+              false);
+        }
+      }
+
+      std::vector<float> result(slabSize);
+      if (!mean.FileName.empty())
+      {
+        std::copy(slabMean.begin(), slabMean.end(), result.begin());
+        write_slab(mean, result, first);
+      }
+      if (!thresholdedMean.FileName.empty())
+      {
+        for (size_t i = 0; i < slabSize; ++i)
+        {
+          result[i] = slabThresholdedSum[i] / numberOfSubjects;
+        }
+        write_slab(thresholdedMean, result, first);
+      }
+      if (!variance.FileName.empty())
+      {
+        for (size_t i = 0; i < slabSize; ++i)
+        {
+          result[i] =
+              numberOfSubjects > 1 ? slabM2[i] / (numberOfSubjects - 1) : 0.0;
+        }
+        write_slab(variance, result, first);
+      }
+      if (!count.FileName.empty())
+      {
+        std::copy(slabCount.begin(), slabCount.end(), result.begin());
+        write_slab(count, result, first);
+      }
+    }
+
+    for (unsigned int o = 0; o < 4; ++o)
+    {
+      close_output(*outputs[o]);
+    }
+  }
+  catch (itk::ExceptionObject& err)
+  {
+    std::cerr << "Exception caught: " << err << std::endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::exception& err)
+  {
+    std::cerr << "Error: " << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,598 @@
+#if defined(_MSC_VER)
+#pragma warning(disable : 4786)
+#endif
+
+#include "itkAnisotropicDiffusionVesselEnhancementImageFilter.h"
+#include "itkGaussianCascadeHessian.h"
+#include "itkPooledImageContainer.h"
+#include "itkStageTimer.h"
+#include "itkWorkStealingPool.h"
+
+#include "boost/program_options.hpp"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkMultiThreader.h"
+#include "vnl/vnl_math.h"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+// vedbench: run the VED pipeline on synthetic vessel phantoms and report the
+// time spent in each stage (Hessian per sigma, vesselness passes, maximum
+// response, eigen analysis, tensor build, diffusion update, file writing),
+// the throughput in voxels per second, the scaling with the number of
+// threads (speedup relative to the first thread count of the same size) and
+// the peak resident memory of the process so far, as JSON.
+//
+// The phantom is a binary tree of tubes: the root runs along z and each
+// segment splits into two children, rotated alternatively around x and y,
+// with 0.7 times its radius and length. The intensity profile across a tube
+// is a smoothed step of one voxel, over a zero background, with additive
+// Gaussian noise.
+//
+// With --gaussianCascade, the runs use the Gaussian cascade and the report
+// has the error of the cascade Hessian against the direct one at every
+// scale of every phantom ("cascade_accuracy").
+
+const int Dimension = 3;
+typedef double PixelType;
+typedef itk::Image<PixelType, Dimension> ImageType;
+
+struct TubeSegment
+{
+  double Start[3];
+  double End[3];
+  double Radius;
+};
+
+bool process_command_line(int argc, char** argv,
+                          boost::program_options::variables_map& vm)
+{
+  try
+  {
+    boost::program_options::options_description program(
+        "Program allowed options\n");
+    program.add_options()("help,h", "produce help message.");
+
+    boost::program_options::options_description phantomVariable(
+        "Phantom\n");
+    phantomVariable.add_options()(
+        "sizes", boost::program_options::value<std::string>()->default_value(
+                     "32,64,96"),
+        "Comma separated edge lengths (voxels) of the cubic phantoms.")(
+        "depth", boost::program_options::value<int>()->default_value(4),
+        "Number of branching levels of the tube tree.")(
+        "noise", boost::program_options::value<double>()->default_value(10.0),
+        "Standard deviation of the Gaussian noise (tube intensity is 100).")(
+        "seed", boost::program_options::value<unsigned int>()->default_value(1),
+        "Seed of the noise generator.")(
+        "savePhantoms",
+        "Flag to write the phantoms (vedbench_phantom_<size>.nii.gz), e.g. "
+        "as inputs of itkVEDMain --validate.");
+
+    boost::program_options::options_description runVariable("Runs\n");
+    runVariable.add_options()(
+        "threads", boost::program_options::value<std::string>(),
+        "Comma separated thread counts (default: 1, 2, 4, ... up to the ITK "
+        "default).")(
+        "sigmaMin", boost::program_options::value<double>()->default_value(0.5),
+        "The minimum sigma.")(
+        "sigmaMax", boost::program_options::value<double>()->default_value(4.0),
+        "The maximum sigma.")(
+        "numberOfScale",
+        boost::program_options::value<int>()->default_value(4),
+        "The number of scales.")(
+        "adaptiveScales",
+        boost::program_options::value<int>()->default_value(0),
+        "The number of coarse scales of the adaptive scale search (0: off).")(
+        "numberOfIteration",
+        boost::program_options::value<int>()->default_value(1),
+        "The number of diffusion iterations.")(
+        "bufferPool",
+        "Reuse the freed image buffers (ImageBufferPool::Map counts the "
+        "buffers mapped).")(
+        "hugePages", "Pooled buffers in 2 MiB huge pages.")(
+        "gaussianCascade",
+        "Run the Gaussian cascade and report its Hessian error against the "
+        "direct Hessian at every scale.")(
+        "frangiKernel",
+        boost::program_options::value<std::string>()->default_value("auto"),
+        "The Frangi response kernel: auto, scalar, avx2 or avx512.")(
+        "workDir", boost::program_options::value<std::string>(),
+        "Directory receiving the files written by the filters (default: "
+        "current directory).")(
+        "output,o",
+        boost::program_options::value<std::string>()->default_value(
+            "vedbench.json"),
+        "The JSON report file name.");
+
+    boost::program_options::options_description global;
+    global.add(program).add(phantomVariable).add(runVariable);
+
+    boost::program_options::store(
+        boost::program_options::parse_command_line(argc, argv, global), vm);
+
+    if (vm.count("help"))
+    {
+      std::cout << global << std::endl;
+      return false;
+    }
+
+    boost::program_options::notify(vm);
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Error: " << e.what() << "\n";
+    return false;
+  }
+  catch (...)
+  {
+    std::cerr << "Unknown error!\n";
+    return false;
+  }
+  return true;
+}
+
+std::vector<int> parse_list(const std::string& description)
+{
+  std::vector<int> values;
+  std::stringstream stream(description);
+  std::string field;
+  while (std::getline(stream, field, ','))
+  {
+    values.push_back(std::stoi(field));
+  }
+  return values;
+}
+
+void add_segments(std::vector<TubeSegment>& segments, const double start[3],
+                  const double direction[3], double length, double radius,
+                  int level, int depth)
+{
+  TubeSegment segment;
+  for (unsigned int i = 0; i < 3; ++i)
+  {
+    segment.Start[i] = start[i];
+    segment.End[i] = start[i] + length * direction[i];
+  }
+  segment.Radius = radius;
+  segments.push_back(segment);
+
+  if (level + 1 >= depth)
+  {
+    return;
+  }
+
+  // Rotate the direction by +/- 35 degrees around x (even levels) or y.
+  const double angle = 35.0 * vnl_math::pi / 180.0;
+  for (int sign = -1; sign <= 1; sign += 2)
+  {
+    const double c = std::cos(sign * angle);
+    const double s = std::sin(sign * angle);
+    double child[3];
+    if (level % 2 == 0)
+    {
+      child[0] = direction[0];
+      child[1] = c * direction[1] - s * direction[2];
+      child[2] = s * direction[1] + c * direction[2];
+    }
+    else
+    {
+      child[0] = c * direction[0] + s * direction[2];
+      child[1] = direction[1];
+      child[2] = -s * direction[0] + c * direction[2];
+    }
+    add_segments(segments, segment.End, child, 0.7 * length, 0.7 * radius,
+                 level + 1, depth);
+  }
+}
+
+ImageType::Pointer make_phantom(int edge, int depth, double noise,
+                                unsigned int seed,
+                                std::vector<TubeSegment>& segments)
+{
+  ImageType::Pointer image = ImageType::New();
+  ImageType::SizeType size;
+  size.Fill(edge);
+  ImageType::RegionType region;
+  region.SetSize(size);
+  image->SetRegions(region);
+  image->Allocate();
+  image->FillBuffer(0.0);
+
+  segments.clear();
+  const double start[3] = {0.5 * edge, 0.5 * edge, 0.1 * edge};
+  const double direction[3] = {0.0, 0.0, 1.0};
+  add_segments(segments, start, direction, 0.35 * edge,
+               std::max(1.0, edge / 16.0), 0, depth);
+
+  // Smoothed step of one voxel across the tube wall; the tree is the maximum
+  // over its segments.
+  for (unsigned int s = 0; s < segments.size(); ++s)
+  {
+    const TubeSegment& segment = segments[s];
+    double axis[3];
+    double axisLength2 = 0.0;
+    ImageType::IndexType lower;
+    ImageType::SizeType extent;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      axis[i] = segment.End[i] - segment.Start[i];
+      axisLength2 += axis[i] * axis[i];
+
+      const double margin = segment.Radius + 2.0;
+      const long first = std::max(
+          0L, static_cast<long>(std::floor(
+                  std::min(segment.Start[i], segment.End[i]) - margin)));
+      const long last = std::min(
+          static_cast<long>(edge) - 1,
+          static_cast<long>(std::ceil(
+              std::max(segment.Start[i], segment.End[i]) + margin)));
+      lower[i] = first;
+      extent[i] = last >= first ? last - first + 1 : 0;
+    }
+
+    ImageType::RegionType box(lower, extent);
+    if (!box.GetNumberOfPixels())
+    {
+      continue;
+    }
+
+    itk::ImageRegionIteratorWithIndex<ImageType> it(image, box);
+    for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+    {
+      const ImageType::IndexType index = it.GetIndex();
+      double t = 0.0;
+      for (unsigned int i = 0; i < 3; ++i)
+      {
+        t += (index[i] - segment.Start[i]) * axis[i];
+      }
+      t = std::max(0.0, std::min(1.0, t / axisLength2));
+
+      double distance2 = 0.0;
+      for (unsigned int i = 0; i < 3; ++i)
+      {
+        distance2 +=
+            vnl_math_sqr(index[i] - (segment.Start[i] + t * axis[i]));
+      }
+      const double value =
+          50.0 * (1.0 - std::tanh(std::sqrt(distance2) - segment.Radius));
+      it.Set(std::max(it.Get(), value));
+    }
+  }
+
+  std::mt19937 generator(seed);
+  std::normal_distribution<double> distribution(0.0, noise);
+  PixelType* buffer = image->GetBufferPointer();
+  for (itk::SizeValueType i = 0; i < region.GetNumberOfPixels(); ++i)
+  {
+    buffer[i] += distribution(generator);
+  }
+
+  return image;
+}
+
+// The error of the Hessian of the Gaussian cascade against the direct
+// HessianRecursiveGaussianImageFilter at every sigma (increasing): largest
+// and root mean square difference of the components, relative to the
+// largest and root mean square component of the direct Hessian.
+void write_cascade_accuracy(std::ostream& report, const ImageType* phantom,
+                            const std::vector<double>& sigmas, bool& first)
+{
+  typedef itk::HessianRecursiveGaussianImageFilter<ImageType> HessianFilterType;
+  typedef HessianFilterType::OutputImageType HessianImageType;
+  const unsigned int numberOfComponents =
+      HessianImageType::PixelType::InternalDimension;
+
+  HessianFilterType::Pointer direct = HessianFilterType::New();
+  direct->SetInput(phantom);
+  direct->SetNormalizeAcrossScale(false);
+
+  HessianImageType::Pointer cascadeHessian = HessianImageType::New();
+  cascadeHessian->CopyInformation(phantom);
+  cascadeHessian->SetRegions(phantom->GetLargestPossibleRegion());
+  cascadeHessian->Allocate();
+  GaussianCascadeHessian<ImageType, HessianImageType> cascade;
+  cascade.SetInput(phantom);
+
+  const itk::SizeValueType numberOfPixels =
+      phantom->GetBufferedRegion().GetNumberOfPixels();
+  for (unsigned int s = 0; s < sigmas.size(); ++s)
+  {
+    direct->SetSigma(sigmas[s]);
+    direct->Update();
+    cascade.Compute(sigmas[s], cascadeHessian);
+
+    const HessianImageType::PixelType* reference =
+        direct->GetOutput()->GetBufferPointer();
+    const HessianImageType::PixelType* candidate =
+        cascadeHessian->GetBufferPointer();
+    double maximumReference = 0.0;
+    double maximumError = 0.0;
+    double sumReference = 0.0;
+    double sumError = 0.0;
+    for (itk::SizeValueType i = 0; i < numberOfPixels; ++i)
+    {
+      for (unsigned int c = 0; c < numberOfComponents; ++c)
+      {
+        const double error = candidate[i][c] - reference[i][c];
+        maximumReference =
+            std::max(maximumReference, std::abs(reference[i][c]));
+        maximumError = std::max(maximumError, std::abs(error));
+        sumReference += reference[i][c] * reference[i][c];
+        sumError += error * error;
+      }
+    }
+
+    report << (first ? "" : ",") << "\n    {\"size\": "
+           << phantom->GetBufferedRegion().GetSize(0)
+           << ", \"sigma\": " << sigmas[s] << ", \"max_relative_error\": "
+           << (maximumReference > 0.0 ? maximumError / maximumReference : 0.0)
+           << ", \"rms_relative_error\": "
+           << (sumReference > 0.0 ? std::sqrt(sumError / sumReference) : 0.0)
+           << "}";
+    first = false;
+  }
+}
+
+long peak_rss_kb()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+int main(int argc, char* argv[])
+{
+  boost::program_options::variables_map vm;
+  if (!process_command_line(argc, argv, vm))
+  {
+    return EXIT_FAILURE;
+  }
+
+  const std::vector<int> sizes = parse_list(vm["sizes"].as<std::string>());
+
+  FrangiKernel::KernelType frangiKernel;
+  try
+  {
+    frangiKernel =
+        FrangiKernel::GetKernelFromName(vm["frangiKernel"].as<std::string>());
+  }
+  catch (std::exception& err)
+  {
+    std::cerr << "Error: " << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (vm.count("bufferPool") || vm.count("hugePages"))
+  {
+    ImageBufferPool::GetInstance().SetEnabled(true);
+    ImageBufferPool::GetInstance().SetHugePages(vm.count("hugePages") > 0);
+    ImageBufferPoolFactory::RegisterOneFactory();
+  }
+
+  std::vector<int> threads;
+  if (vm.count("threads"))
+  {
+    threads = parse_list(vm["threads"].as<std::string>());
+  }
+  else
+  {
+    const int maximum = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    for (int t = 1; t < maximum; t *= 2)
+    {
+      threads.push_back(t);
+    }
+    threads.push_back(maximum);
+  }
+
+  // The report is opened before moving to the work directory.
+  std::ofstream report(vm["output"].as<std::string>().c_str());
+  if (!report)
+  {
+    std::cerr << "Error: cannot write " << vm["output"].as<std::string>()
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (vm.count("workDir") && chdir(vm["workDir"].as<std::string>().c_str()))
+  {
+    std::cerr << "Error: cannot enter " << vm["workDir"].as<std::string>()
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  typedef AnisotropicDiffusionVesselEnhancementImageFilter<ImageType,
+                                                           ImageType>
+      VesselnessFilterType;
+
+  StageTimer& stageTimer = StageTimer::GetInstance();
+  stageTimer.SetEnabled(true);
+
+  report << "{\n  \"sigma_min\": " << vm["sigmaMin"].as<double>()
+         << ",\n  \"sigma_max\": " << vm["sigmaMax"].as<double>()
+         << ",\n  \"number_of_scales\": " << vm["numberOfScale"].as<int>()
+         << ",\n  \"adaptive_scales\": " << vm["adaptiveScales"].as<int>()
+         << ",\n  \"number_of_iterations\": "
+         << vm["numberOfIteration"].as<int>() << ",\n  \"frangi_kernel\": \""
+         << FrangiKernel::GetKernelName(FrangiKernel::Resolve(frangiKernel))
+         << "\",\n  \"gaussian_cascade\": "
+         << (vm.count("gaussianCascade") ? "true" : "false")
+         << ",\n  \"runs\": [";
+
+  // The log-spaced scales of the runs, for the cascade accuracy.
+  std::vector<double> sigmas;
+  const int numberOfScales = vm["numberOfScale"].as<int>();
+  for (int i = 0; i < numberOfScales; ++i)
+  {
+    const double logMinimum = std::log(vm["sigmaMin"].as<double>());
+    const double logMaximum = std::log(vm["sigmaMax"].as<double>());
+    sigmas.push_back(std::exp(
+        numberOfScales > 1
+            ? logMinimum + (logMaximum - logMinimum) * i / (numberOfScales - 1)
+            : logMinimum));
+  }
+  std::ostringstream cascadeReport;
+  bool firstCascade = true;
+
+  bool firstRun = true;
+  for (unsigned int s = 0; s < sizes.size(); ++s)
+  {
+    std::vector<TubeSegment> segments;
+    ImageType::Pointer phantom =
+        make_phantom(sizes[s], vm["depth"].as<int>(), vm["noise"].as<double>(),
+                     vm["seed"].as<unsigned int>(), segments);
+    const double numberOfPixels =
+        phantom->GetBufferedRegion().GetNumberOfPixels();
+
+    if (vm.count("gaussianCascade"))
+    {
+      try
+      {
+        write_cascade_accuracy(cascadeReport, phantom, sigmas, firstCascade);
+      }
+      catch (itk::ExceptionObject& err)
+      {
+        std::cerr << "Exception caught: " << err << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    if (vm.count("savePhantoms"))
+    {
+      typedef itk::ImageFileWriter<ImageType> WriterType;
+      WriterType::Pointer writer = WriterType::New();
+      writer->SetFileName("vedbench_phantom_" + std::to_string(sizes[s]) +
+                          ".nii.gz");
+      writer->SetInput(phantom);
+      try
+      {
+        writer->Update();
+      }
+      catch (itk::ExceptionObject& err)
+      {
+        std::cerr << "Exception caught: " << err << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    double referenceSeconds = 0.0;
+    for (unsigned int t = 0; t < threads.size(); ++t)
+    {
+      std::cout << "vedbench: size " << sizes[s] << ", " << threads[t]
+                << " threads." << std::endl;
+
+      itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads[t]);
+      WorkStealingPool::GetInstance().SetNumberOfThreads(threads[t]);
+      stageTimer.Reset();
+
+      VesselnessFilterType::Pointer filter = VesselnessFilterType::New();
+      filter->SetInput(phantom);
+      filter->SetNumberOfThreads(threads[t]);
+      filter->SetSigmaMin(vm["sigmaMin"].as<double>());
+      filter->SetSigmaMax(vm["sigmaMax"].as<double>());
+      filter->SetNumberOfSigmaSteps(vm["numberOfScale"].as<int>());
+      filter->SetNumberOfCoarseScales(vm["adaptiveScales"].as<int>());
+      filter->SetNumberOfIterations(vm["numberOfIteration"].as<int>() + 1);
+      filter->SetFrangiKernel(frangiKernel);
+      filter->SetGaussianCascade(vm.count("gaussianCascade") > 0);
+
+      const std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      try
+      {
+        filter->Update();
+
+        typedef itk::ImageFileWriter<ImageType> WriterType;
+        WriterType::Pointer writer = WriterType::New();
+        writer->SetFileName("vedbench_output.nii.gz");
+        writer->SetInput(filter->GetOutput());
+        {
+          StageTimerScope timer("IO::WriteOutput", numberOfPixels);
+          writer->Update();
+          timer.AddFileWritten(writer->GetFileName());
+        }
+
+        typedef itk::ImageFileReader<ImageType> ReaderType;
+        ReaderType::Pointer reader = ReaderType::New();
+        reader->SetFileName("vedbench_output.nii.gz");
+        {
+          StageTimerScope timer("IO::ReadInput", numberOfPixels);
+          reader->Update();
+        }
+      }
+      catch (itk::ExceptionObject& err)
+      {
+        std::cerr << "Exception caught: " << err << std::endl;
+        return EXIT_FAILURE;
+      }
+      const std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+
+      if (t == 0)
+      {
+        referenceSeconds = elapsed.count();
+      }
+
+      report << (firstRun ? "" : ",") << "\n    {\n      \"size\": "
+             << sizes[s] << ",\n      \"voxels\": " << numberOfPixels
+             << ",\n      \"tube_radii\": [";
+      for (unsigned int g = 0; g < segments.size(); ++g)
+      {
+        report << (g ? ", " : "") << segments[g].Radius;
+      }
+      report << "],\n      \"threads\": " << threads[t]
+             << ",\n      \"total_seconds\": " << elapsed.count()
+             << ",\n      \"speedup\": "
+             << referenceSeconds / elapsed.count()
+             << ",\n      \"peak_rss_kb\": " << peak_rss_kb()
+             << ",\n      \"stages\": [";
+
+      const StageTimer::RecordMapType records = stageTimer.GetRecords();
+      StageTimer::RecordMapType::const_iterator it;
+      for (it = records.begin(); it != records.end(); ++it)
+      {
+        const StageTimer::Record& record = it->second;
+        report << (it == records.begin() ? "" : ",")
+               << "\n        {\"name\": \"" << StageTimer::Escape(it->first)
+               << "\", \"calls\": " << record.Calls
+               << ", \"seconds\": " << record.Seconds
+               << ", \"cpu_seconds\": " << record.CpuSeconds
+               << ", \"voxels_per_second\": "
+               << (record.Seconds > 0.0 ? record.Voxels / record.Seconds
+                                        : 0.0)
+               << ", \"bytes_allocated\": " << record.BytesAllocated
+               << ", \"bytes_written\": " << record.BytesWritten;
+        if (record.ParallelCalls > 0)
+        {
+          report << ", \"mean_imbalance\": "
+                 << record.ImbalanceSum / record.ParallelCalls;
+        }
+        if (record.Chunks > 0.0)
+        {
+          report << ", \"stolen_chunk_fraction\": "
+                 << record.StolenChunks / record.Chunks;
+        }
+        report << "}";
+      }
+      report << "\n      ]\n    }";
+      firstRun = false;
+    }
+  }
+  report << "\n  ]";
+  if (vm.count("gaussianCascade"))
+  {
+    report << ",\n  \"cascade_accuracy\": [" << cascadeReport.str()
+           << "\n  ]";
+  }
+  report << "\n}\n";
+
+  return EXIT_SUCCESS;
+}
@@ -4,40 +4,54 @@
 
 #include "itkAnisotropicDiffusionVesselEnhancementImageFilter.h"
 #include "itkSymmetricEigenVectorAnalysisImageFilter.h"
+#include "itkFirstTouchAllocator.h"
+#include "itkFrameScheduler.h"
+#include "itkMappedImageIO.h"
+#include "itkMultiHistogramThreshold.h"
+#include "itkNonLocalMeansImageFilter.h"
+#include "itkPooledImageContainer.h"
+#include "itkQuantizedImageWriter.h"
+#include "itkStageTimer.h"
+#include "itkVEDMemoryPlan.h"
+#include "itkVEDStageGraph.h"
+#include "itkWorkStealingPool.h"
 
 #include "boost/program_options.hpp"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
+#include "itkImageRegionConstIterator.h"
 #include "itkCastImageFilter.h"
-#include "itkLiThresholdImageFilter.h"
-#include "itkHuangThresholdImageFilter.h"
-#include "itkIntermodesThresholdImageFilter.h"
-#include "itkIsoDataThresholdImageFilter.h"
-#include "itkKittlerIllingworthThresholdImageFilter.h"
-#include "itkMaximumEntropyThresholdImageFilter.h"
-#include "itkMomentsThresholdImageFilter.h"
-#include "itkOtsuThresholdImageFilter.h"
-#include "itkRenyiEntropyThresholdImageFilter.h"
-#include "itkShanbhagThresholdImageFilter.h"
-#include "itkTriangleThresholdImageFilter.h"
-#include "itkYenThresholdImageFilter.h"
-#include "itkStatisticsImageFilter.h"
-
-#include "itkCurvatureFlowImageFilter.h"
-#include "itkSubtractImageFilter.h"
-#include "itkRescaleIntensityImageFilter.h"
+
 #include "itkGradientAnisotropicDiffusionImageFilter.h"
-#include "itkAnisotropicDiffusionImageFilter.h"
-#include "itkDenseFiniteDifferenceImageFilter.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+
+// With reference set (reference run of --validate), the options of the
+// referenceConfig file come first, then the baseline pipeline (scalar Frangi
+// kernel, every scale, no Gaussian cascade, no deconvolution, no image
+// spacing), and the command line only for the other options: the reference
+// keeps the model of the candidate but none of its optimizations.
 bool process_command_line(int argc, char** argv,
-                          boost::program_options::variables_map& vm)
+                          boost::program_options::variables_map& vm,
+                          bool reference = false,
+                          const std::string& referenceConfig = std::string())
 {
   try
   {
     boost::program_options::options_description program(
         "Program allowed options\n");
-    program.add_options()("help,h", "produce help message.");
+    program.add_options()("help,h", "produce help message.")(
+        "config,C", boost::program_options::value<std::string>(),
+        "A file of 'option = value' lines (same names as the long options). "
+        "The command line takes precedence.");
 
     boost::program_options::options_description requiredVariable("Required\n");
     requiredVariable.add_options()(
@@ -60,7 +74,29 @@ bool process_command_line(int argc, char** argv,
         "numberOfScale,n",
         boost::program_options::value<int>()->default_value(5),
         "The number of scales created between the sigma min/max in the "
-        "multi-scale analysis.");
+        "multi-scale analysis.")(
+        "adaptiveScales",
+        boost::program_options::value<int>()->default_value(0),
+        "Adaptive scale search: only this number of coarse scales is "
+        "computed and the best scale is interpolated between them. 0 or at "
+        "least numberOfScale: every scale is computed.")(
+        "gaussianCascade",
+        boost::program_options::value<bool>()->default_value(false)
+            ->implicit_value(true),
+        "Flag to compute the scales from the smallest up, each smoothed "
+        "from the previous one with a narrow kernel, and the Hessian by "
+        "finite differences (vedbench --gaussianCascade reports the error "
+        "against the direct Hessian).")(
+        "deconvolution",
+        boost::program_options::value<bool>()->default_value(false)
+            ->implicit_value(true),
+        "Flag to deconvolve the vesselness of every scale by a Gaussian of "
+        "variance 2 sigma (FFT, Tikhonov) before the processed scale files "
+        "and the best response.")(
+        "deconvolutionRegularization",
+        boost::program_options::value<double>()->default_value(0.01),
+        "The Tikhonov regularization of the deconvolution (larger: "
+        "smoother, less noise amplification).");
 
     boost::program_options::options_description vesselnessVariable(
         "Frangi vesselness measure\n");
@@ -74,7 +110,11 @@ bool process_command_line(int argc, char** argv,
         "equation to limit plate-like structure.")(
         "c,c", boost::program_options::value<double>()->default_value(0.00001),
         "The c parameter used in Frangi vesselness equation to limit the "
-        "background comparison.");
+        "background comparison.")(
+        "frangiKernel",
+        boost::program_options::value<std::string>()->default_value("auto"),
+        "The Frangi response kernel: auto (the widest supported by the "
+        "processor), scalar, avx2 or avx512.");
 
     boost::program_options::options_description vedVariable(
         "Vessel Enhancing Diffusion\n");
@@ -90,7 +130,15 @@ bool process_command_line(int argc, char** argv,
         "The weigthed strength used in VED param.")(
         "epsilon,e",
         boost::program_options::value<double>()->default_value(1.0),
-        "The epsilon used in VED param.");
+        "The epsilon used in VED param.")(
+        "useImageSpacing",
+        boost::program_options::value<bool>()->default_value(false)
+            ->implicit_value(true),
+        "Flag to divide the finite differences of the diffusion by the "
+        "voxel spacing relative to the smallest one, for inputs which are "
+        "not isotropic: the same diffusion as on the input upsampled to its "
+        "smallest voxel dimension (the Hessian scales are always in physical "
+        "units).");
 
     boost::program_options::options_description flagVariable("Flags\n");
     flagVariable.add_options()("frangiOnly,f", "Flag to stop the pipeline "
@@ -103,7 +151,148 @@ bool process_command_line(int argc, char** argv,
         "generateHessian,H",
         "Flag to generate an output with the hessian matrix per voxel.")(
         "generateIterationFiles,I",
-        "Flag to generate output iteration files and vesselness.");
+        "Flag to generate output iteration files and vesselness.")(
+        "noScaleFiles",
+        "Flag to skip the Scale_*_Vesselness.nii.gz files of every scale.")(
+        "sparseScaleFiles",
+        "Flag to write the scale files as three sparse stacks "
+        "(Scale_{NOWEINER,processed,rescaled}_stack.vss, read by "
+        "ScaleStack) in place of one dense file per scale.")(
+        "noTensorFiles",
+        "Flag to skip the diffusion_mrtrix_tensor and diffusion_peaks "
+        "files.")(
+        "releaseBuffers",
+        "Flag to release the internal buffers as soon as they are not "
+        "needed (lower peak memory).")(
+        "auxiliaryPrecision",
+        boost::program_options::value<std::string>()->default_value("full"),
+        "Precision of the best Hessian, tensor and peak files: full, float32 "
+        "or int16 (scaled with the NIfTI scl_slope/scl_inter). The "
+        "quantization error is printed.")(
+        "scaleIndex",
+        "Flag to write the best scale image as a uint8 scale index with the "
+        "sigma of every index in a JSON sidecar.");
+
+    boost::program_options::options_description segmentationVariable(
+        "Automatic thresholds\n");
+    segmentationVariable.add_options()(
+        "thresholdMethods,T", boost::program_options::value<std::string>(),
+        "Comma separated threshold methods applied to the output, all "
+        "computed from the same histogram (Huang, Intermodes, IsoData, "
+        "KittlerIllingworth, Li, MaximumEntropy, Moments, Otsu, RenyiEntropy, "
+        "Shanbhag, Triangle, Yen or all). Writes Ved_<method>.nii.gz.")(
+        "thresholdMask", boost::program_options::value<std::string>(),
+        "Only the voxels inside this mask are used for the histogram and "
+        "the segmentations.")(
+        "histogramBins",
+        boost::program_options::value<int>()->default_value(100),
+        "The number of histogram bins.");
+
+    boost::program_options::options_description stageVariable("Stages\n");
+    stageVariable.add_options()(
+        "smoothing",
+        boost::program_options::value<std::vector<std::string>>(),
+        "'iterations[,conductance[,timeStep]]' of a gradient anisotropic "
+        "diffusion of the output (default conductance 0.3, time step 0.02). "
+        "Can be repeated. Writes Ved_GradientAnisotropicDiffusion_"
+        "<iterations>_c<conductance>_t<timeStep>.nii.gz.")(
+        "intermediateExtension",
+        boost::program_options::value<std::string>()->default_value(".nii.gz"),
+        "Extension of the files written by the stages (smoothing, "
+        "segmentations, best scale and Hessian): .nii.gz, .nii (uncompressed, "
+        "written without copy) or .mhd (MetaImage header and raw voxels). "
+        "The .nii and .mhd inputs are memory mapped.")(
+        "threads", boost::program_options::value<int>()->default_value(0),
+        "The number of threads of the filters, set once for the whole run "
+        "(0: ITK default). The threaded loops share small chunks of the "
+        "image between them (work stealing).")(
+        "pinThreads",
+        "Bind every thread of the filters to one CPU, spread over the NUMA "
+        "nodes in order.")(
+        "numaFirstTouch",
+        "Initialise the large buffers (diffusion output, update and tensors, "
+        "best response, scales and Hessian) with the threads which process "
+        "them, so that each slab is in the memory of its NUMA node. Use with "
+        "--pinThreads on multi-socket machines.")(
+        "bufferPool",
+        "Keep the freed image buffers and reuse them for the next buffers of "
+        "the same size, so that the scales and iterations after the first "
+        "allocate nothing.")(
+        "hugePages",
+        "Pooled buffers in 2 MiB huge pages (implies --bufferPool).")(
+        "stageThreads",
+        boost::program_options::value<int>()->default_value(0),
+        "The number of independent stages run concurrently (0: ITK "
+        "default).")(
+        "memoryBudget", boost::program_options::value<std::string>(),
+        "Peak memory allowed (e.g. 800M, 16G). The buffers are released "
+        "early, then the scale and tensor files are dropped until the "
+        "memory plan fits; the program stops before reading the image if "
+        "it still does not.");
+
+    boost::program_options::options_description denoisingVariable(
+        "Denoising\n");
+    denoisingVariable.add_options()(
+        "denoise",
+        "Denoise the input with non-local means before the VED, in memory "
+        "(as dipy_nlmeans.py).")(
+        "denoiseSigma",
+        boost::program_options::value<double>()->default_value(0.0),
+        "Standard deviation of the noise (0: estimated from the input).")(
+        "denoiseMask", boost::program_options::value<std::string>(),
+        "Only the voxels inside this mask are denoised; the others are set "
+        "to 0.")(
+        "denoisePatchRadius",
+        boost::program_options::value<int>()->default_value(1),
+        "Radius of the patches compared.")(
+        "denoiseSearchRadius",
+        boost::program_options::value<int>()->default_value(5),
+        "Radius of the search window.")(
+        "denoiseGaussian",
+        "Gaussian noise: no Rician bias correction (e.g. phase images).")(
+        "denoiseOutput", boost::program_options::value<std::string>(),
+        "With --denoise, also write the denoised input to this file.");
+
+    boost::program_options::options_description timeSeriesVariable(
+        "Time series (4D input)\n");
+    timeSeriesVariable.add_options()(
+        "frameLanes", boost::program_options::value<int>()->default_value(1),
+        "The number of frames of a 4D input processed at the same time, each "
+        "by its own filter. The frames of a lane share its filter (scales, "
+        "FFT plans) and all lanes share the threads and the buffer pool.")(
+        "warmStartIterations",
+        boost::program_options::value<int>()->default_value(0),
+        "Start the diffusion of every frame after the first of its lane from "
+        "the diffused previous frame plus the change of the input, with this "
+        "number of iterations instead of numberOfIteration (0: every frame "
+        "starts from its input). The lanes then get contiguous frames.");
+
+    boost::program_options::options_description instrumentationVariable(
+        "Instrumentation\n");
+    instrumentationVariable.add_options()(
+        "profile", boost::program_options::value<std::string>(),
+        "Write the wall time, CPU time, throughput, thread imbalance and "
+        "bytes allocated/written of every stage, scale and iteration to "
+        "this JSON file.")(
+        "trace", boost::program_options::value<std::string>(),
+        "Write the same measures in the Chrome trace_event format (open in "
+        "chrome://tracing or ui.perfetto.dev).");
+
+    boost::program_options::options_description validationVariable(
+        "Validation\n");
+    validationVariable.add_options()(
+        "validate", boost::program_options::value<std::string>(),
+        "Also run the reference pipeline on the same input and write to this "
+        "JSON file the max/mean absolute error of the output, the Dice of "
+        "the thresholded outputs, the best-scale agreement and the speedup.")(
+        "validateReference", boost::program_options::value<std::string>(),
+        "A file of 'option = value' lines for the reference run. By "
+        "default the reference is the baseline pipeline (scalar Frangi "
+        "kernel, every scale, gaussianCascade, deconvolution and "
+        "useImageSpacing off) with the other options of the command line.")(
+        "validateThreshold",
+        boost::program_options::value<std::string>()->default_value("Otsu"),
+        "The threshold method of the Dice.");
 
     boost::program_options::options_description global;
 
@@ -112,11 +301,47 @@ bool process_command_line(int argc, char** argv,
         .add(multipleHessianVariable)
         .add(vesselnessVariable)
         .add(vedVariable)
-        .add(flagVariable);
+        .add(flagVariable)
+        .add(segmentationVariable)
+        .add(stageVariable)
+        .add(denoisingVariable)
+        .add(timeSeriesVariable)
+        .add(instrumentationVariable)
+        .add(validationVariable);
+
+    if (!referenceConfig.empty())
+    {
+      boost::program_options::store(
+          boost::program_options::parse_config_file<char>(
+              referenceConfig.c_str(), global),
+          vm);
+    }
+
+    // The first value stored is kept: the baseline goes before the command
+    // line, which would otherwise bring the optimizations of the candidate.
+    if (reference)
+    {
+      const char* baseline[] = {
+          argv[0], "--frangiKernel=scalar", "--adaptiveScales=0",
+          "--gaussianCascade=false", "--deconvolution=false",
+          "--useImageSpacing=false"};
+      boost::program_options::store(
+          boost::program_options::parse_command_line(
+              sizeof(baseline) / sizeof(*baseline), baseline, global),
+          vm);
+    }
 
     boost::program_options::store(
         boost::program_options::parse_command_line(argc, argv, global), vm);
 
+    if (vm.count("config"))
+    {
+      boost::program_options::store(
+          boost::program_options::parse_config_file<char>(
+              vm["config"].as<std::string>().c_str(), global),
+          vm);
+    }
+
     if (vm.count("help"))
     {
       std::cout << global << std::endl;
@@ -138,6 +363,621 @@ bool process_command_line(int argc, char** argv,
   return true;
 }
 
+
+struct SmoothingInfo
+{
+  int Iterations;
+  double Conductance;
+  double TimeStep;
+};
+
+SmoothingInfo parse_smoothing(const std::string& description)
+{
+  std::vector<std::string> fields;
+  std::stringstream stream(description);
+  std::string field;
+  while (std::getline(stream, field, ','))
+  {
+    fields.push_back(field);
+  }
+  if (fields.empty() || fields.size() > 3)
+  {
+    throw std::runtime_error("Invalid smoothing '" + description +
+                             "', expected iterations[,conductance[,timeStep]].");
+  }
+
+  SmoothingInfo smoothing;
+  smoothing.Iterations = std::stoi(fields[0]);
+  smoothing.Conductance = fields.size() > 1 ? std::stod(fields[1]) : 0.3;
+  smoothing.TimeStep = fields.size() > 2 ? std::stod(fields[2]) : 0.02;
+  return smoothing;
+}
+
+// Ved_GradientAnisotropicDiffusion_<iterations>_c<conductance>_t<timeStep>:
+// the variants with the same number of iterations get their own file.
+std::string smoothing_file_name(const SmoothingInfo& smoothing,
+                                const std::string& extension)
+{
+  std::ostringstream name;
+  name << "Ved_GradientAnisotropicDiffusion_" << smoothing.Iterations << "_c"
+       << smoothing.Conductance << "_t" << smoothing.TimeStep << extension;
+  return name.str();
+}
+
+std::vector<std::string> split_methods(const std::string& description,
+                                       const std::vector<std::string>& all)
+{
+  std::vector<std::string> methods;
+  std::stringstream stream(description);
+  std::string method;
+  while (std::getline(stream, method, ','))
+  {
+    if (method == "all")
+    {
+      return all;
+    }
+    methods.push_back(method);
+  }
+  return methods;
+}
+
+bool write_instrumentation(const boost::program_options::variables_map& vm)
+{
+  const StageTimer& stageTimer = StageTimer::GetInstance();
+  if (vm.count("profile"))
+  {
+    std::ofstream profile(vm["profile"].as<std::string>().c_str());
+    stageTimer.WriteJSON(profile);
+    if (!profile)
+    {
+      std::cerr << "Error: cannot write " << vm["profile"].as<std::string>()
+                << std::endl;
+      return false;
+    }
+  }
+  if (vm.count("trace"))
+  {
+    std::ofstream trace(vm["trace"].as<std::string>().c_str());
+    stageTimer.WriteChromeTrace(trace);
+    if (!trace)
+    {
+      std::cerr << "Error: cannot write " << vm["trace"].as<std::string>()
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// The header of an image.
+itk::ImageIOBase::Pointer read_image_information(const std::string& fileName)
+{
+  itk::ImageIOBase::Pointer imageIO = itk::ImageIOFactory::CreateImageIO(
+      fileName.c_str(), itk::ImageIOFactory::ReadMode);
+  if (!imageIO)
+  {
+    throw std::runtime_error("Cannot read the image " + fileName + ".");
+  }
+  imageIO->SetFileName(fileName);
+  imageIO->ReadImageInformation();
+  return imageIO;
+}
+
+// Number of pixels of an image, from its header only.
+double read_number_of_pixels(const std::string& fileName)
+{
+  itk::ImageIOBase::Pointer imageIO = read_image_information(fileName);
+
+  double numberOfPixels = 1.0;
+  for (unsigned int d = 0; d < imageIO->GetNumberOfDimensions(); ++d)
+  {
+    numberOfPixels *= imageIO->GetDimensions(d);
+  }
+  return numberOfPixels;
+}
+
+// The multi-scale Hessian, Frangi and VED parameters given by the options.
+template <typename TFilter>
+void set_filter_parameters(TFilter* filter,
+                           const boost::program_options::variables_map& vm)
+{
+  filter->SetSigmaMin(vm["sigmaMin"].as<double>());
+  filter->SetSigmaMax(vm["sigmaMax"].as<double>());
+  filter->SetNumberOfSigmaSteps(vm["numberOfScale"].as<int>());
+  filter->SetNumberOfCoarseScales(vm["adaptiveScales"].as<int>());
+  filter->SetGaussianCascade(vm["gaussianCascade"].as<bool>());
+  filter->SetDeconvolution(vm["deconvolution"].as<bool>());
+  filter->SetDeconvolutionRegularization(
+      vm["deconvolutionRegularization"].as<double>());
+
+  filter->SetBrightBlood(!vm.count("darkBlood"));
+  filter->SetAlpha(vm["alpha"].as<double>());
+  filter->SetBeta(vm["beta"].as<double>());
+  filter->SetC(vm["c"].as<double>());
+  filter->SetFrangiKernel(
+      FrangiKernel::GetKernelFromName(vm["frangiKernel"].as<std::string>()));
+
+  // Add + 1 to iteration, to apply frangi to last VED iteration.
+  filter->SetNumberOfIterations(vm["numberOfIteration"].as<int>() + 1);
+  filter->SetSensitivity(vm["sensitivity"].as<double>());
+  filter->SetWStrength(vm["wStrength"].as<double>());
+  filter->SetEpsilon(vm["epsilon"].as<double>());
+  filter->SetUseImageSpacing(vm["useImageSpacing"].as<bool>());
+
+  filter->SetFrangiOnly(vm.count("frangiOnly") > 0);
+  filter->SetScaleObject(vm.count("scaleObject") > 0);
+}
+
+// The filter parameters of set_filter_parameters as text, the kernel
+// resolved, the adaptive scales 0 when every scale is computed and the
+// deconvolution its regularization when it is on. The
+// reference run of --validate must differ from the candidate in one of them.
+std::map<std::string, std::string>
+filter_configuration(const boost::program_options::variables_map& vm)
+{
+  std::map<std::string, std::string> configuration;
+
+  const char* doubles[] = {"sigmaMin", "sigmaMax",    "alpha",
+                           "beta",     "c",           "sensitivity",
+                           "wStrength", "epsilon"};
+  for (unsigned int o = 0; o < sizeof(doubles) / sizeof(*doubles); ++o)
+  {
+    std::ostringstream value;
+    value << vm[doubles[o]].as<double>();
+    configuration[doubles[o]] = value.str();
+  }
+  // The regularization of the deconvolution when it is on.
+  std::ostringstream deconvolution;
+  if (vm["deconvolution"].as<bool>())
+  {
+    deconvolution << vm["deconvolutionRegularization"].as<double>();
+  }
+  else
+  {
+    deconvolution << "false";
+  }
+  configuration["deconvolution"] = deconvolution.str();
+
+  const int numberOfScales = vm["numberOfScale"].as<int>();
+  const int adaptiveScales = vm["adaptiveScales"].as<int>();
+  configuration["numberOfScale"] = std::to_string(numberOfScales);
+  configuration["adaptiveScales"] = std::to_string(
+      adaptiveScales < numberOfScales ? adaptiveScales : 0);
+  configuration["numberOfIteration"] =
+      std::to_string(vm["numberOfIteration"].as<int>());
+
+  const char* bools[] = {"gaussianCascade", "useImageSpacing"};
+  for (unsigned int o = 0; o < sizeof(bools) / sizeof(*bools); ++o)
+  {
+    configuration[bools[o]] = vm[bools[o]].as<bool>() ? "true" : "false";
+  }
+  const char* flags[] = {"darkBlood", "frangiOnly", "scaleObject"};
+  for (unsigned int o = 0; o < sizeof(flags) / sizeof(*flags); ++o)
+  {
+    configuration[flags[o]] = vm.count(flags[o]) ? "true" : "false";
+  }
+
+  const FrangiKernel::KernelType kernel =
+      FrangiKernel::GetKernelFromName(vm["frangiKernel"].as<std::string>());
+  configuration["frangiKernel"] =
+      FrangiKernel::GetKernelName(FrangiKernel::Resolve(kernel));
+  return configuration;
+}
+
+// =============================================================================
+// Time series: the 3D frames of a 4D input go through the filter, several at
+// once (FrameScheduler), into one 4D output. Each lane keeps its filter from
+// a frame to the next. Only the enhanced image is written: the per-frame
+// side outputs would overwrite each other.
+// =============================================================================
+template <typename TFilter>
+int run_time_series(const boost::program_options::variables_map& vm)
+{
+  typedef typename TFilter::InputImageType FrameType;
+  typedef typename TFilter::OutputImageType OutputFrameType;
+  typedef typename FrameType::PixelType PixelType;
+  const unsigned int FrameDimension = FrameType::ImageDimension;
+  typedef itk::Image<PixelType, FrameDimension + 1> SeriesType;
+  typedef itk::Image<float, FrameDimension + 1> OutputSeriesType;
+
+  const char* unsupported[] = {
+      "generateScale",    "generateHessian",  "generateIterationFiles",
+      "scaleIndex",       "sparseScaleFiles", "thresholdMethods",
+      "smoothing",        "validate",         "denoise"};
+  for (unsigned int o = 0; o < sizeof(unsupported) / sizeof(*unsupported);
+       ++o)
+  {
+    if (vm.count(unsupported[o]))
+    {
+      std::cerr << "Error: --" << unsupported[o]
+                << " is not supported with a 4D input." << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  const int warmStartIterations = vm["warmStartIterations"].as<int>();
+  FrameScheduler scheduler;
+  scheduler.SetNumberOfLanes(std::max(1, vm["frameLanes"].as<int>()));
+  scheduler.SetWarmStart(warmStartIterations > 0);
+
+  unsigned int numberOfFrames = 0;
+  double framePixels = 1.0;
+  double memoryBudget = 0.0;
+  std::vector<typename TFilter::Pointer> filters;
+  try
+  {
+    itk::ImageIOBase::Pointer imageIO =
+        read_image_information(vm["input"].as<std::string>());
+    numberOfFrames = imageIO->GetDimensions(FrameDimension);
+    for (unsigned int d = 0; d < FrameDimension; ++d)
+    {
+      framePixels *= imageIO->GetDimensions(d);
+    }
+    if (vm.count("memoryBudget"))
+    {
+      memoryBudget =
+          VEDMemoryPlan::ParseSize(vm["memoryBudget"].as<std::string>());
+    }
+
+    for (unsigned int l = 0; l < scheduler.GetNumberOfLanes(numberOfFrames);
+         ++l)
+    {
+      typename TFilter::Pointer filter = TFilter::New();
+      set_filter_parameters(filter.GetPointer(), vm);
+      filter->SetGenerateScaleFiles(false);
+      filter->SetGenerateTensorFiles(false);
+      filter->SetReleaseInternalBuffers(vm.count("releaseBuffers") > 0);
+      filter->SetKeepDiffusedImage(scheduler.GetWarmStart());
+      filters.push_back(filter);
+    }
+  }
+  catch (itk::ExceptionObject& err)
+  {
+    std::cerr << "Exception caught: " << err << std::endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::exception& err)
+  {
+    std::cerr << "Error: " << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Memory plan: the input and output series, and the filters of the lanes
+  // running together (with the start image of a warm frame).
+  VEDMemoryPlan::Pointer framePlan = VEDMemoryPlan::New();
+  filters[0]->AddBuffersToPlan(framePlan, framePixels,
+                               VEDMemoryPlan::DiffusionPhase);
+  const double laneBytes =
+      framePlan->GetPeakBytes() +
+      (scheduler.GetWarmStart() ? framePixels * sizeof(PixelType) : 0.0);
+
+  VEDMemoryPlan::Pointer plan = VEDMemoryPlan::New();
+  auto build_plan = [&]() {
+    plan->Clear();
+    plan->AddBuffer("input series",
+                    numberOfFrames * framePixels * sizeof(PixelType),
+                    VEDMemoryPlan::ReadPhase, VEDMemoryPlan::PostPhase);
+    plan->AddBuffer("frame filters", filters.size() * laneBytes,
+                    VEDMemoryPlan::HessianPhase,
+                    VEDMemoryPlan::DiffusionPhase);
+    plan->AddBuffer("output series",
+                    numberOfFrames * framePixels * sizeof(float),
+                    VEDMemoryPlan::ReadPhase, VEDMemoryPlan::PostPhase);
+  };
+  build_plan();
+  while (memoryBudget > 0.0 && plan->GetPeakBytes() > memoryBudget &&
+         filters.size() > 1)
+  {
+    filters.pop_back();
+    std::cout << "Memory budget: " << filters.size()
+              << " frames at the same time.\n";
+    build_plan();
+  }
+  scheduler.SetNumberOfLanes(filters.size());
+
+  plan->Print(std::cout);
+
+  if (memoryBudget > 0.0 && plan->GetPeakBytes() > memoryBudget)
+  {
+    std::cerr << "Error: the memory plan needs "
+              << VEDMemoryPlan::FormatSize(plan->GetPeakBytes())
+              << " (during the "
+              << VEDMemoryPlan::GetPhaseName(plan->GetPeakPhase())
+              << " phase), more than the budget of "
+              << VEDMemoryPlan::FormatSize(memoryBudget) << "." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  try
+  {
+    std::cout << "Reading input time series : "
+              << vm["input"].as<std::string>() << std::endl;
+    typename SeriesType::Pointer series;
+    {
+      StageTimerScope timer("IO::Read");
+      series = MappedImageIO::Read<SeriesType>(vm["input"].as<std::string>());
+    }
+
+    typename OutputSeriesType::Pointer output = OutputSeriesType::New();
+    output->CopyInformation(series);
+    output->SetRegions(series->GetBufferedRegion());
+    output->Allocate();
+
+    // Geometry of the frames: the first three axes of the series.
+    typename FrameType::RegionType frameRegion;
+    typename FrameType::SpacingType spacing;
+    typename FrameType::PointType origin;
+    typename FrameType::DirectionType direction;
+    for (unsigned int i = 0; i < FrameDimension; ++i)
+    {
+      frameRegion.SetSize(i, series->GetBufferedRegion().GetSize(i));
+      spacing[i] = series->GetSpacing()[i];
+      origin[i] = series->GetOrigin()[i];
+      for (unsigned int j = 0; j < FrameDimension; ++j)
+      {
+        direction[i][j] = series->GetDirection()[i][j];
+      }
+    }
+    const itk::SizeValueType frameLength = frameRegion.GetNumberOfPixels();
+
+    // A frame of the series, sharing its buffer.
+    auto make_frame = [&](unsigned int frame) {
+      typename FrameType::Pointer image = FrameType::New();
+      image->SetRegions(frameRegion);
+      image->SetSpacing(spacing);
+      image->SetOrigin(origin);
+      image->SetDirection(direction);
+      image->GetPixelContainer()->SetImportPointer(
+          series->GetBufferPointer() + frame * frameLength, frameLength,
+          false);
+      return image;
+    };
+
+    const unsigned int numberOfIterations =
+        vm["numberOfIteration"].as<int>() + 1;
+    std::vector<typename FrameType::Pointer> startImages(filters.size());
+    std::vector<typename OutputFrameType::ConstPointer> diffused(
+        filters.size());
+    std::mutex outputMutex;
+
+    scheduler.Run(numberOfFrames, [&](unsigned int lane, unsigned int frame,
+                                      bool warm) {
+      TFilter* filter = filters[lane];
+      {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        std::cout << "(In itkVEDMain) Frame " << frame + 1 << "/"
+                  << numberOfFrames << " on lane " << lane
+                  << (warm ? ", warm start" : "") << std::endl;
+      }
+      StageTimerScope timer("TimeSeries::Frame", frameLength);
+      timer.SetArgument("frame", frame);
+      timer.SetArgument("lane", lane);
+
+      typename FrameType::Pointer input = make_frame(frame);
+      if (warm)
+      {
+        // The diffused previous frame, moved by the change of the input.
+        typename FrameType::Pointer& start = startImages[lane];
+        if (start.IsNull())
+        {
+          start = FrameType::New();
+          start->CopyInformation(input);
+          start->SetRegions(frameRegion);
+          start->Allocate();
+        }
+        const PixelType* current = input->GetBufferPointer();
+        const PixelType* previous = make_frame(frame - 1)->GetBufferPointer();
+        const typename OutputFrameType::PixelType* previousDiffused =
+            diffused[lane]->GetBufferPointer();
+        PixelType* startBuffer = start->GetBufferPointer();
+        for (itk::SizeValueType i = 0; i < frameLength; ++i)
+        {
+          startBuffer[i] = previousDiffused[i] + current[i] - previous[i];
+        }
+        start->Modified();
+        input = start;
+        filter->SetNumberOfIterations(warmStartIterations + 1);
+      }
+      else
+      {
+        filter->SetNumberOfIterations(numberOfIterations);
+      }
+
+      filter->SetInput(input);
+      filter->Update();
+
+      const typename OutputFrameType::PixelType* result =
+          filter->GetOutput()->GetBufferPointer();
+      float* slab = output->GetBufferPointer() + frame * frameLength;
+      for (itk::SizeValueType i = 0; i < frameLength; ++i)
+      {
+        slab[i] = static_cast<float>(result[i]);
+      }
+      if (scheduler.GetWarmStart())
+      {
+        diffused[lane] = filter->GetDiffusedImage();
+      }
+    });
+    filters.clear();
+
+    std::cout << "Writing out the enhanced time series to "
+              << vm["output"].as<std::string>() << std::endl;
+    StageTimerScope timer("IO::Write");
+    MappedImageIO::Write(output.GetPointer(), vm["output"].as<std::string>());
+    timer.AddFileWritten(vm["output"].as<std::string>());
+  }
+  catch (itk::ExceptionObject& err)
+  {
+    std::cerr << "Exception caught: " << err << std::endl;
+    write_instrumentation(vm);
+    return EXIT_FAILURE;
+  }
+  catch (std::exception& err)
+  {
+    std::cerr << "Error: " << err.what() << std::endl;
+    write_instrumentation(vm);
+    return EXIT_FAILURE;
+  }
+
+  if (ImageBufferPool::GetInstance().IsEnabled())
+  {
+    const ImageBufferPool::Statistics statistics =
+        ImageBufferPool::GetInstance().GetStatistics();
+    std::cout << "Buffer pool: " << statistics.Leases << " buffers, "
+              << statistics.Reuses << " reused, " << statistics.Mappings
+              << " mapped ("
+              << VEDMemoryPlan::FormatSize(statistics.MappedBytes) << ")."
+              << std::endl;
+  }
+
+  return write_instrumentation(vm) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+struct ValidationResult
+{
+  double CandidateSeconds;
+  double ReferenceSeconds;
+  double NumberOfPixels;
+  double ReferenceMaximum;
+  double MaximumAbsoluteError;
+  double MeanAbsoluteError;
+  std::string ThresholdMethod;
+  double CandidateThreshold;
+  double ReferenceThreshold;
+  double CandidateForeground;
+  double ReferenceForeground;
+  double Dice;
+  double ScaleAgreement;
+  double MeanScaleDifference;
+  // The filter parameters which differ: candidate and reference values.
+  std::map<std::string, std::pair<std::string, std::string>> Differences;
+};
+
+// Compare the outputs and best scales of the candidate and the reference.
+// The foreground is above the threshold; the scales are compared on the
+// reference foreground, equal when within 0.1% of the reference sigma.
+template <typename TImage, typename TScalesImage>
+void compare_outputs(const TImage* candidate, const TImage* reference,
+                     const TScalesImage* candidateScales,
+                     const TScalesImage* referenceScales,
+                     ValidationResult& result)
+{
+  const typename TImage::RegionType region = reference->GetBufferedRegion();
+  if (candidate->GetBufferedRegion() != region ||
+      candidateScales->GetBufferedRegion() != region ||
+      referenceScales->GetBufferedRegion() != region)
+  {
+    throw std::runtime_error("The candidate and reference outputs do not "
+                             "have the same size.");
+  }
+
+  itk::ImageRegionConstIterator<TImage> itCandidate(candidate, region);
+  itk::ImageRegionConstIterator<TImage> itReference(reference, region);
+  itk::ImageRegionConstIterator<TScalesImage> itCandidateScale(
+      candidateScales, region);
+  itk::ImageRegionConstIterator<TScalesImage> itReferenceScale(
+      referenceScales, region);
+
+  double errorSum = 0.0;
+  double bothForeground = 0.0;
+  double sameScale = 0.0;
+  double scaleDifferenceSum = 0.0;
+  result.NumberOfPixels = 0.0;
+  result.ReferenceMaximum = 0.0;
+  result.MaximumAbsoluteError = 0.0;
+  result.CandidateForeground = 0.0;
+  result.ReferenceForeground = 0.0;
+  for (; !itReference.IsAtEnd(); ++itCandidate, ++itReference,
+                                 ++itCandidateScale, ++itReferenceScale)
+  {
+    const double value = itCandidate.Get();
+    const double referenceValue = itReference.Get();
+    const double error = std::abs(value - referenceValue);
+    errorSum += error;
+    result.MaximumAbsoluteError = std::max(result.MaximumAbsoluteError, error);
+    result.ReferenceMaximum =
+        std::max(result.ReferenceMaximum, std::abs(referenceValue));
+    result.NumberOfPixels += 1.0;
+
+    const bool foreground = value > result.CandidateThreshold;
+    const bool referenceForeground = referenceValue > result.ReferenceThreshold;
+    result.CandidateForeground += foreground;
+    result.ReferenceForeground += referenceForeground;
+    if (!referenceForeground)
+    {
+      continue;
+    }
+    bothForeground += foreground;
+
+    const double sigma = itReferenceScale.Get();
+    const double scaleDifference = std::abs(itCandidateScale.Get() - sigma);
+    scaleDifferenceSum += scaleDifference;
+    sameScale += scaleDifference <= 1e-3 * sigma;
+  }
+
+  result.MeanAbsoluteError =
+      result.NumberOfPixels > 0.0 ? errorSum / result.NumberOfPixels : 0.0;
+  const double foregroundSum =
+      result.CandidateForeground + result.ReferenceForeground;
+  result.Dice = foregroundSum > 0.0 ? 2.0 * bothForeground / foregroundSum
+                                    : 1.0;
+  result.ScaleAgreement = result.ReferenceForeground > 0.0
+                              ? sameScale / result.ReferenceForeground
+                              : 1.0;
+  result.MeanScaleDifference =
+      result.ReferenceForeground > 0.0
+          ? scaleDifferenceSum / result.ReferenceForeground
+          : 0.0;
+}
+
+void write_validation(std::ostream& os, const ValidationResult& result,
+                      const boost::program_options::variables_map& vm)
+{
+  os << "{\n  \"input\": \""
+     << StageTimer::Escape(vm["input"].as<std::string>())
+     << "\",\n  \"reference_config\": ";
+  if (vm.count("validateReference"))
+  {
+    os << "\"" << StageTimer::Escape(vm["validateReference"].as<std::string>())
+       << "\"";
+  }
+  else
+  {
+    os << "null";
+  }
+  os << ",\n  \"reference_differences\": {";
+  for (std::map<std::string, std::pair<std::string, std::string>>::
+           const_iterator it = result.Differences.begin();
+       it != result.Differences.end(); ++it)
+  {
+    os << (it == result.Differences.begin() ? "\n    \"" : ",\n    \"")
+       << it->first << "\": {\"candidate\": \""
+       << StageTimer::Escape(it->second.first) << "\", \"reference\": \""
+       << StageTimer::Escape(it->second.second) << "\"}";
+  }
+  os << "\n  }";
+  os << ",\n  \"voxels\": " << result.NumberOfPixels
+     << ",\n  \"candidate_seconds\": " << result.CandidateSeconds
+     << ",\n  \"reference_seconds\": " << result.ReferenceSeconds
+     << ",\n  \"speedup\": "
+     << (result.CandidateSeconds > 0.0
+             ? result.ReferenceSeconds / result.CandidateSeconds
+             : 0.0)
+     << ",\n  \"reference_maximum\": " << result.ReferenceMaximum
+     << ",\n  \"max_abs_error\": " << result.MaximumAbsoluteError
+     << ",\n  \"mean_abs_error\": " << result.MeanAbsoluteError
+     << ",\n  \"threshold_method\": \""
+     << StageTimer::Escape(result.ThresholdMethod)
+     << "\",\n  \"candidate_threshold\": " << result.CandidateThreshold
+     << ",\n  \"reference_threshold\": " << result.ReferenceThreshold
+     << ",\n  \"candidate_foreground\": " << result.CandidateForeground
+     << ",\n  \"reference_foreground\": " << result.ReferenceForeground
+     << ",\n  \"dice\": " << result.Dice
+     << ",\n  \"scale_agreement\": " << result.ScaleAgreement
+     << ",\n  \"mean_scale_difference\": " << result.MeanScaleDifference
+     << "\n}\n";
+}
+
 int main(int argc, char* argv[])
 {
   const int Dimension = 3;
@@ -146,7 +986,6 @@ int main(int argc, char* argv[])
 
   typedef itk::Image<InputPixelType, Dimension> InputImageType;
   typedef itk::Image<InputPixelType, Dimension> OutputImageType;
-  typedef itk::ImageFileReader<InputImageType> ImageReaderType;
 
   typedef itk::SymmetricSecondRankTensor<double, Dimension> TensorPixelType;
   typedef itk::Image<TensorPixelType, Dimension> TensorImageType;
@@ -154,44 +993,86 @@ int main(int argc, char* argv[])
   typedef float ScalesPixelType;
   typedef itk::Image<ScalesPixelType, Dimension> ScalesImageType;
 
+  typedef itk::Image<float, Dimension> floatImageType;
+
+  typedef unsigned char OutputSegPixelType;
+  typedef itk::Image<OutputSegPixelType, Dimension> OutputSegType;
+  typedef MultiHistogramThreshold<floatImageType, OutputSegType,
+                                  floatImageType> MultiThresholdType;
+
   boost::program_options::variables_map vm;
   if (!process_command_line(argc, argv, vm))
   {
     return 1;
   }
 
-  ImageReaderType::Pointer reader = ImageReaderType::New();
-  std::cout << "Reading input image : " << vm["input"].as<std::string>()
-            << std::endl;
+  if (vm.count("profile") || vm.count("trace"))
+  {
+    StageTimer::GetInstance().SetEnabled(true);
+  }
 
-  reader->SetFileName(vm["input"].as<std::string>());
+  if (vm["threads"].as<int>() > 0)
+  {
+    itk::MultiThreader::SetGlobalDefaultNumberOfThreads(
+        vm["threads"].as<int>());
+    WorkStealingPool::GetInstance().SetNumberOfThreads(
+        vm["threads"].as<int>());
+  }
+  if (vm.count("pinThreads"))
+  {
+    WorkStealingPool::GetInstance().SetThreadPinning(true);
+  }
+  if (vm.count("numaFirstTouch"))
+  {
+    FirstTouchAllocator::SetEnabled(true);
+  }
+  if (vm.count("bufferPool") || vm.count("hugePages"))
+  {
+    ImageBufferPool::GetInstance().SetEnabled(true);
+    ImageBufferPool::GetInstance().SetHugePages(vm.count("hugePages") > 0);
+    ImageBufferPoolFactory::RegisterOneFactory();
+  }
 
+  typedef AnisotropicDiffusionVesselEnhancementImageFilter<
+      InputImageType, OutputImageType> VesselnessFilterType;
+
+  // A 4D input is a time series of 3D frames.
   try
   {
-    reader->Update();
+    if (read_image_information(vm["input"].as<std::string>())
+            ->GetNumberOfDimensions() == Dimension + 1)
+    {
+      return run_time_series<VesselnessFilterType>(vm);
+    }
   }
   catch (itk::ExceptionObject& err)
   {
-    std::cerr << "Exception thrown: " << err << std::endl;
+    std::cerr << "Exception caught: " << err << std::endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::exception& err)
+  {
+    std::cerr << "Error: " << err.what() << std::endl;
     return EXIT_FAILURE;
   }
 
-  typedef AnisotropicDiffusionVesselEnhancementImageFilter<
-      InputImageType, OutputImageType> VesselnessFilterType;
-
   // Create a vesselness Filter.
   VesselnessFilterType::Pointer VesselnessFilter = VesselnessFilterType::New();
-  VesselnessFilter->SetInput(reader->GetOutput());
 
-  // Multi-scale Hessian parameters
-  VesselnessFilter->SetSigmaMin(vm["sigmaMin"].as<double>());
-  VesselnessFilter->SetSigmaMax(vm["sigmaMax"].as<double>());
-  VesselnessFilter->SetNumberOfSigmaSteps(vm["numberOfScale"].as<int>());
+  // Multi-scale Hessian, Frangi vesselness equation and vessel enhancing
+  // diffusion parameters
+  try
+  {
+    set_filter_parameters(VesselnessFilter.GetPointer(), vm);
+  }
+  catch (std::exception& err)
+  {
+    std::cerr << "Error: " << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
 
-  // Frangi vesselness equation parameters
   if (vm.count("darkBlood"))
   {
-    VesselnessFilter->SetBrightBlood(false);
     std::cout << "Will extract dark blood.\n";
   }
   else
@@ -199,28 +1080,14 @@ int main(int argc, char* argv[])
     std::cout << "Will extract bright blood.\n";
   }
 
-  VesselnessFilter->SetAlpha(vm["alpha"].as<double>());
-  VesselnessFilter->SetBeta(vm["beta"].as<double>());
-  VesselnessFilter->SetC(vm["c"].as<double>());
-
-  // Vessel enhancing diffusion parameters
-
-  // Add + 1 to iteration, to apply frangi to last VED iteration.
-  VesselnessFilter->SetNumberOfIterations(vm["numberOfIteration"].as<int>() + 1);
-  VesselnessFilter->SetSensitivity(vm["sensitivity"].as<double>());
-  VesselnessFilter->SetWStrength(vm["wStrength"].as<double>());
-  VesselnessFilter->SetEpsilon(vm["epsilon"].as<double>());
-
   // Flags
   if (vm.count("frangiOnly"))
   {
-    VesselnessFilter->SetFrangiOnly(true);
     std::cout << "Will generate the Frangi vesselness measure image only.\n";
   }
 
   if (vm.count("scaleObject"))
   {
-    VesselnessFilter->SetScaleObject(true);
     std::cout
         << "Will scale the vesselness based on the eigen value amplitude.\n";
   }
@@ -243,200 +1110,619 @@ int main(int argc, char* argv[])
     std::cout << "Will generate the iteration files\n";
   }
 
+  if (vm.count("noScaleFiles"))
+  {
+    VesselnessFilter->SetGenerateScaleFiles(false);
+  }
+
+  if (vm.count("sparseScaleFiles"))
+  {
+    VesselnessFilter->SetSparseScaleFiles(true);
+  }
+
+  if (vm.count("noTensorFiles"))
+  {
+    VesselnessFilter->SetGenerateTensorFiles(false);
+  }
+
+  QuantizedImageWriter::PrecisionType auxiliaryPrecision;
   try
   {
-    VesselnessFilter->Update();
+    auxiliaryPrecision = QuantizedImageWriter::GetPrecisionFromName(
+        vm["auxiliaryPrecision"].as<std::string>());
   }
-  catch (itk::ExceptionObject& err)
+  catch (std::exception& err)
   {
-    std::cerr << "Exception caught: " << err << std::endl;
+    std::cerr << "Error: " << err.what() << std::endl;
     return EXIT_FAILURE;
   }
+  VesselnessFilter->SetTensorFilesPrecision(auxiliaryPrecision);
+
+  if (vm.count("releaseBuffers"))
+  {
+    VesselnessFilter->SetReleaseInternalBuffers(true);
+  }
 
-  std::cout << "Writing out the enhanced image to "
-            << vm["output"].as<std::string>() << std::endl;
+  // ===========================================================================
+  // Validation: the reference pipeline, the baseline with the model options
+  // of the command line unless overridden by --validateReference, runs on the
+  // same input once every other stage is done. It only keeps its output and
+  // best scales, and must differ from the candidate in at least one filter
+  // parameter.
+  // ===========================================================================
+  const bool validate = vm.count("validate") > 0;
+  VesselnessFilterType::Pointer ReferenceFilter;
+  ValidationResult validation;
+  if (validate)
+  {
+    boost::program_options::variables_map referenceVm;
+    if (!process_command_line(
+            argc, argv, referenceVm, true,
+            vm.count("validateReference")
+                ? vm["validateReference"].as<std::string>()
+                : std::string()))
+    {
+      return 1;
+    }
 
-  typedef itk::Image<float, Dimension> floatImageType;
-  typedef itk::ImageFileWriter<floatImageType> ImageWriterType;
+    ReferenceFilter = VesselnessFilterType::New();
+    try
+    {
+      MultiThresholdType::New()->AddMethod(
+          vm["validateThreshold"].as<std::string>());
+      set_filter_parameters(ReferenceFilter.GetPointer(), referenceVm);
 
-  typedef itk::CastImageFilter< OutputImageType, floatImageType > CastFilterType;
-  typename CastFilterType::Pointer castFilter = CastFilterType::New();
-  castFilter->SetInput(VesselnessFilter->GetOutput());
+      const std::map<std::string, std::string> candidate =
+          filter_configuration(vm);
+      const std::map<std::string, std::string> reference =
+          filter_configuration(referenceVm);
+      for (std::map<std::string, std::string>::const_iterator it =
+               candidate.begin();
+           it != candidate.end(); ++it)
+      {
+        if (reference.at(it->first) != it->second)
+        {
+          validation.Differences[it->first] =
+              std::make_pair(it->second, reference.at(it->first));
+        }
+      }
+      if (validation.Differences.empty())
+      {
+        throw std::runtime_error(
+            "The reference of --validate has the same configuration as the "
+            "candidate. Set the options to compare with --validateReference.");
+      }
+    }
+    catch (itk::ExceptionObject& err)
+    {
+      std::cerr << "Exception caught: " << err << std::endl;
+      return EXIT_FAILURE;
+    }
+    catch (std::exception& err)
+    {
+      std::cerr << "Error: " << err.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+    ReferenceFilter->SetGenerateScale(true);
+    ReferenceFilter->SetGenerateScaleFiles(false);
+    ReferenceFilter->SetGenerateTensorFiles(false);
+    ReferenceFilter->SetReleaseInternalBuffers(true);
 
-  typename ImageWriterType::Pointer writer = ImageWriterType::New();
-  writer->SetFileName(vm["output"].as<std::string>());
-  writer->SetInput(castFilter->GetOutput());
+    // The best scales of the candidate are compared too.
+    VesselnessFilter->SetGenerateScale(true);
+    std::cout << "Will validate against the reference pipeline.\n";
+  }
 
+  // ===========================================================================
+  // Memory plan, from the size of the input and the options, before anything
+  // is computed.
+  // ===========================================================================
+  double numberOfPixels = 0.0;
+  double memoryBudget = 0.0;
   try
   {
-    writer->Update();
+    numberOfPixels = read_number_of_pixels(vm["input"].as<std::string>());
+    if (vm.count("memoryBudget"))
+    {
+      memoryBudget =
+          VEDMemoryPlan::ParseSize(vm["memoryBudget"].as<std::string>());
+    }
   }
   catch (itk::ExceptionObject& err)
   {
     std::cerr << "Exception caught: " << err << std::endl;
     return EXIT_FAILURE;
   }
+  catch (std::exception& err)
+  {
+    std::cerr << "Error: " << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  VEDMemoryPlan::Pointer plan = VEDMemoryPlan::New();
+  auto build_plan = [&]() {
+    // Released buffers end with the ved stage, which then drops the filter.
+    const VEDMemoryPlan::PhaseType filterLastPhase =
+        VesselnessFilter->GetReleaseInternalBuffers()
+            ? VEDMemoryPlan::DiffusionPhase
+            : VEDMemoryPlan::PostPhase;
 
-  //DO SEGMENTATIONS!
-  bool smooth = true;
-  if (smooth == true) 
-  {
-    typedef float OutputPixelType;
-    typedef itk::Image< OutputPixelType, 3 > OutputSmoothImageType;
- 
-    typedef itk::CurvatureFlowImageFilter< OutputSmoothImageType, OutputSmoothImageType > 
-      CurvatureFlowImageFilterType;
-    typedef itk::GradientAnisotropicDiffusionImageFilter<OutputSmoothImageType, OutputSmoothImageType > 
-      GradientAnisotropicDiffusionFilterType ;
-    typedef itk::AnisotropicDiffusionImageFilter<OutputSmoothImageType, OutputSmoothImageType> 
-      AnisotropicDiffusionFilterType ;
-  
-    typedef std::map<std::string, itk::AnisotropicDiffusionImageFilter<OutputSmoothImageType, OutputSmoothImageType>::Pointer> FilterContainerType;
-      FilterContainerType filterContainer;
-    //filterContainer["CurvatureFlow"] = CurvatureFlowImageFilterType::New();
-    filterContainer["GradientAnisotropicDiffusion"] = GradientAnisotropicDiffusionFilterType::New();
-    //filterContainer["AnisotropicDiffusion"] = AnisotropicDiffusionFilterType::New();
-    
-    FilterContainerType::iterator it = filterContainer.begin();
-    int iterations = 5;
-    for (it = filterContainer.begin(); it != filterContainer.end(); ++it) 
-    {
-      for (int iter = 10; iter <= 11.0 ; iter += 3)
+    plan->Clear();
+    plan->AddBuffer("input", numberOfPixels * sizeof(InputPixelType),
+                    VEDMemoryPlan::ReadPhase, filterLastPhase);
+    if (vm.count("denoise"))
+    {
+      // The noisy input (and the mask) while the denoised one is computed.
+      plan->AddBuffer("noisy input", numberOfPixels * sizeof(InputPixelType),
+                      VEDMemoryPlan::ReadPhase, VEDMemoryPlan::ReadPhase);
+      if (vm.count("denoiseMask"))
       {
-      std::cout << "Writing out segmentations (" << (*it).first << "). \n" ;
-      (*it).second->SetConductanceParameter( 0.3 ); //0.5
-      (*it).second->SetTimeStep( 0.02 );
-      (*it).second->SetInput( castFilter->GetOutput() );
-      (*it).second->SetNumberOfIterations( iter );
-      (*it).second->Update();
-
-      typedef itk::ImageFileWriter<OutputSmoothImageType> SegWriterType;
-      typename SegWriterType::Pointer writer = SegWriterType::New();
-      //std::string message = std::string("Ved_") + (*it).first + std::to_string(fConductance) + std::string(".nii.gz") ;  
-      std::string message = std::string("Ved_") + (*it).first + std::to_string(iter) + std::string(".nii.gz") ;  
-      writer->SetFileName(message);
-      writer->SetInput((*it).second->GetOutput());
-      writer->Update();
+        plan->AddBuffer("denoise mask", numberOfPixels * sizeof(float),
+                        VEDMemoryPlan::ReadPhase, VEDMemoryPlan::ReadPhase);
       }
     }
+    VesselnessFilter->AddBuffersToPlan(plan, numberOfPixels, filterLastPhase);
+    plan->AddBuffer("float output", numberOfPixels * sizeof(float),
+                    VEDMemoryPlan::PostPhase, VEDMemoryPlan::PostPhase);
 
-  }
- 
-  //DO SEGMENTATIONS!
-  bool provideSeg = false;
-  if (provideSeg == true) 
-  {
-    typedef  unsigned char  OutputPixelType;
-    typedef itk::Image< OutputPixelType, 3 >   OutputSegType;
- 
-    typedef itk::LiThresholdImageFilter<floatImageType, OutputSegType >
-      LiFilterType;
-    typedef itk::HuangThresholdImageFilter<floatImageType, OutputSegType >
-      HuangFilterType;
-    typedef itk::IntermodesThresholdImageFilter<floatImageType, OutputSegType >
-      IntermodesFilterType;
-    typedef itk::IsoDataThresholdImageFilter<floatImageType, OutputSegType >
-      IsoDataFilterType;
-    typedef itk::KittlerIllingworthThresholdImageFilter<floatImageType, OutputSegType >
-      KittlerIllingworthFilterType;
-    typedef itk::LiThresholdImageFilter<floatImageType, OutputSegType >
-      LiFilterType;
-    typedef itk::MaximumEntropyThresholdImageFilter<floatImageType, OutputSegType >
-      MaximumEntropyFilterType;
-    typedef itk::MomentsThresholdImageFilter<floatImageType, OutputSegType >
-      MomentsFilterType;
-    typedef itk::OtsuThresholdImageFilter<floatImageType, OutputSegType >
-      OtsuFilterType;
-    typedef itk::RenyiEntropyThresholdImageFilter<floatImageType, OutputSegType >
-      RenyiEntropyFilterType;
-    typedef itk::ShanbhagThresholdImageFilter<floatImageType, OutputSegType >
-      ShanbhagFilterType;
-    typedef itk::TriangleThresholdImageFilter<floatImageType, OutputSegType >
-      TriangleFilterType;
-    typedef itk::YenThresholdImageFilter<floatImageType, OutputSegType >
-      YenFilterType;
-  
-    typedef itk::StatisticsImageFilter<floatImageType> StatisticsImageFilterType;
-    StatisticsImageFilterType::Pointer statisticsImageFilter = StatisticsImageFilterType::New();
-    statisticsImageFilter->SetInput(castFilter->GetOutput());
-    statisticsImageFilter->Update();
-
-    typedef std::map<std::string, itk::HistogramThresholdImageFilter<floatImageType, OutputSegType>::Pointer> FilterContainerType;
-    FilterContainerType filterContainer;
-  
-    filterContainer["Huang"] = HuangFilterType::New();
-    //filterContainer["Intermodes"] = IntermodesFilterType::New();
-    //filterContainer["IsoData"] = IsoDataFilterType::New();
-    //filterContainer["KittlerIllingworth"] = KittlerIllingworthFilterType::New();
-    //filterContainer["Li"] = LiFilterType::New();
-    //filterContainer["MaximumEntropy"] = MaximumEntropyFilterType::New();
-    filterContainer["Moments"] = MomentsFilterType::New();
-    filterContainer["Otsu"] = OtsuFilterType::New();
-    //filterContainer["RenyiEntropy"] = RenyiEntropyFilterType::New();
-    //filterContainer["Shanbhag"] = ShanbhagFilterType::New();
-    filterContainer["Triangle"] = TriangleFilterType::New();
-    //filterContainer["Yen"] = YenFilterType::New();
-  
-    FilterContainerType::iterator it = filterContainer.begin();
-    for (it = filterContainer.begin(); it != filterContainer.end(); ++it)
+    if (validate)
+    {
+      // The reference runs alone after the other stages, next to the
+      // candidate output and scales.
+      VEDMemoryPlan::Pointer referencePlan = VEDMemoryPlan::New();
+      ReferenceFilter->AddBuffersToPlan(referencePlan, numberOfPixels,
+                                        VEDMemoryPlan::DiffusionPhase);
+      plan->AddBuffer("validation reference",
+                      referencePlan->GetPeakBytes() +
+                          numberOfPixels * 2 * sizeof(float),
+                      VEDMemoryPlan::PostPhase, VEDMemoryPlan::PostPhase);
+    }
+
+    if (vm.count("smoothing"))
+    {
+      // Output and update buffer of every variant, all running together in
+      // the worst case.
+      const std::vector<std::string> descriptions =
+          vm["smoothing"].as<std::vector<std::string>>();
+      const std::set<std::string> variants(descriptions.begin(),
+                                           descriptions.end());
+      plan->AddBuffer("smoothing",
+                      variants.size() * numberOfPixels * 2 * sizeof(float),
+                      VEDMemoryPlan::PostPhase, VEDMemoryPlan::PostPhase);
+    }
+
+    if (vm.count("thresholdMethods"))
+    {
+      const std::vector<std::string> methods =
+          split_methods(vm["thresholdMethods"].as<std::string>(),
+                        MultiThresholdType::GetAvailableMethods());
+      plan->AddBuffer("segmentations", methods.size() * numberOfPixels *
+                                           sizeof(OutputSegPixelType),
+                      VEDMemoryPlan::PostPhase, VEDMemoryPlan::PostPhase);
+      if (vm.count("thresholdMask"))
       {
-      std::cout << "Writing out segmentations (" << (*it).first << "). \n" ;
-      (*it).second->SetInsideValue( statisticsImageFilter->GetMaximum() );
-      (*it).second->SetOutsideValue( statisticsImageFilter->GetMinimum() );
-      (*it).second->SetInput( castFilter->GetOutput() );
-      (*it).second->SetNumberOfHistogramBins( 100 );
-      (*it).second->Update();
-
-      typedef itk::ImageFileWriter<OutputSegType> SegWriterType;
-      typename SegWriterType::Pointer writer = SegWriterType::New();
-      std::string message = std::string("Ved_") + (*it).first + std::string(".nii.gz") ;  
-      writer->SetFileName(message);
-      writer->SetInput((*it).second->GetOutput());
-      writer->Update();
+        plan->AddBuffer("threshold mask", numberOfPixels * sizeof(float),
+                        VEDMemoryPlan::PostPhase, VEDMemoryPlan::PostPhase);
       }
+    }
+  };
+  build_plan();
 
+  if (memoryBudget > 0.0)
+  {
+    // From the cheapest to the most visible change: releasing the buffers
+    // does not change any output, the scale and tensor files are side
+    // outputs. The requested outputs are never dropped.
+    if (plan->GetPeakBytes() > memoryBudget &&
+        !VesselnessFilter->GetReleaseInternalBuffers())
+    {
+      std::cout << "Memory budget: releasing the internal buffers early.\n";
+      VesselnessFilter->SetReleaseInternalBuffers(true);
+      build_plan();
+    }
+    if (plan->GetPeakBytes() > memoryBudget &&
+        VesselnessFilter->GetGenerateScaleFiles())
+    {
+      std::cout << "Memory budget: the scale files will not be written.\n";
+      VesselnessFilter->SetGenerateScaleFiles(false);
+      build_plan();
+    }
+    if (plan->GetPeakBytes() > memoryBudget &&
+        VesselnessFilter->GetGenerateTensorFiles())
+    {
+      std::cout << "Memory budget: the tensor files will not be written.\n";
+      VesselnessFilter->SetGenerateTensorFiles(false);
+      build_plan();
+    }
   }
- 
 
-  if (vm.count("generateScale"))
+  plan->Print(std::cout);
+
+  if (memoryBudget > 0.0 && plan->GetPeakBytes() < memoryBudget)
   {
+    // The idle buffers of the pool stay within the rest of the budget.
+    ImageBufferPool::GetInstance().SetMaximumIdleBytes(
+        static_cast<size_t>(memoryBudget - plan->GetPeakBytes()));
+  }
 
-    std::cout << "Writing out the best sigma scale image. \n";
-    typedef itk::ImageFileWriter<ScalesImageType> ImageWriterType;
-    ImageWriterType::Pointer writer = ImageWriterType::New();
-    writer->SetFileName("ved_generated_best_scale.nii.gz");
-    writer->SetInput(VesselnessFilter->GetScalesOutput());
+  if (memoryBudget > 0.0 && plan->GetPeakBytes() > memoryBudget)
+  {
+    std::cerr << "Error: the memory plan needs "
+              << VEDMemoryPlan::FormatSize(plan->GetPeakBytes())
+              << " (during the "
+              << VEDMemoryPlan::GetPhaseName(plan->GetPeakPhase())
+              << " phase), more than the budget of "
+              << VEDMemoryPlan::FormatSize(memoryBudget) << "." << std::endl;
+    return EXIT_FAILURE;
+  }
 
-    try
+  // ===========================================================================
+  // Stages. Each stage only reads the buffers of the stages it depends on;
+  // only the requested stages and their dependencies are run.
+  // ===========================================================================
+  VEDStageGraph::Pointer graph = VEDStageGraph::New();
+  graph->SetNumberOfThreads(vm["stageThreads"].as<int>());
+
+  const std::string extension = vm["intermediateExtension"].as<std::string>();
+
+  graph->AddStage("read", {}, [&](VEDStageGraph& g) {
+    std::cout << "Reading input image : " << vm["input"].as<std::string>()
+              << std::endl;
+    InputImageType::Pointer input;
     {
-      writer->Update();
+      StageTimerScope timer("IO::Read");
+      input =
+          MappedImageIO::Read<InputImageType>(vm["input"].as<std::string>());
     }
-    catch (itk::ExceptionObject& err)
+
+    // The denoised image replaces the input of every later stage.
+    if (vm.count("denoise"))
     {
-      std::cerr << "Exception caught: " << err << std::endl;
-      return EXIT_FAILURE;
+      typedef NonLocalMeansImageFilter<InputImageType, InputImageType,
+                                       floatImageType>
+          DenoisingFilterType;
+      DenoisingFilterType::Pointer denoising = DenoisingFilterType::New();
+      denoising->SetInput(input);
+      denoising->SetSigma(vm["denoiseSigma"].as<double>());
+      denoising->SetPatchRadius(
+          std::max(0, vm["denoisePatchRadius"].as<int>()));
+      denoising->SetSearchRadius(
+          std::max(0, vm["denoiseSearchRadius"].as<int>()));
+      denoising->SetRician(!vm.count("denoiseGaussian"));
+      floatImageType::Pointer mask;
+      if (vm.count("denoiseMask"))
+      {
+        mask = MappedImageIO::Read<floatImageType>(
+            vm["denoiseMask"].as<std::string>());
+        denoising->SetMaskImage(mask);
+      }
+      denoising->Update();
+      std::cout << "Denoised the input (noise sigma "
+                << denoising->GetNoiseSigma() << ")." << std::endl;
+
+      input = denoising->GetOutput();
+      input->DisconnectPipeline();
     }
+    g.SetBuffer("input", input);
+  });
+
+  if (vm.count("denoise") && vm.count("denoiseOutput"))
+  {
+    graph->AddStage("writeDenoised", {"read"}, [&](VEDStageGraph& g) {
+      const std::string fileName = vm["denoiseOutput"].as<std::string>();
+      std::cout << "Writing out the denoised input to " << fileName
+                << std::endl;
+
+      StageTimerScope timer("IO::Write");
+      MappedImageIO::Write(g.GetImage<InputImageType>("input").GetPointer(),
+                           fileName);
+      timer.AddFileWritten(fileName);
+    });
+    graph->Request("writeDenoised");
   }
 
-  if (vm.count("generateHessian"))
+  graph->AddStage("ved", {"read"}, [&](VEDStageGraph& g) {
+    VesselnessFilter->SetInput(g.GetImage<InputImageType>("input"));
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    VesselnessFilter->Update();
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    validation.CandidateSeconds = elapsed.count();
+    g.SetBuffer("ved", VesselnessFilter->GetOutput());
+    if (VesselnessFilter->GetGenerateScale())
+    {
+      g.SetBuffer("scales", VesselnessFilter->GetScalesOutput());
+    }
+    if (vm.count("generateHessian"))
+    {
+      g.SetBuffer("hessian", VesselnessFilter->GetHessianOutput());
+    }
+    if (VesselnessFilter->GetReleaseInternalBuffers())
+    {
+      // The published outputs are kept by the graph, the rest goes.
+      VesselnessFilter = nullptr;
+    }
+  });
+
+  graph->AddStage("cast", {"ved"}, [&](VEDStageGraph& g) {
+    typedef itk::CastImageFilter<OutputImageType, floatImageType>
+        CastFilterType;
+    CastFilterType::Pointer castFilter = CastFilterType::New();
+    castFilter->SetInput(g.GetImage<OutputImageType>("ved"));
+    castFilter->Update();
+    g.SetBuffer("vedFloat", castFilter->GetOutput());
+  });
+
+  graph->AddStage("writeOutput", {"cast"}, [&](VEDStageGraph& g) {
+    std::cout << "Writing out the enhanced image to "
+              << vm["output"].as<std::string>() << std::endl;
+
+    StageTimerScope timer("IO::Write");
+    MappedImageIO::Write(g.GetImage<floatImageType>("vedFloat").GetPointer(),
+                         vm["output"].as<std::string>());
+    timer.AddFileWritten(vm["output"].as<std::string>());
+  });
+  graph->Request("writeOutput");
+
+  if (vm.count("smoothing"))
+  {
+    const std::vector<std::string> descriptions =
+        vm["smoothing"].as<std::vector<std::string>>();
+    for (unsigned int d = 0; d < descriptions.size(); ++d)
+    {
+      SmoothingInfo smoothing;
+      try
+      {
+        smoothing = parse_smoothing(descriptions[d]);
+      }
+      catch (std::exception& err)
+      {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+      }
+
+      const std::string fileName = smoothing_file_name(smoothing, extension);
+      const std::string name = "smoothing:" + fileName;
+      if (graph->HasStage(name))
+      {
+        continue;
+      }
+
+      graph->AddStage(name, {"cast"}, [smoothing,
+                                       fileName](VEDStageGraph& g) {
+        typedef itk::GradientAnisotropicDiffusionImageFilter<floatImageType,
+                                                             floatImageType>
+            GradientAnisotropicDiffusionFilterType;
+
+        GradientAnisotropicDiffusionFilterType::Pointer filter =
+            GradientAnisotropicDiffusionFilterType::New();
+        filter->SetConductanceParameter(smoothing.Conductance);
+        filter->SetTimeStep(smoothing.TimeStep);
+        filter->SetNumberOfIterations(smoothing.Iterations);
+        filter->SetInput(g.GetImage<floatImageType>("vedFloat"));
+        {
+          StageTimerScope timer("GradientAnisotropicDiffusion");
+          timer.SetArgument("iterations", smoothing.Iterations);
+          filter->Update();
+        }
+
+        std::cout << "Writing out smoothing (" << fileName << "). \n";
+
+        StageTimerScope timer("IO::Write");
+        MappedImageIO::Write(filter->GetOutput(), fileName);
+        timer.AddFileWritten(fileName);
+      });
+      graph->Request(name);
+    }
+  }
+
+  if (vm.count("thresholdMethods"))
   {
+    graph->AddStage("thresholds", {"cast"}, [&](VEDStageGraph& g) {
+      MultiThresholdType::Pointer multiThreshold = MultiThresholdType::New();
+      multiThreshold->SetNumberOfHistogramBins(vm["histogramBins"].as<int>());
 
-    std::cout << "Writing out the best hessian matrix image. \n";
+      const std::vector<std::string> methods =
+          split_methods(vm["thresholdMethods"].as<std::string>(),
+                        MultiThresholdType::GetAvailableMethods());
+      for (unsigned int m = 0; m < methods.size(); ++m)
+      {
+        multiThreshold->AddMethod(methods[m]);
+      }
+
+      multiThreshold->SetInput(g.GetImage<floatImageType>("vedFloat"));
+
+      if (vm.count("thresholdMask"))
+      {
+        multiThreshold->SetMaskImage(MappedImageIO::Read<floatImageType>(
+            vm["thresholdMask"].as<std::string>()));
+      }
 
-    typedef itk::ImageFileWriter<TensorImageType> ImageWriterType;
-    ImageWriterType::Pointer writer = ImageWriterType::New();
-    writer->SetFileName("ved_generated_best_Hessian.nii.gz");
-    writer->SetInput(VesselnessFilter->GetHessianOutput());
+      multiThreshold->Compute();
 
+      // Same inside/outside values as the HistogramThresholdImageFilter
+      // segmentations previously written here.
+      multiThreshold->SetInsideValue(
+          static_cast<OutputSegPixelType>(multiThreshold->GetMaximum()));
+      multiThreshold->SetOutsideValue(
+          static_cast<OutputSegPixelType>(multiThreshold->GetMinimum()));
+
+      const MultiThresholdType::OutputMapType segmentations =
+          multiThreshold->GenerateSegmentations();
+
+      MultiThresholdType::OutputMapType::const_iterator it;
+      for (it = segmentations.begin(); it != segmentations.end(); ++it)
+      {
+        std::cout << "Writing out segmentations (" << (*it).first
+                  << ", threshold "
+                  << multiThreshold->GetThresholds().at((*it).first)
+                  << "). \n";
+
+        std::string message = std::string("Ved_") + (*it).first + extension;
+        StageTimerScope timer("IO::Write");
+        MappedImageIO::Write((*it).second.GetPointer(), message);
+        timer.AddFileWritten(message);
+      }
+    });
+    graph->Request("thresholds");
+  }
+
+  if (vm.count("generateScale"))
+  {
+    graph->AddStage("writeScale", {"ved"}, [&](VEDStageGraph& g) {
+      std::cout << "Writing out the best sigma scale image. \n";
+      StageTimerScope timer("IO::Write");
+      if (vm.count("scaleIndex"))
+      {
+        const std::string fileName =
+            "ved_generated_best_scale_index" +
+            std::string(extension == ".nii" ? ".nii" : ".nii.gz");
+        const std::string sidecarFileName =
+            "ved_generated_best_scale_index.json";
+        QuantizedImageWriter::PrintError(
+            std::cout, fileName, "uint8 index",
+            QuantizedImageWriter::WriteScaleIndex(
+                g.GetImage<ScalesImageType>("scales").GetPointer(), fileName,
+                sidecarFileName));
+        timer.AddFileWritten(fileName);
+        timer.AddFileWritten(sidecarFileName);
+        return;
+      }
+      const std::string fileName = "ved_generated_best_scale" + extension;
+      MappedImageIO::Write(g.GetImage<ScalesImageType>("scales").GetPointer(),
+                           fileName);
+      timer.AddFileWritten(fileName);
+    });
+    graph->Request("writeScale");
+  }
+
+  if (vm.count("generateHessian"))
+  {
+    graph->AddStage("writeHessian", {"ved"}, [&](VEDStageGraph& g) {
+      std::cout << "Writing out the best hessian matrix image. \n";
+      const std::string fileName = "ved_generated_best_Hessian" + extension;
+      StageTimerScope timer("IO::Write");
+      const QuantizedImageWriter::QuantizationError error =
+          QuantizedImageWriter::Write(
+              g.GetImage<TensorImageType>("hessian").GetPointer(), fileName,
+              auxiliaryPrecision);
+      timer.AddFileWritten(fileName);
+      if (auxiliaryPrecision != QuantizedImageWriter::FullPrecision)
+      {
+        QuantizedImageWriter::PrintError(
+            std::cout, fileName,
+            QuantizedImageWriter::GetPrecisionName(auxiliaryPrecision),
+            error);
+      }
+    });
+    graph->Request("writeHessian");
+  }
+
+  if (validate)
+  {
+    std::vector<std::string> dependencies;
     try
     {
-      writer->Update();
+      // After everything else, so that the timings are not shared.
+      dependencies = graph->GetScheduledStages();
     }
     catch (itk::ExceptionObject& err)
     {
       std::cerr << "Exception caught: " << err << std::endl;
       return EXIT_FAILURE;
     }
+
+    graph->AddStage("validate", dependencies, [&](VEDStageGraph& g) {
+      std::cout << "Running the reference pipeline." << std::endl;
+      ReferenceFilter->SetInput(g.GetImage<InputImageType>("input"));
+      const std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      {
+        StageTimerScope timer("Validation::Reference");
+        ReferenceFilter->Update();
+      }
+      const std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      validation.ReferenceSeconds = elapsed.count();
+
+      typedef itk::CastImageFilter<OutputImageType, floatImageType>
+          CastFilterType;
+      CastFilterType::Pointer castFilter = CastFilterType::New();
+      castFilter->SetInput(ReferenceFilter->GetOutput());
+      castFilter->Update();
+      const floatImageType::Pointer candidate =
+          g.GetImage<floatImageType>("vedFloat");
+      const floatImageType* reference = castFilter->GetOutput();
+
+      // Each output thresholded by its own histogram, as the segmentations.
+      validation.ThresholdMethod = vm["validateThreshold"].as<std::string>();
+      MultiThresholdType::Pointer threshold = MultiThresholdType::New();
+      threshold->SetNumberOfHistogramBins(vm["histogramBins"].as<int>());
+      threshold->AddMethod(validation.ThresholdMethod);
+      threshold->SetInput(candidate);
+      threshold->Compute();
+      validation.CandidateThreshold =
+          threshold->GetThresholds().at(validation.ThresholdMethod);
+      threshold->SetInput(reference);
+      threshold->Compute();
+      validation.ReferenceThreshold =
+          threshold->GetThresholds().at(validation.ThresholdMethod);
+
+      StageTimerScope timer("Validation::Compare");
+      compare_outputs(candidate.GetPointer(), reference,
+                      g.GetImage<ScalesImageType>("scales").GetPointer(),
+                      ReferenceFilter->GetScalesOutput(), validation);
+
+      std::ofstream report(vm["validate"].as<std::string>().c_str());
+      write_validation(report, validation, vm);
+      if (!report)
+      {
+        throw std::runtime_error("Cannot write " +
+                                 vm["validate"].as<std::string>() + ".");
+      }
+      std::cout << "Validation: speedup "
+                << validation.ReferenceSeconds / validation.CandidateSeconds
+                << ", max abs error " << validation.MaximumAbsoluteError
+                << ", Dice " << validation.Dice << ", scale agreement "
+                << validation.ScaleAgreement << "." << std::endl;
+    });
+    graph->Request("validate");
+  }
+
+  try
+  {
+    const std::vector<std::string> scheduled = graph->GetScheduledStages();
+    std::cout << "Stages:";
+    for (unsigned int s = 0; s < scheduled.size(); ++s)
+    {
+      std::cout << " " << scheduled[s];
+    }
+    std::cout << std::endl;
+
+    graph->Execute();
+  }
+  catch (itk::ExceptionObject& err)
+  {
+    std::cerr << "Exception caught: " << err << std::endl;
+    write_instrumentation(vm);
+    return EXIT_FAILURE;
+  }
+
+  if (ImageBufferPool::GetInstance().IsEnabled())
+  {
+    const ImageBufferPool::Statistics statistics =
+        ImageBufferPool::GetInstance().GetStatistics();
+    std::cout << "Buffer pool: " << statistics.Leases << " buffers, "
+              << statistics.Reuses << " reused, " << statistics.Mappings
+              << " mapped ("
+              << VEDMemoryPlan::FormatSize(statistics.MappedBytes) << ")."
+              << std::endl;
+  }
+
+  if (!write_instrumentation(vm))
+  {
+    return EXIT_FAILURE;
   }
 
   return EXIT_SUCCESS;
@@ -0,0 +1,233 @@
+#ifndef __itkVEDMemoryPlan_h
+#define __itkVEDMemoryPlan_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// \class VEDMemoryPlan
+// \brief Peak memory of a VED run, computed before anything is allocated.
+//
+// Every large buffer of the pipeline is added with its size and the phases
+// during which it is alive. The filters add their own buffers
+// (AnisotropicDiffusionVesselEnhancementImageFilter::AddBuffersToPlan), the
+// program adds the input and the post-processing ones. The peak is the
+// largest sum of the buffers alive in one phase.
+//
+// The diffusion iterations repeat the phases Hessian to Diffusion, so a
+// buffer kept from one iteration to the next is alive in all of them.
+
+class VEDMemoryPlan : public itk::Object
+{
+public:
+  typedef VEDMemoryPlan Self;
+  typedef itk::Object Superclass;
+
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  itkNewMacro(Self);
+
+  itkTypeMacro(VEDMemoryPlan, Object);
+
+  typedef enum
+  {
+    ReadPhase = 0,
+    HessianPhase = 1,
+    VesselnessPhase = 2,
+    ScaleFilesPhase = 3,
+    TensorPhase = 4,
+    DiffusionPhase = 5,
+    PostPhase = 6,
+    NumberOfPhases = 7
+  } PhaseType;
+
+  struct Buffer
+  {
+    std::string Name;
+    double Bytes;
+    PhaseType FirstPhase;
+    PhaseType LastPhase;
+  };
+
+  static const char* GetPhaseName(PhaseType phase)
+  {
+    static const char* names[NumberOfPhases] = {
+        "read", "hessian", "vesselness", "scale files",
+        "tensor", "diffusion", "post-processing"};
+    return names[phase];
+  }
+
+  void AddBuffer(const std::string& name, double bytes, PhaseType firstPhase,
+                 PhaseType lastPhase)
+  {
+    Buffer buffer;
+    buffer.Name = name;
+    buffer.Bytes = bytes;
+    buffer.FirstPhase = firstPhase;
+    buffer.LastPhase = lastPhase;
+    m_Buffers.push_back(buffer);
+    this->Modified();
+  }
+
+  void Clear()
+  {
+    m_Buffers.clear();
+    this->Modified();
+  }
+
+  const std::vector<Buffer>& GetBuffers() const { return m_Buffers; }
+
+  double GetPhaseBytes(PhaseType phase) const
+  {
+    double bytes = 0.0;
+    for (unsigned int b = 0; b < m_Buffers.size(); ++b)
+    {
+      if (m_Buffers[b].FirstPhase <= phase && phase <= m_Buffers[b].LastPhase)
+      {
+        bytes += m_Buffers[b].Bytes;
+      }
+    }
+    return bytes;
+  }
+
+  PhaseType GetPeakPhase() const
+  {
+    PhaseType peak = ReadPhase;
+    for (int p = 1; p < NumberOfPhases; ++p)
+    {
+      if (this->GetPhaseBytes(static_cast<PhaseType>(p)) >
+          this->GetPhaseBytes(peak))
+      {
+        peak = static_cast<PhaseType>(p);
+      }
+    }
+    return peak;
+  }
+
+  double GetPeakBytes() const
+  {
+    return this->GetPhaseBytes(this->GetPeakPhase());
+  }
+
+  // The buffers, the total of every phase and the peak.
+  void Print(std::ostream& os) const
+  {
+    os << "Memory plan:\n";
+    for (unsigned int b = 0; b < m_Buffers.size(); ++b)
+    {
+      const Buffer& buffer = m_Buffers[b];
+      char line[160];
+      std::snprintf(line, sizeof(line), "  %-34s %12s  %s", buffer.Name.c_str(),
+                    FormatSize(buffer.Bytes).c_str(),
+                    GetPhaseName(buffer.FirstPhase));
+      os << line;
+      if (buffer.LastPhase != buffer.FirstPhase)
+      {
+        os << " to " << GetPhaseName(buffer.LastPhase);
+      }
+      os << "\n";
+    }
+    for (int p = 0; p < NumberOfPhases; ++p)
+    {
+      const PhaseType phase = static_cast<PhaseType>(p);
+      char line[160];
+      std::snprintf(line, sizeof(line), "  phase %-28s %12s",
+                    GetPhaseName(phase),
+                    FormatSize(this->GetPhaseBytes(phase)).c_str());
+      os << line << "\n";
+    }
+    os << "  peak " << FormatSize(this->GetPeakBytes()) << " ("
+       << GetPhaseName(this->GetPeakPhase()) << ")\n";
+  }
+
+  // "1073741824", "800M", "16G", "1.5T" (powers of 1024).
+  static double ParseSize(const std::string& text)
+  {
+    std::string::size_type end = 0;
+    double value = 0.0;
+    try
+    {
+      value = std::stod(text, &end);
+    }
+    catch (std::exception&)
+    {
+      throw std::invalid_argument("Invalid memory size '" + text + "'.");
+    }
+
+    std::string unit = text.substr(end);
+    unit.erase(std::remove(unit.begin(), unit.end(), ' '), unit.end());
+    std::transform(unit.begin(), unit.end(), unit.begin(), ::toupper);
+    if (!unit.empty() && unit[unit.size() - 1] == 'B')
+    {
+      unit.erase(unit.size() - 1);
+    }
+    if (!unit.empty() && unit[unit.size() - 1] == 'I')
+    {
+      unit.erase(unit.size() - 1);
+    }
+
+    const std::string units = "KMGT";
+    double factor = 1.0;
+    if (unit.size() == 1 && units.find(unit[0]) != std::string::npos)
+    {
+      for (unsigned int u = 0; u <= units.find(unit[0]); ++u)
+      {
+        factor *= 1024.0;
+      }
+    }
+    else if (!unit.empty())
+    {
+      throw std::invalid_argument("Invalid memory size '" + text + "'.");
+    }
+    if (value < 0.0)
+    {
+      throw std::invalid_argument("Invalid memory size '" + text + "'.");
+    }
+    return value * factor;
+  }
+
+  static std::string FormatSize(double bytes)
+  {
+    const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    unsigned int u = 0;
+    while (bytes >= 1024.0 && u < 4)
+    {
+      bytes /= 1024.0;
+      ++u;
+    }
+    char text[32];
+    std::snprintf(text, sizeof(text), u ? "%.1f %s" : "%.0f %s", bytes,
+                  units[u]);
+    return text;
+  }
+
+protected:
+  VEDMemoryPlan() {}
+  ~VEDMemoryPlan() {}
+
+  void PrintSelf(std::ostream& os, itk::Indent indent) const
+  {
+    Superclass::PrintSelf(os, indent);
+
+    os << indent << "NumberOfBuffers: " << m_Buffers.size() << std::endl;
+    os << indent << "PeakBytes: " << this->GetPeakBytes() << std::endl;
+    os << indent << "PeakPhase: " << GetPhaseName(this->GetPeakPhase())
+       << std::endl;
+  }
+
+private:
+  VEDMemoryPlan(const Self&);  // purposely not implemented
+  void operator=(const Self&); // purposely not implemented
+
+  std::vector<Buffer> m_Buffers;
+};
+
+#endif
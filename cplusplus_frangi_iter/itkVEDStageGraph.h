@@ -0,0 +1,388 @@
+#ifndef __itkVEDStageGraph_h
+#define __itkVEDStageGraph_h
+
+#include "itkDataObject.h"
+#include "itkImage.h"
+#include "itkMultiThreader.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkStageTimer.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// \class VEDStageGraph
+// \brief A small dependency graph of the itkVEDMain stages.
+//
+// Each stage has a name, the names of the stages it depends on and a
+// function. Stages publish their images with SetBuffer() and read those of
+// their dependencies with GetImage(): the image returned shares the pixel
+// buffer of the published one (no copy) but has its own pipeline
+// information, so that branches running at the same time do not update the
+// same ITK data object.
+//
+// Execute() only runs the requested stages and their dependencies. The
+// stages whose dependencies are done are taken by a pool of workers, so the
+// independent branches (post-smoothing variants, thresholds, writers) run
+// concurrently. The buffers of a stage are released as soon as the stages
+// depending on it are done.
+
+class VEDStageGraph : public itk::Object
+{
+public:
+  typedef VEDStageGraph Self;
+  typedef itk::Object Superclass;
+
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  itkNewMacro(Self);
+
+  itkTypeMacro(VEDStageGraph, Object);
+
+  typedef std::function<void(VEDStageGraph&)> StageFunctionType;
+
+  // Number of stages running at the same time (0: ITK default).
+  itkSetMacro(NumberOfThreads, int);
+  itkGetConstMacro(NumberOfThreads, int);
+
+  void AddStage(const std::string& name,
+                const std::vector<std::string>& dependencies,
+                const StageFunctionType& function)
+  {
+    if (m_Stages.count(name))
+    {
+      itkExceptionMacro(<< "Stage " << name << " is defined twice.");
+    }
+    StageInfo& stage = m_Stages[name];
+    stage.Dependencies = dependencies;
+    stage.Function = function;
+    m_StageOrder.push_back(name);
+    this->Modified();
+  }
+
+  bool HasStage(const std::string& name) const
+  {
+    return m_Stages.count(name) > 0;
+  }
+
+  // Mark a stage as a wanted output of the graph.
+  void Request(const std::string& name)
+  {
+    if (!m_Stages.count(name))
+    {
+      itkExceptionMacro(<< "Unknown stage " << name << ".");
+    }
+    m_Requested.insert(name);
+    this->Modified();
+  }
+
+  void SetBuffer(const std::string& name, const itk::DataObject* buffer)
+  {
+    std::lock_guard<std::mutex> lock(m_BufferMutex);
+    m_Buffers[name] = const_cast<itk::DataObject*>(buffer);
+
+    std::map<std::thread::id, std::string>::const_iterator running =
+        m_RunningStages.find(std::this_thread::get_id());
+    if (running != m_RunningStages.end())
+    {
+      m_BufferProducers[name] = running->second;
+    }
+  }
+
+  // A new image header sharing the pixel buffer of the image published
+  // under name.
+  template <typename TImage>
+  typename TImage::Pointer GetImage(const std::string& name)
+  {
+    const TImage* buffer = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(m_BufferMutex);
+      std::map<std::string, itk::DataObject::Pointer>::const_iterator it =
+          m_Buffers.find(name);
+      if (it != m_Buffers.end())
+      {
+        buffer = dynamic_cast<const TImage*>(it->second.GetPointer());
+      }
+    }
+    if (!buffer)
+    {
+      itkExceptionMacro(<< "No image buffer named " << name << ".");
+    }
+
+    typename TImage::Pointer image = TImage::New();
+    image->CopyInformation(buffer);
+    image->SetRegions(buffer->GetBufferedRegion());
+    image->SetPixelContainer(
+        const_cast<typename TImage::PixelContainer*>(
+            buffer->GetPixelContainer()));
+    return image;
+  }
+
+  // The requested stages and their dependencies, in definition order.
+  std::vector<std::string> GetScheduledStages() const
+  {
+    std::set<std::string> needed;
+    std::vector<std::string> pending(m_Requested.begin(), m_Requested.end());
+    while (!pending.empty())
+    {
+      const std::string name = pending.back();
+      pending.pop_back();
+      if (!needed.insert(name).second)
+      {
+        continue;
+      }
+      const StageInfo& stage = m_Stages.at(name);
+      for (unsigned int d = 0; d < stage.Dependencies.size(); ++d)
+      {
+        if (!m_Stages.count(stage.Dependencies[d]))
+        {
+          itkExceptionMacro(<< "Stage " << name << " depends on the unknown "
+                            << "stage " << stage.Dependencies[d] << ".");
+        }
+        pending.push_back(stage.Dependencies[d]);
+      }
+    }
+
+    std::vector<std::string> scheduled;
+    for (unsigned int s = 0; s < m_StageOrder.size(); ++s)
+    {
+      if (needed.count(m_StageOrder[s]))
+      {
+        scheduled.push_back(m_StageOrder[s]);
+      }
+    }
+    return scheduled;
+  }
+
+  // Run the scheduled stages. The first error stops the scheduling of new
+  // stages and is thrown once the running ones are finished.
+  void Execute()
+  {
+    ExecuteStruct str;
+    str.Graph = this;
+    str.Scheduled = this->GetScheduledStages();
+    str.Remaining = str.Scheduled.size();
+    str.Running = 0;
+
+    for (unsigned int s = 0; s < str.Scheduled.size(); ++s)
+    {
+      const std::string& name = str.Scheduled[s];
+      const std::vector<std::string>& dependencies =
+          m_Stages[name].Dependencies;
+      str.MissingDependencies[name] = dependencies.size();
+      str.PendingDependents[name];
+      for (unsigned int d = 0; d < dependencies.size(); ++d)
+      {
+        str.Dependents[dependencies[d]].push_back(name);
+        ++str.PendingDependents[dependencies[d]];
+      }
+      if (dependencies.empty())
+      {
+        str.Ready.push_back(name);
+      }
+    }
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    if (m_NumberOfThreads > 0)
+    {
+      threader->SetNumberOfThreads(m_NumberOfThreads);
+    }
+    threader->SetNumberOfThreads(std::max<int>(
+        1, std::min<int>(threader->GetNumberOfThreads(),
+                         static_cast<int>(str.Scheduled.size()))));
+    threader->SetSingleMethod(ExecuteThreaderCallback, &str);
+    threader->SingleMethodExecute();
+
+    m_Buffers.clear();
+    m_BufferProducers.clear();
+
+    if (!str.Error.empty())
+    {
+      itkExceptionMacro(<< str.Error);
+    }
+  }
+
+protected:
+  VEDStageGraph() : m_NumberOfThreads{0} {}
+  ~VEDStageGraph() {}
+
+  void PrintSelf(std::ostream& os, itk::Indent indent) const
+  {
+    Superclass::PrintSelf(os, indent);
+
+    os << indent << "NumberOfThreads: " << m_NumberOfThreads << std::endl;
+    for (unsigned int s = 0; s < m_StageOrder.size(); ++s)
+    {
+      os << indent << "Stage: " << m_StageOrder[s]
+         << (m_Requested.count(m_StageOrder[s]) ? " (requested)" : "")
+         << std::endl;
+    }
+  }
+
+private:
+  VEDStageGraph(const Self&);  // purposely not implemented
+  void operator=(const Self&); // purposely not implemented
+
+  struct StageInfo
+  {
+    std::vector<std::string> Dependencies;
+    StageFunctionType Function;
+  };
+
+  // Structure for passing information into the static callback method.
+  struct ExecuteStruct
+  {
+    VEDStageGraph* Graph;
+    std::vector<std::string> Scheduled;
+    std::map<std::string, unsigned int> MissingDependencies;
+    std::map<std::string, std::vector<std::string>> Dependents;
+    std::map<std::string, unsigned int> PendingDependents;
+    std::vector<std::string> Ready;
+    size_t Remaining;
+    unsigned int Running;
+    std::string Error;
+    std::mutex Mutex;
+    std::condition_variable Condition;
+  };
+
+  // Each worker takes a ready stage, runs it and releases its dependents,
+  // until every scheduled stage is done.
+  static ITK_THREAD_RETURN_TYPE ExecuteThreaderCallback(void* arg)
+  {
+    const auto threadInfo =
+        static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+    const auto str = static_cast<ExecuteStruct*>(threadInfo->UserData);
+
+    std::unique_lock<std::mutex> lock(str->Mutex);
+    while (true)
+    {
+      str->Condition.wait(lock, [str]() {
+        return !str->Ready.empty() || str->Running == 0;
+      });
+      if (str->Ready.empty() && str->Remaining > 0 && str->Error.empty())
+      {
+        // Nothing runs and nothing is ready: the dependencies loop.
+        str->Error = "The stage dependencies contain a cycle.";
+      }
+      if (str->Remaining == 0 || !str->Error.empty())
+      {
+        str->Condition.notify_all();
+        break;
+      }
+
+      const std::string name = str->Ready.front();
+      str->Ready.erase(str->Ready.begin());
+      ++str->Running;
+      lock.unlock();
+
+      str->Graph->SetRunningStage(name);
+      std::string error;
+      try
+      {
+        StageTimerScope timer("Stage::" + name);
+        str->Graph->m_Stages[name].Function(*str->Graph);
+      }
+      catch (itk::ExceptionObject& err)
+      {
+        error = "Stage " + name + ": " + err.GetDescription();
+      }
+      catch (std::exception& err)
+      {
+        error = "Stage " + name + ": " + err.what();
+      }
+
+      str->Graph->SetRunningStage("");
+
+      // Nothing reads the buffers of a stage whose dependents are all done.
+      std::vector<itk::DataObject::Pointer> released;
+
+      lock.lock();
+      const std::vector<std::string>& dependencies =
+          str->Graph->m_Stages[name].Dependencies;
+      for (unsigned int d = 0; d < dependencies.size(); ++d)
+      {
+        if (--str->PendingDependents[dependencies[d]] == 0)
+        {
+          str->Graph->ReleaseBuffers(dependencies[d], released);
+        }
+      }
+      if (str->PendingDependents[name] == 0)
+      {
+        str->Graph->ReleaseBuffers(name, released);
+      }
+
+      --str->Running;
+      --str->Remaining;
+      if (!error.empty() && str->Error.empty())
+      {
+        str->Error = error;
+      }
+      const std::vector<std::string>& dependents = str->Dependents[name];
+      for (unsigned int d = 0; d < dependents.size(); ++d)
+      {
+        if (--str->MissingDependencies[dependents[d]] == 0)
+        {
+          str->Ready.push_back(dependents[d]);
+        }
+      }
+      str->Condition.notify_all();
+    }
+
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  void SetRunningStage(const std::string& name)
+  {
+    std::lock_guard<std::mutex> lock(m_BufferMutex);
+    if (name.empty())
+    {
+      m_RunningStages.erase(std::this_thread::get_id());
+    }
+    else
+    {
+      m_RunningStages[std::this_thread::get_id()] = name;
+    }
+  }
+
+  // Move the buffers published by stage into released.
+  void ReleaseBuffers(const std::string& stage,
+                      std::vector<itk::DataObject::Pointer>& released)
+  {
+    std::lock_guard<std::mutex> lock(m_BufferMutex);
+    std::map<std::string, std::string>::iterator it = m_BufferProducers.begin();
+    while (it != m_BufferProducers.end())
+    {
+      if (it->second == stage)
+      {
+        released.push_back(m_Buffers[it->first]);
+        m_Buffers.erase(it->first);
+        m_BufferProducers.erase(it++);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+
+  int m_NumberOfThreads;
+
+  std::map<std::string, StageInfo> m_Stages;
+  std::vector<std::string> m_StageOrder;
+  std::set<std::string> m_Requested;
+
+  std::mutex m_BufferMutex;
+  std::map<std::string, itk::DataObject::Pointer> m_Buffers;
+  std::map<std::string, std::string> m_BufferProducers;
+  std::map<std::thread::id, std::string> m_RunningStages;
+};
+
+#endif
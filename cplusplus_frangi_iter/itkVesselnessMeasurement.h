@@ -4,6 +4,10 @@
 #include "itkSymmetricSecondRankTensor.h"
 #include "itkSymmetricEigenVectorAnalysisImageFilter.h"
 #include "itkImageToImageFilter.h"
+#include "itkFrangiKernel.h"
+#include "itkWorkStealingPool.h"
+
+#include <vector>
 
 //*\class HessianToObjectnessMeasureImageFilter
 //	\brief A filter to enhance M-dimensional objects in N-dimensional images
@@ -117,6 +121,31 @@ public:
   itkGetConstMacro(FrangiOnly, bool);
   itkBooleanMacro(FrangiOnly);
   
+  // The Frangi response kernel (FrangiKernel), automatic by default: the
+  // widest one supported by the processor.
+  itkSetMacro(FrangiKernel, FrangiKernel::KernelType);
+  itkGetConstMacro(FrangiKernel, FrangiKernel::KernelType);
+
+  // Skip the eigen analysis of the voxels that cannot be tubes of the wanted
+  // polarity (bounds from the Hessian trace, Frobenius norm and Gershgorin
+  // discs), and of the blocks without any such voxel. The output is the
+  // same. On by default.
+  itkSetMacro(Pruning, bool);
+  itkGetConstMacro(Pruning, bool);
+  itkBooleanMacro(Pruning);
+
+  // Edge length (voxels) of the blocks of both passes, the chunks shared by
+  // the threads of the WorkStealingPool.
+  itkSetMacro(BlockSize, unsigned int);
+  itkGetConstMacro(BlockSize, unsigned int);
+
+  // The blocks tiling the requested region, x fastest.
+  itk::SizeValueType GetNumberOfBlocks() const;
+  OutputImageRegionType GetBlockRegion(itk::SizeValueType block) const;
+
+  // The largest measure of every block, after the second pass.
+  const std::vector<double>& GetBlockMaximum() const { return m_BlockMaximum; }
+
   itkSetMacro(FirstPass, bool);
   itkGetConstMacro(FirstPass, bool);
   itkBooleanMacro(FirstPass);
@@ -141,16 +170,37 @@ protected:
   ~VesselnessMeasurement() {}
   void PrintSelf(std::ostream& os, itk::Indent indent) const;
 
-  void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
-                            itk::ThreadIdType threadId);
-  
-  
+  // The blocks of both passes are run by the WorkStealingPool.
+  void GenerateData();
 
 private:
   VesselnessMeasurement(const Self&);
 
   void operator=(const Self&);
 
+  // False when lambda2 and lambda3 cannot both have the vessel sign and a
+  // magnitude of at least FrangiKernel::GetEpsilon().
+  bool CanBeTube(const InputPixelType& hessian) const;
+
+  // Arrays of one thread in the second pass.
+  struct BlockWorkspace
+  {
+    std::vector<double> Lambda1;
+    std::vector<double> Lambda2;
+    std::vector<double> Lambda3;
+    std::vector<double> Measure;
+    std::vector<size_t> Positions;
+  };
+
+  // First pass: the largest S / 2 and the smallest lambda3 of the block.
+  void FirstPassBlock(const OutputImageRegionType& blockRegion, double& gamma,
+                      double& minLambda) const;
+
+  // Second pass: the vesselness of the block and its maximum.
+  void SecondPassBlock(itk::SizeValueType block,
+                       const FrangiKernel::Parameters& parameters,
+                       BlockWorkspace& workspace);
+
   // functor used to sort the eigenvalues are to be sorted
   // |e1|<=|e2|<=...<=|eN|
   // \class AbsLessEqualCompare
@@ -193,6 +243,11 @@ private:
   bool m_BrightObject;
   bool m_ScaleObjectnessMeasure;
   bool m_FrangiOnly;
+  FrangiKernel::KernelType m_FrangiKernel;
+  bool m_Pruning;
+  unsigned int m_BlockSize;
+
+  std::vector<double> m_BlockMaximum;
 };
 
 #ifndef ITK_MANUAL_INSTANTIATION
@@ -5,13 +5,12 @@
 
 #include "itkImageRegionIterator.h"
 #include "itkImageIterator.h"
-#include "itkProgressReporter.h"
 #include "itkSymmetricEigenAnalysis.h"
 #include "vnl/vnl_math.h"
 
 #include <algorithm>
-
-#define EPSILON 1e-03
+#include <atomic>
+#include <vector>
 
 template <typename TInputImage, typename TOutputImage>
 VesselnessMeasurement<TInputImage, TOutputImage>::VesselnessMeasurement()
@@ -25,178 +24,305 @@ VesselnessMeasurement<TInputImage, TOutputImage>::VesselnessMeasurement(
     double const& alpha, double const& beta, double const& c, const bool scale,
     const bool bright, const bool frangi, const bool firstPass, double minL3)
     : m_Alpha{alpha}, m_Beta{beta}, m_C{c}, m_ScaleObjectnessMeasure{scale},
-      m_BrightObject{bright}, m_FrangiOnly{frangi}, m_FirstPass{firstPass}, m_MinLambda(minL3)
+      m_BrightObject{bright}, m_FrangiOnly{frangi}, m_FirstPass{firstPass}, m_MinLambda(minL3),
+      m_FrangiKernel{FrangiKernel::AutomaticKernel}, m_Pruning{true},
+      m_BlockSize{8}
 {
 }
 
 // =============================================================================
-// Threading functions to generate the vesselness measure. This is called from
-// multiScaleHessian.
+// Both passes, block by block. The blocks are the chunks of the
+// WorkStealingPool, so the threads which get the empty or pruned blocks help
+// the others. This is called from multiScaleHessian.
 // =============================================================================
 template <typename TInputImage, typename TOutputImage>
-void VesselnessMeasurement<TInputImage, TOutputImage>::ThreadedGenerateData(
-    const OutputImageRegionType& outputRegionForThread,
-    itk::ThreadIdType threadId)
+void VesselnessMeasurement<TInputImage, TOutputImage>::GenerateData()
 {
+  this->AllocateOutputs();
+
+  WorkStealingPool& pool = WorkStealingPool::GetInstance();
+  const itk::SizeValueType numberOfBlocks = this->GetNumberOfBlocks();
+  const double numberOfPixels =
+      this->GetOutput()->GetRequestedRegion().GetNumberOfPixels();
+
+  // The progress is reported by thread 0, as with itk::ProgressReporter.
+  std::atomic<itk::SizeValueType> completedBlocks(0);
+  const itk::SizeValueType progressInterval =
+      std::max<itk::SizeValueType>(1, numberOfBlocks / 100);
+  auto blockCompleted = [&](unsigned int threadId) {
+    const itk::SizeValueType completed = ++completedBlocks;
+    if (threadId == 0 && completed % progressInterval == 0)
+    {
+      this->UpdateProgress(static_cast<float>(completed) / numberOfBlocks);
+    }
+  };
 
-  typename OutputImageType::Pointer output = this->GetOutput();
-  typename InputImageType::ConstPointer input = this->GetInput();
+  if (numberOfPixels == 0)
+  {
+    return;
+  }
+
+  // The first pass reads the Hessian, the second one also writes the
+  // output.
+  const double hessianBytesPerBlock =
+      sizeof(InputPixelType) * numberOfPixels / numberOfBlocks;
+  const double outputBytesPerBlock =
+      sizeof(OutputPixelType) * numberOfPixels / numberOfBlocks;
+
+  if (m_FirstPass)
+  {
+    std::vector<double> gamma(pool.GetNumberOfThreads(), m_Gamma);
+    std::vector<double> minLambda(pool.GetNumberOfThreads(), m_MinLambda);
+    pool.ParallelFor("VesselnessMeasurement::FirstPass", numberOfBlocks,
+                     this->GetNumberOfThreads(),
+                     [&](unsigned int threadId, size_t block) {
+                       this->FirstPassBlock(this->GetBlockRegion(block),
+                                            gamma[threadId],
+                                            minLambda[threadId]);
+                       blockCompleted(threadId);
+                     },
+                     hessianBytesPerBlock);
+
+    // use same m_Gamma value as Frangi
+    m_Gamma = *std::max_element(gamma.begin(), gamma.end());
+    m_MinLambda = *std::min_element(minLambda.begin(), minLambda.end());
+    return;
+  }
 
-  itk::ProgressReporter progress(this, threadId,
-                                 outputRegionForThread.GetNumberOfPixels(),
-                                 1000 / this->GetNumberOfThreads());
+  m_BlockMaximum.assign(numberOfBlocks, 0.0);
+
+  FrangiKernel::Parameters parameters;
+  parameters.Alpha = m_Alpha;
+  parameters.Beta = m_Beta;
+  parameters.Gamma = m_Gamma;
+  parameters.C = m_C;
+  parameters.BrightObject = m_BrightObject;
+  parameters.ScaleObjectnessMeasure = m_ScaleObjectnessMeasure;
+
+  std::vector<BlockWorkspace> workspaces(pool.GetNumberOfThreads());
+  pool.ParallelFor("VesselnessMeasurement::SecondPass", numberOfBlocks,
+                   this->GetNumberOfThreads(),
+                   [&](unsigned int threadId, size_t block) {
+                     this->SecondPassBlock(block, parameters,
+                                           workspaces[threadId]);
+                     blockCompleted(threadId);
+                   },
+                   hessianBytesPerBlock + outputBytesPerBlock);
+}
 
+template <typename TInputImage, typename TOutputImage>
+void VesselnessMeasurement<TInputImage, TOutputImage>::FirstPassBlock(
+    const OutputImageRegionType& blockRegion, double& gamma,
+    double& minLambda) const
+{
   // calculator for computation of the eigen values
   typedef itk::SymmetricEigenAnalysis<InputPixelType, EigenValueArrayType>
       CalculatorType;
   CalculatorType eigenCalculator(ImageDimension);
 
-  // walk the region of eigen values and get the vesselness measure
-  itk::ImageRegionConstIterator<InputImageType> it(input,
-                                                   outputRegionForThread);
-  itk::ImageRegionIterator<OutputImageType> oit(output, outputRegionForThread);
-
-  if (m_FirstPass) 
+  itk::ImageRegionConstIterator<InputImageType> it(this->GetInput(),
+                                                   blockRegion);
+  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
   {
-    it.GoToBegin();
-    while (!it.IsAtEnd())
+    EigenValueArrayType eigenValues;
+    eigenCalculator.ComputeEigenValues(it.Get(), eigenValues);
+    const double S =
+        vcl_sqrt(vnl_math_sqr(eigenValues[0]) + vnl_math_sqr(eigenValues[1]) +
+                vnl_math_sqr(eigenValues[2]));
+
+    gamma = std::max(gamma, S / 2.0);
+
+    EigenValueArrayType sortedEigenValues = eigenValues;
+    std::sort(sortedEigenValues.Begin(), sortedEigenValues.End(),
+              AbsLessEqualCompare());
+
+    if (sortedEigenValues[2] < minLambda)
     {
-      EigenValueArrayType eigenValues;
-      eigenCalculator.ComputeEigenValues(it.Get(), eigenValues);
-      const double S =
-          vcl_sqrt(vnl_math_sqr(eigenValues[0]) + vnl_math_sqr(eigenValues[1]) +
-                  vnl_math_sqr(eigenValues[2]));
-
-      // use same m_Gamma value as Frangi
-      m_Gamma = std::max(m_Gamma, S / 2.0);
-
-      EigenValueArrayType sortedEigenValues = eigenValues;
-      std::sort(sortedEigenValues.Begin(), sortedEigenValues.End(),
-                AbsLessEqualCompare());
-
-      if (sortedEigenValues[2] < m_MinLambda) 
-      {
-        m_MinLambda = sortedEigenValues[2];
-      }
-
-      ++it;
-      progress.CompletedPixel();
+      minLambda = sortedEigenValues[2];
     }
-    return;
   }
+}
 
-  oit.GoToBegin();
-  it.GoToBegin();
+// =============================================================================
+// The eigenvalues of the voxels of the block that can be tubes, sorted by
+// magnitude, as three arrays, then the Frangi response of all of them.
+// =============================================================================
+template <typename TInputImage, typename TOutputImage>
+void VesselnessMeasurement<TInputImage, TOutputImage>::SecondPassBlock(
+    itk::SizeValueType block, const FrangiKernel::Parameters& parameters,
+    BlockWorkspace& workspace)
+{
+  typedef itk::SymmetricEigenAnalysis<InputPixelType, EigenValueArrayType>
+      CalculatorType;
+  CalculatorType eigenCalculator(ImageDimension);
+  eigenCalculator.SetOrderEigenMagnitudes( 1 );
 
-  while (!it.IsAtEnd())
+  const OutputImageRegionType blockRegion = this->GetBlockRegion(block);
+  const size_t blockVoxels = blockRegion.GetNumberOfPixels();
+  if (workspace.Measure.size() < blockVoxels)
   {
-    EigenValueArrayType sortedEigenValues;
-      
-    eigenCalculator.SetOrderEigenMagnitudes( 1 );
-    eigenCalculator.ComputeEigenValues(it.Get(), sortedEigenValues);
-
-    const double lambda1 = sortedEigenValues[0];
-    const double lambda2 = sortedEigenValues[1];
-    const double lambda3 = sortedEigenValues[2];
+    workspace.Lambda1.resize(blockVoxels);
+    workspace.Lambda2.resize(blockVoxels);
+    workspace.Lambda3.resize(blockVoxels);
+    workspace.Measure.resize(blockVoxels);
+    workspace.Positions.resize(blockVoxels);
+  }
 
-    if (m_BrightObject)
-    {
-      // Doing bright extraction then, If blood is dark, skip.
-      if (lambda2 >= 0.0 || lambda3 >= 0.0 || vnl_math_abs(lambda2) < EPSILON ||
-          vnl_math_abs(lambda3) < EPSILON)
-      {
-        oit.Set(itk::NumericTraits<OutputPixelType>::Zero);
-        ++it;
-        ++oit;
-        progress.CompletedPixel();
-        continue;
-      }
-    }
-    else
+  size_t n = 0;
+  size_t position = 0;
+  itk::ImageRegionConstIterator<InputImageType> bit(this->GetInput(),
+                                                    blockRegion);
+  for (bit.GoToBegin(); !bit.IsAtEnd(); ++bit, ++position)
+  {
+    if (m_Pruning && !this->CanBeTube(bit.Get()))
     {
-      // Doing dark extraction then, If blood is bright, skip.
-      if (lambda2 <= 0.0 || lambda3 <= 0.0 || vnl_math_abs(lambda2) < EPSILON ||
-          vnl_math_abs(lambda3) < EPSILON)
-      {
-        oit.Set(itk::NumericTraits<OutputPixelType>::Zero);
-        ++it;
-        ++oit;
-        progress.CompletedPixel();
-        continue;
-      }
+      continue;
     }
+    EigenValueArrayType sortedEigenValues;
+    eigenCalculator.ComputeEigenValues(bit.Get(), sortedEigenValues);
+    workspace.Lambda1[n] = sortedEigenValues[0];
+    workspace.Lambda2[n] = sortedEigenValues[1];
+    workspace.Lambda3[n] = sortedEigenValues[2];
+    workspace.Positions[n] = position;
+    ++n;
+  }
 
-    const double lambda1Abs = vnl_math_abs(lambda1);
-    const double lambda2Abs = vnl_math_abs(lambda2);
-    const double lambda3Abs = vnl_math_abs(lambda3);
-
-    const double lambda1Sqr = vnl_math_sqr(lambda1);
-    const double lambda2Sqr = vnl_math_sqr(lambda2);
-    const double lambda3Sqr = vnl_math_sqr(lambda3);
-
-    const double alphaSqr = vnl_math_sqr(m_Alpha);
-    const double betaSqr = vnl_math_sqr(m_Beta);
-    const double gammaSqr = vnl_math_sqr(m_Gamma);
-
-    const double A = lambda2Abs / lambda3Abs;
-    const double B = lambda1Abs / vcl_sqrt(vnl_math_abs(lambda2 * lambda3));
-    const double S = lambda1Sqr + lambda2Sqr + lambda3Sqr;
-
-    const double vesMeasure1 =
-        1 - vcl_exp(-1.0 * (vnl_math_sqr(A) / (2.0 * alphaSqr)));
-
-    const double vesMeasure2 =
-        vcl_exp(-1.0 * (vnl_math_sqr(B) / (2.0 * betaSqr)));
-
-    const double vesMeasure3 =
-        1 - vcl_exp(-1.0 * (S / (2.0 * gammaSqr)));
-    
-    const double vesMeasure4 =
-        vcl_exp(-1.0 * (2.0 * vnl_math_sqr(m_C)) / (lambda2Abs * lambda3Sqr));
-
-    /*//////////////////
-    double regularizedLambda3val = 0.95;
-    double lambdaP=0;
-    
-    
-    //MIKE AJUSTEMENT : https://www.researchgate.net/publication/283558933_Beyond_Frangi_An_improved_multiscale_vesselness_filter
-    if ( lambda3 < ( regularizedLambda3val * vnl_math_min(lambda3,m_MinLambda) ) )
-    {
-      lambdaP = lambda3;
-    }
-    else
-    {
-      lambdaP = regularizedLambda3val * vnl_math_min(lambda3,m_MinLambda);
-    }
-    
-    double vesselnessMeasure = 0;
-    if (lambda2 <= lambdaP/2.0 )
-    {
-      vesselnessMeasure = 1.0;
-    }
-    else
-    {
-      vesselnessMeasure = vesMeasure2 * vesMeasure4 * vnl_math_sqr(lambda2) * (lambdaP-lambda2) * vnl_math_cube(3.0/(lambda2 + lambdaP));
-    }
-    oit.Set(static_cast<OutputPixelType>(1000.0*vesselnessMeasure));
+  // A block without any possible tube skips the kernel.
+  if (n > 0)
+  {
+    FrangiKernel::Evaluate(m_FrangiKernel, parameters, &workspace.Lambda1[0],
+                           &workspace.Lambda2[0], &workspace.Lambda3[0],
+                           &workspace.Measure[0], n);
+  }
+
+  /*//////////////////
+  double regularizedLambda3val = 0.95;
+  double lambdaP=0;
+  
+  
+  //MIKE AJUSTEMENT : https://www.researchgate.net/publication/283558933_Beyond_Frangi_An_improved_multiscale_vesselness_filter
+  if ( lambda3 < ( regularizedLambda3val * vnl_math_min(lambda3,m_MinLambda) ) )
+  {
+    lambdaP = lambda3;
+  }
+  else
+  {
+    lambdaP = regularizedLambda3val * vnl_math_min(lambda3,m_MinLambda);
+  }
+  
+  double vesselnessMeasure = 0;
+  if (lambda2 <= lambdaP/2.0 )
+  {
+    vesselnessMeasure = 1.0;
+  }
+  else
+  {
+    vesselnessMeasure = vesMeasure2 * vesMeasure4 * vnl_math_sqr(lambda2) * (lambdaP-lambda2) * vnl_math_cube(3.0/(lambda2 + lambdaP));
+  }
+  oit.Set(static_cast<OutputPixelType>(1000.0*vesselnessMeasure));
    ////////////////*/
-        
-    double vesselnessMeasure = vesMeasure1 * vesMeasure2 * vesMeasure3 * vesMeasure4;
 
-    if (m_ScaleObjectnessMeasure)
-    {
-      oit.Set(static_cast<OutputPixelType>(lambda3Abs * vesselnessMeasure));
-    }
-    else
+
+  double blockMaximum = 0.0;
+  size_t i = 0;
+  position = 0;
+  itk::ImageRegionIterator<OutputImageType> boit(this->GetOutput(),
+                                                 blockRegion);
+  for (boit.GoToBegin(); !boit.IsAtEnd(); ++boit, ++position)
+  {
+    double value = 0.0;
+    if (i < n && workspace.Positions[i] == position)
     {
-      oit.Set(static_cast<OutputPixelType>(vesselnessMeasure));
+      value = workspace.Measure[i++];
     }
-    
+    boit.Set(static_cast<OutputPixelType>(value));
+    blockMaximum = std::max(blockMaximum, value);
+  }
+  m_BlockMaximum[block] = blockMaximum;
+}
+
+// =============================================================================
+// Blocks of both passes.
+// =============================================================================
+template <typename TInputImage, typename TOutputImage>
+itk::SizeValueType
+VesselnessMeasurement<TInputImage, TOutputImage>::GetNumberOfBlocks() const
+{
+  const OutputImageRegionType region = this->GetOutput()->GetRequestedRegion();
+  const itk::SizeValueType blockSize = std::max(1u, m_BlockSize);
 
-    ++it;
-    ++oit;
-    progress.CompletedPixel();
+  itk::SizeValueType numberOfBlocks = 1;
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    numberOfBlocks *= (region.GetSize(d) + blockSize - 1) / blockSize;
   }
+  return numberOfBlocks;
+}
+
+template <typename TInputImage, typename TOutputImage>
+typename VesselnessMeasurement<TInputImage,
+                               TOutputImage>::OutputImageRegionType
+VesselnessMeasurement<TInputImage, TOutputImage>::GetBlockRegion(
+    itk::SizeValueType block) const
+{
+  const OutputImageRegionType region = this->GetOutput()->GetRequestedRegion();
+  const itk::SizeValueType blockSize = std::max(1u, m_BlockSize);
+
+  OutputImageRegionType blockRegion = region;
+  for (unsigned int d = 0; d < ImageDimension; ++d)
+  {
+    const itk::SizeValueType blocks =
+        (region.GetSize(d) + blockSize - 1) / blockSize;
+    const itk::SizeValueType offset = (block % blocks) * blockSize;
+    block /= blocks;
+
+    blockRegion.SetIndex(d, region.GetIndex(d) + offset);
+    blockRegion.SetSize(d, std::min(blockSize, region.GetSize(d) - offset));
+  }
+  return blockRegion;
+}
+
+// =============================================================================
+// Necessary conditions for a tube, from the Hessian only. With |lambda1| <=
+// |lambda2| <= |lambda3| and lambda2, lambda3 < 0 (bright tube), lambda1 +
+// lambda2 <= 0 so the trace is at most lambda3 <= -epsilon; the smallest
+// eigenvalue, at least the lowest Gershgorin bound, is at most -epsilon; and
+// the squared Frobenius norm is at least lambda2^2 + lambda3^2 >= 2
+// epsilon^2. The opposite signs for dark tubes. A small margin covers the
+// rounding of the eigen solver.
+// =============================================================================
+template <typename TInputImage, typename TOutputImage>
+bool VesselnessMeasurement<TInputImage, TOutputImage>::CanBeTube(
+    const InputPixelType& hessian) const
+{
+  // D11, D12, D13, D22, D23, D33
+  const double h11 = hessian[0];
+  const double h12 = hessian[1];
+  const double h13 = hessian[2];
+  const double h22 = hessian[3];
+  const double h23 = hessian[4];
+  const double h33 = hessian[5];
+
+  const double frobeniusSqr = h11 * h11 + h22 * h22 + h33 * h33 +
+                              2.0 * (h12 * h12 + h13 * h13 + h23 * h23);
+  const double epsilon =
+      FrangiKernel::GetEpsilon() * (1.0 - 1e-3) - 1e-12 * vcl_sqrt(frobeniusSqr);
+  if (frobeniusSqr < 2.0 * epsilon * epsilon)
+  {
+    return false;
+  }
+
+  const double trace = h11 + h22 + h33;
+  const double r1 = vnl_math_abs(h12) + vnl_math_abs(h13);
+  const double r2 = vnl_math_abs(h12) + vnl_math_abs(h23);
+  const double r3 = vnl_math_abs(h13) + vnl_math_abs(h23);
+  if (m_BrightObject)
+  {
+    const double lowest = std::min(h11 - r1, std::min(h22 - r2, h33 - r3));
+    return trace <= -epsilon && lowest <= -epsilon;
+  }
+  const double highest = std::max(h11 + r1, std::max(h22 + r2, h33 + r3));
+  return trace >= epsilon && highest >= epsilon;
 }
 
 template <typename TInputImage, typename TOutputImage>
@@ -212,6 +338,11 @@ void VesselnessMeasurement<TInputImage, TOutputImage>::PrintSelf(
      << std::endl;
   os << indent << "BrightObject: " << m_BrightObject << std::endl;
   os << indent << "FrangiOnly: " << m_FrangiOnly << std::endl;
+  os << indent << "Pruning: " << m_Pruning << std::endl;
+  os << indent << "BlockSize: " << m_BlockSize << std::endl;
+  os << indent << "FrangiKernel: "
+     << FrangiKernel::GetKernelName(FrangiKernel::Resolve(m_FrangiKernel))
+     << std::endl;
 }
 
 #endif
\ No newline at end of file
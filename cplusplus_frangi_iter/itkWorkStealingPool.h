@@ -0,0 +1,450 @@
+#ifndef __itkWorkStealingPool_h
+#define __itkWorkStealingPool_h
+
+#include "itkNumaTopology.h"
+#include "itkStageTimer.h"
+
+#include "itkImageRegion.h"
+#include "itkMultiThreader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// \class WorkStealingPool
+// \brief Process wide pool of threads running loops over small chunks.
+//
+// The threaded loops of the filters (diffusion update and change, vesselness
+// passes, sparse scale stacks) cut their region into many small chunks
+// instead of one slab per thread. Each thread starts on a contiguous range
+// of chunks and, once its range is empty, steals the upper half of the
+// range of another thread, so the threads which get the empty slabs at the
+// top and bottom of a head, or the fast background voxels, help the others
+// instead of waiting.
+//
+// The threads are created once and kept for the next loops. Their number is
+// set once for the process (SetNumberOfThreads(), ITK's global default
+// otherwise); the caller of ParallelFor() is thread 0. The time of every
+// thread and the number of chunks stolen are reported to the StageTimer
+// under the name of the loop. One loop runs at a time: a loop started from
+// another thread waits, a loop started from inside a loop runs on the
+// calling thread.
+//
+// With SetThreadPinning(), thread t stays on the CPU
+// NumaTopology::GetThreadCpu(t), so that the threads of the first chunks
+// run on the first NUMA node. ParallelForStatic() runs the initial ranges
+// without stealing: the same thread always gets the same chunks, which is
+// what a first-touch initialisation needs to put the pages of every slab on
+// the node of the thread which processes it later. Loops given the bytes
+// read and written per chunk report the bandwidth of every node.
+class WorkStealingPool
+{
+public:
+  typedef std::function<void(unsigned int, size_t)> ChunkFunctionType;
+
+  static WorkStealingPool& GetInstance()
+  {
+    static WorkStealingPool instance;
+    return instance;
+  }
+
+  // Threads of the loops, the calling thread included.
+  void SetNumberOfThreads(unsigned int numberOfThreads)
+  {
+    std::lock_guard<std::mutex> loopLock(m_LoopMutex);
+    this->StopWorkers();
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_NumberOfThreads = std::max(1u, numberOfThreads);
+  }
+
+  unsigned int GetNumberOfThreads()
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_NumberOfThreads == 0)
+    {
+      m_NumberOfThreads = std::max(
+          1, static_cast<int>(
+                 itk::MultiThreader::GetGlobalDefaultNumberOfThreads()));
+    }
+    return m_NumberOfThreads;
+  }
+
+  // Edge of the chunks of the image loops, 16 by default.
+  void SetChunkSize(unsigned int chunkSize)
+  {
+    m_ChunkSize = std::max(1u, chunkSize);
+  }
+  unsigned int GetChunkSize() const { return m_ChunkSize; }
+
+  // Bind every thread to one CPU, spread over the NUMA nodes. Off by
+  // default.
+  void SetThreadPinning(bool threadPinning)
+  {
+    std::lock_guard<std::mutex> loopLock(m_LoopMutex);
+    this->StopWorkers();
+    m_ThreadPinning = threadPinning;
+  }
+  bool GetThreadPinning() const { return m_ThreadPinning; }
+
+  // Run body(threadId, chunk) for every chunk of [0, numberOfChunks), on at
+  // most maximumNumberOfThreads threads (all of them if 0). threadId is
+  // smaller than GetNumberOfThreads(). The first exception thrown by body
+  // stops the loop and is rethrown. bytesPerChunk is the memory traffic of
+  // one chunk, for the bandwidth of the nodes.
+  void ParallelFor(const std::string& name, size_t numberOfChunks,
+                   unsigned int maximumNumberOfThreads,
+                   const ChunkFunctionType& body, double bytesPerChunk = 0.0)
+  {
+    this->Loop(name, numberOfChunks, maximumNumberOfThreads, body,
+               bytesPerChunk, false);
+  }
+
+  // Same as ParallelFor(), without stealing: thread t runs the chunks
+  // [numberOfChunks * t / T, numberOfChunks * (t + 1) / T) of T threads.
+  void ParallelForStatic(const std::string& name, size_t numberOfChunks,
+                         unsigned int maximumNumberOfThreads,
+                         const ChunkFunctionType& body,
+                         double bytesPerChunk = 0.0)
+  {
+    this->Loop(name, numberOfChunks, maximumNumberOfThreads, body,
+               bytesPerChunk, true);
+  }
+
+  // Chunks of an image region: whole rows, the other dimensions cut in
+  // pieces of GetChunkSize().
+  template <typename TRegion>
+  itk::SizeValueType GetNumberOfChunks(const TRegion& region) const
+  {
+    itk::SizeValueType numberOfChunks = 1;
+    for (unsigned int d = 1; d < TRegion::ImageDimension; ++d)
+    {
+      numberOfChunks *= (region.GetSize(d) + m_ChunkSize - 1) / m_ChunkSize;
+    }
+    return region.GetNumberOfPixels() > 0 ? numberOfChunks : 0;
+  }
+
+  template <typename TRegion>
+  TRegion GetChunkRegion(const TRegion& region, itk::SizeValueType chunk) const
+  {
+    TRegion chunkRegion = region;
+    for (unsigned int d = 1; d < TRegion::ImageDimension; ++d)
+    {
+      const itk::SizeValueType chunks =
+          (region.GetSize(d) + m_ChunkSize - 1) / m_ChunkSize;
+      const itk::SizeValueType offset = (chunk % chunks) * m_ChunkSize;
+      chunk /= chunks;
+
+      chunkRegion.SetIndex(d, region.GetIndex(d) + offset);
+      chunkRegion.SetSize(
+          d, std::min<itk::SizeValueType>(m_ChunkSize,
+                                          region.GetSize(d) - offset));
+    }
+    return chunkRegion;
+  }
+
+private:
+  struct LoopType
+  {
+    const ChunkFunctionType* Body;
+    unsigned int NumberOfThreads;
+    bool Static;
+    double BytesPerChunk;
+    std::unique_ptr<std::atomic<uint64_t>[]> Ranges;
+    std::atomic<size_t> Stolen;
+    std::atomic<bool> Failed;
+    std::exception_ptr Exception;
+    std::mutex ExceptionMutex;
+    StageThreadTimes Times;
+  };
+
+  WorkStealingPool()
+      : m_NumberOfThreads{0}, m_ChunkSize{16}, m_ThreadPinning{false},
+        m_Generation{0}, m_Running{0}, m_Loop{nullptr}, m_Stop{false}
+  {
+  }
+
+  ~WorkStealingPool() { this->StopWorkers(); }
+
+  void Loop(const std::string& name, size_t numberOfChunks,
+            unsigned int maximumNumberOfThreads, const ChunkFunctionType& body,
+            double bytesPerChunk, bool isStatic)
+  {
+    if (numberOfChunks == 0)
+    {
+      return;
+    }
+    unsigned int numberOfThreads = this->GetNumberOfThreads();
+    if (maximumNumberOfThreads > 0)
+    {
+      numberOfThreads = std::min(numberOfThreads, maximumNumberOfThreads);
+    }
+    numberOfThreads = static_cast<unsigned int>(
+        std::min<size_t>(numberOfThreads, numberOfChunks));
+
+    if (numberOfThreads == 1 || InsideLoop())
+    {
+      StageThreadTimes times;
+      times.Start(name, 1);
+      {
+        StageThreadTimes::Scope threadTimer(times, 0);
+        for (size_t chunk = 0; chunk < numberOfChunks; ++chunk)
+        {
+          body(0, chunk);
+        }
+        times.SetThreadTraffic(0, NumaTopology::GetInstance().GetCurrentNode(),
+                               bytesPerChunk * numberOfChunks);
+      }
+      times.SetChunkCounts(numberOfChunks, 0);
+      times.Finish();
+      return;
+    }
+
+    std::lock_guard<std::mutex> loopLock(m_LoopMutex);
+    this->StartWorkers();
+
+    // The ranges are packed as (next << 32) | end, so that the owner and
+    // the thieves update them with a single compare and swap.
+    LoopType loop;
+    loop.Body = &body;
+    loop.NumberOfThreads = numberOfThreads;
+    loop.Static = isStatic;
+    loop.BytesPerChunk = bytesPerChunk;
+    loop.Ranges.reset(new std::atomic<uint64_t>[numberOfThreads]);
+    const uint64_t lastChunk =
+        std::min<uint64_t>(numberOfChunks, UINT32_MAX);
+    for (unsigned int t = 0; t < numberOfThreads; ++t)
+    {
+      loop.Ranges[t] = Pack(lastChunk * t / numberOfThreads,
+                            lastChunk * (t + 1) / numberOfThreads);
+    }
+    loop.Stolen = 0;
+    loop.Failed = false;
+    loop.Times.Start(name, numberOfThreads);
+
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Loop = &loop;
+      m_Running = static_cast<unsigned int>(m_Workers.size());
+      ++m_Generation;
+    }
+    m_Wake.notify_all();
+
+    {
+      std::unique_ptr<NumaTopology::PinScope> pin;
+      if (m_ThreadPinning)
+      {
+        pin.reset(new NumaTopology::PinScope(
+            NumaTopology::GetInstance().GetThreadCpu(0, m_NumberOfThreads)));
+      }
+      this->Run(loop, 0);
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(m_Mutex);
+      m_Done.wait(lock, [this]() { return m_Running == 0; });
+      m_Loop = nullptr;
+    }
+
+    // More than 2^32 chunks: the last ones on the calling thread.
+    for (size_t chunk = lastChunk; chunk < numberOfChunks && !loop.Failed;
+         ++chunk)
+    {
+      body(0, chunk);
+    }
+
+    loop.Times.SetChunkCounts(numberOfChunks, loop.Stolen);
+    loop.Times.Finish();
+    if (loop.Exception)
+    {
+      std::rethrow_exception(loop.Exception);
+    }
+  }
+
+  static uint64_t Pack(uint64_t next, uint64_t end)
+  {
+    return (next << 32) | end;
+  }
+
+  static bool& InsideLoop()
+  {
+    static thread_local bool inside = false;
+    return inside;
+  }
+
+  // Called with m_LoopMutex held.
+  void StartWorkers()
+  {
+    const unsigned int numberOfWorkers = this->GetNumberOfThreads() - 1;
+    while (m_Workers.size() < numberOfWorkers)
+    {
+      const unsigned int threadId = m_Workers.size() + 1;
+      unsigned long generation;
+      {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        generation = m_Generation;
+      }
+      m_Workers.push_back(std::thread(&WorkStealingPool::Worker, this,
+                                      threadId, generation));
+    }
+  }
+
+  void StopWorkers()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Stop = true;
+    }
+    m_Wake.notify_all();
+    for (unsigned int w = 0; w < m_Workers.size(); ++w)
+    {
+      m_Workers[w].join();
+    }
+    m_Workers.clear();
+    m_Stop = false;
+  }
+
+  void Worker(unsigned int threadId, unsigned long generation)
+  {
+    if (m_ThreadPinning)
+    {
+      const NumaTopology& topology = NumaTopology::GetInstance();
+      NumaTopology::PinCurrentThread(
+          topology.GetThreadCpu(threadId, m_NumberOfThreads));
+    }
+    while (true)
+    {
+      LoopType* loop;
+      {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_Wake.wait(lock, [&]() {
+          return m_Stop || m_Generation != generation;
+        });
+        if (m_Stop)
+        {
+          return;
+        }
+        generation = m_Generation;
+        loop = m_Loop;
+      }
+
+      if (threadId < loop->NumberOfThreads)
+      {
+        this->Run(*loop, threadId);
+      }
+
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      if (--m_Running == 0)
+      {
+        m_Done.notify_all();
+      }
+    }
+  }
+
+  // The chunks of the own range, then stolen ones until every range is
+  // empty.
+  void Run(LoopType& loop, unsigned int threadId)
+  {
+    InsideLoop() = true;
+    {
+      StageThreadTimes::Scope threadTimer(loop.Times, threadId);
+      const unsigned int node = NumaTopology::GetInstance().GetCurrentNode();
+      size_t numberOfChunks = 0;
+      size_t chunk;
+      while (!loop.Failed)
+      {
+        if (!this->Pop(loop, threadId, chunk))
+        {
+          if (loop.Static || !this->Steal(loop, threadId))
+          {
+            break;
+          }
+          continue;
+        }
+        try
+        {
+          (*loop.Body)(threadId, chunk);
+          ++numberOfChunks;
+        }
+        catch (...)
+        {
+          std::lock_guard<std::mutex> lock(loop.ExceptionMutex);
+          if (!loop.Exception)
+          {
+            loop.Exception = std::current_exception();
+          }
+          loop.Failed = true;
+        }
+      }
+      loop.Times.SetThreadTraffic(threadId, node,
+                                  loop.BytesPerChunk * numberOfChunks);
+    }
+    InsideLoop() = false;
+  }
+
+  bool Pop(LoopType& loop, unsigned int threadId, size_t& chunk)
+  {
+    std::atomic<uint64_t>& range = loop.Ranges[threadId];
+    uint64_t value = range.load();
+    while ((value >> 32) < (value & UINT32_MAX))
+    {
+      if (range.compare_exchange_weak(value, value + (uint64_t(1) << 32)))
+      {
+        chunk = value >> 32;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Move the upper half of the range of another thread to the own (empty)
+  // range. False when every range is empty.
+  bool Steal(LoopType& loop, unsigned int threadId)
+  {
+    for (unsigned int k = 1; k < loop.NumberOfThreads; ++k)
+    {
+      std::atomic<uint64_t>& victim =
+          loop.Ranges[(threadId + k) % loop.NumberOfThreads];
+      uint64_t value = victim.load();
+      while ((value >> 32) < (value & UINT32_MAX))
+      {
+        const uint64_t next = value >> 32;
+        const uint64_t end = value & UINT32_MAX;
+        const uint64_t middle = end - (end - next + 1) / 2;
+        if (victim.compare_exchange_weak(value, Pack(next, middle)))
+        {
+          loop.Ranges[threadId] = Pack(middle, end);
+          loop.Stolen += end - middle;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  WorkStealingPool(const WorkStealingPool&); // purposely not implemented
+  void operator=(const WorkStealingPool&);   // purposely not implemented
+
+  unsigned int m_NumberOfThreads;
+  unsigned int m_ChunkSize;
+  bool m_ThreadPinning;
+
+  std::mutex m_LoopMutex;
+  std::mutex m_Mutex;
+  std::condition_variable m_Wake;
+  std::condition_variable m_Done;
+  std::vector<std::thread> m_Workers;
+  unsigned long m_Generation;
+  unsigned int m_Running;
+  LoopType* m_Loop;
+  bool m_Stop;
+};
+
+#endif
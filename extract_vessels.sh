@@ -24,7 +24,7 @@ printf "Step 0. Parse the arguments.\n"
 printf "+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+\n"
 
 if [ "${1}" = "-h" ]; then
-    printf "extract_vessels.sh filename ext type(TOF or SWI or OTHER) [-m --mask mask_filename] [-p --phase phase_filename] [-s --std denoised_STD_value] [-f --factor upsampleFactor] [-c --centerline]"
+    printf "extract_vessels.sh filename ext type(TOF or SWI or OTHER) [-m --mask mask_filename] [-p --phase phase_filename] [-s --std denoised_STD_value] [-f --factor upsampleFactor] [-u --upsample] [-c --centerline]"
     exit
 fi
 
@@ -115,6 +115,9 @@ if(( $(echo "$# > 3" | bc -l) )); then
         checkArg ${upsampleFactor}
         shift # past argument
         ;;
+        -u|--upsample)
+        upsampleOutput=true
+        ;;
         -c|--centerline)
         getCenterline=true
         shift # past argument
@@ -157,6 +160,7 @@ echo FILE MASK           = "${image}_mask"
 echo FILE PHASE          = "${phase}"
 echo STD                 = "${stdDenoised}"
 echo UPSAMPLED FACTOR    = "${upsampleFactor}"
+echo UPSAMPLE OUTPUTS    = "${upsampleOutput}"
 echo GENERATE DIAMETERS = "${getDiameters}"
 echo GENERATE CENTERLINE = "${getCenterline}"
 
@@ -220,10 +224,17 @@ printf "\n+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+\n"
 printf "Step 2. Denoising with nl means and refit to space ORIG\n"
 printf "+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+\n"
 
-if [ ! -f ${image}_std${stdDenoised}_denoised.${ext} ]; then
-   if [ "${imgType}" = "OTHER" ]; then
-      ${scriptpath}/dipy_nlmeans.py -std 5 -mask ${image}_mask.${ext} -o ${image}_std${stdDenoised} ${image}_autobox.${ext}
-   elif [ "${imgType}" = "TOF" ] || [ "${imgType}" = "SWI" ]; then
+# OTHER images are denoised by itkVEDMain itself (step 3), in memory, which
+# also writes the denoised volume to ${image}_std${stdDenoised}_denoised.
+denoiseOptions=""
+if [ "${imgType}" = "OTHER" ]; then
+   denoiseOptions="--denoise --denoise_sigma 5 --denoise_mask ${image}_mask.${ext} --denoise_output ${image}_std${stdDenoised}_denoised.${ext}"
+fi
+
+if [ "${imgType}" = "OTHER" ]; then
+   printf "Denoised with the VED (step 3).\n"
+elif [ ! -f ${image}_std${stdDenoised}_denoised.${ext} ]; then
+   if [ "${imgType}" = "TOF" ] || [ "${imgType}" = "SWI" ]; then
       cp -rf ${image}_autobox.${ext} ${image}_std${stdDenoised}_denoised.${ext}
    else
       ${scriptpath}/dipy_nlmeans.py -std 25 -mask ${image}_mask.${ext} -o ${image}_std${stdDenoised} ${image}_autobox.${ext}
@@ -244,6 +255,9 @@ if [ "${imgType}" = "SWI" ]; then
     else
         printf "Inverted contrast file already exists for this subject.\n"
     fi
+elif [ "${imgType}" = "OTHER" ]; then
+    # Not denoised yet: the VED denoises its input.
+    cp -rf ${image}_autobox.${ext} ${image}_Contrasted.${ext}
 else
     cp -rf ${image}_std${stdDenoised}_denoised.${ext} ${image}_Contrasted.${ext}     
     printf "No needs to invert the constrast for TOF.\n"
@@ -293,16 +307,13 @@ echo "small scales = ${small_scale}, large scales = ${large_scale}"
 
 if [ ! -f ${image}_Ved.${ext} ]; then
     if [ "${imgType}" = "TOF" ]; then
-        3dresample -overwrite -dxyz ${smalldim} ${smalldim} ${smalldim} -rmode Cu -prefix ${image}_upsampled.${ext} -inset ${image}_Contrasted.${ext}
-        ${scriptpath}/ComputeVED.py ${image}_upsampled.${ext} ${image}_Ved.${ext} -m ${small_scale} -O -M ${large_scale} -t 1 -n 20 -s 2 -w 90 -I --out_folder "./${image}_iterations" 
+        ${scriptpath}/ComputeVED.py ${image}_Contrasted.${ext} ${image}_Ved.${ext} -U -m ${small_scale} -O -M ${large_scale} -t 1 -n 20 -s 2 -w 90 -I --out_folder "./${image}_iterations" 
         #${scriptpath}/ComputeVED.py ${image}_upsampled.${ext} ${image}_Ved.${ext} -m ${smalldim} -M 6 -t 18 -n 10 -s 5 -w 25 #--generate_scale -D 'scales'
     elif [ "${imgType}" = "SWI" ]; then
-        3dresample -overwrite -dxyz ${smalldim} ${smalldim} ${smalldim} -rmode Cu -prefix ${image}_upsampled.${ext} -inset ${image}_Contrasted.${ext}
-        ${scriptpath}/ComputeVED.py ${image}_upsampled.${ext} ${image}_Ved.${ext} -m ${small_scale} -O -M ${large_scale} -t 1 -n 20 -s 2 -w 90 -I --out_folder "./${image}_iterations" 
+        ${scriptpath}/ComputeVED.py ${image}_Contrasted.${ext} ${image}_Ved.${ext} -U -m ${small_scale} -O -M ${large_scale} -t 1 -n 20 -s 2 -w 90 -I --out_folder "./${image}_iterations" 
         #${scriptpath}/ComputeVED.py ${image}_upsampled.${ext} ${image}_Ved.${ext} -m ${smalldim} -M 6 -t 18 -n 10 -s 5 -w 25
     elif [ "${imgType}" = "OTHER" ]; then
-        3dresample -overwrite -dxyz ${smalldim} ${smalldim} ${smalldim} -rmode Cu -prefix ${image}_upsampled.${ext} -inset ${image}_Contrasted.${ext}
-        ${scriptpath}/ComputeVED.py ${image}_upsampled.${ext} ${image}_Ved.${ext} -m ${small_scale} -O -M ${large_scale_clarity} -t 1 -n 15 -s 2 -w 90 -I --out_folder "./${image}_iterations" 
+        ${scriptpath}/ComputeVED.py ${image}_Contrasted.${ext} ${image}_Ved.${ext} -U -m ${small_scale} -O -M ${large_scale_clarity} -t 1 -n 15 -s 2 -w 90 -I --out_folder "./${image}_iterations" ${denoiseOptions}
     fi
     rm -rf ./${image}_iterations
 else
@@ -383,9 +394,10 @@ if [ ! -f ${image}_Ved_corrected.${ext} ] || [ -f ${image}_Ved_scales_sqrt.${ext
     3dTstat -overwrite -max -prefix ${image}_newVed_corrected.${ext} ${image}_newVed_scales_sqrt.${ext}[0..10] 
     3dTstat -overwrite -max -prefix ${image}_newVed_unscaled_corrected.${ext} ${image}_newVed_notscaled_scales_sqrt.${ext}[0..10] 
     
-    3dcalc -overwrite -a ${image}_Ved_corrected.${ext} -b ${image}_newmask.${ext} -expr "step(b)*astep(a,1.0)" -prefix ${image}_Ved_Thr.${ext} -datum short
-    3dcalc -overwrite -a ${image}_newVed_corrected.${ext} -b ${image}_newmask.${ext} -expr "step(b)*astep(a,40.0)" -prefix ${image}_newVed_Thr.${ext} -datum short
-    3dcalc -overwrite -a ${image}_newVed_unscaled_corrected.${ext} -b ${image}_newmask.${ext} -expr "step(b)*astep(a,1.0)" -prefix ${image}_newVed_unscaled_Thr.${ext} -datum short
+    ${scriptpath}/itkMaskCleanupMain -m ${image}_newmask.${ext} -c 2 -s 60 \
+        -v ${image}_Ved_corrected.${ext},1.0,${image}_Ved_Thr_clean.${ext},${image}_Ved_Thr.${ext} \
+        -v ${image}_newVed_corrected.${ext},40.0,${image}_newVed_Thr_clean.${ext},${image}_newVed_Thr.${ext} \
+        -v ${image}_newVed_unscaled_corrected.${ext},1.0,${image}_newVed_unscaled_Thr_clean.${ext},${image}_newVed_unscaled_Thr.${ext}
    
     3dcalc -overwrite -a ${image}_Ved_corrected.${ext} -b ${image}_newmask.${ext} -expr "step(b)*astep(a,1.0)*log(a)*step(log(a))" -prefix ${image}_Ved_log.${ext}
     3dcalc -overwrite -a ${image}_newVed_corrected.${ext} -b ${image}_newmask.${ext} -expr "step(b)*astep(a,40.0)*log(a)*step(log(a))" -prefix ${image}_newVed_log.${ext} 
@@ -395,13 +407,6 @@ if [ ! -f ${image}_Ved_corrected.${ext} ] || [ -f ${image}_Ved_scales_sqrt.${ext
     3dcalc -overwrite -a ${image}_newVed_corrected.${ext} -b ${image}_newmask.${ext} -expr "step(b)*astep(a,40.0)*log(log(a))*step(log(a))" -prefix ${image}_newVed_loglog.${ext} 
     3dcalc -overwrite -a ${image}_newVed_unscaled_corrected.${ext} -b ${image}_newmask.${ext} -expr "step(b)*astep(a,1.0)*log(log(a))*step(log(a))" -prefix ${image}_newVed_unscaled_loglog.${ext}
     
-    3dmask_tool -overwrite -dilate_inputs 1 -1 -input ${image}_Ved_Thr.${ext} -prefix ${image}_Ved_Thr_opened.${ext} 
-    3dmask_tool -overwrite -dilate_inputs 1 -1 -input ${image}_newVed_Thr\.${ext} -prefix ${image}_newVed_Thr_opened.${ext} 
-    3dmask_tool -overwrite -dilate_inputs 1 -1 -input ${image}_newVed_unscaled_Thr.${ext} -prefix ${image}_newVed_unscaled_Thr_opened.${ext} 
-
-    3dmerge -overwrite -dxyz=1 -isovalue -1clust 1.01 60 -prefix ${image}_Ved_Thr_clean.${ext} ${image}_Ved_Thr_opened.${ext}
-    3dmerge -overwrite -dxyz=1 -isovalue -1clust 1.01 60 -prefix ${image}_newVed_Thr_clean.${ext} ${image}_newVed_Thr_opened.${ext}
-    3dmerge -overwrite -dxyz=1 -isovalue -1clust 1.01 60 -prefix ${image}_newVed_unscaled_Thr_clean.${ext} ${image}_newVed_unscaled_Thr_opened.${ext}
    
 else
     printf "Diameters file already exists for this subject.\n"
@@ -448,5 +453,21 @@ printf "+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+\n"
 #    printf "Centerline file already exists for this subject.\n"
 #fi
 
+printf "\n+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+\n"
+printf "Step 8. Isotropic outputs (optional).\n"
+printf "+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+\n"
+# The VED runs on the native grid (spacing used in the diffusion); the
+# outputs are only resampled to an isotropic grid when asked.
+if [ "${upsampleOutput}" = true ]; then
+    for output in Ved_corrected newVed_corrected newVed_unscaled_corrected; do
+        3dresample -overwrite -dxyz ${smalldim} ${smalldim} ${smalldim} -rmode Cu -prefix ${image}_${output}_upsampled.${ext} -inset ${image}_${output}.${ext}
+    done
+    for output in Ved_Thr_clean newVed_Thr_clean newVed_unscaled_Thr_clean; do
+        3dresample -overwrite -dxyz ${smalldim} ${smalldim} ${smalldim} -rmode NN -prefix ${image}_${output}_upsampled.${ext} -inset ${image}_${output}.${ext}
+    done
+else
+    printf "Outputs kept on the native grid.\n"
+fi
+
 printf "Pipeline process completed.\n"
 unset AFNI_NIFTI_TYPE_WARN